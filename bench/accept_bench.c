@@ -0,0 +1,202 @@
+// Measures inbound handshakes accepted per second against a local flood of
+// clients, with one listener and with several SO_REUSEPORT listeners.
+//
+// Usage: bench/accept_bench [connections]
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <libbtcp2p/connection.h>
+
+#define NUM_CLIENTS 8
+#define MAX_LISTENERS 8
+#define MAX_HANDSHAKING 16
+
+static const struct btcp2p_chain_t CHAIN = {
+  .name = "regtest", .version = BTCP2P_PROTOCOL_VERSION, .magic = BTCP2P_MAGIC_REGTEST, .port = 18444
+};
+
+// The client's half of the handshake, sent in one write.
+static uint8_t HELLO[256];
+static size_t HELLO_SIZE;
+
+struct listener_thread_t {
+  pthread_t thread;
+  struct btcp2p_listener_t listener;
+};
+
+struct client_thread_t {
+  pthread_t thread;
+  size_t connections;
+};
+
+static uint16_t PORT;
+static atomic_size_t ACCEPTED;
+static atomic_bool DONE;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build_hello(void) {
+  struct btcp2p_connection_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.chain = &CHAIN;
+  btcp2p_checked_buffer_create(&conn.outgoing.payload);
+
+  btcp2p_pack_message(&conn, &conn.outgoing, "version", "i", BTCP2P_PROTOCOL_VERSION);
+  memcpy(HELLO, &conn.outgoing.header, sizeof(conn.outgoing.header));
+  memcpy(HELLO + sizeof(conn.outgoing.header), conn.outgoing.payload.buffer, conn.outgoing.header.length);
+  HELLO_SIZE = sizeof(conn.outgoing.header) + conn.outgoing.header.length;
+
+  btcp2p_pack_message(&conn, &conn.outgoing, "verack", "");
+  memcpy(HELLO + HELLO_SIZE, &conn.outgoing.header, sizeof(conn.outgoing.header));
+  HELLO_SIZE += sizeof(conn.outgoing.header);
+
+  btcp2p_checked_buffer_destroy(&conn.outgoing.payload);
+}
+
+static void* serve(void* arg) {
+  struct listener_thread_t* self = arg;
+  struct btcp2p_connection_t peers[MAX_HANDSHAKING];
+  bool handshaking[MAX_HANDSHAKING] = { false };
+
+  while (!atomic_load(&DONE)) {
+    struct pollfd pfds[MAX_HANDSHAKING + 1];
+    nfds_t num_pfds = 0;
+    pfds[num_pfds++] = (struct pollfd){ .fd = self->listener.socket, .events = POLLIN, .revents = 0 };
+    for (size_t i = 0; i < MAX_HANDSHAKING; i++) {
+      if (handshaking[i]) {
+        pfds[num_pfds++] = (struct pollfd){ .fd = btcp2p_io_fd(&peers[i]), .events = POLLIN, .revents = 0 };
+      }
+    }
+    poll(pfds, num_pfds, 10);
+
+    for (size_t i = 0; i < MAX_HANDSHAKING; i++) {
+      if (!handshaking[i]) {
+        memset(&peers[i], 0, sizeof(peers[i]));
+        if (btcp2p_accept(&self->listener, &peers[i]) != BTCP2P_ACCEPT_COMPLETE) {
+          break;
+        }
+        handshaking[i] = true;
+      }
+    }
+
+    // Peers are hung up on as soon as their handshake is over.
+    for (size_t i = 0; i < MAX_HANDSHAKING; i++) {
+      if (!handshaking[i]) {
+        continue;
+      }
+      enum btcp2p_handshake_status_t status = btcp2p_continue_handshake(&peers[i]);
+      if (status != BTCP2P_HANDSHAKE_PARTIAL) {
+        if (status == BTCP2P_HANDSHAKE_COMPLETE) {
+          atomic_fetch_add(&ACCEPTED, 1);
+        }
+        btcp2p_disconnect(&peers[i]);
+        handshaking[i] = false;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < MAX_HANDSHAKING; i++) {
+    if (handshaking[i]) {
+      btcp2p_disconnect(&peers[i]);
+    }
+  }
+
+  return NULL;
+}
+
+// flood connects, says hello, and waits for the server to answer and hang up.
+static void* flood(void* arg) {
+  struct client_thread_t* self = arg;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(PORT);
+
+  uint8_t reply[1024];
+  for (size_t i = 0; i < self->connections; i++) {
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        send(client, HELLO, HELLO_SIZE, 0) != (ssize_t)HELLO_SIZE)
+    {
+      perror("client");
+      close(client);
+      continue;
+    }
+    while (recv(client, reply, sizeof(reply), 0) > 0);
+    close(client);
+  }
+
+  return NULL;
+}
+
+static bool run(size_t num_listeners, size_t connections) {
+  struct listener_thread_t listeners[MAX_LISTENERS];
+  struct client_thread_t clients[NUM_CLIENTS];
+  char port[6] = "0";
+
+  memset(listeners, 0, sizeof(listeners));
+  for (size_t i = 0; i < num_listeners; i++) {
+    listeners[i].listener.reuse_port = num_listeners > 1;
+    if (!btcp2p_listen(&listeners[i].listener, "regtest", "127.0.0.1", port)) {
+      return false;
+    }
+    PORT = btcp2p_listener_port(&listeners[i].listener);
+    snprintf(port, sizeof(port), "%u", PORT);
+  }
+
+  atomic_store(&ACCEPTED, 0);
+  atomic_store(&DONE, false);
+  for (size_t i = 0; i < num_listeners; i++) {
+    pthread_create(&listeners[i].thread, NULL, serve, &listeners[i]);
+  }
+
+  double start = now();
+  for (size_t i = 0; i < NUM_CLIENTS; i++) {
+    clients[i].connections = connections / NUM_CLIENTS;
+    pthread_create(&clients[i].thread, NULL, flood, &clients[i]);
+  }
+  for (size_t i = 0; i < NUM_CLIENTS; i++) {
+    pthread_join(clients[i].thread, NULL);
+  }
+  double elapsed = now() - start;
+
+  atomic_store(&DONE, true);
+  for (size_t i = 0; i < num_listeners; i++) {
+    pthread_join(listeners[i].thread, NULL);
+    btcp2p_listener_close(&listeners[i].listener);
+  }
+
+  size_t accepted = atomic_load(&ACCEPTED);
+  printf("%-10zu %10zu %12.0f\n", num_listeners, accepted, accepted / elapsed);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  size_t connections = argc > 1 ? (size_t)atoi(argv[1]) : 16000;
+  build_hello();
+
+  printf("%-10s %10s %12s\n", "listeners", "accepted", "accepts/s");
+  for (size_t n = 1; n <= MAX_LISTENERS; n *= 2) {
+    if (!run(n, connections)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,243 @@
+// Measures what an idle connection costs and how quickly it reacts to
+// locally generated work, pumping with the fixed BTCP2P_PUMP_TIMEOUT_MS
+// poll and with an indefinite wait ended by btcp2p_wake or a timer.
+//
+// Usage: bench/pump_bench [samples]
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <libbtcp2p/connection.h>
+
+#define IDLE_NS BTCP2P_NS_PER_SECOND
+#define MAX_SAMPLES 1000
+
+static const struct btcp2p_chain_t CHAIN = {
+  .name = "regtest", .version = BTCP2P_PROTOCOL_VERSION, .magic = BTCP2P_MAGIC_REGTEST, .port = 18444
+};
+
+struct pump_t {
+  struct btcp2p_connection_t connection;
+  int peer;
+  struct btcp2p_timer_wheel_t timers;
+  pthread_t thread;
+  bool use_wake; ///< Signal work with btcp2p_wake rather than letting the pump poll.
+  size_t samples;
+  atomic_uint_fast64_t posted_ns; ///< Time work was posted, or 0 once picked up.
+  uint64_t latencies_ns[MAX_SAMPLES];
+};
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * BTCP2P_NS_PER_SECOND + (uint64_t)ts.tv_nsec;
+}
+
+static void send_frame(int peer, char const * const command) {
+  struct btcp2p_connection_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.chain = &CHAIN;
+  btcp2p_checked_buffer_create(&conn.outgoing.payload);
+
+  if (strcmp(command, "version") == 0) {
+    btcp2p_pack_message(&conn, &conn.outgoing, command, "i", BTCP2P_PROTOCOL_VERSION);
+  } else {
+    btcp2p_pack_message(&conn, &conn.outgoing, command, "");
+  }
+  ssize_t sent = send(peer, &conn.outgoing.header, sizeof(conn.outgoing.header), 0);
+  if (conn.outgoing.header.length > 0) {
+    sent = send(peer, conn.outgoing.payload.buffer, conn.outgoing.header.length, 0);
+  }
+  (void)sent;
+
+  btcp2p_checked_buffer_destroy(&conn.outgoing.payload);
+}
+
+// open_pump handshakes a connection over a socket pair.
+static bool open_pump(struct pump_t* pump, bool use_wake) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  memset(pump, 0, sizeof(struct pump_t));
+  pump->use_wake = use_wake;
+  pump->connection.use_wake = use_wake;
+  pump->peer = fds[1];
+  if (!btcp2p_begin_handshake(&pump->connection, &CHAIN, fds[0])) {
+    return false;
+  }
+
+  send_frame(pump->peer, "version");
+  send_frame(pump->peer, "verack");
+  enum btcp2p_handshake_status_t status = BTCP2P_HANDSHAKE_PARTIAL;
+  while (status == BTCP2P_HANDSHAKE_PARTIAL) {
+    status = btcp2p_continue_handshake(&pump->connection);
+    struct pollfd pfd = { .fd = btcp2p_io_fd(&pump->connection), .events = POLLIN, .revents = 0 };
+    poll(&pfd, 1, 10);
+  }
+
+  btcp2p_timer_wheel_create(&pump->timers, btcp2p_timer_now_ns());
+  pump->connection.timers = &pump->timers;
+  return status == BTCP2P_HANDSHAKE_COMPLETE;
+}
+
+static void close_pump(struct pump_t* pump) {
+  btcp2p_disconnect(&pump->connection);
+  close(pump->peer);
+}
+
+static void stop_idling(struct btcp2p_wheel_timer_t* timer, void* ctx) {
+  (void)timer;
+  *(bool*)ctx = true;
+}
+
+// idle pumps a connection that receives nothing for IDLE_NS and reports the
+// wake-ups and CPU time that cost per second.
+static void idle(char const * const name, bool indefinite) {
+  struct pump_t* pump = malloc(sizeof(struct pump_t));
+  if (!open_pump(pump, false)) {
+    free(pump);
+    return;
+  }
+
+  bool done = false;
+  struct btcp2p_wheel_timer_t timer = { 0 };
+  uint64_t start_ns = btcp2p_timer_now_ns();
+  btcp2p_timer_wheel_schedule(&pump->timers, &timer, start_ns + IDLE_NS, stop_idling, &done);
+
+  uint64_t start_cpu = cpu_ns();
+  size_t wakeups = 0;
+  while (!done) {
+    btcp2p_message_pump_timeout(&pump->connection, indefinite ? -1 : BTCP2P_PUMP_TIMEOUT_MS);
+    wakeups++;
+  }
+  double seconds = (double)(btcp2p_timer_now_ns() - start_ns) / BTCP2P_NS_PER_SECOND;
+
+  printf("%-26s %12.1f %14.1f\n", name, wakeups / seconds, (double)(cpu_ns() - start_cpu) / 1000 / seconds);
+  close_pump(pump);
+  free(pump);
+}
+
+// run_pump pumps until every sample has been picked up, timing how long
+// each posted piece of work waited.
+static void* run_pump(void* arg) {
+  struct pump_t* pump = arg;
+  size_t taken = 0;
+
+  while (taken < pump->samples) {
+    btcp2p_message_pump_timeout(&pump->connection, pump->use_wake ? -1 : BTCP2P_PUMP_TIMEOUT_MS);
+
+    uint64_t posted_ns = atomic_exchange(&pump->posted_ns, 0);
+    if (posted_ns != 0) {
+      pump->latencies_ns[taken++] = btcp2p_timer_now_ns() - posted_ns;
+    }
+  }
+
+  return NULL;
+}
+
+static int compare_u64(void const* a, void const* b) {
+  uint64_t x = *(uint64_t const*)a;
+  uint64_t y = *(uint64_t const*)b;
+  return x < y ? -1 : x > y;
+}
+
+// report prints the median and worst of the samples in microseconds.
+static void report(char const * const name, uint64_t* samples, size_t count) {
+  qsort(samples, count, sizeof(uint64_t), compare_u64);
+  printf("%-26s %12.1f %14.1f\n", name, samples[count / 2] / 1000.0, samples[count - 1] / 1000.0);
+}
+
+// wake_latency posts work to a pumping thread at irregular intervals.
+static void wake_latency(char const * const name, bool use_wake, size_t samples) {
+  struct pump_t* pump = malloc(sizeof(struct pump_t));
+  if (!open_pump(pump, use_wake)) {
+    free(pump);
+    return;
+  }
+  pump->samples = samples;
+  pthread_create(&pump->thread, NULL, run_pump, pump);
+
+  for (size_t i = 0; i < samples; i++) {
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = (long)(1000000 + rand() % 9000000) };
+    nanosleep(&pause, NULL);
+
+    atomic_store(&pump->posted_ns, btcp2p_timer_now_ns());
+    if (use_wake) {
+      btcp2p_wake(&pump->connection);
+    }
+    while (atomic_load(&pump->posted_ns) != 0) {
+      nanosleep(&pause, NULL);
+    }
+  }
+  pthread_join(pump->thread, NULL);
+
+  report(name, pump->latencies_ns, samples);
+  close_pump(pump);
+  free(pump);
+}
+
+struct lateness_t {
+  uint64_t samples[MAX_SAMPLES];
+  size_t count;
+};
+
+static void record_lateness(struct btcp2p_wheel_timer_t* timer, void* ctx) {
+  struct lateness_t* lateness = ctx;
+  lateness->samples[lateness->count++] = btcp2p_timer_now_ns() - timer->deadline_ns;
+}
+
+// timer_lateness schedules sends at irregular deadlines and measures how late
+// the pump fires them.
+static void timer_lateness(size_t samples) {
+  struct pump_t* pump = malloc(sizeof(struct pump_t));
+  struct lateness_t* lateness = calloc(1, sizeof(struct lateness_t));
+  if (!open_pump(pump, false)) {
+    free(pump);
+    free(lateness);
+    return;
+  }
+
+  struct btcp2p_wheel_timer_t timer = { 0 };
+  for (size_t i = 0; i < samples; i++) {
+    uint64_t delay_ns = BTCP2P_NS_PER_MS + (uint64_t)(rand() % 9000) * 1000;
+    btcp2p_timer_wheel_schedule(&pump->timers, &timer, btcp2p_timer_now_ns() + delay_ns,
+                                record_lateness, lateness);
+    while (lateness->count == i) {
+      btcp2p_message_pump_timeout(&pump->connection, -1);
+    }
+  }
+
+  report("timer, indefinite wait", lateness->samples, lateness->count);
+  close_pump(pump);
+  free(pump);
+  free(lateness);
+}
+
+int main(int argc, char** argv) {
+  size_t samples = argc > 1 ? (size_t)atoi(argv[1]) : 50;
+  if (samples == 0 || samples > MAX_SAMPLES) {
+    samples = MAX_SAMPLES;
+  }
+
+  printf("%-26s %12s %14s\n", "idle connection", "wakeups/s", "cpu us/s");
+  idle("fixed timeout", false);
+  idle("indefinite wait", true);
+
+  printf("\n%-26s %12s %14s\n", "latency", "median us", "max us");
+  wake_latency("work, fixed timeout", false, samples);
+  wake_latency("work, btcp2p_wake", true, samples);
+  timer_lateness(samples);
+
+  return 0;
+}
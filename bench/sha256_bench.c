@@ -0,0 +1,51 @@
+// Measures SHA-256 throughput for every backend the CPU supports.
+//
+// Usage: bench/sha256_bench [megabytes]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libbtcp2p/sha256.h>
+
+// Typical P2P payload sizes: an inv, a transaction and a block.
+static const size_t SIZES[] = { 37, 300, 1024 * 1024 };
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  size_t total = (argc > 1 ? (size_t)atoi(argv[1]) : 256) * 1024 * 1024;
+  size_t max_size = SIZES[sizeof(SIZES) / sizeof(SIZES[0]) - 1];
+  uint8_t* data = malloc(max_size);
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+  memset(data, 0xA5, max_size);
+
+  printf("%-10s %10s %10s\n", "backend", "size", "GB/s");
+  for (int backend = 0; backend < BTCP2P_SHA256_BACKEND_COUNT; backend++) {
+    if (!btcp2p_sha256_use_backend(backend)) {
+      continue;
+    }
+
+    for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++) {
+      size_t iterations = total / SIZES[i];
+      double start = now();
+      for (size_t n = 0; n < iterations; n++) {
+        btcp2p_sha256d(data, SIZES[i], digest);
+        data[n % SIZES[i]] ^= digest[0];
+      }
+      double elapsed = now() - start;
+
+      printf("%-10s %10zu %10.3f\n",
+             btcp2p_sha256_backend_name(backend),
+             SIZES[i],
+             iterations * SIZES[i] / elapsed / 1e9);
+    }
+  }
+
+  free(data);
+  return 0;
+}
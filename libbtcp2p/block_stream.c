@@ -0,0 +1,325 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "libbtcp2p/block_stream.h"
+#include "libbtcp2p/command.h"
+#include "libbtcp2p/vartypes.h"
+
+// Sizes of the fixed-length transaction fields.
+#define BTCP2P_TX_VERSION_SIZE 4
+#define BTCP2P_TX_FLAG_SIZE 1
+#define BTCP2P_TX_OUTPOINT_SIZE 36
+#define BTCP2P_TX_SEQUENCE_SIZE 4
+#define BTCP2P_TX_VALUE_SIZE 8
+#define BTCP2P_TX_LOCK_TIME_SIZE 4
+
+void btcp2p_block_stream_create(struct btcp2p_block_stream_t* stream,
+                                btcp2p_block_header_callback_t on_header,
+                                btcp2p_block_tx_callback_t on_tx,
+                                void* ctx)
+{
+  stream->on_header = on_header;
+  stream->on_tx = on_tx;
+  stream->ctx = ctx;
+  btcp2p_checked_buffer_create(&stream->window);
+  btcp2p_block_stream_reset(stream);
+}
+
+void btcp2p_block_stream_destroy(struct btcp2p_block_stream_t* stream) {
+  btcp2p_checked_buffer_destroy(&stream->window);
+}
+
+void btcp2p_block_stream_reset(struct btcp2p_block_stream_t* stream) {
+  stream->state = BTCP2P_BLOCK_STREAM_HEADER;
+  btcp2p_checked_buffer_prepare_write(&stream->window);
+  stream->parsed = 0;
+  stream->tx_count = 0;
+  stream->tx_index = 0;
+  stream->inputs = 0;
+  stream->remaining = 0;
+  stream->items = 0;
+  stream->segwit = false;
+}
+
+bool btcp2p_block_stream_done(struct btcp2p_block_stream_t const * const stream) {
+  return stream->state == BTCP2P_BLOCK_STREAM_DONE;
+}
+
+// btcp2p_block_stream_field_size returns the size of the field the stream
+// expects next, given the avail bytes of it at data, or the number of bytes
+// needed to tell if there are too few. The varint that counts or prefixes
+// the field is decoded into *value. Returns SIZE_MAX for a length that no
+// block could hold.
+static size_t btcp2p_block_stream_field_size(struct btcp2p_block_stream_t const * const stream,
+                                             uint8_t const * data,
+                                             size_t avail,
+                                             uint64_t* value)
+{
+  bool prefixed = false;
+
+  switch (stream->state) {
+  case BTCP2P_BLOCK_STREAM_HEADER:
+    return BTCP2P_BLOCK_HEADER_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_VERSION:
+    return BTCP2P_TX_VERSION_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_FLAG:
+    return BTCP2P_TX_FLAG_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_OUTPOINT:
+    return BTCP2P_TX_OUTPOINT_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_SEQUENCE:
+    return BTCP2P_TX_SEQUENCE_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_VALUE:
+    return BTCP2P_TX_VALUE_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_LOCK_TIME:
+    return BTCP2P_TX_LOCK_TIME_SIZE;
+  case BTCP2P_BLOCK_STREAM_TX_SIG_SCRIPT:
+  case BTCP2P_BLOCK_STREAM_TX_PK_SCRIPT:
+  case BTCP2P_BLOCK_STREAM_TX_WITNESS_ITEM:
+    prefixed = true;
+    break;
+  default:
+    break;
+  }
+
+  if (avail == 0) {
+    return 1;
+  }
+  size_t size = data[0] < 0xFD ? 1 : data[0] == 0xFD ? 3 : data[0] == 0xFE ? 5 : 9;
+  if (avail < size) {
+    return size;
+  }
+
+  struct btcp2p_checked_buffer_t cb = {
+    .buffer = (uint8_t*)data, .len = size, .rw_cursor = 0, .capacity = size
+  };
+  struct btcp2p_varint_t vi;
+  btcp2p_varint_unpack(&vi, &cb);
+  *value = vi.value;
+
+  if (!prefixed) {
+    return size;
+  }
+  if (vi.value > BTCP2P_MAX_PAYLOAD) {
+    return SIZE_MAX;
+  }
+  return size + (size_t)vi.value;
+}
+
+// btcp2p_block_stream_after_outputs moves on to the witnesses, if the
+// transaction has any, or else to its lock time.
+static void btcp2p_block_stream_after_outputs(struct btcp2p_block_stream_t* stream) {
+  if (stream->segwit && stream->inputs > 0) {
+    stream->remaining = stream->inputs;
+    stream->state = BTCP2P_BLOCK_STREAM_TX_WITNESS_COUNT;
+  } else {
+    stream->state = BTCP2P_BLOCK_STREAM_TX_LOCK_TIME;
+  }
+}
+
+// btcp2p_block_stream_after_witness moves on to the next input's witness or
+// to the lock time after the last.
+static void btcp2p_block_stream_after_witness(struct btcp2p_block_stream_t* stream) {
+  stream->remaining--;
+  stream->state = stream->remaining > 0
+    ? BTCP2P_BLOCK_STREAM_TX_WITNESS_COUNT
+    : BTCP2P_BLOCK_STREAM_TX_LOCK_TIME;
+}
+
+// btcp2p_block_stream_next moves the stream past a decoded field, setting
+// *ended if the field finished the header, the transaction count or a
+// transaction. Returns false if the field is invalid.
+static bool btcp2p_block_stream_next(struct btcp2p_block_stream_t* stream,
+                                     uint8_t const * field,
+                                     uint64_t value,
+                                     bool* ended)
+{
+  *ended = false;
+
+  switch (stream->state) {
+  case BTCP2P_BLOCK_STREAM_HEADER:
+    stream->state = BTCP2P_BLOCK_STREAM_TX_COUNT;
+    *ended = true;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_COUNT:
+    // Every block has at least its coinbase.
+    if (value == 0) {
+      return false;
+    }
+    stream->tx_count = value;
+    stream->state = BTCP2P_BLOCK_STREAM_TX_VERSION;
+    *ended = true;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_VERSION:
+    stream->segwit = false;
+    stream->state = BTCP2P_BLOCK_STREAM_TX_INPUT_COUNT;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_INPUT_COUNT:
+    // An empty input count before any witness flag is the segwit marker.
+    if (value == 0 && !stream->segwit) {
+      stream->state = BTCP2P_BLOCK_STREAM_TX_FLAG;
+      break;
+    }
+    stream->inputs = value;
+    stream->remaining = value;
+    stream->state = value > 0 ? BTCP2P_BLOCK_STREAM_TX_OUTPOINT : BTCP2P_BLOCK_STREAM_TX_OUTPUT_COUNT;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_FLAG:
+    if (field[0] != 1) {
+      return false;
+    }
+    stream->segwit = true;
+    stream->state = BTCP2P_BLOCK_STREAM_TX_INPUT_COUNT;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_OUTPOINT:
+    stream->state = BTCP2P_BLOCK_STREAM_TX_SIG_SCRIPT;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_SIG_SCRIPT:
+    stream->state = BTCP2P_BLOCK_STREAM_TX_SEQUENCE;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_SEQUENCE:
+    stream->remaining--;
+    stream->state = stream->remaining > 0
+      ? BTCP2P_BLOCK_STREAM_TX_OUTPOINT
+      : BTCP2P_BLOCK_STREAM_TX_OUTPUT_COUNT;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_OUTPUT_COUNT:
+    stream->remaining = value;
+    if (value > 0) {
+      stream->state = BTCP2P_BLOCK_STREAM_TX_VALUE;
+    } else {
+      btcp2p_block_stream_after_outputs(stream);
+    }
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_VALUE:
+    stream->state = BTCP2P_BLOCK_STREAM_TX_PK_SCRIPT;
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_PK_SCRIPT:
+    stream->remaining--;
+    if (stream->remaining > 0) {
+      stream->state = BTCP2P_BLOCK_STREAM_TX_VALUE;
+    } else {
+      btcp2p_block_stream_after_outputs(stream);
+    }
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_WITNESS_COUNT:
+    stream->items = value;
+    if (value > 0) {
+      stream->state = BTCP2P_BLOCK_STREAM_TX_WITNESS_ITEM;
+    } else {
+      btcp2p_block_stream_after_witness(stream);
+    }
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_WITNESS_ITEM:
+    stream->items--;
+    if (stream->items == 0) {
+      btcp2p_block_stream_after_witness(stream);
+    }
+    break;
+  case BTCP2P_BLOCK_STREAM_TX_LOCK_TIME:
+    stream->tx_index++;
+    stream->state = stream->tx_index < stream->tx_count
+      ? BTCP2P_BLOCK_STREAM_TX_VERSION
+      : BTCP2P_BLOCK_STREAM_DONE;
+    *ended = true;
+    break;
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+// btcp2p_block_stream_emit passes a finished header or transaction to its
+// callback. decoded is the state that finished it.
+static void btcp2p_block_stream_emit(struct btcp2p_block_stream_t* stream,
+                                     enum btcp2p_block_stream_state_t decoded,
+                                     uint8_t const * unit,
+                                     size_t length)
+{
+  if (decoded == BTCP2P_BLOCK_STREAM_HEADER && stream->on_header) {
+    stream->on_header(unit, stream->ctx);
+  } else if (decoded == BTCP2P_BLOCK_STREAM_TX_LOCK_TIME && stream->on_tx) {
+    stream->on_tx(unit, length, stream->tx_index - 1, stream->ctx);
+  }
+}
+
+bool btcp2p_block_stream_feed(struct btcp2p_block_stream_t* stream,
+                              uint8_t const * data,
+                              size_t length)
+{
+  size_t offset = 0;
+  size_t unit_start = 0;
+
+  while (stream->state != BTCP2P_BLOCK_STREAM_FAILED) {
+    if (stream->state == BTCP2P_BLOCK_STREAM_DONE) {
+      if (offset == length) {
+        return true;
+      }
+      break;
+    }
+
+    // A unit split across pieces is decoded from the window, and everything
+    // else in place.
+    bool windowed = stream->window.rw_cursor > 0;
+    uint8_t const * field = windowed ? stream->window.buffer + stream->parsed : data + offset;
+    size_t avail = windowed ? stream->window.rw_cursor - stream->parsed : length - offset;
+
+    uint64_t value = 0;
+    size_t size = btcp2p_block_stream_field_size(stream, field, avail, &value);
+    if (size == SIZE_MAX) {
+      break;
+    }
+
+    if (size > avail) {
+      if (!windowed) {
+        // The unit continues in the next piece, so keep what there is of it.
+        if (unit_start < length &&
+            !btcp2p_checked_buffer_write(&stream->window, data + unit_start, length - unit_start)) {
+          break;
+        }
+        stream->parsed = offset - unit_start;
+        return true;
+      }
+      if (offset == length) {
+        return true;
+      }
+
+      // Only take what the field needs, so the window never holds more than
+      // the unit.
+      size_t amount = size - avail;
+      if (amount > length - offset) {
+        amount = length - offset;
+      }
+      if (!btcp2p_checked_buffer_write(&stream->window, data + offset, amount)) {
+        break;
+      }
+      offset += amount;
+      continue;
+    }
+
+    enum btcp2p_block_stream_state_t decoded = stream->state;
+    bool ended;
+    if (!btcp2p_block_stream_next(stream, field, value, &ended)) {
+      break;
+    }
+
+    if (windowed) {
+      stream->parsed += size;
+    } else {
+      offset += size;
+    }
+    if (ended) {
+      if (windowed) {
+        btcp2p_block_stream_emit(stream, decoded, stream->window.buffer, stream->parsed);
+        btcp2p_checked_buffer_prepare_write(&stream->window);
+        stream->parsed = 0;
+      } else {
+        btcp2p_block_stream_emit(stream, decoded, data + unit_start, offset - unit_start);
+      }
+      unit_start = offset;
+    }
+  }
+
+  stream->state = BTCP2P_BLOCK_STREAM_FAILED;
+  return false;
+}
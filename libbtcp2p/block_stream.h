@@ -0,0 +1,98 @@
+// Streaming decoder for block payloads.
+//
+// A block stream is fed a block payload in whatever pieces it arrives in and
+// calls back with the 80-byte header and then with each serialized
+// transaction as soon as its last byte is available, so parsing overlaps the
+// transfer of the rest of the block. Transactions that lie wholly within one
+// piece are passed straight from it; only a transaction split across pieces
+// is gathered into the stream's window, so the memory a block needs is the
+// largest such transaction rather than the whole block.
+//
+// Transactions are emitted before the frame's checksum can be checked. A
+// receive that then fails means the block's transactions must be dropped.
+//
+// Example:
+//   btcp2p_block_stream_create(&stream, on_header, on_tx, &state);
+//   connection.block_stream = &stream;
+//   ... connect ...
+//   while (btcp2p_message_pump(&connection)) {
+//     if (btcp2p_has_message(&connection, "block")) { ... the block is complete ... }
+//   }
+#ifndef LIBBTCP2P_BLOCK_STREAM_H
+#define LIBBTCP2P_BLOCK_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbtcp2p/checked_buffer.h"
+#include "libbtcp2p/message.h"
+
+// Callback invoked with a block's serialized header.
+typedef void (*btcp2p_block_header_callback_t)(uint8_t const header[BTCP2P_BLOCK_HEADER_SIZE], void* ctx);
+
+// Callback invoked with each serialized transaction of a block, including
+// any witness data, and its position in the block. The bytes are only valid
+// during the call.
+typedef void (*btcp2p_block_tx_callback_t)(uint8_t const * tx, size_t length, uint64_t index, void* ctx);
+
+// The field of a block the stream expects next.
+enum btcp2p_block_stream_state_t {
+  BTCP2P_BLOCK_STREAM_HEADER,
+  BTCP2P_BLOCK_STREAM_TX_COUNT,
+  BTCP2P_BLOCK_STREAM_TX_VERSION,
+  BTCP2P_BLOCK_STREAM_TX_INPUT_COUNT,
+  BTCP2P_BLOCK_STREAM_TX_FLAG, ///< Segwit flag after an empty input count marker.
+  BTCP2P_BLOCK_STREAM_TX_OUTPOINT,
+  BTCP2P_BLOCK_STREAM_TX_SIG_SCRIPT,
+  BTCP2P_BLOCK_STREAM_TX_SEQUENCE,
+  BTCP2P_BLOCK_STREAM_TX_OUTPUT_COUNT,
+  BTCP2P_BLOCK_STREAM_TX_VALUE,
+  BTCP2P_BLOCK_STREAM_TX_PK_SCRIPT,
+  BTCP2P_BLOCK_STREAM_TX_WITNESS_COUNT,
+  BTCP2P_BLOCK_STREAM_TX_WITNESS_ITEM,
+  BTCP2P_BLOCK_STREAM_TX_LOCK_TIME,
+  BTCP2P_BLOCK_STREAM_DONE, ///< Every transaction has been emitted.
+  BTCP2P_BLOCK_STREAM_FAILED ///< The payload is not a well-formed block.
+};
+
+struct btcp2p_block_stream_t {
+  btcp2p_block_header_callback_t on_header;
+  btcp2p_block_tx_callback_t on_tx;
+  void* ctx; ///< Passed to the callbacks.
+  enum btcp2p_block_stream_state_t state;
+  struct btcp2p_checked_buffer_t window; ///< Start of a header or transaction split across pieces.
+  size_t parsed; ///< Bytes of the window already decoded.
+  uint64_t tx_count; ///< Transactions the block declares.
+  uint64_t tx_index; ///< Transaction being decoded.
+  uint64_t inputs; ///< Inputs of the transaction being decoded.
+  uint64_t remaining; ///< Inputs, outputs or witnesses left in the current list.
+  uint64_t items; ///< Witness items left for the current input.
+  bool segwit; ///< Does the transaction being decoded carry witnesses?
+};
+
+// btcp2p_block_stream_create initializes a stream ready for the start of a
+// block, calling on_header and on_tx with ctx. Either callback may be NULL.
+void btcp2p_block_stream_create(struct btcp2p_block_stream_t* stream,
+                                btcp2p_block_header_callback_t on_header,
+                                btcp2p_block_tx_callback_t on_tx,
+                                void* ctx);
+
+// btcp2p_block_stream_destroy frees resources allocated for the stream.
+void btcp2p_block_stream_destroy(struct btcp2p_block_stream_t* stream);
+
+// btcp2p_block_stream_reset prepares the stream for the start of a new
+// block.
+void btcp2p_block_stream_reset(struct btcp2p_block_stream_t* stream);
+
+// btcp2p_block_stream_feed decodes the next length bytes of the block,
+// emitting everything they complete. Returns false once the bytes cannot be
+// part of a well-formed block, including bytes after its last transaction.
+bool btcp2p_block_stream_feed(struct btcp2p_block_stream_t* stream,
+                              uint8_t const * data,
+                              size_t length);
+
+// btcp2p_block_stream_done returns true if a whole block has been decoded.
+bool btcp2p_block_stream_done(struct btcp2p_block_stream_t const * const stream);
+
+#endif // LIBBTCP2P_BLOCK_STREAM_H
@@ -2,8 +2,14 @@
 #define LIBBTCP2P_BTCP2P_H
 
 #include <libbtcp2p/checked_buffer.h>
+#include <libbtcp2p/command.h>
 #include <libbtcp2p/connection.h>
+#include <libbtcp2p/connector.h>
 #include <libbtcp2p/log.h>
+#ifdef __linux__
+#include <libbtcp2p/reactor.h>
+#include <libbtcp2p/runtime.h>
+#endif
 #include <libbtcp2p/timer.h>
 #include <libbtcp2p/types.h>
 #include <libbtcp2p/vartypes.h>
@@ -0,0 +1,29 @@
+#include "libbtcp2p/budget.h"
+
+void btcp2p_budget_create(struct btcp2p_budget_t* budget, size_t limit) {
+  atomic_init(&budget->used, 0);
+  atomic_init(&budget->refused, 0);
+  budget->limit = limit;
+}
+
+bool btcp2p_budget_charge(struct btcp2p_budget_t* budget, size_t amount) {
+  size_t used = atomic_load_explicit(&budget->used, memory_order_relaxed);
+
+  do {
+    if (amount > budget->limit || used > budget->limit - amount) {
+      atomic_fetch_add_explicit(&budget->refused, 1, memory_order_relaxed);
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&budget->used, &used, used + amount,
+                                                  memory_order_relaxed, memory_order_relaxed));
+
+  return true;
+}
+
+void btcp2p_budget_release(struct btcp2p_budget_t* budget, size_t amount) {
+  atomic_fetch_sub_explicit(&budget->used, amount, memory_order_relaxed);
+}
+
+size_t btcp2p_budget_used(struct btcp2p_budget_t* budget) {
+  return atomic_load_explicit(&budget->used, memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+// Memory budgets for received payloads.
+//
+// A budget caps how many payload bytes may be held in memory at once. Frame
+// readers charge a payload to their connection's budgets as soon as its
+// header announces the length, before anything is allocated for it, and
+// pause rather than read on while a budget is exhausted. The charge is
+// released once the message has been handled. One budget may be shared by
+// every connection in a process, across threads, to bound memory under
+// adversarial load.
+//
+// Example:
+//   btcp2p_budget_create(&global, 256 * 1024 * 1024);
+//   connection.recv_budget = &global;
+//   ... connect ...
+#ifndef LIBBTCP2P_BUDGET_H
+#define LIBBTCP2P_BUDGET_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct btcp2p_budget_t {
+  atomic_size_t used; ///< Bytes currently charged.
+  size_t limit; ///< Most bytes that may be charged at once.
+  atomic_size_t refused; ///< Charges refused for lack of room.
+};
+
+// btcp2p_budget_create initializes an empty budget of limit bytes.
+void btcp2p_budget_create(struct btcp2p_budget_t* budget, size_t limit);
+
+// btcp2p_budget_charge adds amount bytes to the budget if they fit within its
+// limit, and returns whether they did. It is safe to call from any thread.
+bool btcp2p_budget_charge(struct btcp2p_budget_t* budget, size_t amount);
+
+// btcp2p_budget_release returns amount previously charged bytes to the
+// budget. It is safe to call from any thread.
+void btcp2p_budget_release(struct btcp2p_budget_t* budget, size_t amount);
+
+// btcp2p_budget_used returns the number of bytes currently charged.
+size_t btcp2p_budget_used(struct btcp2p_budget_t* budget);
+
+#endif // LIBBTCP2P_BUDGET_H
@@ -1,21 +1,37 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "libbtcp2p/checked_buffer.h"
 
-// ALIGNUP aligns the given amount to ensure that it is a power of alignment.
-#define ALIGNUP(Size, Alignment) ( (((uint32_t)Size) + (Alignment) - 1) & (~((Alignment) - 1)) )
+// Alignment of the buffer's capacity.
+#define BTCP2P_CHECKED_BUFFER_ALIGNMENT 64
+
+// ALIGNUP rounds the given size up to a multiple of alignment, which must be
+// a power of two. Sizes within alignment of SIZE_MAX must be rejected first.
+#define ALIGNUP(Size, Alignment) ( (((size_t)(Size)) + (Alignment) - 1) & (~((size_t)(Alignment) - 1)) )
 
 void btcp2p_checked_buffer_create(struct btcp2p_checked_buffer_t* cb) {
   memset(cb, 0, sizeof(struct btcp2p_checked_buffer_t));
   btcp2p_checked_buffer_resize(cb, BTCP2P_CHECKED_BUFFER_INITIAL_CAPACITY);
 }
 
-void btcp2p_checked_buffer_resize(struct btcp2p_checked_buffer_t* cb,
+bool btcp2p_checked_buffer_resize(struct btcp2p_checked_buffer_t* cb,
                                   size_t capacity)
 {
-  cb->capacity = ALIGNUP(capacity, 64);
-  cb->buffer = realloc(cb->buffer, cb->capacity);
+  if (capacity > SIZE_MAX - BTCP2P_CHECKED_BUFFER_ALIGNMENT) {
+    return false;
+  }
+
+  size_t aligned = ALIGNUP(capacity, BTCP2P_CHECKED_BUFFER_ALIGNMENT);
+  uint8_t* buffer = realloc(cb->buffer, aligned);
+  if (!buffer) {
+    return false;
+  }
+
+  cb->buffer = buffer;
+  cb->capacity = aligned;
+  return true;
 }
 
 void btcp2p_checked_buffer_destroy(struct btcp2p_checked_buffer_t* cb) {
@@ -52,8 +68,10 @@ void btcp2p_checked_buffer_prepare_read(struct btcp2p_checked_buffer_t* cb,
                                         uint8_t const * const src,
                                         size_t src_len)
 {
-  if (src_len > cb->capacity) {
-    btcp2p_checked_buffer_resize(cb, src_len);
+  if (src_len > cb->capacity && !btcp2p_checked_buffer_resize(cb, src_len)) {
+    cb->len = 0;
+    cb->rw_cursor = 0;
+    return;
   }
 
   memcpy(cb->buffer, src, src_len);
@@ -81,17 +99,20 @@ void btcp2p_checked_buffer_prepare_write(struct btcp2p_checked_buffer_t* cb) {
   cb->len = 0;
 }
 
-void btcp2p_checked_buffer_write(struct btcp2p_checked_buffer_t* cb,
+bool btcp2p_checked_buffer_write(struct btcp2p_checked_buffer_t* cb,
                                  uint8_t const * const src,
                                  size_t write_amount)
 {
-  uint32_t remaining_space = cb->capacity - cb->rw_cursor;
-  if (write_amount > remaining_space) {
-    btcp2p_checked_buffer_resize(cb, cb->capacity + (write_amount - remaining_space));
+  size_t remaining_space = cb->capacity - cb->rw_cursor;
+  if (write_amount > remaining_space &&
+      (write_amount - remaining_space > SIZE_MAX - cb->capacity ||
+       !btcp2p_checked_buffer_resize(cb, cb->capacity + (write_amount - remaining_space)))) {
+    return false;
   }
 
   memcpy(cb->buffer + cb->rw_cursor, src, write_amount);
   cb->rw_cursor += write_amount;
+  return true;
 }
 
 uint32_t btcp2p_checked_buffer_amount_written(struct btcp2p_checked_buffer_t* cb) {
@@ -101,8 +122,8 @@ uint32_t btcp2p_checked_buffer_amount_written(struct btcp2p_checked_buffer_t* cb
 uint8_t* btcp2p_checked_buffer_prepare_copy(struct btcp2p_checked_buffer_t* cb,
                                             size_t copy_amount_bytes)
 {
-  if (copy_amount_bytes > cb->capacity) {
-    btcp2p_checked_buffer_resize(cb, copy_amount_bytes);
+  if (copy_amount_bytes > cb->capacity && !btcp2p_checked_buffer_resize(cb, copy_amount_bytes)) {
+    return NULL;
   }
 
   cb->len = copy_amount_bytes;
@@ -24,8 +24,9 @@ struct btcp2p_checked_buffer_t {
 void btcp2p_checked_buffer_create(struct btcp2p_checked_buffer_t* cb);
 
 // btcp2p_checked_buffer_resize resizes the given checked buffer or creates a new
-// checked buffer with the given initial capacity.
-void btcp2p_checked_buffer_resize(struct btcp2p_checked_buffer_t* cb,
+// checked buffer with the given initial capacity. It returns false, leaving
+// the buffer as it was, if the memory could not be allocated.
+bool btcp2p_checked_buffer_resize(struct btcp2p_checked_buffer_t* cb,
                                   size_t capacity);
 
 // btcp2p_checked_buffer_destroy free resources allocated for the checked buffer.
@@ -45,7 +46,7 @@ void btcp2p_checked_buffer_read_reset(struct btcp2p_checked_buffer_t* cb);
 
 // btcp2p_checked_buffer_prepare_read loads the given data into the checked
 // buffer for reading, resizing as needed. It then resets the read/write cursor
-// to the start of the buffer.
+// to the start of the buffer. If the buffer cannot grow it is left empty.
 void btcp2p_checked_buffer_prepare_read(struct btcp2p_checked_buffer_t* cb,
                                         uint8_t const * const src,
                                         size_t src_len);
@@ -64,8 +65,9 @@ void btcp2p_checked_buffer_prepare_write(struct btcp2p_checked_buffer_t* cb);
 
 // btcp2p_checked_buffer_write writes the given amount of data from the source
 // buffer into the destination buffer. It resizes the buffer if there is an
-// attempt to write beyond the existing capacity.
-void btcp2p_checked_buffer_write(struct btcp2p_checked_buffer_t* cb,
+// attempt to write beyond the existing capacity, and returns false without
+// writing if it could not.
+bool btcp2p_checked_buffer_write(struct btcp2p_checked_buffer_t* cb,
                                  uint8_t const * const src,
                                  size_t write_amount);
 
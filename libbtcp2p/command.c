@@ -0,0 +1,181 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "libbtcp2p/command.h"
+
+// Multiplier chosen so that every known command hashes to its own slot.
+#define BTCP2P_COMMAND_HASH_MULTIPLIER 0x332dd3313a0b9965ULL
+
+// Number of bits in a command hash.
+#define BTCP2P_COMMAND_HASH_BITS 7
+
+// A command field viewed as a string or as the two words it is compared by.
+union btcp2p_command_name_t {
+  char name[12];
+  struct {
+    uint64_t lo; ///< First eight bytes of the command.
+    uint32_t hi; ///< Last four bytes of the command.
+  } words;
+};
+
+static const union btcp2p_command_name_t COMMAND_NAMES[BTCP2P_CMD_COUNT] = {
+  [BTCP2P_CMD_UNKNOWN] = { .name = "" },
+  [BTCP2P_CMD_VERSION] = { .name = "version" },
+  [BTCP2P_CMD_VERACK] = { .name = "verack" },
+  [BTCP2P_CMD_ADDR] = { .name = "addr" },
+  [BTCP2P_CMD_ADDRV2] = { .name = "addrv2" },
+  [BTCP2P_CMD_SENDADDRV2] = { .name = "sendaddrv2" },
+  [BTCP2P_CMD_INV] = { .name = "inv" },
+  [BTCP2P_CMD_GETDATA] = { .name = "getdata" },
+  [BTCP2P_CMD_MERKLEBLOCK] = { .name = "merkleblock" },
+  [BTCP2P_CMD_GETBLOCKS] = { .name = "getblocks" },
+  [BTCP2P_CMD_GETHEADERS] = { .name = "getheaders" },
+  [BTCP2P_CMD_TX] = { .name = "tx" },
+  [BTCP2P_CMD_HEADERS] = { .name = "headers" },
+  [BTCP2P_CMD_BLOCK] = { .name = "block" },
+  [BTCP2P_CMD_GETADDR] = { .name = "getaddr" },
+  [BTCP2P_CMD_MEMPOOL] = { .name = "mempool" },
+  [BTCP2P_CMD_PING] = { .name = "ping" },
+  [BTCP2P_CMD_PONG] = { .name = "pong" },
+  [BTCP2P_CMD_NOTFOUND] = { .name = "notfound" },
+  [BTCP2P_CMD_FILTERLOAD] = { .name = "filterload" },
+  [BTCP2P_CMD_FILTERADD] = { .name = "filteradd" },
+  [BTCP2P_CMD_FILTERCLEAR] = { .name = "filterclear" },
+  [BTCP2P_CMD_SENDHEADERS] = { .name = "sendheaders" },
+  [BTCP2P_CMD_FEEFILTER] = { .name = "feefilter" },
+  [BTCP2P_CMD_SENDCMPCT] = { .name = "sendcmpct" },
+  [BTCP2P_CMD_CMPCTBLOCK] = { .name = "cmpctblock" },
+  [BTCP2P_CMD_GETBLOCKTXN] = { .name = "getblocktxn" },
+  [BTCP2P_CMD_BLOCKTXN] = { .name = "blocktxn" },
+  [BTCP2P_CMD_GETCFILTERS] = { .name = "getcfilters" },
+  [BTCP2P_CMD_CFILTER] = { .name = "cfilter" },
+  [BTCP2P_CMD_GETCFHEADERS] = { .name = "getcfheaders" },
+  [BTCP2P_CMD_CFHEADERS] = { .name = "cfheaders" },
+  [BTCP2P_CMD_GETCFCHECKPT] = { .name = "getcfcheckpt" },
+  [BTCP2P_CMD_CFCHECKPT] = { .name = "cfcheckpt" },
+  [BTCP2P_CMD_WTXIDRELAY] = { .name = "wtxidrelay" },
+  [BTCP2P_CMD_SENDTXRCNCL] = { .name = "sendtxrcncl" },
+  [BTCP2P_CMD_REJECT] = { .name = "reject" },
+  [BTCP2P_CMD_ALERT] = { .name = "alert" },
+};
+
+// Command id for each hash slot. Unused slots hold BTCP2P_CMD_UNKNOWN.
+static const uint8_t COMMAND_SLOTS[1 << BTCP2P_COMMAND_HASH_BITS] = {
+  [  0] = BTCP2P_CMD_NOTFOUND,
+  [  3] = BTCP2P_CMD_INV,
+  [  6] = BTCP2P_CMD_SENDADDRV2,
+  [ 12] = BTCP2P_CMD_HEADERS,
+  [ 20] = BTCP2P_CMD_GETHEADERS,
+  [ 25] = BTCP2P_CMD_SENDTXRCNCL,
+  [ 30] = BTCP2P_CMD_MEMPOOL,
+  [ 31] = BTCP2P_CMD_FILTERCLEAR,
+  [ 34] = BTCP2P_CMD_ALERT,
+  [ 35] = BTCP2P_CMD_SENDHEADERS,
+  [ 42] = BTCP2P_CMD_GETCFHEADERS,
+  [ 45] = BTCP2P_CMD_BLOCKTXN,
+  [ 46] = BTCP2P_CMD_CFCHECKPT,
+  [ 47] = BTCP2P_CMD_SENDCMPCT,
+  [ 48] = BTCP2P_CMD_CFHEADERS,
+  [ 56] = BTCP2P_CMD_REJECT,
+  [ 57] = BTCP2P_CMD_MERKLEBLOCK,
+  [ 64] = BTCP2P_CMD_WTXIDRELAY,
+  [ 68] = BTCP2P_CMD_GETADDR,
+  [ 71] = BTCP2P_CMD_FILTERADD,
+  [ 74] = BTCP2P_CMD_VERSION,
+  [ 80] = BTCP2P_CMD_CFILTER,
+  [ 83] = BTCP2P_CMD_GETCFILTERS,
+  [ 84] = BTCP2P_CMD_VERACK,
+  [ 85] = BTCP2P_CMD_TX,
+  [ 89] = BTCP2P_CMD_GETBLOCKTXN,
+  [ 90] = BTCP2P_CMD_ADDR,
+  [ 93] = BTCP2P_CMD_ADDRV2,
+  [ 94] = BTCP2P_CMD_PING,
+  [ 99] = BTCP2P_CMD_FEEFILTER,
+  [101] = BTCP2P_CMD_BLOCK,
+  [103] = BTCP2P_CMD_GETBLOCKS,
+  [104] = BTCP2P_CMD_PONG,
+  [110] = BTCP2P_CMD_CMPCTBLOCK,
+  [123] = BTCP2P_CMD_GETDATA,
+  [126] = BTCP2P_CMD_GETCFCHECKPT,
+  [127] = BTCP2P_CMD_FILTERLOAD,
+};
+
+// Size of the compact size prefix that counts a list of up to 65535 items.
+#define BTCP2P_COUNT_PREFIX 3
+
+// Largest payload per command. Lists are bounded by the counts peers enforce:
+// 1000 addresses, 50000 inventory entries, 2000 headers and 101 locator
+// hashes. Addrv2 addresses are at most 512 bytes.
+static const uint32_t COMMAND_MAX_PAYLOADS[BTCP2P_CMD_COUNT] = {
+  [BTCP2P_CMD_UNKNOWN] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_VERSION] = 1024,
+  [BTCP2P_CMD_VERACK] = 0,
+  [BTCP2P_CMD_ADDR] = BTCP2P_COUNT_PREFIX + 1000 * 30,
+  [BTCP2P_CMD_ADDRV2] = BTCP2P_COUNT_PREFIX + 1000 * (4 + 9 + 1 + BTCP2P_COUNT_PREFIX + 512 + 2),
+  [BTCP2P_CMD_SENDADDRV2] = 0,
+  [BTCP2P_CMD_INV] = BTCP2P_COUNT_PREFIX + 50000 * 36,
+  [BTCP2P_CMD_GETDATA] = BTCP2P_COUNT_PREFIX + 50000 * 36,
+  [BTCP2P_CMD_MERKLEBLOCK] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_GETBLOCKS] = 4 + BTCP2P_COUNT_PREFIX + 101 * 32 + 32,
+  [BTCP2P_CMD_GETHEADERS] = 4 + BTCP2P_COUNT_PREFIX + 101 * 32 + 32,
+  [BTCP2P_CMD_TX] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_HEADERS] = BTCP2P_COUNT_PREFIX + 2000 * 81,
+  [BTCP2P_CMD_BLOCK] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_GETADDR] = 0,
+  [BTCP2P_CMD_MEMPOOL] = 0,
+  [BTCP2P_CMD_PING] = 8,
+  [BTCP2P_CMD_PONG] = 8,
+  [BTCP2P_CMD_NOTFOUND] = BTCP2P_COUNT_PREFIX + 50000 * 36,
+  [BTCP2P_CMD_FILTERLOAD] = BTCP2P_COUNT_PREFIX + 36000 + 4 + 4 + 1,
+  [BTCP2P_CMD_FILTERADD] = BTCP2P_COUNT_PREFIX + 520,
+  [BTCP2P_CMD_FILTERCLEAR] = 0,
+  [BTCP2P_CMD_SENDHEADERS] = 0,
+  [BTCP2P_CMD_FEEFILTER] = 8,
+  [BTCP2P_CMD_SENDCMPCT] = 9,
+  [BTCP2P_CMD_CMPCTBLOCK] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_GETBLOCKTXN] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_BLOCKTXN] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_GETCFILTERS] = 1 + 4 + 32,
+  [BTCP2P_CMD_CFILTER] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_GETCFHEADERS] = 1 + 4 + 32,
+  [BTCP2P_CMD_CFHEADERS] = 1 + 32 + 32 + BTCP2P_COUNT_PREFIX + 2000 * 32,
+  [BTCP2P_CMD_GETCFCHECKPT] = 1 + 32,
+  [BTCP2P_CMD_CFCHECKPT] = BTCP2P_MAX_PAYLOAD,
+  [BTCP2P_CMD_WTXIDRELAY] = 0,
+  [BTCP2P_CMD_SENDTXRCNCL] = 4 + 8,
+  [BTCP2P_CMD_REJECT] = 1024,
+  [BTCP2P_CMD_ALERT] = 1024,
+};
+
+enum btcp2p_command_id_t btcp2p_command_lookup(char const command[12]) {
+  uint64_t lo;
+  uint32_t hi;
+  memcpy(&lo, command, sizeof(lo));
+  memcpy(&hi, command + sizeof(lo), sizeof(hi));
+
+  uint64_t hash = (lo ^ ((uint64_t)hi << 32)) * BTCP2P_COMMAND_HASH_MULTIPLIER;
+  uint8_t id = COMMAND_SLOTS[hash >> (64 - BTCP2P_COMMAND_HASH_BITS)];
+
+  // Commands outside the known set can share a slot, so confirm the match.
+  if (COMMAND_NAMES[id].words.lo != lo || COMMAND_NAMES[id].words.hi != hi) {
+    return BTCP2P_CMD_UNKNOWN;
+  }
+
+  return (enum btcp2p_command_id_t)id;
+}
+
+char const * btcp2p_command_name(enum btcp2p_command_id_t id) {
+  if ((unsigned)id >= BTCP2P_CMD_COUNT) {
+    return COMMAND_NAMES[BTCP2P_CMD_UNKNOWN].name;
+  }
+
+  return COMMAND_NAMES[id].name;
+}
+
+uint32_t btcp2p_command_max_payload(enum btcp2p_command_id_t id) {
+  if ((unsigned)id >= BTCP2P_CMD_COUNT) {
+    return BTCP2P_MAX_PAYLOAD;
+  }
+
+  return COMMAND_MAX_PAYLOADS[id];
+}
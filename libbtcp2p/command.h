@@ -0,0 +1,73 @@
+// Interns P2P command names as small integer ids.
+//
+// The 12-byte command field of each received header is mapped to a
+// btcp2p_command_id_t once, so that code handling messages compares integers
+// instead of strings. Lookups hash the command with a perfect hash over the
+// known commands and confirm the match with two integer compares.
+#ifndef LIBBTCP2P_COMMAND_H
+#define LIBBTCP2P_COMMAND_H
+
+#include <stdint.h>
+
+// Largest payload accepted for any command: the most a serialized block
+// can take up.
+#define BTCP2P_MAX_PAYLOAD (4 * 1000 * 1000)
+
+// Commands known to the library. Anything else maps to BTCP2P_CMD_UNKNOWN.
+enum btcp2p_command_id_t {
+  BTCP2P_CMD_UNKNOWN = 0,
+  BTCP2P_CMD_VERSION,
+  BTCP2P_CMD_VERACK,
+  BTCP2P_CMD_ADDR,
+  BTCP2P_CMD_ADDRV2,
+  BTCP2P_CMD_SENDADDRV2,
+  BTCP2P_CMD_INV,
+  BTCP2P_CMD_GETDATA,
+  BTCP2P_CMD_MERKLEBLOCK,
+  BTCP2P_CMD_GETBLOCKS,
+  BTCP2P_CMD_GETHEADERS,
+  BTCP2P_CMD_TX,
+  BTCP2P_CMD_HEADERS,
+  BTCP2P_CMD_BLOCK,
+  BTCP2P_CMD_GETADDR,
+  BTCP2P_CMD_MEMPOOL,
+  BTCP2P_CMD_PING,
+  BTCP2P_CMD_PONG,
+  BTCP2P_CMD_NOTFOUND,
+  BTCP2P_CMD_FILTERLOAD,
+  BTCP2P_CMD_FILTERADD,
+  BTCP2P_CMD_FILTERCLEAR,
+  BTCP2P_CMD_SENDHEADERS,
+  BTCP2P_CMD_FEEFILTER,
+  BTCP2P_CMD_SENDCMPCT,
+  BTCP2P_CMD_CMPCTBLOCK,
+  BTCP2P_CMD_GETBLOCKTXN,
+  BTCP2P_CMD_BLOCKTXN,
+  BTCP2P_CMD_GETCFILTERS,
+  BTCP2P_CMD_CFILTER,
+  BTCP2P_CMD_GETCFHEADERS,
+  BTCP2P_CMD_CFHEADERS,
+  BTCP2P_CMD_GETCFCHECKPT,
+  BTCP2P_CMD_CFCHECKPT,
+  BTCP2P_CMD_WTXIDRELAY,
+  BTCP2P_CMD_SENDTXRCNCL,
+  BTCP2P_CMD_REJECT,
+  BTCP2P_CMD_ALERT,
+  BTCP2P_CMD_COUNT ///< Number of command ids, including BTCP2P_CMD_UNKNOWN.
+};
+
+// btcp2p_command_lookup returns the id for a NUL-padded 12-byte command field,
+// or BTCP2P_CMD_UNKNOWN if the command is not known to the library.
+enum btcp2p_command_id_t btcp2p_command_lookup(char const command[12]);
+
+// btcp2p_command_name returns the command string for an id, or an empty
+// string for BTCP2P_CMD_UNKNOWN.
+char const * btcp2p_command_name(enum btcp2p_command_id_t id);
+
+// btcp2p_command_max_payload returns the largest payload a well-behaved peer
+// sends with a command, derived from the protocol's own limits, such as 8
+// bytes for ping and BTCP2P_MAX_PAYLOAD for block. Unknown commands are
+// allowed BTCP2P_MAX_PAYLOAD.
+uint32_t btcp2p_command_max_payload(enum btcp2p_command_id_t id);
+
+#endif // LIBBTCP2P_COMMAND_H
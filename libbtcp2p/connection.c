@@ -1,3 +1,6 @@
+// Needed for accept4.
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -8,14 +11,14 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <unistd.h>
 
-#include <openssl/sha.h>
-
 #include "libbtcp2p/connection.h"
+#include "libbtcp2p/io.h"
 #include "libbtcp2p/log.h"
 #include "libbtcp2p/pack.h"
 #include "libbtcp2p/types.h"
@@ -30,7 +33,7 @@ static const struct btcp2p_chain_t CHAINS[] = {
   [3] = { 0 }
 };
 
-static struct btcp2p_chain_t const * btcp2p_chain_for_network(char const * const network) {
+struct btcp2p_chain_t const * btcp2p_chain_for_network(char const * const network) {
   for (struct btcp2p_chain_t const * next = CHAINS;
        next->name != NULL;
        next++)
@@ -55,80 +58,269 @@ static void btcp2p_netaddr_create(struct btcp2p_netaddr_t* addr,
   addr->port = htons(port);
 }
 
-// btcp2p_payload_checksum returns the first 4 bytes of the double-SHA256 hash
-// of the given payload.
-static uint32_t btcp2p_payload_checksum(uint8_t const * const payload,
-                                        size_t payload_size)
+// btcp2p_recv_frame receives whatever data is available without blocking
+// and reports whether a whole frame has been assembled in
+// connection->message. The frame's checksum has not been validated.
+static enum btcp2p_recv_status_t btcp2p_recv_frame(struct btcp2p_connection_t* connection)
 {
-  static unsigned char m1[SHA256_DIGEST_LENGTH];
-  static unsigned char m2[SHA256_DIGEST_LENGTH];
-  SHA256(SHA256(payload, payload_size, m1), SHA256_DIGEST_LENGTH, m2);
-  return *(uint32_t*)&m2;
-}
+  struct btcp2p_message_t* message = &connection->message;
+
+  // The previous message has been handled, so the ring space backing its
+  // payload can be reused.
+  btcp2p_ring_buffer_consume(&connection->recv_ring, connection->recv_ring_held);
+  connection->recv_ring_held = 0;
+
+  for (;;) {
+    enum btcp2p_frame_state_t state = btcp2p_frame_reader_consume(&connection->reader,
+                                                                  message,
+                                                                  &connection->recv_ring,
+                                                                  &connection->recv_ring_held);
+    if (state == BTCP2P_FRAME_COMPLETE) {
+      break;
+    }
+    if (state == BTCP2P_FRAME_OVERSIZED &&
+        message->header.length > connection->reader.max_payload[message->command_id])
+    {
+      btcp2p_log(
+        BTCP2P_LOG_ERROR,
+        "'%.12s' payload of %u bytes exceeds the limit of %u.\n",
+        message->header.command,
+        message->header.length,
+        connection->reader.max_payload[message->command_id]
+      );
+      return BTCP2P_RECV_FAILED;
+    }
+    if (state == BTCP2P_FRAME_OVERSIZED) {
+      btcp2p_log(
+        BTCP2P_LOG_ERROR,
+        "unable to allocate %u bytes for '%.12s' payload.\n",
+        message->header.length,
+        message->header.command
+      );
+      return BTCP2P_RECV_FAILED;
+    }
+    if (state == BTCP2P_FRAME_PAUSED) {
+      // Leave the rest on the socket so that the peer is slowed down by TCP
+      // flow control until there is room.
+      return BTCP2P_RECV_PARTIAL;
+    }
 
-// btcp2p_sendall blocks until all of the given data is successfully sent.
-static int btcp2p_sendall(int socket, uint8_t* data, int datalen) {
-  int total = 0;
-  int bytesleft = datalen;
-  int n = 0;
+    // The ring is empty at this point. Large payload remainders skip the ring
+    // and are received directly into the payload buffer, or dropped straight
+    // from the socket if the message is being discarded.
+    uint8_t* dst;
+    size_t want = btcp2p_frame_reader_want(&connection->reader, message, &dst);
+    if (connection->reader.state == BTCP2P_FRAME_OVERSIZED) {
+      continue;
+    }
+    bool direct = (connection->reader.state == BTCP2P_FRAME_PAYLOAD_PARTIAL ||
+                   connection->reader.state == BTCP2P_FRAME_DISCARD) &&
+                  want >= BTCP2P_RECV_DIRECT_THRESHOLD;
+
+    ssize_t result;
+    if (direct && dst == NULL) {
+      result = btcp2p_io_skip(connection, want);
+    } else if (direct) {
+      result = btcp2p_io_recv(connection, dst, want);
+    } else {
+      struct iovec iov[2];
+      int iovcnt = btcp2p_ring_buffer_write_iov(&connection->recv_ring, iov);
+      result = btcp2p_io_readv(connection, iov, iovcnt);
+    }
 
-  while (total < datalen) {
-    n = send(socket, data + total, bytesleft, 0);
-    if (n == -1) {
-      break;
+    if (result == 0) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "remote host closed connection.\n");
+      return BTCP2P_RECV_FAILED;
+    }
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return BTCP2P_RECV_PARTIAL;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      btcp2p_log(BTCP2P_LOG_ERROR, "message recv error: %s\n", strerror(errno));
+      return BTCP2P_RECV_FAILED;
+    }
+
+    if (direct) {
+      btcp2p_frame_reader_advance(&connection->reader, message, result);
+    } else {
+      btcp2p_ring_buffer_commit(&connection->recv_ring, result);
     }
-    total += n;
-    bytesleft -= n;
   }
 
-  return n == -1 ? -1 : 0;
+  btcp2p_frame_reader_reset(&connection->reader);
+  return BTCP2P_RECV_COMPLETE;
 }
 
-static bool btcp2p_recv_message(struct btcp2p_connection_t* connection,
-                                struct btcp2p_message_t* message)
+// btcp2p_take_verified makes the oldest frame in the verify queue the
+// connection's current message once its checksum has been checked.
+static enum btcp2p_recv_status_t btcp2p_take_verified(struct btcp2p_connection_t* connection)
 {
-  ssize_t result = recv(
-    connection->socket,
-    &message->header,
-    sizeof(message->header),
-    MSG_WAITALL
-  );
+  struct btcp2p_verify_job_t* job;
 
-  if (result == 0) {
-    btcp2p_log(BTCP2P_LOG_ERROR, "remote host closed connection.\n");
-    return false;
-  }
-  if (result < 0) {
-    btcp2p_log(BTCP2P_LOG_ERROR, "header recv error: %s\n", strerror(errno));
-    return false;
+  switch (btcp2p_verify_queue_peek(&connection->verify_queue, &job)) {
+  case BTCP2P_VERIFY_PENDING:
+    return BTCP2P_RECV_PARTIAL;
+  case BTCP2P_VERIFY_REJECTED:
+    btcp2p_log(
+      BTCP2P_LOG_ERROR,
+      "invalid message checksum: expected %08x was %08x.\n",
+      job->message.header.checksum,
+      job->checksum
+    );
+    btcp2p_verify_queue_pop(&connection->verify_queue);
+    return BTCP2P_RECV_FAILED;
+  default:
+    break;
   }
 
-  if (message->header.length > 0) {
-    uint8_t* buffer = btcp2p_checked_buffer_prepare_copy(
-      &message->payload,
-      message->header.length
-    );
+  // Keep the payload in the connection's own buffer so that the queue slot
+  // can be reused straight away.
+  struct btcp2p_checked_buffer_t spare = connection->verified;
+  connection->verified = job->message.payload;
+  job->message.payload = spare;
 
-    result = recv(
-      connection->socket,
-      buffer,
-      message->header.length,
-      MSG_WAITALL
-    );
+  connection->message = job->message;
+  connection->message.payload = connection->verified;
+  connection->recv_charged = job->message.header.length;
+  btcp2p_verify_queue_pop(&connection->verify_queue);
 
-    if (result == 0) {
-      btcp2p_log(BTCP2P_LOG_ERROR, "remote host closed connection.\n");
-      return false;
+  connection->has_message = true;
+  return BTCP2P_RECV_COMPLETE;
+}
+
+// btcp2p_try_recv_verified receives frames for a connection with a verify
+// pool. Every frame that can be read without blocking is handed to the pool
+// so that workers hash them while the socket is drained, and the oldest is
+// returned once it has been checked.
+static enum btcp2p_recv_status_t btcp2p_try_recv_verified(struct btcp2p_connection_t* connection)
+{
+  for (;;) {
+    enum btcp2p_recv_status_t status = btcp2p_take_verified(connection);
+    if (status != BTCP2P_RECV_PARTIAL ||
+        btcp2p_verify_queue_full(&connection->verify_queue))
+    {
+      return status;
     }
-    if (result < 0) {
-      btcp2p_log(BTCP2P_LOG_ERROR, "payload recv error: %s\n", strerror(errno));
-      return false;
+
+    status = btcp2p_recv_frame(connection);
+    if (status != BTCP2P_RECV_COMPLETE) {
+      // A worker may have finished the oldest frame meanwhile.
+      return status == BTCP2P_RECV_PARTIAL ? btcp2p_take_verified(connection) : status;
     }
 
-    // Validate the checksum of the message
-    uint32_t actual_checksum = btcp2p_payload_checksum(
-      buffer, message->header.length
-    );
+    struct btcp2p_message_t* frame = btcp2p_verify_queue_reserve(&connection->verify_queue);
+    frame->header = connection->message.header;
+    frame->command_id = connection->message.command_id;
+
+    if (connection->recv_ring_held > 0) {
+      btcp2p_checked_buffer_prepare_read(
+        &frame->payload,
+        connection->message.payload.buffer,
+        connection->message.header.length
+      );
+      btcp2p_ring_buffer_consume(&connection->recv_ring, connection->recv_ring_held);
+      connection->recv_ring_held = 0;
+    } else {
+      struct btcp2p_checked_buffer_t spare = frame->payload;
+      frame->payload = connection->reader.storage;
+      connection->reader.storage = spare;
+    }
+    frame->payload.len = frame->header.length;
+    frame->payload.rw_cursor = 0;
+
+    btcp2p_verify_queue_submit(&connection->verify_queue);
+  }
+}
+
+// btcp2p_is_feature returns true for the messages a peer announces optional
+// features with.
+static bool btcp2p_is_feature(enum btcp2p_command_id_t id)
+{
+  return id == BTCP2P_CMD_SENDHEADERS ||
+         id == BTCP2P_CMD_WTXIDRELAY ||
+         id == BTCP2P_CMD_SENDADDRV2 ||
+         id == BTCP2P_CMD_SENDCMPCT ||
+         id == BTCP2P_CMD_FEEFILTER;
+}
+
+// btcp2p_record_feature notes a feature announced by the connection's current
+// message, if it is a feature announcement, and updates what has been
+// negotiated with the peer. The payload is left ready to be unpacked again.
+static void btcp2p_record_feature(struct btcp2p_connection_t* conn)
+{
+  struct btcp2p_peer_features_t* peer = &conn->peer_features;
+  struct btcp2p_negotiated_t* negotiated = &conn->negotiated;
+
+  switch (conn->message.command_id) {
+  case BTCP2P_CMD_SENDHEADERS:
+    peer->sendheaders = true;
+    break;
+  case BTCP2P_CMD_WTXIDRELAY:
+    peer->wtxidrelay = true;
+    break;
+  case BTCP2P_CMD_SENDADDRV2:
+    peer->sendaddrv2 = true;
+    break;
+  case BTCP2P_CMD_SENDCMPCT: {
+    uint8_t high_bandwidth = 0;
+    uint64_t version = 0;
+    btcp2p_unpack_message(conn, "bl", &high_bandwidth, &version);
+    btcp2p_checked_buffer_read_reset(&conn->message.payload);
+    peer->sendcmpct = true;
+    if (version >= peer->cmpct_version) {
+      peer->cmpct_version = version;
+      peer->cmpct_high_bandwidth = high_bandwidth != 0;
+    }
+    break;
+  }
+  case BTCP2P_CMD_FEEFILTER:
+    btcp2p_unpack_message(conn, "l", &peer->feefilter);
+    btcp2p_checked_buffer_read_reset(&conn->message.payload);
+    break;
+  default:
+    return;
+  }
+
+  // Features that need both sides to opt in.
+  negotiated->wtxidrelay = conn->features.wtxidrelay &&
+                           peer->wtxidrelay &&
+                           negotiated->peer_version >= BTCP2P_WTXID_RELAY_VERSION;
+  negotiated->sendcmpct = conn->features.sendcmpct &&
+                          peer->sendcmpct &&
+                          peer->cmpct_version >= BTCP2P_CMPCT_VERSION;
+  negotiated->cmpct_high_bandwidth = negotiated->sendcmpct && conn->features.cmpct_high_bandwidth;
+}
+
+enum btcp2p_recv_status_t btcp2p_try_recv_message(struct btcp2p_connection_t* connection)
+{
+  struct btcp2p_message_t* message = &connection->message;
+
+  // The previous message has been handled, so its payload no longer counts
+  // against the budgets.
+  btcp2p_frame_reader_release(&connection->reader, connection->recv_charged);
+  connection->recv_charged = 0;
+
+  if (connection->verify_pool) {
+    enum btcp2p_recv_status_t status = btcp2p_try_recv_verified(connection);
+    if (status == BTCP2P_RECV_COMPLETE) {
+      btcp2p_record_feature(connection);
+    }
+    return status;
+  }
+
+  enum btcp2p_recv_status_t status = btcp2p_recv_frame(connection);
+  if (status != BTCP2P_RECV_COMPLETE) {
+    return status;
+  }
+  connection->recv_charged = connection->reader.charged;
+
+  if (message->header.length > 0) {
+    // Validate the checksum of the message, which the reader computed as the
+    // payload arrived.
+    uint32_t actual_checksum = connection->reader.checksum;
     if (message->header.checksum != actual_checksum) {
       btcp2p_log(
         BTCP2P_LOG_ERROR,
@@ -136,24 +328,161 @@ static bool btcp2p_recv_message(struct btcp2p_connection_t* connection,
         message->header.checksum,
         actual_checksum
       );
-      return false;
+      return BTCP2P_RECV_FAILED;
     }
   }
 
+  if (btcp2p_frame_reader_streams(&connection->reader, message) &&
+      !btcp2p_block_stream_done(connection->reader.block_stream))
+  {
+    btcp2p_log(BTCP2P_LOG_ERROR, "malformed block payload of %u bytes.\n", message->header.length);
+    return BTCP2P_RECV_FAILED;
+  }
+
   connection->has_message = true;
+  btcp2p_record_feature(connection);
+  return BTCP2P_RECV_COMPLETE;
+}
+
+bool btcp2p_has_pending_data(struct btcp2p_connection_t* connection)
+{
+  struct btcp2p_verify_job_t* job;
+  if (connection->verify_pool &&
+      btcp2p_verify_queue_peek(&connection->verify_queue, &job) != BTCP2P_VERIFY_PENDING)
+  {
+    return true;
+  }
+
+  if (btcp2p_ring_buffer_readable(&connection->recv_ring) > connection->recv_ring_held) {
+    return true;
+  }
+
+  return btcp2p_io_has_pending(connection);
+}
+
+// btcp2p_block_for_message waits, without a timeout, until another receive
+// attempt could make progress. Returns false on a poll error.
+static bool btcp2p_block_for_message(struct btcp2p_connection_t* connection)
+{
+  // A paused connection waits for room rather than for data.
+  if (btcp2p_recv_paused(connection)) {
+    poll(NULL, 0, BTCP2P_RECV_RETRY_MS);
+    return true;
+  }
+
+  // Nothing can be returned before the oldest verifying frame, so wait for
+  // it rather than for more data.
+  if (connection->verify_pool &&
+      btcp2p_verify_queue_depth(&connection->verify_queue) > 0)
+  {
+    btcp2p_verify_queue_wait(&connection->verify_queue, -1);
+    return true;
+  }
+
+  struct pollfd pfd;
+  pfd.fd = btcp2p_io_fd(connection);
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "poll error: %s\n", strerror(errno));
+    return false;
+  }
+
   return true;
 }
 
-bool btcp2p_perform_handshake(struct btcp2p_connection_t* conn)
+bool btcp2p_recv_message(struct btcp2p_connection_t* connection)
+{
+  for (;;) {
+    switch (btcp2p_try_recv_message(connection)) {
+    case BTCP2P_RECV_COMPLETE:
+      return true;
+    case BTCP2P_RECV_FAILED:
+      return false;
+    default:
+      break;
+    }
+
+    if (!btcp2p_block_for_message(connection)) {
+      return false;
+    }
+  }
+}
+
+// btcp2p_open_session prepares the buffers and I/O backend of a connection
+// whose socket has just been connected or accepted.
+static void btcp2p_open_session(struct btcp2p_connection_t* connection)
+{
+  btcp2p_checked_buffer_create(&connection->outgoing.payload);
+  btcp2p_send_queue_create(&connection->send_queue, BTCP2P_SEND_QUEUE_MAX_BYTES);
+  btcp2p_frame_reader_create(&connection->reader);
+  btcp2p_frame_reader_set_budget(&connection->reader,
+                                 connection->recv_budget,
+                                 connection->recv_limit ? connection->recv_limit : BTCP2P_RECV_BUDGET);
+  connection->recv_charged = 0;
+  connection->batch_charged = 0;
+  memset(&connection->resume_timer, 0, sizeof(connection->resume_timer));
+  connection->reader.block_stream = connection->block_stream;
+  if (connection->verify_pool) {
+    // Payloads are hashed by the pool instead of as they arrive.
+    connection->reader.hash_payload = false;
+    btcp2p_verify_queue_create(&connection->verify_queue, connection->verify_pool, connection);
+    btcp2p_checked_buffer_create(&connection->verified);
+  }
+  btcp2p_ring_buffer_create(&connection->recv_ring, BTCP2P_RECV_RING_CAPACITY);
+  connection->recv_ring_held = 0;
+  memset(&connection->peer_features, 0, sizeof(connection->peer_features));
+  memset(&connection->negotiated, 0, sizeof(connection->negotiated));
+  memset(&connection->held_features, 0, sizeof(connection->held_features));
+  connection->num_held_features = 0;
+  btcp2p_io_open(connection);
+  memset(&connection->zerocopy, 0, sizeof(connection->zerocopy));
+  if (connection->use_zerocopy &&
+      !btcp2p_zerocopy_enable(&connection->zerocopy, connection->socket))
+  {
+    btcp2p_log(BTCP2P_LOG_INFO, "zero-copy sends unavailable: %s\n", strerror(errno));
+    connection->use_zerocopy = false;
+  }
+  connection->wake_fd = -1;
+  if (connection->use_wake && (connection->wake_fd = btcp2p_io_wake_open()) < 0) {
+    btcp2p_log(BTCP2P_LOG_INFO, "wake events unavailable: %s\n", strerror(errno));
+    connection->use_wake = false;
+  }
+}
+
+// btcp2p_close_session releases everything btcp2p_open_session prepared. It
+// does not close the socket.
+static void btcp2p_close_session(struct btcp2p_connection_t* connection)
+{
+  btcp2p_io_close(connection);
+  btcp2p_ring_buffer_destroy(&connection->recv_ring);
+  if (connection->verify_pool) {
+    btcp2p_verify_queue_destroy(&connection->verify_queue);
+    btcp2p_checked_buffer_destroy(&connection->verified);
+  }
+  btcp2p_frame_reader_destroy(&connection->reader);
+  btcp2p_send_queue_destroy(&connection->send_queue);
+  btcp2p_zerocopy_destroy(&connection->zerocopy);
+  btcp2p_checked_buffer_destroy(&connection->outgoing.payload);
+  btcp2p_checked_buffer_destroy(&connection->held_features);
+  if (connection->wake_fd >= 0) {
+    close(connection->wake_fd);
+    connection->wake_fd = -1;
+  }
+}
+
+// btcp2p_send_version sends our version message to the remote host.
+static bool btcp2p_send_version(struct btcp2p_connection_t* conn)
 {
   struct btcp2p_varstr_t varstr = { { 0 }, 0 };
   btcp2p_varstr_encode(&varstr, (char*)BTCP2P_USER_AGENT, strlen(BTCP2P_USER_AGENT));
 
-  btcp2p_pack_and_send_message(
+  return btcp2p_pack_and_send_message(
     conn,
     "version",
     "ilLNNojIb",
-    70015,
+    conn->features.wtxidrelay ? BTCP2P_WTXID_RELAY_VERSION : BTCP2P_PROTOCOL_VERSION,
     0,
     time(NULL),
     conn->addr_recv,
@@ -161,34 +490,237 @@ bool btcp2p_perform_handshake(struct btcp2p_connection_t* conn)
     /* nonce, */
     varstr,
     0,
-    true
+    !conn->features.block_only
   );
+}
+
+// btcp2p_record_version notes the protocol version and relay flag from the
+// peer's version message. The relay flag defaults to true when absent.
+static void btcp2p_record_version(struct btcp2p_connection_t* conn)
+{
+  int32_t version = 0;
+  uint64_t services = 0;
+  int64_t timestamp = 0;
+  struct btcp2p_netaddr_t addr_recv;
+  struct btcp2p_netaddr_t addr_from;
+  uint64_t nonce = 0;
+  struct btcp2p_varstr_t user_agent;
+  int32_t start_height = 0;
+  uint8_t relay = 1;
+
+  btcp2p_unpack_message(conn, "IlLNNljIb", &version, &services, &timestamp, &addr_recv,
+                        &addr_from, &nonce, &user_agent, &start_height, &relay);
+  btcp2p_checked_buffer_read_reset(&conn->message.payload);
+
+  conn->negotiated.peer_version = version;
+  conn->negotiated.peer_relay = relay != 0;
+}
 
-  if (!btcp2p_recv_message(conn, &conn->message)) {
+// btcp2p_send_verack acknowledges the peer's version, along with the
+// features chosen in conn->features that the peer's version understands.
+// wtxidrelay and sendaddrv2 must precede the verack; the rest follow it.
+static bool btcp2p_send_verack(struct btcp2p_connection_t* conn)
+{
+  struct btcp2p_features_t const * features = &conn->features;
+  struct btcp2p_negotiated_t* negotiated = &conn->negotiated;
+  int32_t version = negotiated->peer_version;
+
+  if (features->wtxidrelay && version >= BTCP2P_WTXID_RELAY_VERSION &&
+      !btcp2p_pack_and_send_message(conn, "wtxidrelay", ""))
+  {
     return false;
   }
+  if (features->sendaddrv2) {
+    if (!btcp2p_pack_and_send_message(conn, "sendaddrv2", "")) {
+      return false;
+    }
+    negotiated->sendaddrv2 = true;
+  }
 
-  if (!btcp2p_has_message(conn, "version")) {
-    btcp2p_log(BTCP2P_LOG_ERROR, "did not receive version message\n");
+  if (!btcp2p_pack_and_send_message(conn, "verack", "")) {
     return false;
   }
 
-  if (!btcp2p_recv_message(conn, &conn->message)) {
+  if (features->sendheaders && version >= BTCP2P_SENDHEADERS_VERSION) {
+    if (!btcp2p_pack_and_send_message(conn, "sendheaders", "")) {
+      return false;
+    }
+    negotiated->sendheaders = true;
+  }
+  if (features->sendcmpct && version >= BTCP2P_SENDCMPCT_VERSION &&
+      !btcp2p_pack_and_send_message(conn, "sendcmpct", "bl",
+                                    features->cmpct_high_bandwidth ? 1 : 0,
+                                    (uint64_t)BTCP2P_CMPCT_VERSION))
+  {
     return false;
   }
+  if (features->feefilter > 0 && !features->block_only && version >= BTCP2P_FEEFILTER_VERSION) {
+    if (!btcp2p_pack_and_send_message(conn, "feefilter", "l", features->feefilter)) {
+      return false;
+    }
+    negotiated->feefilter = features->feefilter;
+  }
+
+  negotiated->relay = !features->block_only;
+  return true;
+}
 
-  if (!btcp2p_has_message(conn, "verack")) {
-    btcp2p_log(BTCP2P_LOG_ERROR, "did not receive verack message\n");
+// btcp2p_hold_feature keeps a copy of the connection's current message, a
+// feature announcement received during the handshake, to be passed to its
+// handler once the handshake completes.
+static bool btcp2p_hold_feature(struct btcp2p_connection_t* conn)
+{
+  if (conn->num_held_features >= BTCP2P_HELD_FEATURES_MAX) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "too many feature messages during handshake\n");
     return false;
   }
 
-  if (!btcp2p_pack_and_send_message(conn, "verack", "")) {
+  struct btcp2p_checked_buffer_t* held = &conn->held_features;
+  size_t length = conn->message.header.length;
+  if (!btcp2p_checked_buffer_write(held, (uint8_t*)&conn->message.header, sizeof(conn->message.header)) ||
+      (length > 0 && !btcp2p_checked_buffer_write(held, conn->message.payload.buffer, length)))
+  {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to hold feature message\n");
     return false;
   }
 
+  conn->num_held_features++;
   return true;
 }
 
+// btcp2p_deliver_held_features passes each held feature announcement to its
+// handler as the connection's current message, then restores the message
+// that completed the handshake.
+static void btcp2p_deliver_held_features(struct btcp2p_connection_t* conn)
+{
+  if (conn->num_held_features == 0) {
+    return;
+  }
+
+  struct btcp2p_message_t last = conn->message;
+  bool had_message = conn->has_message;
+  struct btcp2p_checked_buffer_t payload;
+  btcp2p_checked_buffer_create(&payload);
+
+  uint8_t const * cursor = conn->held_features.buffer;
+  for (size_t i = 0; i < conn->num_held_features; i++) {
+    memset(&conn->message, 0, sizeof(conn->message));
+    memcpy(&conn->message.header, cursor, sizeof(conn->message.header));
+    cursor += sizeof(conn->message.header);
+    conn->message.command_id = btcp2p_command_lookup(conn->message.header.command);
+
+    btcp2p_checked_buffer_prepare_read(&payload, cursor, conn->message.header.length);
+    cursor += conn->message.header.length;
+    conn->message.payload = payload;
+    conn->has_message = true;
+    btcp2p_dispatch(conn);
+  }
+
+  btcp2p_checked_buffer_destroy(&payload);
+  btcp2p_checked_buffer_destroy(&conn->held_features);
+  conn->num_held_features = 0;
+  conn->message = last;
+  conn->has_message = had_message;
+}
+
+enum btcp2p_handshake_status_t btcp2p_continue_handshake(struct btcp2p_connection_t* conn)
+{
+  while (conn->handshake != BTCP2P_HANDSHAKE_DONE) {
+    switch (btcp2p_try_recv_message(conn)) {
+    case BTCP2P_RECV_FAILED:
+      return BTCP2P_HANDSHAKE_FAILED;
+    case BTCP2P_RECV_PARTIAL:
+      return BTCP2P_HANDSHAKE_PARTIAL;
+    default:
+      break;
+    }
+
+    switch (conn->message.command_id) {
+    case BTCP2P_CMD_VERSION:
+      if (conn->handshake == BTCP2P_HANDSHAKE_AWAIT_VERACK) {
+        btcp2p_log(BTCP2P_LOG_ERROR, "received duplicate version message\n");
+        return BTCP2P_HANDSHAKE_FAILED;
+      }
+
+      // The listening side only speaks once it has heard the peer's version.
+      // Either side acknowledges it straight away rather than waiting for
+      // the peer's verack, so the exchange takes a single round trip.
+      btcp2p_record_version(conn);
+      if ((conn->inbound && !btcp2p_send_version(conn)) || !btcp2p_send_verack(conn)) {
+        return BTCP2P_HANDSHAKE_FAILED;
+      }
+      conn->handshake = conn->handshake == BTCP2P_HANDSHAKE_AWAIT_LATE_VERSION
+        ? BTCP2P_HANDSHAKE_DONE
+        : BTCP2P_HANDSHAKE_AWAIT_VERACK;
+      break;
+    case BTCP2P_CMD_VERACK:
+      // A verack acknowledges our version, which an inbound connection has
+      // not sent before the peer's.
+      if (conn->handshake == BTCP2P_HANDSHAKE_AWAIT_LATE_VERSION ||
+          (conn->handshake == BTCP2P_HANDSHAKE_AWAIT_VERSION && conn->inbound))
+      {
+        btcp2p_log(BTCP2P_LOG_ERROR, "received unexpected verack message\n");
+        return BTCP2P_HANDSHAKE_FAILED;
+      }
+      conn->handshake = conn->handshake == BTCP2P_HANDSHAKE_AWAIT_VERACK
+        ? BTCP2P_HANDSHAKE_DONE
+        : BTCP2P_HANDSHAKE_AWAIT_LATE_VERSION;
+      break;
+    default:
+      // Announcements were recorded as they arrived. Their handlers wait for
+      // the handshake to complete, since they may answer the peer.
+      if (btcp2p_is_feature(conn->message.command_id)) {
+        if (!btcp2p_hold_feature(conn)) {
+          return BTCP2P_HANDSHAKE_FAILED;
+        }
+      } else {
+        btcp2p_log(
+          BTCP2P_LOG_ERROR,
+          "did not receive version message, got '%.12s'\n",
+          conn->message.header.command
+        );
+        return BTCP2P_HANDSHAKE_FAILED;
+      }
+      break;
+    }
+  }
+
+  conn->used_fastopen = !conn->inbound && conn->use_fastopen && btcp2p_io_fastopen_used(conn->socket);
+  btcp2p_deliver_held_features(conn);
+  return BTCP2P_HANDSHAKE_COMPLETE;
+}
+
+// btcp2p_finish_handshake blocks until the handshake started on the
+// connection completes or fails.
+static bool btcp2p_finish_handshake(struct btcp2p_connection_t* conn)
+{
+  for (;;) {
+    switch (btcp2p_continue_handshake(conn)) {
+    case BTCP2P_HANDSHAKE_COMPLETE:
+      return true;
+    case BTCP2P_HANDSHAKE_FAILED:
+      return false;
+    default:
+      break;
+    }
+
+    if (!btcp2p_block_for_message(conn)) {
+      return false;
+    }
+  }
+}
+
+bool btcp2p_perform_handshake(struct btcp2p_connection_t* conn)
+{
+  conn->inbound = false;
+  conn->handshake = BTCP2P_HANDSHAKE_AWAIT_VERSION;
+  if (!btcp2p_send_version(conn)) {
+    return false;
+  }
+
+  return btcp2p_finish_handshake(conn);
+}
+
 bool btcp2p_connect(struct btcp2p_connection_t* connection,
                     char const * const network,
                     char const * const ipv4_address)
@@ -264,7 +796,16 @@ bool btcp2p_connect(struct btcp2p_connection_t* connection,
   FD_SET(connection->socket, &readfds);
   FD_SET(connection->socket, &writefds);
 
-  // Connect to the remote host.
+  // Ask for the connect to be deferred until our version is written, so
+  // that it can travel in the SYN. Without a cookie for the peer the kernel
+  // connects normally.
+  if (connection->use_fastopen && !btcp2p_io_fastopen_connect(connection->socket)) {
+    btcp2p_log(BTCP2P_LOG_INFO, "TCP Fast Open unavailable: %s\n", strerror(errno));
+    connection->use_fastopen = false;
+  }
+
+  // Connect to the remote host. A deferred Fast Open connect succeeds at
+  // once.
   status = connect(
     connection->socket,
     connection->remote_address->ai_addr,
@@ -272,7 +813,7 @@ bool btcp2p_connect(struct btcp2p_connection_t* connection,
   );
 
   // Error out if we aren't actually connecting
-  if (status != -1 || errno != EINPROGRESS) {
+  if (status != 0 && errno != EINPROGRESS) {
     btcp2p_log(
       BTCP2P_LOG_ERROR,
       "unable to connect: %s\n",
@@ -286,7 +827,7 @@ bool btcp2p_connect(struct btcp2p_connection_t* connection,
   }
 
   // Wait until we either connect or timeout
-  if (select(connection->socket+1, &readfds, &writefds, NULL, &tv) <= 0) {
+  if (status != 0 && select(connection->socket+1, &readfds, &writefds, NULL, &tv) <= 0) {
     btcp2p_log(
       BTCP2P_LOG_ERROR,
       "connect timeout or error: %s.\n",
@@ -328,18 +869,17 @@ bool btcp2p_connect(struct btcp2p_connection_t* connection,
     return false;
   }
 
-  // Place the socket back into blocking mode
-  fcntl(connection->socket, F_SETFL, opts);
-
-  btcp2p_checked_buffer_create(&connection->message.payload);
+  btcp2p_open_session(connection);
   if (!btcp2p_perform_handshake(connection)) {
-    btcp2p_checked_buffer_destroy(&connection->message.payload);
+    btcp2p_close_session(connection);
     freeaddrinfo(connection->remote_address);
     close(connection->socket);
 
     return false;
   }
 
+  connection->closed = false;
+
   // Set the receiving address
   btcp2p_netaddr_create(&connection->addr_recv, ~0, "127.0.0.1", connection->chain->port);
 
@@ -366,31 +906,474 @@ bool btcp2p_connect(struct btcp2p_connection_t* connection,
 }
 
 void btcp2p_disconnect(struct btcp2p_connection_t* connection) {
+  btcp2p_close_session(connection);
   close(connection->socket);
-  freeaddrinfo(connection->remote_address);
-  btcp2p_checked_buffer_destroy(&connection->message.payload);
+  if (connection->remote_address) {
+    freeaddrinfo(connection->remote_address);
+  }
+}
+
+void btcp2p_netaddr_from_sockaddr(struct btcp2p_netaddr_t* addr,
+                                  struct sockaddr_storage const * const sa)
+{
+  addr->services = ~0;
+  if (sa->ss_family == AF_INET6) {
+    struct sockaddr_in6 const * in6 = (struct sockaddr_in6 const *)sa;
+    memcpy(addr->address, &in6->sin6_addr, 16);
+    addr->port = in6->sin6_port;
+  } else {
+    struct sockaddr_in const * in = (struct sockaddr_in const *)sa;
+    memset(addr->address, 0, 10);
+    addr->address[10] = 0xFF;
+    addr->address[11] = 0xFF;
+    memcpy(&addr->address[12], &in->sin_addr, 4);
+    addr->port = in->sin_port;
+  }
+}
+
+bool btcp2p_listen(struct btcp2p_listener_t* listener,
+                   char const * const network,
+                   char const * const address,
+                   char const * const port)
+{
+  listener->socket = -1;
+  listener->chain = btcp2p_chain_for_network(network);
+  if (!listener->chain) {
+    btcp2p_log(
+      BTCP2P_LOG_ERROR,
+      "unable to find configuration for network '%s'\n",
+      network
+    );
+    return false;
+  }
+
+  char port_string[6];
+  snprintf(port_string, 6, "%d", listener->chain->port);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo* local_address;
+  int status = getaddrinfo(address, port ? port : port_string, &hints, &local_address);
+  if (status != 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "getaddrinfo failed: %s\n", gai_strerror(status));
+    return false;
+  }
+
+  listener->socket = socket(local_address->ai_family,
+                            local_address->ai_socktype,
+                            local_address->ai_protocol);
+  if (listener->socket < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to open socket: %s\n", strerror(errno));
+    freeaddrinfo(local_address);
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(listener->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (listener->reuse_port) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(listener->socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "unable to set SO_REUSEPORT: %s\n", strerror(errno));
+      goto failed;
+    }
+#else
+    btcp2p_log(BTCP2P_LOG_ERROR, "SO_REUSEPORT is not supported on this platform\n");
+    goto failed;
+#endif
+  }
+
+  // Accepting must never block, so that one listener can be polled along
+  // with connections.
+  int opts = fcntl(listener->socket, F_GETFL);
+  fcntl(listener->socket, F_SETFL, opts | O_NONBLOCK);
+  fcntl(listener->socket, F_SETFD, FD_CLOEXEC);
+
+  if (bind(listener->socket, local_address->ai_addr, local_address->ai_addrlen) < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to bind: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  // Fast Open is an optimisation only; peers fall back to a normal
+  // handshake if it cannot be enabled.
+  if (listener->use_fastopen &&
+      !btcp2p_io_fastopen_listen(listener->socket,
+                                 listener->backlog > 0 ? listener->backlog : BTCP2P_LISTEN_BACKLOG))
+  {
+    btcp2p_log(BTCP2P_LOG_INFO, "TCP Fast Open unavailable: %s\n", strerror(errno));
+  }
+
+  if (listen(listener->socket, listener->backlog > 0 ? listener->backlog : BTCP2P_LISTEN_BACKLOG) < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to listen: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  freeaddrinfo(local_address);
+  return true;
+
+failed:
+  freeaddrinfo(local_address);
+  close(listener->socket);
+  listener->socket = -1;
+  return false;
+}
+
+void btcp2p_listener_close(struct btcp2p_listener_t* listener) {
+  if (listener->socket >= 0) {
+    close(listener->socket);
+  }
+  listener->socket = -1;
+}
+
+uint16_t btcp2p_listener_port(struct btcp2p_listener_t const * const listener) {
+  struct sockaddr_storage local;
+  socklen_t local_len = sizeof(local);
+  if (getsockname(listener->socket, (struct sockaddr*)&local, &local_len) < 0) {
+    return 0;
+  }
+
+  if (local.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6*)&local)->sin6_port);
+  }
+  return ntohs(((struct sockaddr_in*)&local)->sin_port);
+}
+
+enum btcp2p_accept_status_t btcp2p_accept(struct btcp2p_listener_t* listener,
+                                          struct btcp2p_connection_t* connection)
+{
+  struct sockaddr_storage remote;
+  socklen_t remote_len = sizeof(remote);
+
+#ifdef SOCK_NONBLOCK
+  connection->socket = accept4(listener->socket,
+                               (struct sockaddr*)&remote,
+                               &remote_len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  connection->socket = accept(listener->socket, (struct sockaddr*)&remote, &remote_len);
+  if (connection->socket >= 0) {
+    fcntl(connection->socket, F_SETFL, fcntl(connection->socket, F_GETFL) | O_NONBLOCK);
+    fcntl(connection->socket, F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  if (connection->socket < 0) {
+    // The peer may have given up while it waited in the backlog.
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+      return BTCP2P_ACCEPT_NONE;
+    }
+
+    btcp2p_log(BTCP2P_LOG_ERROR, "accept failed: %s\n", strerror(errno));
+    return BTCP2P_ACCEPT_FAILED;
+  }
+
+  connection->chain = listener->chain;
+  connection->remote_address = NULL;
+  btcp2p_netaddr_from_sockaddr(&connection->addr_from, &remote);
+
+  struct sockaddr_storage local;
+  socklen_t local_len = sizeof(local);
+  memset(&local, 0, sizeof(local));
+  getsockname(connection->socket, (struct sockaddr*)&local, &local_len);
+  btcp2p_netaddr_from_sockaddr(&connection->addr_recv, &local);
+
+  // The handshake is left to the caller's poller, so a peer that never
+  // sends its version cannot hold up the peers accepted after it.
+  btcp2p_open_session(connection);
+  connection->inbound = true;
+  connection->handshake = BTCP2P_HANDSHAKE_AWAIT_VERSION;
+  connection->closed = false;
+  return BTCP2P_ACCEPT_COMPLETE;
+}
+
+bool btcp2p_begin_handshake(struct btcp2p_connection_t* connection,
+                            struct btcp2p_chain_t const * const chain,
+                            int socket)
+{
+  connection->socket = socket;
+  connection->chain = chain;
+  connection->remote_address = NULL;
+
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+  memset(&address, 0, sizeof(address));
+  if (getpeername(socket, (struct sockaddr*)&address, &address_len) == 0) {
+    btcp2p_netaddr_from_sockaddr(&connection->addr_from, &address);
+  }
+
+  address_len = sizeof(address);
+  memset(&address, 0, sizeof(address));
+  getsockname(socket, (struct sockaddr*)&address, &address_len);
+  btcp2p_netaddr_from_sockaddr(&connection->addr_recv, &address);
+
+  btcp2p_open_session(connection);
+  connection->inbound = false;
+  connection->handshake = BTCP2P_HANDSHAKE_AWAIT_VERSION;
+  connection->closed = false;
+  if (!btcp2p_send_version(connection)) {
+    btcp2p_close_session(connection);
+    close(socket);
+    return false;
+  }
+
+  return true;
+}
+
+// btcp2p_poll_once waits up to timeout_ms milliseconds, or forever if
+// negative, for data to arrive, flushing queued messages if the socket gains
+// room meanwhile, and ending early when the connection is woken. Sets
+// *polled if anything happened before the timeout. Returns false if a flush
+// failed.
+static bool btcp2p_poll_once(struct btcp2p_connection_t* connection,
+                             int timeout_ms,
+                             bool* readable,
+                             bool* polled)
+{
+  *polled = true;
+
+  // Nothing can be returned before the oldest verifying frame, so wait for
+  // it rather than for more data.
+  if (connection->verify_pool &&
+      btcp2p_verify_queue_depth(&connection->verify_queue) > 0)
+  {
+    *readable = btcp2p_verify_queue_wait(&connection->verify_queue, timeout_ms);
+    *polled = *readable;
+    return true;
+  }
+
+  // A paused connection is not reading, so it only waits to check for room
+  // again, and counts the retry as having polled.
+  bool paused = btcp2p_recv_paused(connection);
+  if (paused && (timeout_ms < 0 || timeout_ms > BTCP2P_RECV_RETRY_MS)) {
+    timeout_ms = BTCP2P_RECV_RETRY_MS;
+  }
+
+  // Also wait for wakes, and for room in the send buffer if queued messages
+  // remain.
+  struct pollfd pfd[3];
+  nfds_t nfds = 1;
+  nfds_t wake = 0;
+  nfds_t writable = 0;
+  pfd[0].fd = btcp2p_io_fd(connection);
+  pfd[0].events = paused ? 0 : POLLIN | POLLHUP | POLLRDNORM;
+  pfd[0].revents = 0;
+  if (connection->wake_fd >= 0) {
+    wake = nfds++;
+    pfd[wake].fd = connection->wake_fd;
+    pfd[wake].events = POLLIN;
+    pfd[wake].revents = 0;
+  }
+  if (btcp2p_queued_bytes(connection) > 0) {
+    writable = nfds++;
+    pfd[writable].fd = connection->socket;
+    pfd[writable].events = POLLOUT;
+    pfd[writable].revents = 0;
+  }
+
+  *readable = paused;
+  *polled = poll(pfd, nfds, timeout_ms) != 0 || paused;
+  if (*polled) {
+    if (wake && pfd[wake].revents) {
+      btcp2p_io_wake_drain(connection->wake_fd);
+    }
+    if (writable && (pfd[writable].revents & POLLOUT) && !btcp2p_flush(connection)) {
+      return false;
+    }
+    *readable = paused || pfd[0].revents != 0;
+  }
+
+  return true;
+}
+
+// btcp2p_wait_for_data waits up to timeout_ms milliseconds, or forever if
+// negative, as btcp2p_poll_once does. The wait also ends once one of the
+// connection's timers has fired. Returns false if a flush failed.
+static bool btcp2p_wait_for_data(struct btcp2p_connection_t* connection,
+                                 int timeout_ms,
+                                 bool* readable)
+{
+  uint64_t start_ns = btcp2p_timer_now_ns();
+
+  for (;;) {
+    uint64_t now_ns = btcp2p_timer_now_ns();
+    int remaining_ms = timeout_ms;
+    if (timeout_ms >= 0) {
+      uint64_t elapsed_ms = (now_ns - start_ns) / BTCP2P_NS_PER_MS;
+      remaining_ms = elapsed_ms >= (uint64_t)timeout_ms ? 0 : timeout_ms - (int)elapsed_ms;
+    }
+
+    int wait_ms = remaining_ms;
+    if (connection->timers && connection->timers->count > 0) {
+      wait_ms = btcp2p_timer_wheel_timeout_ms(connection->timers, now_ns, remaining_ms);
+    }
+
+    bool polled;
+    if (!btcp2p_poll_once(connection, wait_ms, readable, &polled)) {
+      return false;
+    }
+
+    // The wheel's next deadline may only have been for moving distant
+    // timers down a level, in which case nothing fires and the wait goes on.
+    if (polled || wait_ms == remaining_ms ||
+        btcp2p_timer_wheel_advance(connection->timers, btcp2p_timer_now_ns()) > 0)
+    {
+      return true;
+    }
+  }
+}
+
+// btcp2p_fire_timers fires the connection's timers that have come due.
+static void btcp2p_fire_timers(struct btcp2p_connection_t* connection)
+{
+  if (connection->timers && connection->timers->count > 0) {
+    btcp2p_timer_wheel_advance(connection->timers, btcp2p_timer_now_ns());
+  }
 }
 
 bool btcp2p_message_pump(struct btcp2p_connection_t* connection)
+{
+  return btcp2p_message_pump_timeout(connection, BTCP2P_PUMP_TIMEOUT_MS);
+}
+
+bool btcp2p_message_pump_timeout(struct btcp2p_connection_t* connection, int timeout_ms)
 {
   connection->has_message = false;
 
-  struct pollfd pfd;
-  pfd.fd = connection->socket;
-  pfd.events = POLLIN | POLLHUP | POLLRDNORM;
-  pfd.revents = 0;
+  if (!btcp2p_flush(connection)) {
+    return false;
+  }
 
-  if (poll(&pfd, 1, 100 /* milliseconds */) > 0) {
-    if (!btcp2p_recv_message(connection, &connection->message)) {
+  // Data may already be buffered by the I/O backend, so try before waiting.
+  enum btcp2p_recv_status_t status = btcp2p_try_recv_message(connection);
+
+  if (status == BTCP2P_RECV_PARTIAL) {
+    bool readable;
+    if (!btcp2p_wait_for_data(connection, timeout_ms, &readable)) {
       return false;
     }
+    if (readable) {
+      status = btcp2p_try_recv_message(connection);
+    }
+  }
 
-    connection->has_message = true;
+  if (status == BTCP2P_RECV_COMPLETE) {
+    btcp2p_dispatch(connection);
+  }
+  if (status != BTCP2P_RECV_FAILED) {
+    btcp2p_fire_timers(connection);
+  }
+
+  return status != BTCP2P_RECV_FAILED;
+}
+
+bool btcp2p_wake(struct btcp2p_connection_t* connection)
+{
+  if (!connection->use_wake || connection->wake_fd < 0) {
+    return false;
   }
 
+  btcp2p_io_wake(connection->wake_fd);
   return true;
 }
 
+// btcp2p_take_message moves the connection's current message into message,
+// leaving the connection without a current message. Payloads assembled in the
+// frame reader's buffer are handed over by exchanging buffers, while payloads
+// still referenced in the receive ring are copied.
+static void btcp2p_take_message(struct btcp2p_connection_t* connection,
+                                struct btcp2p_message_t* message)
+{
+  struct btcp2p_checked_buffer_t payload = message->payload;
+  *message = connection->message;
+  message->payload = payload;
+
+  if (connection->recv_ring_held > 0) {
+    btcp2p_checked_buffer_prepare_read(
+      &message->payload,
+      connection->message.payload.buffer,
+      connection->message.payload.len
+    );
+  } else {
+    struct btcp2p_checked_buffer_t* owner = connection->verify_pool
+      ? &connection->verified
+      : &connection->reader.storage;
+    struct btcp2p_checked_buffer_t spare = message->payload;
+    message->payload = *owner;
+    *owner = spare;
+  }
+
+  connection->has_message = false;
+}
+
+bool btcp2p_message_pump_batch(struct btcp2p_connection_t* connection,
+                               struct btcp2p_message_t* messages,
+                               size_t max,
+                               size_t* count)
+{
+  return btcp2p_message_pump_batch_timeout(connection, messages, max, count, BTCP2P_PUMP_TIMEOUT_MS);
+}
+
+bool btcp2p_message_pump_batch_timeout(struct btcp2p_connection_t* connection,
+                                       struct btcp2p_message_t* messages,
+                                       size_t max,
+                                       size_t* count,
+                                       int timeout_ms)
+{
+  *count = 0;
+  connection->has_message = false;
+
+  // The caller has finished with the previous batch's payloads.
+  btcp2p_frame_reader_release(&connection->reader, connection->batch_charged);
+  connection->batch_charged = 0;
+
+  if (!btcp2p_flush(connection)) {
+    return false;
+  }
+
+  bool waited = false;
+  while (*count < max) {
+    enum btcp2p_recv_status_t status = btcp2p_try_recv_message(connection);
+
+    if (status == BTCP2P_RECV_FAILED) {
+      return false;
+    }
+
+    if (status == BTCP2P_RECV_PARTIAL) {
+      // Only wait if nothing at all has been received yet.
+      if (*count > 0 || waited) {
+        break;
+      }
+
+      bool readable;
+      if (!btcp2p_wait_for_data(connection, timeout_ms, &readable)) {
+        return false;
+      }
+      if (!readable) {
+        break;
+      }
+      waited = true;
+      continue;
+    }
+
+    // The payload stays charged while the caller holds it, so the budgets
+    // end the batch once they are used up.
+    btcp2p_dispatch(connection);
+    btcp2p_take_message(connection, &messages[(*count)++]);
+    connection->batch_charged += connection->recv_charged;
+    connection->recv_charged = 0;
+  }
+
+  btcp2p_fire_timers(connection);
+  return true;
+}
+
+bool btcp2p_recv_paused(struct btcp2p_connection_t const * const connection)
+{
+  return connection->reader.state == BTCP2P_FRAME_PAUSED;
+}
+
 bool btcp2p_has_message(struct btcp2p_connection_t* connection,
                         char const command[12])
 {
@@ -398,12 +1381,102 @@ bool btcp2p_has_message(struct btcp2p_connection_t* connection,
     return false;
   }
 
-  if (command != NULL) {
-    if (strncmp(connection->message.header.command, command, 12) != 0) {
-      return false;
-    }
+  if (command == NULL) {
+    return true;
+  }
+
+  // Pad the command so that it can be interned like a header field.
+  char padded[12] = { 0 };
+  strncpy(padded, command, sizeof(padded));
+
+  enum btcp2p_command_id_t id = btcp2p_command_lookup(padded);
+  if (id != BTCP2P_CMD_UNKNOWN) {
+    return connection->message.command_id == id;
   }
 
+  return memcmp(connection->message.header.command, padded, sizeof(padded)) == 0;
+}
+
+bool btcp2p_has_command(struct btcp2p_connection_t const * const connection,
+                        enum btcp2p_command_id_t id)
+{
+  return connection->has_message && connection->message.command_id == id;
+}
+
+uint8_t const * btcp2p_message_digest(struct btcp2p_connection_t const * const connection)
+{
+  if (!connection->has_message || !connection->message.has_digest) {
+    return NULL;
+  }
+
+  return connection->message.digest;
+}
+
+uint8_t const * btcp2p_block_hash(struct btcp2p_connection_t const * const connection)
+{
+  if (!connection->has_message || !connection->message.has_block_hash) {
+    return NULL;
+  }
+
+  return connection->message.block_hash;
+}
+
+void btcp2p_on(struct btcp2p_connection_t* connection,
+               enum btcp2p_command_id_t id,
+               btcp2p_handler_t handler,
+               void* ctx)
+{
+  if ((unsigned)id >= BTCP2P_CMD_COUNT) {
+    return;
+  }
+
+  connection->handlers[id].handler = handler;
+  connection->handlers[id].ctx = ctx;
+}
+
+void btcp2p_subscribe(struct btcp2p_connection_t* connection, uint64_t commands) {
+  // The handshake cannot complete without these.
+  commands |= BTCP2P_COMMAND_BIT(BTCP2P_CMD_VERSION) | BTCP2P_COMMAND_BIT(BTCP2P_CMD_VERACK);
+  connection->reader.discard_mask = ~commands;
+}
+
+uint64_t btcp2p_dropped_bytes(struct btcp2p_connection_t const * const connection,
+                              enum btcp2p_command_id_t id)
+{
+  if ((unsigned)id >= BTCP2P_CMD_COUNT) {
+    return 0;
+  }
+
+  return connection->reader.dropped_bytes[id];
+}
+
+uint64_t btcp2p_received_bytes(struct btcp2p_connection_t const * const connection,
+                               enum btcp2p_command_id_t id)
+{
+  if ((unsigned)id >= BTCP2P_CMD_COUNT) {
+    return 0;
+  }
+
+  return connection->reader.received_bytes[id];
+}
+
+bool btcp2p_dispatch(struct btcp2p_connection_t* connection) {
+  if (!connection->has_message) {
+    return false;
+  }
+
+  struct btcp2p_handler_entry_t* entry = &connection->handlers[connection->message.command_id];
+  if (!entry->handler) {
+    entry = &connection->handlers[BTCP2P_CMD_UNKNOWN];
+  }
+  if (!entry->handler) {
+    return false;
+  }
+
+  // The handler and any later unpacking both start from the beginning.
+  btcp2p_checked_buffer_read_reset(&connection->message.payload);
+  entry->handler(connection, entry->ctx);
+  btcp2p_checked_buffer_read_reset(&connection->message.payload);
   return true;
 }
 
@@ -423,56 +1496,186 @@ bool btcp2p_unpack_message(struct btcp2p_connection_t* connection,
   return true;
 }
 
+// btcp2p_vpack_message packs a message for the connection's network from a
+// va_list of arguments and fills in its header.
+static void btcp2p_vpack_message(struct btcp2p_connection_t* connection,
+                                 struct btcp2p_message_t* message,
+                                 char const command[12],
+                                 char const * const format,
+                                 va_list args)
+{
+  btcp2p_checked_buffer_prepare_write(&message->payload);
+  message->header.magic = connection->chain->magic;
+  memset(message->header.command, 0, 12);
+  strncpy(message->header.command, command, 12);
+  message->command_id = btcp2p_command_lookup(message->header.command);
+
+  message->header.length = btcp2p_vpack(&message->payload, format, args);
+
+  struct btcp2p_sha256_t ctx;
+  btcp2p_frame_hash_begin(&ctx, message);
+  btcp2p_frame_hash_update(&ctx, message, message->payload.buffer, 0, message->header.length);
+  message->header.checksum = btcp2p_frame_hash_final(&ctx, message);
+}
+
+void btcp2p_pack_message(struct btcp2p_connection_t* connection,
+                         struct btcp2p_message_t* message,
+                         char const command[12],
+                         char const * const format,
+                         ...)
+{
+  va_list args;
+  va_start(args, format);
+  btcp2p_vpack_message(connection, message, command, format, args);
+  va_end(args);
+}
+
+bool btcp2p_send_messages(struct btcp2p_connection_t* connection,
+                          struct btcp2p_message_t const * const messages,
+                          size_t count)
+{
+  struct iovec iov[BTCP2P_IO_MAX_IOV];
+  int iovcnt = 0;
+
+  // Queued messages were packed first, so they must reach the socket first.
+  size_t queued = 0;
+  uint8_t* pending = btcp2p_send_queue_peek(&connection->send_queue, &queued);
+  if (queued > 0) {
+    iov[0].iov_base = pending;
+    iov[0].iov_len = queued;
+    iovcnt = 1;
+  }
+
+  // Each message contributes a header and a payload iovec.
+  size_t next = 0;
+  while (next < count || iovcnt > 0) {
+    while (next < count && iovcnt + 2 <= BTCP2P_IO_MAX_IOV) {
+      iov[iovcnt].iov_base = (void*)&messages[next].header;
+      iov[iovcnt].iov_len = sizeof(messages[next].header);
+      iovcnt++;
+
+      if (messages[next].header.length > 0) {
+        iov[iovcnt].iov_base = messages[next].payload.buffer;
+        iov[iovcnt].iov_len = messages[next].header.length;
+        iovcnt++;
+      }
+      next++;
+    }
+
+    if (btcp2p_io_sendv_all(connection, iov, iovcnt) < 0) {
+      btcp2p_log(
+        BTCP2P_LOG_ERROR,
+        "message batch send failed: %s\n",
+        strerror(errno)
+      );
+      return false;
+    }
+
+    if (queued > 0) {
+      btcp2p_send_queue_advance(&connection->send_queue, queued);
+      queued = 0;
+    }
+    iovcnt = 0;
+  }
+
+  return true;
+}
+
 bool btcp2p_pack_and_send_message(struct btcp2p_connection_t* connection,
                                   char const command[12],
                                   char const * const format,
                                   ...)
 {
-  // Set this to false since we're about to use the message
-  connection->has_message = false;
+  va_list args;
+  va_start(args, format);
+  btcp2p_vpack_message(connection, &connection->outgoing, command, format, args);
+  va_end(args);
+
+  if (connection->zerocopy.enabled &&
+      connection->outgoing.header.length >= BTCP2P_ZEROCOPY_THRESHOLD)
+  {
+    // Queued messages were packed first, so they must reach the socket first.
+    if (!btcp2p_send_messages(connection, NULL, 0)) {
+      return false;
+    }
 
-  btcp2p_checked_buffer_prepare_write(&connection->message.payload);
-  connection->message.header.magic = connection->chain->magic;
-  memset(connection->message.header.command, 0, 12);
-  strncpy(connection->message.header.command, command, 12);
+    if (btcp2p_zerocopy_send(&connection->zerocopy,
+                             connection->socket,
+                             &connection->outgoing) < 0)
+    {
+      btcp2p_log(BTCP2P_LOG_ERROR, "zero-copy send failed: %s\n", strerror(errno));
+      return false;
+    }
+
+    return true;
+  }
 
+  // Header and payload go out together in a single system call.
+  return btcp2p_send_messages(connection, &connection->outgoing, 1);
+}
+
+bool btcp2p_queue_message(struct btcp2p_connection_t* connection,
+                          char const command[12],
+                          char const * const format,
+                          ...)
+{
   va_list args;
   va_start(args, format);
-  connection->message.header.length = btcp2p_vpack(
-    &connection->message.payload,
-    format,
-    args
-  );
+  btcp2p_vpack_message(connection, &connection->outgoing, command, format, args);
   va_end(args);
 
-  connection->message.header.checksum = btcp2p_payload_checksum(
-    connection->message.payload.buffer,
-    connection->message.header.length
-  );
+  return btcp2p_send_queue_push(&connection->send_queue, &connection->outgoing);
+}
 
-  if (btcp2p_sendall(connection->socket,
-                     (uint8_t*)&connection->message.header,
-                     sizeof(connection->message.header)) < 0)
-  {
-    btcp2p_log(
-      BTCP2P_LOG_ERROR,
-      "message header send failed: %s\n",
-      strerror(errno)
-    );
-    return false;
-  }
+bool btcp2p_flush(struct btcp2p_connection_t* connection) {
+  size_t pending;
+  uint8_t* data;
 
-  if (btcp2p_sendall(connection->socket,
-                     connection->message.payload.buffer,
-                     connection->message.header.length) < 0)
-  {
-    btcp2p_log(
-      BTCP2P_LOG_ERROR,
-      "message payload send failed: %s\n",
-      strerror(errno)
-    );
-    return false;
+  while ((data = btcp2p_send_queue_peek(&connection->send_queue, &pending)), pending > 0) {
+    // Large queues are written in pieces. Every piece but the last is flagged
+    // as having more to follow so no short segment is sent between them.
+    size_t len = pending;
+    if (len > BTCP2P_SEND_QUEUE_MAX_WRITE) {
+      len = BTCP2P_SEND_QUEUE_MAX_WRITE;
+    }
+
+    ssize_t n = btcp2p_io_send(connection, data, len, len < pending);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // A deferred Fast Open connect may still be completing.
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+        connection->is_writable = false;
+        return true;
+      }
+
+      btcp2p_log(BTCP2P_LOG_ERROR, "queued send failed: %s\n", strerror(errno));
+      return false;
+    }
+
+    btcp2p_send_queue_advance(&connection->send_queue, n);
   }
 
   return true;
 }
+
+size_t btcp2p_queued_messages(struct btcp2p_connection_t const * const connection) {
+  return btcp2p_send_queue_depth(&connection->send_queue);
+}
+
+size_t btcp2p_queued_bytes(struct btcp2p_connection_t const * const connection) {
+  return btcp2p_send_queue_pending_bytes(&connection->send_queue);
+}
+
+void btcp2p_cork(struct btcp2p_connection_t* connection, bool corked) {
+#ifdef TCP_CORK
+  int value = corked ? 1 : 0;
+  if (setsockopt(connection->socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "setsockopt TCP_CORK failed: %s\n", strerror(errno));
+  }
+#else
+  (void)connection;
+  (void)corked;
+#endif
+}
@@ -5,29 +5,131 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <sys/socket.h>
+
+#include "libbtcp2p/block_stream.h"
+#include "libbtcp2p/budget.h"
 #include "libbtcp2p/checked_buffer.h"
+#include "libbtcp2p/command.h"
+#include "libbtcp2p/frame.h"
+#include "libbtcp2p/io.h"
+#include "libbtcp2p/message.h"
+#include "libbtcp2p/ring_buffer.h"
+#include "libbtcp2p/send_queue.h"
+#include "libbtcp2p/timer.h"
 #include "libbtcp2p/types.h"
+#include "libbtcp2p/verify_pool.h"
+#include "libbtcp2p/zerocopy.h"
 
 // Protocol version number
 #define BTCP2P_PROTOCOL_VERSION 70015
 
+// Longest wait for data in btcp2p_message_pump and btcp2p_message_pump_batch.
+#define BTCP2P_PUMP_TIMEOUT_MS 100
+
+// First protocol versions that understand each optional feature
+#define BTCP2P_SENDHEADERS_VERSION 70012
+#define BTCP2P_FEEFILTER_VERSION 70013
+#define BTCP2P_SENDCMPCT_VERSION 70014
+#define BTCP2P_WTXID_RELAY_VERSION 70016
+
+// Compact block version we negotiate, the one that carries witnesses
+#define BTCP2P_CMPCT_VERSION 2
+
 // Network magic numbers
 #define BTCP2P_MAGIC_MAINNET 0xD9B4BEF9
 #define BTCP2P_MAGIC_TESTNET 0x0709110B
 #define BTCP2P_MAGIC_REGTEST 0xDAB5BFFA
 
-// P2P message header
-struct btcp2p_message_header_t {
-  uint32_t magic; ///< Network magic number
-  char command[12]; ///< Command to execute as a string
-  uint32_t length; ///< Length of the payload
-  uint32_t checksum; ///< Checksum of message contents
+// Size of the per-connection ring that socket data is received into.
+#define BTCP2P_RECV_RING_CAPACITY (64 * 1024)
+
+// Payload remainders at least this large are received straight into the
+// payload buffer instead of passing through the receive ring.
+#define BTCP2P_RECV_DIRECT_THRESHOLD (16 * 1024)
+
+// Default limit on the payload bytes a connection holds between receiving
+// their headers and the messages being handled.
+#define BTCP2P_RECV_BUDGET (2 * BTCP2P_MAX_PAYLOAD)
+
+// Time a connection that stopped reading for lack of budget waits before
+// checking for room again.
+#define BTCP2P_RECV_RETRY_MS 10
+
+// Default number of inbound connections a listener queues before they are
+// accepted.
+#define BTCP2P_LISTEN_BACKLOG 1024
+
+// Most feature announcements a peer may send before the handshake completes.
+// They are held back until then, and a peer that sends more fails the
+// handshake.
+#define BTCP2P_HELD_FEATURES_MAX 16
+
+// Outcome of a non-blocking attempt to receive a message.
+enum btcp2p_recv_status_t {
+  BTCP2P_RECV_COMPLETE, ///< A whole message was received.
+  BTCP2P_RECV_PARTIAL, ///< No whole message has been received yet.
+  BTCP2P_RECV_FAILED ///< The connection failed or was closed.
+};
+
+// Outcome of an attempt to accept an inbound connection.
+enum btcp2p_accept_status_t {
+  BTCP2P_ACCEPT_COMPLETE, ///< A peer was accepted and its handshake has begun.
+  BTCP2P_ACCEPT_NONE, ///< No peer is waiting to be accepted.
+  BTCP2P_ACCEPT_FAILED ///< The listener failed.
+};
+
+// Progress of a handshake driven without blocking.
+enum btcp2p_handshake_status_t {
+  BTCP2P_HANDSHAKE_COMPLETE, ///< Both sides have exchanged version and verack.
+  BTCP2P_HANDSHAKE_PARTIAL, ///< Waiting for more messages from the peer.
+  BTCP2P_HANDSHAKE_FAILED ///< The peer broke protocol or the connection failed.
 };
 
-// P2P message
-struct btcp2p_message_t {
-  struct btcp2p_message_header_t header;
-  struct btcp2p_checked_buffer_t payload;
+// Step a connection's handshake has reached
+enum btcp2p_handshake_state_t {
+  BTCP2P_HANDSHAKE_AWAIT_VERSION, ///< Waiting for the peer's version.
+  BTCP2P_HANDSHAKE_AWAIT_VERACK, ///< Waiting for the peer's verack.
+  BTCP2P_HANDSHAKE_AWAIT_LATE_VERSION, ///< The peer's verack came first; waiting for its version.
+  BTCP2P_HANDSHAKE_DONE ///< The handshake has completed.
+};
+
+// Optional features a peer announced
+struct btcp2p_peer_features_t {
+  bool sendheaders; ///< Announce new blocks with headers (BIP 130).
+  bool wtxidrelay; ///< Announce transactions by wtxid (BIP 339).
+  bool sendaddrv2; ///< Gossip addresses with addrv2 (BIP 155).
+  bool sendcmpct; ///< Compact blocks (BIP 152), as described below.
+  bool cmpct_high_bandwidth; ///< Push compact blocks without announcing them first.
+  uint64_t cmpct_version; ///< Highest compact block version announced.
+  uint64_t feefilter; ///< Lowest fee rate to relay, in satoshis per kvB (BIP 133).
+};
+
+// Optional features to ask a peer for during the handshake. Each cuts what
+// the peer sends us. All are off by default.
+struct btcp2p_features_t {
+  bool sendheaders; ///< Have new blocks announced with headers instead of inv.
+  bool wtxidrelay; ///< Have transactions announced by wtxid; needs the peer to agree.
+  bool sendaddrv2; ///< Have addresses gossiped with addrv2.
+  bool sendcmpct; ///< Offer compact blocks; needs the peer to agree.
+  bool cmpct_high_bandwidth; ///< Have compact blocks pushed without an announcement.
+  uint64_t feefilter; ///< Lowest fee rate to be sent, in satoshis per kvB, or 0.
+  bool block_only; ///< Send relay=false so that no transactions are announced.
+};
+
+// Outcome of feature negotiation with a peer. Features the peer must agree
+// to are updated whenever its announcement arrives, which for compact blocks
+// is usually just after the handshake.
+struct btcp2p_negotiated_t {
+  int32_t peer_version; ///< Protocol version in the peer's version message.
+  bool peer_relay; ///< Does the peer want transactions announced to it?
+  bool relay; ///< Will the peer announce transactions to us?
+  bool sendheaders; ///< Will the peer announce blocks to us with headers?
+  bool wtxidrelay; ///< Are transactions announced by wtxid in both directions?
+  bool sendaddrv2; ///< May the peer gossip addresses to us with addrv2?
+  bool sendcmpct; ///< Have both sides offered compact blocks version 2?
+  bool cmpct_high_bandwidth; ///< Will the peer push compact blocks to us?
+  uint64_t feefilter; ///< Fee rate filter the peer applies to what it sends us, or 0.
 };
 
 // Chain definition
@@ -38,48 +140,361 @@ struct btcp2p_chain_t {
   uint16_t port; ///< Network port
 };
 
+struct btcp2p_connection_t;
+
+// Handler invoked with a connection whose current message it was registered
+// for, along with the context pointer given at registration.
+typedef void (*btcp2p_handler_t)(struct btcp2p_connection_t* connection, void* ctx);
+
+// Handler registered for a single command.
+struct btcp2p_handler_entry_t {
+  btcp2p_handler_t handler;
+  void* ctx;
+};
+
 struct btcp2p_connection_t {
   int socket;
   struct addrinfo* remote_address;
+  enum btcp2p_io_backend_t io_backend; ///< I/O backend, chosen before connecting.
+  struct btcp2p_uring_t* uring; ///< io_uring state for BTCP2P_IO_URING.
   struct btcp2p_chain_t const * chain;
   bool has_message; ///< Did we receive a message on most recent poll?
+  bool closed; ///< Was the connection closed or did it fail on last receive?
+  bool is_writable; ///< Did the socket last report room for more data?
+  bool inbound; ///< Was the connection accepted from a listener?
+  enum btcp2p_handshake_state_t handshake; ///< Progress of the version/verack exchange.
+  struct btcp2p_features_t features; ///< Features to negotiate, chosen before connecting.
+  struct btcp2p_peer_features_t peer_features; ///< Features announced by the peer.
+  struct btcp2p_negotiated_t negotiated; ///< Features agreed with the peer.
+  struct btcp2p_checked_buffer_t held_features; ///< Frames of the feature announcements received during the handshake.
+  size_t num_held_features; ///< Feature announcements in held_features.
   struct btcp2p_message_t message; ///< Last message received on network.
+  struct btcp2p_frame_reader_t reader; ///< Progress receiving next message.
+  struct btcp2p_ring_buffer_t recv_ring; ///< Received but unparsed data.
+  size_t recv_ring_held; ///< Ring bytes backing the last message's payload.
+  struct btcp2p_message_t outgoing; ///< Scratch space for packing messages.
+  struct btcp2p_send_queue_t send_queue; ///< Queued messages not yet written.
+  bool use_zerocopy; ///< Send large payloads with MSG_ZEROCOPY, chosen before connecting.
+  bool use_fastopen; ///< Send our version in the SYN with TCP Fast Open, chosen before connecting.
+  bool used_fastopen; ///< Did our version reach the peer in the SYN?
+  struct btcp2p_zerocopy_t zerocopy; ///< Payload buffers awaiting zero-copy completions.
+  struct btcp2p_verify_pool_t* verify_pool; ///< Pool that checks checksums, chosen before connecting.
+  struct btcp2p_verify_queue_t verify_queue; ///< Received frames awaiting verify_pool.
+  struct btcp2p_checked_buffer_t verified; ///< Payload of the last frame taken from verify_queue.
+  bool use_wake; ///< Let other threads wake the message pump with btcp2p_wake, chosen before connecting.
+  int wake_fd; ///< eventfd signalled by btcp2p_wake, or -1.
+  struct btcp2p_timer_wheel_t* timers; ///< Timers fired by the message pump, or NULL.
+  struct btcp2p_budget_t* recv_budget; ///< Budget for received payloads shared with other connections, or NULL, chosen before connecting.
+  size_t recv_limit; ///< Most payload bytes held ahead of handling, or 0 for BTCP2P_RECV_BUDGET, chosen before connecting.
+  size_t recv_charged; ///< Budget charged for the current message's payload.
+  size_t batch_charged; ///< Budget charged for the payloads of the last batch.
+  struct btcp2p_wheel_timer_t resume_timer; ///< Retries a paused connection on its reactor.
+  struct btcp2p_block_stream_t* block_stream; ///< Decodes blocks as they arrive instead of keeping their payloads, or NULL, chosen before connecting. Not used with a verify_pool.
+  struct btcp2p_handler_entry_t handlers[BTCP2P_CMD_COUNT]; ///< Handlers by command id.
   struct btcp2p_netaddr_t addr_from;
   struct btcp2p_netaddr_t addr_recv;
+  bool is_ready; ///< Is the connection queued on its reactor's ready list?
+  struct btcp2p_connection_t* next_ready; ///< Next connection on ready list.
+};
+
+// Listening socket for inbound connections
+struct btcp2p_listener_t {
+  int socket;
+  struct btcp2p_chain_t const * chain;
+  bool reuse_port; ///< Share the port with other listeners (SO_REUSEPORT), chosen before listening.
+  int backlog; ///< Length of the accept queue, or 0 for BTCP2P_LISTEN_BACKLOG.
+  bool use_fastopen; ///< Accept a version carried in the SYN (TCP_FASTOPEN), chosen before listening.
 };
 
 // TODO: Add the ability to specify a port
 
 // btcp2p_connect opens a new TCP socket connection to the given IP address
-// serving the giving Bitcoin network.
+// serving the giving Bitcoin network. With use_fastopen set, our version is
+// sent in the SYN if the kernel holds a Fast Open cookie for the peer, and
+// used_fastopen records whether the peer accepted it.
 bool btcp2p_connect(struct btcp2p_connection_t* connection,
                     char const * const network,
                     char const * const ipv4_address);
 
+// btcp2p_chain_for_network returns the chain definition for a network name
+// such as "mainnet", or NULL if the network is unknown.
+struct btcp2p_chain_t const * btcp2p_chain_for_network(char const * const network);
+
+// btcp2p_netaddr_from_sockaddr fills in a network address from a socket
+// address, mapping IPv4 addresses into IPv6.
+void btcp2p_netaddr_from_sockaddr(struct btcp2p_netaddr_t* addr,
+                                  struct sockaddr_storage const * const sa);
+
+// btcp2p_begin_handshake opens a connection around a socket that has already
+// finished connecting to a peer on the given chain, and sends our version
+// without waiting for a reply. The handshake is then advanced with
+// btcp2p_continue_handshake. If the socket's connect was deferred by TCP Fast
+// Open the peer is not known yet, and addr_from is left as the caller set it.
+// Returns false, with the socket closed, if the version could not be sent.
+// Otherwise the connection must eventually be closed with btcp2p_disconnect.
+bool btcp2p_begin_handshake(struct btcp2p_connection_t* connection,
+                            struct btcp2p_chain_t const * const chain,
+                            int socket);
+
+// btcp2p_continue_handshake processes whatever handshake messages have
+// arrived without blocking, and answers them. It may be called whenever the
+// connection's socket polls readable. The peer's version and verack may come
+// in either order, and our verack goes out as soon as its version arrives,
+// along with the features chosen in the connection's features that the
+// peer's version supports. Feature announcements (sendheaders, wtxidrelay,
+// sendaddrv2, sendcmpct, feefilter) may arrive before the handshake
+// completes; they are held back and passed to any handler registered for
+// them, in the order received, once it does, so handlers may answer them.
+// Any other early message fails the handshake. Announcements are recorded in
+// peer_features, and the outcome in negotiated, as soon as they arrive.
+enum btcp2p_handshake_status_t btcp2p_continue_handshake(struct btcp2p_connection_t* connection);
+
 // btcp2p_disconnect closes an open connection and cleans up resources.
 void btcp2p_disconnect(struct btcp2p_connection_t* connection);
 
-// btcp2p_message_pump polls for new messages on the socket. Returns true
-// unless there was an error receiving messages on the socket or the socket was
-// closed by the remote host.
+// btcp2p_listen opens a non-blocking socket listening for peers on the given
+// Bitcoin network. address may be NULL to listen on every interface, and port
+// may be NULL for the network's default port or "0" for any free port. With
+// reuse_port set, several listeners, typically one per thread, may listen on
+// the same port and the kernel spreads incoming connections between them.
+bool btcp2p_listen(struct btcp2p_listener_t* listener,
+                   char const * const network,
+                   char const * const address,
+                   char const * const port);
+
+// btcp2p_listener_close stops listening. Connections already accepted are
+// not affected.
+void btcp2p_listener_close(struct btcp2p_listener_t* listener);
+
+// btcp2p_listener_port returns the local port the listener is bound to.
+uint16_t btcp2p_listener_port(struct btcp2p_listener_t const * const listener);
+
+// btcp2p_accept takes the next waiting peer off the listener without
+// blocking and starts the listening side of the handshake with it. As after
+// btcp2p_begin_handshake, the caller drives the handshake with
+// btcp2p_continue_handshake whenever the connection's socket polls readable;
+// our version and verack are sent once the peer's version arrives. Callers
+// should give up on peers that have not completed the handshake by a
+// deadline of their choosing, since nothing else times out a silent peer. On
+// BTCP2P_ACCEPT_COMPLETE the connection must be closed with
+// btcp2p_disconnect whatever becomes of the handshake. Returns
+// BTCP2P_ACCEPT_NONE if no peer is waiting, so callers should accept until
+// then each time the listener's socket polls readable. The connection's
+// io_backend, use_zerocopy, verify_pool and features are honoured as for
+// btcp2p_connect.
+//
+// Example:
+//   while (btcp2p_accept(&listener, &peers[n]) == BTCP2P_ACCEPT_COMPLETE) {
+//     deadlines[n++] = now_ms + 5000;
+//   }
+//   ... poll the listener and every peer still handshaking ...
+//   switch (btcp2p_continue_handshake(&peers[i])) { ... }
+enum btcp2p_accept_status_t btcp2p_accept(struct btcp2p_listener_t* listener,
+                                          struct btcp2p_connection_t* connection);
+
+// btcp2p_message_pump polls for new messages on the socket, waiting up to
+// BTCP2P_PUMP_TIMEOUT_MS for one. Returns true unless there was an error
+// receiving messages on the socket or the socket was closed by the remote
+// host.
 bool btcp2p_message_pump(struct btcp2p_connection_t* connection);
 
+// btcp2p_message_pump_timeout is btcp2p_message_pump waiting up to
+// timeout_ms milliseconds, or indefinitely if timeout_ms is negative. The
+// wait also ends when another thread calls btcp2p_wake or when a timer on
+// connection->timers comes due. Due timers are fired before returning, even
+// if a message was already waiting, so timers can schedule sends such as
+// pings without a separate thread.
+//
+// Example:
+//   connection.use_wake = true;
+//   connection.timers = &timers;
+//   ... connect ...
+//   while (btcp2p_message_pump_timeout(&connection, -1)) {
+//     if (connection.has_message) { ... }
+//     ... handle work posted by the threads that called btcp2p_wake ...
+//   }
+bool btcp2p_message_pump_timeout(struct btcp2p_connection_t* connection, int timeout_ms);
+
+// btcp2p_wake makes a message pump that is waiting on the connection return
+// at once. It may be called from any thread while the connection is open.
+// Returns false if the connection was not opened with use_wake set or the
+// platform does not support it.
+bool btcp2p_wake(struct btcp2p_connection_t* connection);
+
+// btcp2p_message_pump_batch receives every complete message already waiting
+// on the connection, up to max, into messages and stores how many were
+// received in count. It waits as btcp2p_message_pump does, including for
+// wakes and timers, only if no message is waiting at all. Each message's
+// payload buffer must have been created with btcp2p_checked_buffer_create;
+// received payloads are either copied into it or exchanged with it, so the
+// buffers stay owned by the caller and remain valid across later receives.
+// Payloads can be unpacked with btcp2p_unpack. They stay charged to the
+// connection's receive budgets until the next batch is pumped, so a batch
+// ends early once the next payload would not fit them. Handlers registered
+// with btcp2p_on are called for each message, but the connection has no
+// current message afterwards. Returns false under the same conditions as
+// btcp2p_message_pump.
+bool btcp2p_message_pump_batch(struct btcp2p_connection_t* connection,
+                               struct btcp2p_message_t* messages,
+                               size_t max,
+                               size_t* count);
+
+// btcp2p_message_pump_batch_timeout is btcp2p_message_pump_batch waiting up
+// to timeout_ms milliseconds, or indefinitely if timeout_ms is negative, as
+// btcp2p_message_pump_timeout does.
+bool btcp2p_message_pump_batch_timeout(struct btcp2p_connection_t* connection,
+                                       struct btcp2p_message_t* messages,
+                                       size_t max,
+                                       size_t* count,
+                                       int timeout_ms);
+
+// btcp2p_try_recv_message receives whatever data is available without
+// blocking and reports whether a whole message has been assembled in
+// connection->message. Partially received messages are resumed on the next
+// call. Each socket read fills the connection's receive ring with a single
+// system call, and messages already sitting in the ring are returned without
+// touching the socket. The payload of the returned message is only valid
+// until the next receive. If the connection was opened with verify_pool set,
+// every available frame is handed to the pool and messages are returned in
+// arrival order once their checksums have been checked.
+enum btcp2p_recv_status_t btcp2p_try_recv_message(struct btcp2p_connection_t* connection);
+
+// btcp2p_recv_paused returns true if the connection has stopped reading from
+// its socket because the next payload does not fit in its receive budget or
+// the shared recv_budget. Receiving resumes by itself once earlier messages
+// have been handled and released their share. Headers announcing a payload
+// larger than btcp2p_command_max_payload allows for the command fail the
+// receive instead, before anything is allocated for the payload.
+bool btcp2p_recv_paused(struct btcp2p_connection_t const * const connection);
+
+// btcp2p_has_pending_data returns true if received data is waiting to be
+// parsed, either in the connection's receive ring or on the socket itself.
+bool btcp2p_has_pending_data(struct btcp2p_connection_t* connection);
+
+// btcp2p_recv_message blocks until the next message has been received from
+// the connection. Returns false if there was a receive error, the remote host
+// closed the connection, or the message checksum was invalid.
+bool btcp2p_recv_message(struct btcp2p_connection_t* connection);
+
 // btcp2p_has_message indicates whether or not a message for the given command
 // has been received. If the command given is NULL then it is true if there was
-// any message received.
+// any message received. Known commands are compared by their interned id.
 bool btcp2p_has_message(struct btcp2p_connection_t* connection,
                         char const command[12]);
 
+// btcp2p_has_command indicates whether or not a message with the given
+// command id has been received.
+bool btcp2p_has_command(struct btcp2p_connection_t const * const connection,
+                        enum btcp2p_command_id_t id);
+
+// btcp2p_message_digest returns the double-SHA256 of the current message's
+// payload, computed while it was received. For a tx message without witness
+// data this is the txid. Returns NULL if there is no current message.
+uint8_t const * btcp2p_message_digest(struct btcp2p_connection_t const * const connection);
+
+// btcp2p_block_hash returns the hash of the current message if it is a block,
+// computed from its first BTCP2P_BLOCK_HEADER_SIZE bytes while they were
+// received. Returns NULL for any other message.
+uint8_t const * btcp2p_block_hash(struct btcp2p_connection_t const * const connection);
+
+// btcp2p_on registers a handler for messages with the given command id,
+// replacing any previous handler. Passing NULL removes the handler. The
+// handler registered for BTCP2P_CMD_UNKNOWN is a catch-all that receives
+// unknown commands and any known command without its own handler. Handlers
+// may be registered before connecting and are called by btcp2p_message_pump
+// and btcp2p_reactor_next for each message received.
+void btcp2p_on(struct btcp2p_connection_t* connection,
+               enum btcp2p_command_id_t id,
+               btcp2p_handler_t handler,
+               void* ctx);
+
+// Subscription mask that receives every message.
+#define BTCP2P_SUBSCRIBE_ALL (~0ULL)
+
+// btcp2p_subscribe limits the messages received on an open connection to the
+// commands whose BTCP2P_COMMAND_BIT is set in the mask. Other messages are
+// skipped as they arrive, without being buffered or checksummed.
+// BTCP2P_CMD_UNKNOWN covers every command unknown to the library, and version
+// and verack are always received. Connections start subscribed to
+// BTCP2P_SUBSCRIBE_ALL.
+void btcp2p_subscribe(struct btcp2p_connection_t* connection, uint64_t commands);
+
+// btcp2p_dropped_bytes returns the number of bytes, headers included, skipped
+// for messages with the given command id because the connection was not
+// subscribed to them.
+uint64_t btcp2p_dropped_bytes(struct btcp2p_connection_t const * const connection,
+                              enum btcp2p_command_id_t id);
+
+// btcp2p_received_bytes returns the number of bytes, headers included,
+// received for messages with the given command id, not counting those
+// skipped. Comparing it across connections shows the bandwidth that
+// negotiated features save.
+uint64_t btcp2p_received_bytes(struct btcp2p_connection_t const * const connection,
+                               enum btcp2p_command_id_t id);
+
+// btcp2p_dispatch calls the handler registered for the connection's current
+// message. Returns true if a handler was called.
+bool btcp2p_dispatch(struct btcp2p_connection_t* connection);
+
 // btcp2p_unpack_message unpacks a message from the connection
 bool btcp2p_unpack_message(struct btcp2p_connection_t* connection,
                            char const * const format,
                            ...);
 
+// btcp2p_pack_message packs a message for the connection's network according
+// to the given format string without sending it. The message's payload buffer
+// must have been created with btcp2p_checked_buffer_create.
+void btcp2p_pack_message(struct btcp2p_connection_t* connection,
+                         struct btcp2p_message_t* message,
+                         char const command[12],
+                         char const * const restrict format,
+                         ...);
+
+// btcp2p_send_messages sends a batch of packed messages over the connection,
+// writing the headers and payloads of many messages with each system call.
+// Any messages waiting in the outbound queue are written first.
+bool btcp2p_send_messages(struct btcp2p_connection_t* connection,
+                          struct btcp2p_message_t const * const messages,
+                          size_t count);
+
 // btcp2p_pack_and_send_message packs a message according to the given format
-// string and attempts to send it over the given connection.
+// string and attempts to send it over the given connection. The header and
+// payload are written with a single system call. If the connection was opened
+// with use_zerocopy set, payloads of at least BTCP2P_ZEROCOPY_THRESHOLD bytes
+// are instead sent without copying them into the kernel.
 bool btcp2p_pack_and_send_message(struct btcp2p_connection_t* connection,
                                   char const command[12],
                                   char const * const restrict format,
                                   ...);
 
+// btcp2p_queue_message packs a message and appends it to the connection's
+// outbound queue without writing to the socket. Small messages queued back to
+// back are written together by the next flush. Returns false, without queuing
+// anything, if the queue would exceed BTCP2P_SEND_QUEUE_MAX_BYTES, in which
+// case callers should flush and retry later, or if memory ran out.
+bool btcp2p_queue_message(struct btcp2p_connection_t* connection,
+                          char const command[12],
+                          char const * const restrict format,
+                          ...);
+
+// btcp2p_flush writes as much of the outbound queue as the socket accepts
+// without blocking. Whatever is left is written by later flushes; reactors
+// flush automatically once the socket reports room for more data. Returns
+// false if the socket failed.
+bool btcp2p_flush(struct btcp2p_connection_t* connection);
+
+// btcp2p_queued_messages returns the number of queued messages that have not
+// been completely written to the socket.
+size_t btcp2p_queued_messages(struct btcp2p_connection_t const * const connection);
+
+// btcp2p_queued_bytes returns the number of queued bytes that have not been
+// written to the socket.
+size_t btcp2p_queued_bytes(struct btcp2p_connection_t const * const connection);
+
+// btcp2p_cork asks the kernel to hold back partially filled segments until the
+// connection is uncorked, so that bursts of messages spread over several
+// flushes still leave in full-sized segments. Has no effect on platforms
+// without TCP_CORK.
+void btcp2p_cork(struct btcp2p_connection_t* connection, bool corked);
+
 #endif // LIBBTCP2P_CONNECTION_H
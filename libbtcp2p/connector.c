@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbtcp2p/connector.h"
+#include "libbtcp2p/io.h"
+#include "libbtcp2p/log.h"
+
+static uint64_t btcp2p_connector_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void btcp2p_dns_cache_create(struct btcp2p_dns_cache_t* cache) {
+  memset(cache, 0, sizeof(struct btcp2p_dns_cache_t));
+  cache->ttl_ms = BTCP2P_DNS_CACHE_TTL_MS;
+}
+
+void btcp2p_dns_cache_destroy(struct btcp2p_dns_cache_t* cache) {
+  struct btcp2p_dns_entry_t* entry = cache->entries;
+  while (entry) {
+    struct btcp2p_dns_entry_t* next = entry->next;
+    free(entry->host);
+    free(entry);
+    entry = next;
+  }
+  cache->entries = NULL;
+}
+
+// btcp2p_dns_entry_fill stores resolved addresses in the order they should be
+// raced: the family getaddrinfo preferred first, alternating with the other.
+static void btcp2p_dns_entry_fill(struct btcp2p_dns_entry_t* entry,
+                                  struct addrinfo const * const results)
+{
+  struct addrinfo const * preferred[BTCP2P_DNS_MAX_ADDRESSES];
+  struct addrinfo const * other[BTCP2P_DNS_MAX_ADDRESSES];
+  size_t num_preferred = 0;
+  size_t num_other = 0;
+
+  for (struct addrinfo const * next = results; next != NULL; next = next->ai_next) {
+    if (next->ai_addrlen > sizeof(struct sockaddr_storage)) {
+      continue;
+    }
+    if (next->ai_family == results->ai_family) {
+      if (num_preferred < BTCP2P_DNS_MAX_ADDRESSES) preferred[num_preferred++] = next;
+    } else if (num_other < BTCP2P_DNS_MAX_ADDRESSES) {
+      other[num_other++] = next;
+    }
+  }
+
+  entry->num_addresses = 0;
+  for (size_t i = 0;
+       (i < num_preferred || i < num_other) && entry->num_addresses < BTCP2P_DNS_MAX_ADDRESSES;
+       i++)
+  {
+    struct addrinfo const * pair[2] = { i < num_preferred ? preferred[i] : NULL,
+                                        i < num_other ? other[i] : NULL };
+    for (int k = 0; k < 2 && entry->num_addresses < BTCP2P_DNS_MAX_ADDRESSES; k++) {
+      if (pair[k]) {
+        memcpy(&entry->addresses[entry->num_addresses], pair[k]->ai_addr, pair[k]->ai_addrlen);
+        entry->address_lengths[entry->num_addresses] = pair[k]->ai_addrlen;
+        entry->num_addresses++;
+      }
+    }
+  }
+}
+
+struct btcp2p_dns_entry_t const * btcp2p_dns_cache_resolve(struct btcp2p_dns_cache_t* cache,
+                                                           char const * const host,
+                                                           char const * const port)
+{
+  uint64_t now = btcp2p_connector_now_ms();
+
+  struct btcp2p_dns_entry_t* entry = cache->entries;
+  while (entry && (strcmp(entry->host, host) != 0 || strcmp(entry->port, port) != 0)) {
+    entry = entry->next;
+  }
+  if (entry && now < entry->expires_ms) {
+    cache->hits++;
+    return entry;
+  }
+
+  cache->misses++;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* results;
+  int status = getaddrinfo(host, port, &hints, &results);
+  if (status != 0) {
+    // A stale answer is better than none while the resolver is unreachable.
+    if (entry) {
+      btcp2p_log(BTCP2P_LOG_INFO, "reusing expired addresses for %s: %s\n", host, gai_strerror(status));
+      return entry;
+    }
+    btcp2p_log(BTCP2P_LOG_ERROR, "getaddrinfo failed: %s\n", gai_strerror(status));
+    return NULL;
+  }
+
+  if (!entry) {
+    entry = calloc(1, sizeof(struct btcp2p_dns_entry_t));
+    if (!entry || !(entry->host = strdup(host))) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "unable to allocate DNS cache entry.\n");
+      free(entry);
+      freeaddrinfo(results);
+      return NULL;
+    }
+    snprintf(entry->port, sizeof(entry->port), "%s", port);
+    entry->next = cache->entries;
+    cache->entries = entry;
+  }
+
+  btcp2p_dns_entry_fill(entry, results);
+  entry->expires_ms = now + cache->ttl_ms;
+  freeaddrinfo(results);
+
+  return entry;
+}
+
+void btcp2p_connector_create(struct btcp2p_connector_t* connector) {
+  memset(connector, 0, sizeof(struct btcp2p_connector_t));
+  btcp2p_dns_cache_create(&connector->dns);
+}
+
+// btcp2p_connect_attempt_close_sockets abandons every address still
+// connecting.
+static void btcp2p_connect_attempt_close_sockets(struct btcp2p_connect_attempt_t* attempt) {
+  for (size_t i = 0; i < attempt->num_sockets; i++) {
+    close(attempt->sockets[i]);
+  }
+  attempt->num_sockets = 0;
+}
+
+// btcp2p_connect_attempt_abandon releases whatever an unfinished attempt
+// holds.
+static void btcp2p_connect_attempt_abandon(struct btcp2p_connect_attempt_t* attempt) {
+  if (attempt->state == BTCP2P_CONNECT_HANDSHAKING) {
+    btcp2p_disconnect(attempt->connection);
+  }
+  btcp2p_connect_attempt_close_sockets(attempt);
+}
+
+void btcp2p_connector_destroy(struct btcp2p_connector_t* connector) {
+  for (struct btcp2p_connect_attempt_t* attempt = connector->active;
+       attempt != NULL;
+       attempt = attempt->next)
+  {
+    btcp2p_connect_attempt_abandon(attempt);
+  }
+  connector->active = NULL;
+  connector->num_active = 0;
+  connector->done_head = NULL;
+  connector->done_tail = NULL;
+  connector->num_done = 0;
+
+  free(connector->pollfds);
+  connector->pollfds = NULL;
+  connector->pollfds_capacity = 0;
+  btcp2p_dns_cache_destroy(&connector->dns);
+}
+
+// btcp2p_connect_attempt_race starts connecting to the next candidate
+// address. Candidates that fail straight away are skipped.
+static void btcp2p_connect_attempt_race(struct btcp2p_connect_attempt_t* attempt, uint64_t now) {
+  while (attempt->next_address < attempt->num_addresses) {
+    size_t index = attempt->next_address++;
+    struct sockaddr* address = (struct sockaddr*)&attempt->addresses[index];
+
+    int fd = socket(address->sa_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+      attempt->error = errno;
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (attempt->connection->use_fastopen && !btcp2p_io_fastopen_connect(fd)) {
+      btcp2p_log(BTCP2P_LOG_INFO, "TCP Fast Open unavailable: %s\n", strerror(errno));
+      attempt->connection->use_fastopen = false;
+    }
+
+    int status = connect(fd, address, attempt->address_lengths[index]);
+    if (status < 0 && errno != EINPROGRESS) {
+      attempt->error = errno;
+      close(fd);
+      continue;
+    }
+
+    // A connect deferred by Fast Open is writable at once and wins the race,
+    // but getpeername cannot name the peer until the SYN has gone out.
+    if (status == 0) {
+      btcp2p_netaddr_from_sockaddr(&attempt->connection->addr_from, &attempt->addresses[index]);
+    }
+
+    attempt->sockets[attempt->num_sockets++] = fd;
+    attempt->next_race_ms = now + BTCP2P_CONNECTOR_RACE_DELAY_MS;
+    return;
+  }
+}
+
+// btcp2p_connect_attempt_fail marks an attempt failed and releases what it
+// holds.
+static void btcp2p_connect_attempt_fail(struct btcp2p_connect_attempt_t* attempt,
+                                        int error,
+                                        uint64_t now)
+{
+  btcp2p_connect_attempt_abandon(attempt);
+  attempt->state = BTCP2P_CONNECT_FAILED;
+  attempt->error = error;
+  attempt->finished_ms = now;
+}
+
+// btcp2p_connect_attempt_handshake advances an attempt's handshake. Returns
+// true once the attempt has finished.
+static bool btcp2p_connect_attempt_handshake(struct btcp2p_connect_attempt_t* attempt,
+                                             uint64_t now)
+{
+  switch (btcp2p_continue_handshake(attempt->connection)) {
+  case BTCP2P_HANDSHAKE_COMPLETE:
+    attempt->state = BTCP2P_CONNECT_READY;
+    attempt->finished_ms = now;
+    return true;
+  case BTCP2P_HANDSHAKE_FAILED:
+    btcp2p_connect_attempt_fail(attempt, EPROTO, now);
+    return true;
+  default:
+    break;
+  }
+
+  if (now >= attempt->deadline_ms) {
+    btcp2p_connect_attempt_fail(attempt, ETIMEDOUT, now);
+    return true;
+  }
+
+  return false;
+}
+
+// btcp2p_connect_attempt_connected hands the winning socket to the
+// connection and starts the handshake. Returns true if the attempt has
+// finished.
+static bool btcp2p_connect_attempt_connected(struct btcp2p_connect_attempt_t* attempt,
+                                             int fd,
+                                             uint64_t now)
+{
+  btcp2p_connect_attempt_close_sockets(attempt);
+  attempt->connected_ms = now;
+
+  if (!btcp2p_begin_handshake(attempt->connection, attempt->chain, fd)) {
+    btcp2p_connect_attempt_fail(attempt, errno ? errno : EPIPE, now);
+    return true;
+  }
+
+  attempt->state = BTCP2P_CONNECT_HANDSHAKING;
+  return btcp2p_connect_attempt_handshake(attempt, now);
+}
+
+// btcp2p_connect_attempt_advance moves an attempt on given the poll results
+// for its descriptors. Returns true once the attempt has finished.
+static bool btcp2p_connect_attempt_advance(struct btcp2p_connect_attempt_t* attempt,
+                                           struct pollfd const * const pollfds,
+                                           size_t num_pollfds,
+                                           uint64_t now)
+{
+  if (attempt->state == BTCP2P_CONNECT_HANDSHAKING) {
+    return btcp2p_connect_attempt_handshake(attempt, now);
+  }
+
+  for (size_t i = 0; i < num_pollfds; i++) {
+    if (pollfds[i].revents == 0) {
+      continue;
+    }
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(pollfds[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) {
+      error = errno;
+    }
+    if (error == 0) {
+      // Take the winner out of the race before the rest are closed.
+      for (size_t k = 0; k < attempt->num_sockets; k++) {
+        if (attempt->sockets[k] == pollfds[i].fd) {
+          attempt->sockets[k] = attempt->sockets[--attempt->num_sockets];
+          break;
+        }
+      }
+      return btcp2p_connect_attempt_connected(attempt, pollfds[i].fd, now);
+    }
+
+    attempt->error = error;
+    for (size_t k = 0; k < attempt->num_sockets; k++) {
+      if (attempt->sockets[k] == pollfds[i].fd) {
+        close(attempt->sockets[k]);
+        attempt->sockets[k] = attempt->sockets[--attempt->num_sockets];
+        break;
+      }
+    }
+  }
+
+  if (now >= attempt->deadline_ms) {
+    btcp2p_connect_attempt_fail(attempt, ETIMEDOUT, now);
+    return true;
+  }
+
+  // Race the next address if the current ones have failed or are slow.
+  if (attempt->num_sockets == 0 || now >= attempt->next_race_ms) {
+    btcp2p_connect_attempt_race(attempt, now);
+  }
+
+  if (attempt->num_sockets == 0) {
+    btcp2p_connect_attempt_fail(attempt, attempt->error ? attempt->error : ECONNREFUSED, now);
+    return true;
+  }
+
+  return false;
+}
+
+// btcp2p_connector_push_done queues a finished attempt for
+// btcp2p_connector_next.
+static void btcp2p_connector_push_done(struct btcp2p_connector_t* connector,
+                                       struct btcp2p_connect_attempt_t* attempt)
+{
+  if (attempt->state == BTCP2P_CONNECT_READY) {
+    uint64_t elapsed_ms = attempt->finished_ms - attempt->started_ms;
+    connector->stats.ready++;
+    connector->stats.handshake_ms += elapsed_ms;
+    if (attempt->connection->used_fastopen) {
+      connector->stats.fastopen++;
+      connector->stats.fastopen_handshake_ms += elapsed_ms;
+    }
+  } else {
+    connector->stats.failed++;
+  }
+
+  attempt->next = NULL;
+  if (connector->done_tail) {
+    connector->done_tail->next = attempt;
+  } else {
+    connector->done_head = attempt;
+  }
+  connector->done_tail = attempt;
+  connector->num_done++;
+}
+
+bool btcp2p_connector_start(struct btcp2p_connector_t* connector,
+                            struct btcp2p_connect_attempt_t* attempt,
+                            struct btcp2p_connection_t* connection,
+                            char const * const network,
+                            char const * const host,
+                            char const * const port,
+                            int timeout_ms)
+{
+  memset(attempt, 0, sizeof(struct btcp2p_connect_attempt_t));
+  attempt->connection = connection;
+  attempt->chain = btcp2p_chain_for_network(network);
+  if (!attempt->chain) {
+    btcp2p_log(
+      BTCP2P_LOG_ERROR,
+      "unable to find configuration for network '%s'\n",
+      network
+    );
+    return false;
+  }
+
+  char port_string[6];
+  snprintf(port_string, 6, "%d", attempt->chain->port);
+
+  struct btcp2p_dns_entry_t const * entry =
+    btcp2p_dns_cache_resolve(&connector->dns, host, port ? port : port_string);
+  if (!entry) {
+    return false;
+  }
+  memcpy(attempt->addresses, entry->addresses, sizeof(attempt->addresses));
+  memcpy(attempt->address_lengths, entry->address_lengths, sizeof(attempt->address_lengths));
+  attempt->num_addresses = entry->num_addresses;
+
+  uint64_t now = btcp2p_connector_now_ms();
+  attempt->state = BTCP2P_CONNECT_CONNECTING;
+  attempt->started_ms = now;
+  attempt->deadline_ms = now + (uint64_t)(timeout_ms > 0 ? timeout_ms : BTCP2P_CONNECTOR_TIMEOUT_MS);
+
+  btcp2p_connect_attempt_race(attempt, now);
+  if (attempt->num_sockets == 0) {
+    btcp2p_connect_attempt_fail(attempt, attempt->error ? attempt->error : EADDRNOTAVAIL, now);
+    btcp2p_connector_push_done(connector, attempt);
+    return true;
+  }
+
+  attempt->next = connector->active;
+  connector->active = attempt;
+  connector->num_active++;
+  return true;
+}
+
+// btcp2p_connector_gather fills in the descriptors to poll for an attempt and
+// returns how many there are.
+static size_t btcp2p_connector_gather(struct btcp2p_connect_attempt_t* attempt,
+                                      struct pollfd* pollfds)
+{
+  if (attempt->state == BTCP2P_CONNECT_HANDSHAKING) {
+    pollfds[0].fd = btcp2p_io_fd(attempt->connection);
+    pollfds[0].events = POLLIN;
+    pollfds[0].revents = 0;
+    return 1;
+  }
+
+  for (size_t i = 0; i < attempt->num_sockets; i++) {
+    pollfds[i].fd = attempt->sockets[i];
+    pollfds[i].events = POLLOUT;
+    pollfds[i].revents = 0;
+  }
+  return attempt->num_sockets;
+}
+
+bool btcp2p_connector_pump(struct btcp2p_connector_t* connector, int timeout_ms) {
+  if (connector->num_active == 0) {
+    return true;
+  }
+
+  size_t needed = connector->num_active * BTCP2P_DNS_MAX_ADDRESSES;
+  if (needed > connector->pollfds_capacity) {
+    struct pollfd* pollfds = realloc(connector->pollfds, needed * sizeof(struct pollfd));
+    if (!pollfds) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "unable to allocate connector poll set.\n");
+      return false;
+    }
+    connector->pollfds = pollfds;
+    connector->pollfds_capacity = needed;
+  }
+
+  // Wake up in time for the next race or deadline.
+  uint64_t now = btcp2p_connector_now_ms();
+  uint64_t wake = timeout_ms < 0 ? UINT64_MAX : now + (uint64_t)timeout_ms;
+  size_t count = 0;
+  for (struct btcp2p_connect_attempt_t* attempt = connector->active;
+       attempt != NULL;
+       attempt = attempt->next)
+  {
+    count += btcp2p_connector_gather(attempt, connector->pollfds + count);
+    if (attempt->deadline_ms < wake) {
+      wake = attempt->deadline_ms;
+    }
+    if (attempt->state == BTCP2P_CONNECT_CONNECTING &&
+        attempt->next_address < attempt->num_addresses &&
+        attempt->next_race_ms < wake)
+    {
+      wake = attempt->next_race_ms;
+    }
+  }
+
+  int wait_ms = wake > now ? (int)(wake - now) : 0;
+  if (poll(connector->pollfds, count, wait_ms) < 0 && errno != EINTR) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "poll error: %s\n", strerror(errno));
+    return false;
+  }
+
+  now = btcp2p_connector_now_ms();
+  struct pollfd const * pollfds = connector->pollfds;
+  struct btcp2p_connect_attempt_t** link = &connector->active;
+  while (*link) {
+    struct btcp2p_connect_attempt_t* attempt = *link;
+    size_t num_pollfds = attempt->state == BTCP2P_CONNECT_HANDSHAKING ? 1 : attempt->num_sockets;
+
+    bool finished = btcp2p_connect_attempt_advance(attempt, pollfds, num_pollfds, now);
+    pollfds += num_pollfds;
+
+    if (finished) {
+      *link = attempt->next;
+      connector->num_active--;
+      btcp2p_connector_push_done(connector, attempt);
+    } else {
+      link = &attempt->next;
+    }
+  }
+
+  return true;
+}
+
+struct btcp2p_connect_attempt_t* btcp2p_connector_next(struct btcp2p_connector_t* connector) {
+  struct btcp2p_connect_attempt_t* attempt = connector->done_head;
+  if (attempt) {
+    connector->done_head = attempt->next;
+    if (!connector->done_head) {
+      connector->done_tail = NULL;
+    }
+    attempt->next = NULL;
+    connector->num_done--;
+  }
+
+  return attempt;
+}
+
+size_t btcp2p_connector_pending(struct btcp2p_connector_t const * const connector) {
+  return connector->num_active + connector->num_done;
+}
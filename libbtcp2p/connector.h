@@ -0,0 +1,180 @@
+// Opens many outbound connections at once without blocking.
+//
+// btcp2p_connect does one connection at a time and blocks through the TCP
+// connect and the handshake. A connector instead runs every attempt as a
+// small state machine driven by btcp2p_connector_pump, so hundreds of peers
+// can be brought up in the time of the slowest one.
+//
+// Each attempt resolves its host through the connector's DNS cache, then
+// races the resulting addresses happy-eyeballs style (RFC 8305): addresses
+// alternate between IPv6 and IPv4, and a further address is tried every
+// BTCP2P_CONNECTOR_RACE_DELAY_MS while earlier ones are still connecting. The
+// first socket to connect wins and the others are closed. The version/verack
+// exchange then runs without blocking. An attempt that has not completed by
+// its deadline fails with ETIMEDOUT.
+//
+// Reconnecting to many known peers at once, such as after a restart, can
+// skip a round trip per peer by setting use_fastopen on each connection:
+// where the kernel holds a TCP Fast Open cookie for the peer, our version
+// travels in the SYN. The kernel keeps cookies across restarts and falls back
+// to a normal connect without one, so the handshake is the same either way.
+// The connector's stats compare handshake times with and without Fast Open.
+//
+// Example:
+//   btcp2p_connector_create(&connector);
+//   for (size_t i = 0; i < count; i++) {
+//     btcp2p_connector_start(&connector, &attempts[i], &conns[i], "mainnet", hosts[i], NULL, 5000);
+//   }
+//   while (btcp2p_connector_pending(&connector) > 0 && btcp2p_connector_pump(&connector, 100)) {
+//     struct btcp2p_connect_attempt_t* attempt;
+//     while ((attempt = btcp2p_connector_next(&connector)) != NULL) {
+//       if (attempt->state == BTCP2P_CONNECT_READY) { ... use attempt->connection ... }
+//     }
+//   }
+#ifndef LIBBTCP2P_CONNECTOR_H
+#define LIBBTCP2P_CONNECTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "libbtcp2p/connection.h"
+
+// Maximum number of addresses kept for a host.
+#define BTCP2P_DNS_MAX_ADDRESSES 8
+
+// Default time a resolved host is reused before it is resolved again.
+#define BTCP2P_DNS_CACHE_TTL_MS (5 * 60 * 1000)
+
+// Delay before racing the next address while earlier ones still connect.
+#define BTCP2P_CONNECTOR_RACE_DELAY_MS 250
+
+// Default time an attempt may take to connect and complete its handshake.
+#define BTCP2P_CONNECTOR_TIMEOUT_MS 10000
+
+// Addresses resolved for one host and port
+struct btcp2p_dns_entry_t {
+  char* host;
+  char port[6];
+  struct sockaddr_storage addresses[BTCP2P_DNS_MAX_ADDRESSES]; ///< In the order to try them.
+  socklen_t address_lengths[BTCP2P_DNS_MAX_ADDRESSES];
+  size_t num_addresses;
+  uint64_t expires_ms; ///< Monotonic time after which the entry is resolved again.
+  struct btcp2p_dns_entry_t* next;
+};
+
+struct btcp2p_dns_cache_t {
+  struct btcp2p_dns_entry_t* entries;
+  uint64_t ttl_ms; ///< How long entries are reused.
+  uint64_t hits; ///< Lookups answered from the cache.
+  uint64_t misses; ///< Lookups that called getaddrinfo.
+};
+
+// Stage an attempt has reached
+enum btcp2p_connect_state_t {
+  BTCP2P_CONNECT_CONNECTING, ///< Waiting for a TCP connect to complete.
+  BTCP2P_CONNECT_HANDSHAKING, ///< Exchanging version and verack.
+  BTCP2P_CONNECT_READY, ///< The connection is open and handshaked.
+  BTCP2P_CONNECT_FAILED ///< The attempt gave up; see error.
+};
+
+// One outbound connection being opened by a connector. Owned by the caller
+// and only read once btcp2p_connector_next has returned it.
+struct btcp2p_connect_attempt_t {
+  struct btcp2p_connection_t* connection; ///< Open once the attempt is ready.
+  struct btcp2p_chain_t const * chain;
+  enum btcp2p_connect_state_t state;
+  int error; ///< errno explaining a failed attempt.
+  struct sockaddr_storage addresses[BTCP2P_DNS_MAX_ADDRESSES]; ///< Candidates in racing order.
+  socklen_t address_lengths[BTCP2P_DNS_MAX_ADDRESSES];
+  size_t num_addresses;
+  size_t next_address; ///< Index of the next candidate to try.
+  int sockets[BTCP2P_DNS_MAX_ADDRESSES]; ///< Sockets still connecting.
+  size_t num_sockets;
+  uint64_t started_ms; ///< When the attempt was started.
+  uint64_t connected_ms; ///< When the TCP connect completed.
+  uint64_t finished_ms; ///< When the attempt became ready or failed.
+  uint64_t next_race_ms; ///< When the next candidate is raced.
+  uint64_t deadline_ms; ///< When the attempt fails with ETIMEDOUT.
+  void* ctx; ///< Caller's pointer.
+  struct btcp2p_connect_attempt_t* next;
+};
+
+// Handshake times of the attempts a connector has finished. Comparing
+// handshake_ms / ready with fastopen_handshake_ms / fastopen shows the time
+// TCP Fast Open saved.
+struct btcp2p_connector_stats_t {
+  uint64_t ready; ///< Attempts that became ready.
+  uint64_t failed; ///< Attempts that failed.
+  uint64_t fastopen; ///< Ready attempts whose version was carried in the SYN.
+  uint64_t handshake_ms; ///< Total time from start to ready over all ready attempts.
+  uint64_t fastopen_handshake_ms; ///< Share of handshake_ms spent by fastopen attempts.
+};
+
+struct btcp2p_connector_t {
+  struct btcp2p_dns_cache_t dns;
+  struct btcp2p_connector_stats_t stats;
+  struct btcp2p_connect_attempt_t* active; ///< Attempts still in progress.
+  size_t num_active;
+  struct btcp2p_connect_attempt_t* done_head; ///< Finished attempts not yet returned.
+  struct btcp2p_connect_attempt_t* done_tail;
+  size_t num_done;
+  struct pollfd* pollfds; ///< Scratch space for btcp2p_connector_pump.
+  size_t pollfds_capacity;
+};
+
+// btcp2p_dns_cache_create initializes an empty cache whose entries are
+// reused for BTCP2P_DNS_CACHE_TTL_MS.
+void btcp2p_dns_cache_create(struct btcp2p_dns_cache_t* cache);
+
+// btcp2p_dns_cache_destroy frees every entry in the cache.
+void btcp2p_dns_cache_destroy(struct btcp2p_dns_cache_t* cache);
+
+// btcp2p_dns_cache_resolve returns the addresses of host and port, resolving
+// them with getaddrinfo if they are not cached or have expired. IPv6 and IPv4
+// addresses are interleaved in the order they should be tried. Numeric hosts
+// never touch DNS. Returns NULL if the host could not be resolved. The entry
+// is valid until the next call.
+struct btcp2p_dns_entry_t const * btcp2p_dns_cache_resolve(struct btcp2p_dns_cache_t* cache,
+                                                           char const * const host,
+                                                           char const * const port);
+
+// btcp2p_connector_create initializes a connector with no attempts.
+void btcp2p_connector_create(struct btcp2p_connector_t* connector);
+
+// btcp2p_connector_destroy abandons every attempt still in progress, closing
+// their sockets, and frees the connector. Attempts that became ready keep
+// their connections open.
+void btcp2p_connector_destroy(struct btcp2p_connector_t* connector);
+
+// btcp2p_connector_start begins opening connection to host on the given
+// Bitcoin network. port may be NULL for the network's default port, and
+// timeout_ms may be 0 for BTCP2P_CONNECTOR_TIMEOUT_MS. The connection's
+// io_backend, use_zerocopy, use_fastopen, verify_pool and features are
+// honoured as for btcp2p_connect. Returns false, without queuing the attempt, if the network
+// is unknown or the host could not be resolved.
+bool btcp2p_connector_start(struct btcp2p_connector_t* connector,
+                            struct btcp2p_connect_attempt_t* attempt,
+                            struct btcp2p_connection_t* connection,
+                            char const * const network,
+                            char const * const host,
+                            char const * const port,
+                            int timeout_ms);
+
+// btcp2p_connector_pump waits up to timeout_ms milliseconds for progress on
+// any attempt and advances every attempt that can move. Returns false on an
+// unrecoverable poll error.
+bool btcp2p_connector_pump(struct btcp2p_connector_t* connector, int timeout_ms);
+
+// btcp2p_connector_next returns the next attempt that has become ready or
+// failed, or NULL if there are none. Each attempt is returned once.
+struct btcp2p_connect_attempt_t* btcp2p_connector_next(struct btcp2p_connector_t* connector);
+
+// btcp2p_connector_pending returns the number of attempts started and not yet
+// returned by btcp2p_connector_next.
+size_t btcp2p_connector_pending(struct btcp2p_connector_t const * const connector);
+
+#endif // LIBBTCP2P_CONNECTOR_H
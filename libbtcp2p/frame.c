@@ -0,0 +1,347 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "libbtcp2p/frame.h"
+
+void btcp2p_frame_reader_create(struct btcp2p_frame_reader_t* reader) {
+  btcp2p_checked_buffer_create(&reader->storage);
+  reader->discard_mask = 0;
+  reader->hash_payload = true;
+  memset(reader->dropped_bytes, 0, sizeof(reader->dropped_bytes));
+  memset(reader->received_bytes, 0, sizeof(reader->received_bytes));
+  for (size_t id = 0; id < BTCP2P_CMD_COUNT; id++) {
+    reader->max_payload[id] = btcp2p_command_max_payload((enum btcp2p_command_id_t)id);
+  }
+  reader->budget = NULL;
+  reader->budget_limit = SIZE_MAX;
+  reader->budget_held = 0;
+  reader->charged = 0;
+  reader->block_stream = NULL;
+  btcp2p_frame_reader_reset(reader);
+}
+
+void btcp2p_frame_reader_destroy(struct btcp2p_frame_reader_t* reader) {
+  btcp2p_frame_reader_release(reader, reader->budget_held);
+  btcp2p_checked_buffer_destroy(&reader->storage);
+}
+
+void btcp2p_frame_reader_set_budget(struct btcp2p_frame_reader_t* reader,
+                                    struct btcp2p_budget_t* budget,
+                                    size_t limit)
+{
+  reader->budget = budget;
+  reader->budget_limit = limit;
+}
+
+void btcp2p_frame_reader_release(struct btcp2p_frame_reader_t* reader, size_t amount) {
+  if (amount == 0) {
+    return;
+  }
+
+  reader->budget_held -= amount;
+  if (reader->budget) {
+    btcp2p_budget_release(reader->budget, amount);
+  }
+}
+
+// btcp2p_frame_reader_charge charges amount payload bytes to the reader's
+// budgets, returning false without charging anything if they do not fit.
+static bool btcp2p_frame_reader_charge(struct btcp2p_frame_reader_t* reader, size_t amount) {
+  // A lone payload is always within the reader's own budget.
+  if (reader->budget_held > 0 &&
+      (reader->budget_held >= reader->budget_limit || amount > reader->budget_limit - reader->budget_held))
+  {
+    return false;
+  }
+  if (reader->budget && !btcp2p_budget_charge(reader->budget, amount)) {
+    return false;
+  }
+
+  reader->budget_held += amount;
+  return true;
+}
+
+bool btcp2p_frame_reader_streams(struct btcp2p_frame_reader_t const * const reader,
+                                 struct btcp2p_message_t const * const message)
+{
+  return reader->block_stream && reader->hash_payload && message->command_id == BTCP2P_CMD_BLOCK;
+}
+
+// btcp2p_frame_reader_buffer_size returns the bytes the reader buffers for
+// the payload of message at once.
+static size_t btcp2p_frame_reader_buffer_size(struct btcp2p_frame_reader_t const * const reader,
+                                              struct btcp2p_message_t const * const message)
+{
+  if (btcp2p_frame_reader_streams(reader, message) && message->header.length > BTCP2P_FRAME_STREAM_CHUNK) {
+    return BTCP2P_FRAME_STREAM_CHUNK;
+  }
+  return message->header.length;
+}
+
+enum btcp2p_frame_state_t btcp2p_frame_reader_resume(struct btcp2p_frame_reader_t* reader,
+                                                     struct btcp2p_message_t* message)
+{
+  size_t size = btcp2p_frame_reader_buffer_size(reader, message);
+  if (reader->state == BTCP2P_FRAME_PAUSED && btcp2p_frame_reader_charge(reader, size)) {
+    reader->charged = size;
+    reader->state = BTCP2P_FRAME_PAYLOAD_PARTIAL;
+  }
+
+  return reader->state;
+}
+
+void btcp2p_frame_reader_reset(struct btcp2p_frame_reader_t* reader) {
+  reader->state = BTCP2P_FRAME_HEADER_PARTIAL;
+  reader->received = 0;
+}
+
+// btcp2p_frame_reader_prepare_payload sizes the reader's own buffer for the
+// payload announced in the header and points the message at it. Returns
+// false if the buffer could not grow.
+static bool btcp2p_frame_reader_prepare_payload(struct btcp2p_frame_reader_t* reader,
+                                                struct btcp2p_message_t* message)
+{
+  if (!btcp2p_checked_buffer_prepare_copy(&reader->storage, btcp2p_frame_reader_buffer_size(reader, message))) {
+    return false;
+  }
+  message->payload = reader->storage;
+  return true;
+}
+
+void btcp2p_frame_hash_begin(struct btcp2p_sha256_t* ctx,
+                             struct btcp2p_message_t* message)
+{
+  btcp2p_sha256_init(ctx);
+  message->has_digest = false;
+  message->has_block_hash = false;
+}
+
+void btcp2p_frame_hash_update(struct btcp2p_sha256_t* ctx,
+                              struct btcp2p_message_t* message,
+                              uint8_t const * data,
+                              size_t offset,
+                              size_t amount)
+{
+  // The block hash covers a prefix of the payload, so a copy of the running
+  // hash is finished once the prefix has been hashed.
+  if (message->command_id == BTCP2P_CMD_BLOCK &&
+      offset < BTCP2P_BLOCK_HEADER_SIZE &&
+      offset + amount >= BTCP2P_BLOCK_HEADER_SIZE)
+  {
+    size_t prefix = BTCP2P_BLOCK_HEADER_SIZE - offset;
+    btcp2p_sha256_update(ctx, data, prefix);
+
+    struct btcp2p_sha256_t header_ctx = *ctx;
+    btcp2p_sha256d_final(&header_ctx, message->block_hash);
+    message->has_block_hash = true;
+
+    data += prefix;
+    amount -= prefix;
+  }
+
+  btcp2p_sha256_update(ctx, data, amount);
+}
+
+uint32_t btcp2p_frame_hash_final(struct btcp2p_sha256_t* ctx,
+                                 struct btcp2p_message_t* message)
+{
+  uint32_t checksum;
+  btcp2p_sha256d_final(ctx, message->digest);
+  message->has_digest = true;
+  memcpy(&checksum, message->digest, sizeof(checksum));
+  return checksum;
+}
+
+// btcp2p_frame_reader_finish_checksum completes the payload hash and records
+// the frame's checksum.
+static void btcp2p_frame_reader_finish_checksum(struct btcp2p_frame_reader_t* reader,
+                                                struct btcp2p_message_t* message)
+{
+  if (reader->hash_payload) {
+    reader->checksum = btcp2p_frame_hash_final(&reader->hash, message);
+  }
+}
+
+size_t btcp2p_frame_reader_want(struct btcp2p_frame_reader_t* reader,
+                                struct btcp2p_message_t* message,
+                                uint8_t** dst)
+{
+  switch (reader->state) {
+  case BTCP2P_FRAME_HEADER_PARTIAL:
+    *dst = (uint8_t*)&message->header + reader->received;
+    return sizeof(message->header) - reader->received;
+  case BTCP2P_FRAME_PAYLOAD_PARTIAL:
+    // Prepare the payload buffer before any of the payload arrives.
+    if (reader->received == 0 && !btcp2p_frame_reader_prepare_payload(reader, message)) {
+      reader->state = BTCP2P_FRAME_OVERSIZED;
+      *dst = NULL;
+      return 0;
+    }
+    // Streamed payloads reuse the start of the buffer for every chunk.
+    if (btcp2p_frame_reader_streams(reader, message)) {
+      size_t remaining = message->header.length - reader->received;
+      *dst = reader->storage.buffer;
+      return remaining < BTCP2P_FRAME_STREAM_CHUNK ? remaining : BTCP2P_FRAME_STREAM_CHUNK;
+    }
+    *dst = reader->storage.buffer + reader->received;
+    return message->header.length - reader->received;
+  case BTCP2P_FRAME_DISCARD:
+    *dst = NULL;
+    return message->header.length - reader->received;
+  default:
+    *dst = NULL;
+    return 0;
+  }
+}
+
+enum btcp2p_frame_state_t btcp2p_frame_reader_advance(struct btcp2p_frame_reader_t* reader,
+                                                      struct btcp2p_message_t* message,
+                                                      size_t amount)
+{
+  reader->received += amount;
+
+  switch (reader->state) {
+  case BTCP2P_FRAME_HEADER_PARTIAL:
+    if (reader->received < sizeof(message->header)) {
+      break;
+    }
+
+    reader->received = 0;
+    reader->charged = 0;
+    message->command_id = btcp2p_command_lookup(message->header.command);
+    if (message->header.length > reader->max_payload[message->command_id]) {
+      reader->state = BTCP2P_FRAME_OVERSIZED;
+      break;
+    }
+    btcp2p_frame_hash_begin(&reader->hash, message);
+    if (reader->discard_mask & BTCP2P_COMMAND_BIT(message->command_id)) {
+      reader->state = BTCP2P_FRAME_DISCARD;
+      return btcp2p_frame_reader_advance(reader, message, 0);
+    }
+    reader->received_bytes[message->command_id] += sizeof(message->header) + message->header.length;
+    if (btcp2p_frame_reader_streams(reader, message)) {
+      btcp2p_block_stream_reset(reader->block_stream);
+    }
+    if (message->header.length > 0) {
+      // Nothing is allocated for the payload until it has been charged.
+      reader->state = BTCP2P_FRAME_PAUSED;
+      return btcp2p_frame_reader_resume(reader, message);
+    } else {
+      btcp2p_frame_reader_prepare_payload(reader, message);
+      btcp2p_frame_reader_finish_checksum(reader, message);
+      reader->state = BTCP2P_FRAME_COMPLETE;
+    }
+    break;
+  case BTCP2P_FRAME_PAYLOAD_PARTIAL: {
+    bool streams = btcp2p_frame_reader_streams(reader, message);
+    uint8_t const * data = streams
+      ? reader->storage.buffer
+      : reader->storage.buffer + reader->received - amount;
+    if (reader->hash_payload) {
+      btcp2p_frame_hash_update(&reader->hash, message, data, reader->received - amount, amount);
+    }
+    if (streams) {
+      btcp2p_block_stream_feed(reader->block_stream, data, amount);
+    }
+    if (reader->received == message->header.length) {
+      btcp2p_frame_reader_finish_checksum(reader, message);
+      if (streams) {
+        message->payload.len = 0;
+      }
+      reader->state = BTCP2P_FRAME_COMPLETE;
+    }
+    break;
+  }
+  case BTCP2P_FRAME_DISCARD:
+    if (reader->received == message->header.length) {
+      reader->dropped_bytes[message->command_id] +=
+        sizeof(message->header) + message->header.length;
+      btcp2p_frame_reader_reset(reader);
+    }
+    break;
+  default:
+    break;
+  }
+
+  return reader->state;
+}
+
+size_t btcp2p_frame_reader_feed(struct btcp2p_frame_reader_t* reader,
+                                struct btcp2p_message_t* message,
+                                uint8_t const * const src,
+                                size_t src_len)
+{
+  size_t consumed = 0;
+
+  while (consumed < src_len &&
+         btcp2p_frame_reader_resume(reader, message) != BTCP2P_FRAME_COMPLETE &&
+         reader->state != BTCP2P_FRAME_PAUSED &&
+         reader->state != BTCP2P_FRAME_OVERSIZED)
+  {
+    uint8_t* dst;
+    size_t amount = btcp2p_frame_reader_want(reader, message, &dst);
+    if (amount > src_len - consumed) {
+      amount = src_len - consumed;
+    }
+
+    if (dst) {
+      memcpy(dst, src + consumed, amount);
+    }
+    consumed += amount;
+    btcp2p_frame_reader_advance(reader, message, amount);
+  }
+
+  return consumed;
+}
+
+enum btcp2p_frame_state_t btcp2p_frame_reader_consume(struct btcp2p_frame_reader_t* reader,
+                                                      struct btcp2p_message_t* message,
+                                                      struct btcp2p_ring_buffer_t* ring,
+                                                      size_t* held)
+{
+  *held = 0;
+
+  while (btcp2p_frame_reader_resume(reader, message) != BTCP2P_FRAME_COMPLETE &&
+         reader->state != BTCP2P_FRAME_PAUSED &&
+         reader->state != BTCP2P_FRAME_OVERSIZED &&
+         btcp2p_ring_buffer_readable(ring) > 0)
+  {
+    if (reader->state == BTCP2P_FRAME_PAYLOAD_PARTIAL && reader->received == 0) {
+      uint8_t* payload = btcp2p_ring_buffer_peek(ring, message->header.length);
+      if (payload) {
+        message->payload.buffer = payload;
+        message->payload.len = message->header.length;
+        message->payload.rw_cursor = 0;
+        message->payload.capacity = message->header.length;
+
+        if (reader->hash_payload) {
+          btcp2p_frame_hash_update(&reader->hash, message, payload, 0, message->header.length);
+        }
+        if (btcp2p_frame_reader_streams(reader, message)) {
+          btcp2p_block_stream_feed(reader->block_stream, payload, message->header.length);
+          message->payload.len = 0;
+        }
+        btcp2p_frame_reader_finish_checksum(reader, message);
+
+        *held = message->header.length;
+        reader->state = BTCP2P_FRAME_COMPLETE;
+        break;
+      }
+    }
+
+    uint8_t* dst;
+    size_t amount = btcp2p_frame_reader_want(reader, message, &dst);
+    if (dst) {
+      amount = btcp2p_ring_buffer_read(ring, dst, amount);
+    } else {
+      // Discarded bytes are dropped from the ring without being copied.
+      if (amount > btcp2p_ring_buffer_readable(ring)) {
+        amount = btcp2p_ring_buffer_readable(ring);
+      }
+      btcp2p_ring_buffer_consume(ring, amount);
+    }
+    btcp2p_frame_reader_advance(reader, message, amount);
+  }
+
+  return reader->state;
+}
@@ -0,0 +1,180 @@
+// Resumable reader for P2P message frames.
+//
+// A frame reader assembles a message from however many bytes happen to be
+// available, remembering its progress between calls. This allows messages to
+// be received from non-blocking sockets without waiting for a whole header or
+// payload to arrive.
+//
+// The payload is hashed as it arrives, so its checksum is known as soon as
+// the last byte has been read instead of requiring a pass over the whole
+// payload afterwards. The full double-SHA256 is kept in the message's digest,
+// and for blocks the hash of the first 80 bytes is recorded on the way past
+// as the block hash.
+//
+// The payload of an assembled message is a read-only view. It either refers
+// to the reader's own payload buffer or, for payloads consumed from a ring
+// buffer, directly into the ring. Either way it is only valid until the next
+// frame is read.
+//
+// Payloads larger than the reader's limit for their command are refused from
+// the header, before anything is allocated for them. Payloads that would
+// overrun the reader's memory budgets leave the reader paused after their
+// header until btcp2p_frame_reader_resume finds room, so the caller stops
+// reading from the peer meanwhile.
+//
+// A reader given a block stream passes block payloads to it as they arrive,
+// through a buffer of at most BTCP2P_FRAME_STREAM_CHUNK bytes, instead of
+// keeping them. The assembled message then has an empty payload but still
+// has its checksum, digest and block hash.
+//
+// Example:
+//   uint8_t* dst;
+//   size_t want = btcp2p_frame_reader_want(&reader, &message, &dst);
+//   ssize_t n = recv(socket, dst, want, 0);
+//   if (n > 0 && btcp2p_frame_reader_advance(&reader, &message, n) ==
+//       BTCP2P_FRAME_COMPLETE) { ... }
+#ifndef LIBBTCP2P_FRAME_H
+#define LIBBTCP2P_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbtcp2p/block_stream.h"
+#include "libbtcp2p/budget.h"
+#include "libbtcp2p/checked_buffer.h"
+#include "libbtcp2p/command.h"
+#include "libbtcp2p/message.h"
+#include "libbtcp2p/ring_buffer.h"
+#include "libbtcp2p/sha256.h"
+
+// Most bytes of a streamed block payload held by the reader at once.
+#define BTCP2P_FRAME_STREAM_CHUNK (64 * 1024)
+
+// Frame reader states
+enum btcp2p_frame_state_t {
+  BTCP2P_FRAME_HEADER_PARTIAL, ///< Waiting for the rest of the header.
+  BTCP2P_FRAME_PAYLOAD_PARTIAL, ///< Waiting for the rest of the payload.
+  BTCP2P_FRAME_COMPLETE, ///< A whole message has been assembled.
+  BTCP2P_FRAME_DISCARD, ///< Skipping the payload of an unwanted message.
+  BTCP2P_FRAME_PAUSED, ///< Waiting for budget to receive the payload.
+  BTCP2P_FRAME_OVERSIZED ///< The header announced a payload over the limit, or one that could not be allocated.
+};
+
+// BTCP2P_COMMAND_BIT returns the discard mask bit for a command id.
+#define BTCP2P_COMMAND_BIT(Id) (1ULL << (Id))
+
+_Static_assert(BTCP2P_CMD_COUNT <= 64, "command ids must fit in a 64-bit mask");
+
+struct btcp2p_frame_reader_t {
+  enum btcp2p_frame_state_t state;
+  size_t received; ///< Bytes received of the current header or payload.
+  struct btcp2p_checked_buffer_t storage; ///< Owns copied payload bytes.
+  bool hash_payload; ///< Hash payloads as they arrive? Defaults to true.
+  struct btcp2p_sha256_t hash; ///< Hash of the payload received so far.
+  uint32_t checksum; ///< Checksum of the payload once the frame is complete.
+  uint64_t discard_mask; ///< Bits of command ids whose frames are skipped.
+  uint64_t dropped_bytes[BTCP2P_CMD_COUNT]; ///< Bytes skipped per command.
+  uint64_t received_bytes[BTCP2P_CMD_COUNT]; ///< Bytes of frames kept per command.
+  uint32_t max_payload[BTCP2P_CMD_COUNT]; ///< Largest payload accepted per command.
+  struct btcp2p_budget_t* budget; ///< Budget shared with other readers, or NULL.
+  size_t budget_limit; ///< Most payload bytes this reader may have charged at once.
+  size_t budget_held; ///< Payload bytes charged and not yet released.
+  size_t charged; ///< Bytes charged for the current frame's payload.
+  struct btcp2p_block_stream_t* block_stream; ///< Decodes block payloads instead of keeping them, or NULL.
+};
+
+// btcp2p_frame_hash_begin starts hashing the payload of message.
+void btcp2p_frame_hash_begin(struct btcp2p_sha256_t* ctx,
+                             struct btcp2p_message_t* message);
+
+// btcp2p_frame_hash_update hashes amount bytes of the message's payload that
+// start offset bytes into it. For block messages, the hash of the first
+// BTCP2P_BLOCK_HEADER_SIZE bytes is recorded in block_hash as they pass.
+void btcp2p_frame_hash_update(struct btcp2p_sha256_t* ctx,
+                              struct btcp2p_message_t* message,
+                              uint8_t const * data,
+                              size_t offset,
+                              size_t amount);
+
+// btcp2p_frame_hash_final records the double-SHA256 of the payload in the
+// message's digest and returns its first 4 bytes as the header checksum.
+uint32_t btcp2p_frame_hash_final(struct btcp2p_sha256_t* ctx,
+                                 struct btcp2p_message_t* message);
+
+// btcp2p_frame_reader_create initializes a reader ready for its first frame
+// that keeps every message, limits payloads to btcp2p_command_max_payload and
+// has no memory budget.
+void btcp2p_frame_reader_create(struct btcp2p_frame_reader_t* reader);
+
+// btcp2p_frame_reader_destroy frees resources allocated for the reader and
+// releases whatever it still has charged to its budgets.
+void btcp2p_frame_reader_destroy(struct btcp2p_frame_reader_t* reader);
+
+// btcp2p_frame_reader_set_budget limits the payload bytes charged to the
+// reader at once to limit, or leaves them unlimited if limit is SIZE_MAX, and
+// also charges them to budget unless it is NULL. A shared budget should allow
+// at least BTCP2P_MAX_PAYLOAD. Must be called before the first frame is
+// read.
+void btcp2p_frame_reader_set_budget(struct btcp2p_frame_reader_t* reader,
+                                    struct btcp2p_budget_t* budget,
+                                    size_t limit);
+
+// btcp2p_frame_reader_release returns amount bytes charged for a payload to
+// the reader's budgets. Payloads stay charged from their header until the
+// caller releases them, normally once the message has been handled.
+void btcp2p_frame_reader_release(struct btcp2p_frame_reader_t* reader, size_t amount);
+
+// btcp2p_frame_reader_resume tries again to charge the payload of a paused
+// frame and returns the new state. A frame is always let through when its
+// reader holds no other charges, so that a lone payload within the command
+// limit is never refused by the reader's own budget.
+enum btcp2p_frame_state_t btcp2p_frame_reader_resume(struct btcp2p_frame_reader_t* reader,
+                                                     struct btcp2p_message_t* message);
+
+// btcp2p_frame_reader_streams returns true if the payload of message is
+// passed to the reader's block stream rather than kept. Payloads are only
+// streamed while the reader hashes them, since nothing else could check
+// their checksum.
+bool btcp2p_frame_reader_streams(struct btcp2p_frame_reader_t const * const reader,
+                                 struct btcp2p_message_t const * const message);
+
+// btcp2p_frame_reader_reset prepares the reader to assemble a new frame.
+void btcp2p_frame_reader_reset(struct btcp2p_frame_reader_t* reader);
+
+// btcp2p_frame_reader_want returns the number of bytes needed to finish the
+// current header or payload and points dst at where they should be written.
+// Returns 0 once the frame is complete. While discarding, dst is set to NULL
+// and the bytes should be skipped rather than stored.
+size_t btcp2p_frame_reader_want(struct btcp2p_frame_reader_t* reader,
+                                struct btcp2p_message_t* message,
+                                uint8_t** dst);
+
+// btcp2p_frame_reader_advance records that amount bytes were written to the
+// location returned by btcp2p_frame_reader_want, or skipped while discarding,
+// and returns the new state. Once a header is complete, the whole payload
+// length is charged to the budgets unless the frame is discarded.
+enum btcp2p_frame_state_t btcp2p_frame_reader_advance(struct btcp2p_frame_reader_t* reader,
+                                                      struct btcp2p_message_t* message,
+                                                      size_t amount);
+
+// btcp2p_frame_reader_feed copies bytes from src into the frame until either
+// the source is exhausted or the frame is complete, paused or oversized.
+// Returns the number of bytes consumed from src.
+size_t btcp2p_frame_reader_feed(struct btcp2p_frame_reader_t* reader,
+                                struct btcp2p_message_t* message,
+                                uint8_t const * const src,
+                                size_t src_len);
+
+// btcp2p_frame_reader_consume reads the frame from a ring buffer until either
+// the ring is empty or the frame is complete, paused or oversized, and
+// returns the new state. A paused frame is resumed first if it can be. A
+// payload that sits wholly and contiguously in the ring is not copied: the
+// message refers to it in place, *held is set to its length, and those bytes
+// are left in the ring for the caller to consume once the message has been
+// handled.
+enum btcp2p_frame_state_t btcp2p_frame_reader_consume(struct btcp2p_frame_reader_t* reader,
+                                                      struct btcp2p_message_t* message,
+                                                      struct btcp2p_ring_buffer_t* ring,
+                                                      size_t* held);
+
+#endif // LIBBTCP2P_FRAME_H
@@ -0,0 +1,278 @@
+// Needed for struct tcp_info.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "libbtcp2p/connection.h"
+#include "libbtcp2p/io.h"
+#include "libbtcp2p/log.h"
+
+#ifdef BTCP2P_HAVE_IO_URING
+#include "libbtcp2p/io_uring.h"
+#endif
+
+// btcp2p_sendmsg_all blocks until every byte described by the iovecs has
+// been sent, using one sendmsg call per batch of iovecs and resuming after
+// partial writes.
+static int btcp2p_sendmsg_all(int socket,
+                              struct iovec const * const iov,
+                              int iovcnt)
+{
+  struct iovec pending[BTCP2P_IO_MAX_IOV];
+  int next = 0;
+
+  while (next < iovcnt) {
+    int count = iovcnt - next;
+    if (count > BTCP2P_IO_MAX_IOV) {
+      count = BTCP2P_IO_MAX_IOV;
+    }
+    memcpy(pending, iov + next, count * sizeof(struct iovec));
+    next += count;
+
+    struct iovec* cursor = pending;
+    while (count > 0) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = cursor;
+      msg.msg_iovlen = count;
+
+      ssize_t n = sendmsg(socket, &msg, 0);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+          return -1;
+        }
+
+        // The socket is non-blocking, so wait for room in the send buffer.
+        // A Fast Open connect that could not carry our data in its SYN
+        // reports EINPROGRESS instead, and polls writable once connected.
+        struct pollfd pfd = { .fd = socket, .events = POLLOUT, .revents = 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+          return -1;
+        }
+        continue;
+      }
+
+      // Skip the iovecs that were written in full and trim the first one that
+      // was only partially written.
+      while (count > 0 && (size_t)n >= cursor->iov_len) {
+        n -= cursor->iov_len;
+        cursor++;
+        count--;
+      }
+      if (count > 0) {
+        cursor->iov_base = (uint8_t*)cursor->iov_base + n;
+        cursor->iov_len -= n;
+      }
+    }
+  }
+
+  return 0;
+}
+
+void btcp2p_io_open(struct btcp2p_connection_t* connection) {
+  connection->uring = NULL;
+
+  int opts = fcntl(connection->socket, F_GETFL);
+  fcntl(connection->socket, F_SETFL, opts | O_NONBLOCK);
+
+  if (connection->io_backend != BTCP2P_IO_URING) {
+    return;
+  }
+
+#ifdef BTCP2P_HAVE_IO_URING
+  connection->uring = btcp2p_uring_open(connection->socket);
+#endif
+
+  if (!connection->uring) {
+    btcp2p_log(BTCP2P_LOG_INFO, "io_uring unavailable, falling back to sockets.\n");
+    connection->io_backend = BTCP2P_IO_SOCKET;
+  }
+}
+
+void btcp2p_io_close(struct btcp2p_connection_t* connection) {
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    btcp2p_uring_close(connection->uring);
+  }
+#endif
+  connection->uring = NULL;
+}
+
+int btcp2p_io_fd(struct btcp2p_connection_t* connection) {
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    return btcp2p_uring_fd(connection->uring);
+  }
+#endif
+  return connection->socket;
+}
+
+bool btcp2p_io_has_pending(struct btcp2p_connection_t* connection) {
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    return btcp2p_uring_has_pending(connection->uring);
+  }
+#endif
+
+  uint8_t byte;
+  ssize_t result = recv(connection->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (result >= 0) {
+    return true;
+  }
+
+  return errno != EAGAIN && errno != EWOULDBLOCK;
+}
+
+ssize_t btcp2p_io_recv(struct btcp2p_connection_t* connection,
+                       void* dst,
+                       size_t len)
+{
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    return btcp2p_uring_recv(connection->uring, dst, len);
+  }
+#endif
+
+  return recv(connection->socket, dst, len, 0);
+}
+
+ssize_t btcp2p_io_skip(struct btcp2p_connection_t* connection, size_t len) {
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    return btcp2p_uring_recv(connection->uring, NULL, len);
+  }
+#endif
+
+#ifdef __linux__
+  // TCP sockets drop the data instead of copying it out with MSG_TRUNC.
+  return recv(connection->socket, NULL, len, MSG_TRUNC);
+#else
+  uint8_t sink[4096];
+  return recv(connection->socket, sink, len < sizeof(sink) ? len : sizeof(sink), 0);
+#endif
+}
+
+ssize_t btcp2p_io_readv(struct btcp2p_connection_t* connection,
+                        struct iovec const * const iov,
+                        int iovcnt)
+{
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      ssize_t n = btcp2p_uring_recv(connection->uring, iov[i].iov_base, iov[i].iov_len);
+      if (n <= 0) {
+        return total > 0 ? total : n;
+      }
+      total += n;
+      if ((size_t)n < iov[i].iov_len) {
+        break;
+      }
+    }
+    return total;
+  }
+#endif
+
+  return readv(connection->socket, iov, iovcnt);
+}
+
+ssize_t btcp2p_io_send(struct btcp2p_connection_t* connection,
+                       void const * const src,
+                       size_t len,
+                       bool more)
+{
+  int flags = MSG_DONTWAIT;
+#ifdef MSG_MORE
+  if (more) {
+    flags |= MSG_MORE;
+  }
+#endif
+
+  return send(connection->socket, src, len, flags);
+}
+
+int btcp2p_io_sendv_all(struct btcp2p_connection_t* connection,
+                        struct iovec const * const iov,
+                        int iovcnt)
+{
+#ifdef BTCP2P_HAVE_IO_URING
+  if (connection->uring) {
+    return btcp2p_uring_sendv_all(connection->uring, iov, iovcnt);
+  }
+#endif
+
+  return btcp2p_sendmsg_all(connection->socket, iov, iovcnt);
+}
+
+bool btcp2p_io_fastopen_connect(int socket) {
+#ifdef TCP_FASTOPEN_CONNECT
+  int on = 1;
+  return setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) == 0;
+#else
+  (void)socket;
+  errno = ENOPROTOOPT;
+  return false;
+#endif
+}
+
+bool btcp2p_io_fastopen_listen(int socket, int queue) {
+#ifdef TCP_FASTOPEN
+  return setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) == 0;
+#else
+  (void)socket;
+  (void)queue;
+  errno = ENOPROTOOPT;
+  return false;
+#endif
+}
+
+bool btcp2p_io_fastopen_used(int socket) {
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  return getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 &&
+         (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+  (void)socket;
+  return false;
+#endif
+}
+
+int btcp2p_io_wake_open(void) {
+#ifdef __linux__
+  return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+void btcp2p_io_wake(int fd) {
+  uint64_t one = 1;
+  ssize_t written = write(fd, &one, sizeof(one));
+  (void)written;
+}
+
+void btcp2p_io_wake_drain(int fd) {
+  uint64_t wakes;
+  ssize_t drained = read(fd, &wakes, sizeof(wakes));
+  (void)drained;
+}
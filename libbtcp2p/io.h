@@ -0,0 +1,108 @@
+// Interfaces for the socket I/O backends used by connections.
+//
+// Connections use plain socket system calls unless io_uring is requested by
+// setting io_backend before connecting. The io_uring backend is only
+// available when the library is built with `make IO_URING=1` on Linux and
+// the running kernel supports multishot receives with provided buffer rings.
+// Otherwise connections transparently fall back to plain sockets.
+#ifndef LIBBTCP2P_IO_H
+#define LIBBTCP2P_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct btcp2p_connection_t;
+
+// Maximum number of iovecs passed to a single send system call.
+#define BTCP2P_IO_MAX_IOV 64
+
+// I/O backends
+enum btcp2p_io_backend_t {
+  BTCP2P_IO_SOCKET, ///< Non-blocking socket system calls.
+  BTCP2P_IO_URING   ///< io_uring multishot receives and linked sends.
+};
+
+// btcp2p_io_open prepares the I/O backend requested by the connection on its
+// open socket and places the socket in non-blocking mode. If the backend is
+// unavailable the connection falls back to BTCP2P_IO_SOCKET.
+void btcp2p_io_open(struct btcp2p_connection_t* connection);
+
+// btcp2p_io_close releases any resources held by the connection's I/O
+// backend. It does not close the socket.
+void btcp2p_io_close(struct btcp2p_connection_t* connection);
+
+// btcp2p_io_fd returns the file descriptor that becomes readable when the
+// connection has data to receive.
+int btcp2p_io_fd(struct btcp2p_connection_t* connection);
+
+// btcp2p_io_has_pending returns true if data or an end-of-stream is waiting
+// to be received on the connection.
+bool btcp2p_io_has_pending(struct btcp2p_connection_t* connection);
+
+// btcp2p_io_recv receives up to len bytes into dst without blocking. Returns
+// the number of bytes received, 0 if the remote host closed the connection,
+// or -1 on error with errno set (EAGAIN if no data is available yet).
+ssize_t btcp2p_io_recv(struct btcp2p_connection_t* connection,
+                       void* dst,
+                       size_t len);
+
+// btcp2p_io_skip discards up to len received bytes without copying them
+// where the platform allows it. Returns values as for btcp2p_io_recv.
+ssize_t btcp2p_io_skip(struct btcp2p_connection_t* connection, size_t len);
+
+// btcp2p_io_readv receives as much data as fits in the given iovecs without
+// blocking. Returns values as for btcp2p_io_recv.
+ssize_t btcp2p_io_readv(struct btcp2p_connection_t* connection,
+                        struct iovec const * const iov,
+                        int iovcnt);
+
+// btcp2p_io_send writes up to len bytes from src without blocking. If more
+// is true the kernel is told that further data follows immediately so that it
+// can hold back a partially filled segment. Both backends write with a plain
+// socket call. Returns the number of bytes sent or -1 on error with errno set
+// (EAGAIN if the send buffer is full).
+ssize_t btcp2p_io_send(struct btcp2p_connection_t* connection,
+                       void const * const src,
+                       size_t len,
+                       bool more);
+
+// btcp2p_io_sendv_all blocks until every byte described by the given iovecs
+// has been sent, waiting for the socket to drain if it is full. Sockets send
+// up to BTCP2P_IO_MAX_IOV iovecs per system call. Returns 0 on success or -1 on error with errno set.
+int btcp2p_io_sendv_all(struct btcp2p_connection_t* connection,
+                        struct iovec const * const iov,
+                        int iovcnt);
+
+// btcp2p_io_fastopen_connect asks for the next connect on the socket to be
+// deferred until its first write, so that the write can ride in the SYN with
+// TCP Fast Open. Without a cookie from the peer the kernel falls back to a
+// normal handshake by itself. Must be called before connect. Returns false,
+// with errno set, if the platform does not support it.
+bool btcp2p_io_fastopen_connect(int socket);
+
+// btcp2p_io_fastopen_listen lets a listening socket accept data in SYNs,
+// keeping up to queue such connections pending. Must be called before
+// listen. Returns false, with errno set, if the platform does not support it.
+bool btcp2p_io_fastopen_listen(int socket, int queue);
+
+// btcp2p_io_fastopen_used returns true if data was carried in the SYN of the
+// socket's connection and acknowledged by the peer.
+bool btcp2p_io_fastopen_used(int socket);
+
+// btcp2p_io_wake_open creates a non-blocking eventfd that polls readable once
+// signalled by btcp2p_io_wake, until drained by btcp2p_io_wake_drain. Returns
+// -1, with errno set, if the platform does not support it.
+int btcp2p_io_wake_open(void);
+
+// btcp2p_io_wake signals a descriptor from btcp2p_io_wake_open. It is safe to
+// call from any thread.
+void btcp2p_io_wake(int fd);
+
+// btcp2p_io_wake_drain resets a signalled descriptor, however many times it
+// was signalled.
+void btcp2p_io_wake_drain(int fd);
+
+#endif // LIBBTCP2P_IO_H
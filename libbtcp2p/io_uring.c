@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libbtcp2p/io_uring.h"
+#include "libbtcp2p/log.h"
+
+// Number of submission queue entries per ring.
+#define BTCP2P_URING_ENTRIES 32
+
+// Number of completion queue entries per ring. Every provided buffer can be
+// filled before completions are reaped, so the queue has room for all of them
+// alongside send completions and the end of a multishot receive.
+#define BTCP2P_URING_CQ_ENTRIES (4 * BTCP2P_URING_BUFFER_COUNT)
+
+// Maximum number of sends linked into a single chain.
+#define BTCP2P_URING_MAX_LINKED_SENDS 8
+
+// Maximum number of iovecs written by a single send.
+#define BTCP2P_URING_MAX_SEND_IOV 64
+
+// Provided buffer group used for multishot receives.
+#define BTCP2P_URING_BUFFER_GROUP 0
+
+// Completion tags stored in user_data. Sends carry their chain index in the
+// upper bits.
+#define BTCP2P_URING_TAG_RECV 1
+#define BTCP2P_URING_TAG_SEND 2
+#define BTCP2P_URING_TAG_NOTIFY 3
+#define BTCP2P_URING_TAG_BITS 8
+
+// A received chunk of data held in one of the provided buffers.
+struct btcp2p_uring_chunk_t {
+  uint16_t bid; ///< Provided buffer id holding the data.
+  uint32_t offset; ///< Offset of the first unconsumed byte.
+  uint32_t len; ///< Number of unconsumed bytes.
+};
+
+struct btcp2p_uring_t {
+  int fd;
+  int socket;
+
+  // Submission queue
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  unsigned* sq_flags;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned to_submit;
+  struct io_uring_sqe* sqes;
+
+  // Completion queue
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // Mapped ring memory
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // Provided receive buffers
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  uint8_t* buffers;
+  uint16_t buf_ring_tail;
+
+  // Received chunks waiting to be consumed, in arrival order.
+  struct btcp2p_uring_chunk_t chunks[BTCP2P_URING_BUFFER_COUNT];
+  unsigned chunk_head;
+  unsigned chunk_count;
+
+  bool recv_armed; ///< Is a multishot receive currently armed?
+  bool eof; ///< Has the remote host closed the connection?
+  int recv_error; ///< Receive errno, or 0.
+
+  unsigned sends_pending; ///< Linked sends awaiting completion.
+  int send_results[BTCP2P_URING_MAX_LINKED_SENDS];
+};
+
+static int btcp2p_uring_setup(unsigned entries, struct io_uring_params* params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int btcp2p_uring_enter(struct btcp2p_uring_t* ring,
+                              unsigned min_complete,
+                              unsigned flags)
+{
+  int result = (int)syscall(
+    __NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0
+  );
+  if (result >= 0) {
+    ring->to_submit -= (unsigned)result < ring->to_submit ? (unsigned)result : ring->to_submit;
+  }
+  return result;
+}
+
+static int btcp2p_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// btcp2p_uring_get_sqe returns the next free submission queue entry, flushing
+// queued submissions to the kernel if the queue is full.
+static struct io_uring_sqe* btcp2p_uring_get_sqe(struct btcp2p_uring_t* ring) {
+  unsigned tail = *ring->sq_tail;
+  while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    if (btcp2p_uring_enter(ring, 0, 0) < 0 && errno != EINTR) {
+      return NULL;
+    }
+  }
+
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+
+  return sqe;
+}
+
+// btcp2p_uring_push_sqe publishes the entry most recently returned by
+// btcp2p_uring_get_sqe.
+static void btcp2p_uring_push_sqe(struct btcp2p_uring_t* ring) {
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+static void btcp2p_uring_recycle_buffer(struct btcp2p_uring_t* ring, uint16_t bid) {
+  struct io_uring_buf* buf =
+    &ring->buf_ring->bufs[ring->buf_ring_tail & (BTCP2P_URING_BUFFER_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * BTCP2P_URING_BUFFER_SIZE);
+  buf->len = BTCP2P_URING_BUFFER_SIZE;
+  buf->bid = bid;
+
+  ring->buf_ring_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+static bool btcp2p_uring_arm_recv(struct btcp2p_uring_t* ring) {
+  struct io_uring_sqe* sqe = btcp2p_uring_get_sqe(ring);
+  if (!sqe) {
+    return false;
+  }
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = ring->socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BTCP2P_URING_BUFFER_GROUP;
+  sqe->user_data = BTCP2P_URING_TAG_RECV;
+  btcp2p_uring_push_sqe(ring);
+
+  ring->recv_armed = true;
+  return true;
+}
+
+static void btcp2p_uring_handle_cqe(struct btcp2p_uring_t* ring,
+                                    struct io_uring_cqe const * const cqe)
+{
+  uint64_t tag = cqe->user_data & ((1 << BTCP2P_URING_TAG_BITS) - 1);
+
+  if (tag == BTCP2P_URING_TAG_NOTIFY) {
+    return;
+  }
+
+  if (tag == BTCP2P_URING_TAG_SEND) {
+    ring->send_results[cqe->user_data >> BTCP2P_URING_TAG_BITS] = cqe->res;
+    ring->sends_pending--;
+    return;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    ring->recv_armed = false;
+  }
+
+  if (cqe->res > 0) {
+    unsigned slot = (ring->chunk_head + ring->chunk_count) % BTCP2P_URING_BUFFER_COUNT;
+    ring->chunks[slot].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    ring->chunks[slot].offset = 0;
+    ring->chunks[slot].len = cqe->res;
+    ring->chunk_count++;
+  } else if (cqe->res == 0) {
+    ring->eof = true;
+  } else if (cqe->res != -ENOBUFS) {
+    // Running out of provided buffers only stops the multishot receive. It is
+    // re-armed once consumed buffers are handed back.
+    ring->recv_error = -cqe->res;
+  }
+}
+
+// btcp2p_uring_reap processes every completion currently in the queue.
+static void btcp2p_uring_reap(struct btcp2p_uring_t* ring) {
+  // Completions that did not fit in the queue are held by the kernel until
+  // the ring is entered to collect them.
+  if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+    btcp2p_uring_enter(ring, 0, IORING_ENTER_GETEVENTS);
+  }
+
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    btcp2p_uring_handle_cqe(ring, &ring->cqes[head & ring->cq_mask]);
+    head++;
+  }
+
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool btcp2p_uring_map(struct btcp2p_uring_t* ring,
+                             struct io_uring_params const * const params)
+{
+  ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = 0;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    return false;
+  }
+
+  if (ring->cq_ring_size) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      return false;
+    }
+  } else {
+    ring->cq_ring = ring->sq_ring;
+  }
+
+  ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    return false;
+  }
+
+  uint8_t* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params->sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params->sq_off.tail);
+  ring->sq_mask = *(unsigned*)(sq + params->sq_off.ring_mask);
+  ring->sq_entries = *(unsigned*)(sq + params->sq_off.ring_entries);
+  ring->sq_array = (unsigned*)(sq + params->sq_off.array);
+  ring->sq_flags = (unsigned*)(sq + params->sq_off.flags);
+
+  uint8_t* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params->cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params->cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + params->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+
+  return true;
+}
+
+static bool btcp2p_uring_register_buffers(struct btcp2p_uring_t* ring) {
+  ring->buf_ring_size = BTCP2P_URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    return false;
+  }
+
+  ring->buffers = malloc((size_t)BTCP2P_URING_BUFFER_COUNT * BTCP2P_URING_BUFFER_SIZE);
+  if (!ring->buffers) {
+    return false;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = BTCP2P_URING_BUFFER_COUNT;
+  reg.bgid = BTCP2P_URING_BUFFER_GROUP;
+
+  if (btcp2p_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return false;
+  }
+
+  for (uint16_t bid = 0; bid < BTCP2P_URING_BUFFER_COUNT; bid++) {
+    btcp2p_uring_recycle_buffer(ring, bid);
+  }
+
+  return true;
+}
+
+struct btcp2p_uring_t* btcp2p_uring_open(int socket) {
+  struct btcp2p_uring_t* ring = calloc(1, sizeof(struct btcp2p_uring_t));
+  if (!ring) {
+    return NULL;
+  }
+  ring->socket = socket;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = BTCP2P_URING_CQ_ENTRIES;
+
+  ring->fd = btcp2p_uring_setup(BTCP2P_URING_ENTRIES, &params);
+  if (ring->fd < 0) {
+    btcp2p_log(BTCP2P_LOG_DEBUG, "io_uring_setup failed: %s\n", strerror(errno));
+    free(ring);
+    return NULL;
+  }
+
+  if (!btcp2p_uring_map(ring, &params) || !btcp2p_uring_register_buffers(ring)) {
+    btcp2p_log(BTCP2P_LOG_DEBUG, "io_uring ring setup failed: %s\n", strerror(errno));
+    btcp2p_uring_close(ring);
+    return NULL;
+  }
+
+  // Kernels without multishot receive reject the request while it is being
+  // submitted, so the failure is visible immediately.
+  if (!btcp2p_uring_arm_recv(ring) || btcp2p_uring_enter(ring, 0, 0) < 0) {
+    btcp2p_uring_close(ring);
+    return NULL;
+  }
+
+  btcp2p_uring_reap(ring);
+  if (ring->recv_error) {
+    btcp2p_log(
+      BTCP2P_LOG_DEBUG,
+      "io_uring multishot receive unsupported: %s\n",
+      strerror(ring->recv_error)
+    );
+    btcp2p_uring_close(ring);
+    return NULL;
+  }
+
+  return ring;
+}
+
+void btcp2p_uring_close(struct btcp2p_uring_t* ring) {
+  // Closing the ring cancels the outstanding multishot receive.
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->buf_ring) {
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  }
+  free(ring->buffers);
+  free(ring);
+}
+
+int btcp2p_uring_fd(struct btcp2p_uring_t* ring) {
+  return ring->fd;
+}
+
+bool btcp2p_uring_has_pending(struct btcp2p_uring_t* ring) {
+  btcp2p_uring_reap(ring);
+
+  if (ring->chunk_count > 0 || ring->eof || ring->recv_error) {
+    return true;
+  }
+
+  // Without an armed receive, data stays queued on the socket itself.
+  if (!ring->recv_armed) {
+    uint8_t byte;
+    ssize_t result = recv(ring->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+
+  return false;
+}
+
+ssize_t btcp2p_uring_recv(struct btcp2p_uring_t* ring,
+                          void* dst,
+                          size_t len)
+{
+  bool submitted = false;
+
+  for (;;) {
+    btcp2p_uring_reap(ring);
+
+    if (ring->chunk_count > 0) {
+      size_t copied = 0;
+      while (copied < len && ring->chunk_count > 0) {
+        struct btcp2p_uring_chunk_t* chunk = &ring->chunks[ring->chunk_head];
+        size_t amount = len - copied < chunk->len ? len - copied : chunk->len;
+
+        if (dst) {
+          memcpy(
+            (uint8_t*)dst + copied,
+            ring->buffers + (size_t)chunk->bid * BTCP2P_URING_BUFFER_SIZE + chunk->offset,
+            amount
+          );
+        }
+        copied += amount;
+        chunk->offset += amount;
+        chunk->len -= amount;
+
+        if (chunk->len == 0) {
+          btcp2p_uring_recycle_buffer(ring, chunk->bid);
+          ring->chunk_head = (ring->chunk_head + 1) % BTCP2P_URING_BUFFER_COUNT;
+          ring->chunk_count--;
+        }
+      }
+      return copied;
+    }
+
+    if (ring->recv_error) {
+      errno = ring->recv_error;
+      return -1;
+    }
+    if (ring->eof) {
+      return 0;
+    }
+
+    if (!ring->recv_armed && !btcp2p_uring_arm_recv(ring)) {
+      return -1;
+    }
+
+    // Give a freshly armed receive one chance to complete inline.
+    if (ring->to_submit == 0 || submitted) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (btcp2p_uring_enter(ring, 0, 0) < 0 && errno != EINTR) {
+      return -1;
+    }
+    submitted = true;
+  }
+}
+
+// btcp2p_uring_send_remainder sends the rest of a buffer with plain system
+// calls after a short send broke a linked chain.
+static int btcp2p_uring_send_remainder(struct btcp2p_uring_t* ring,
+                                       uint8_t const * data,
+                                       size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(ring->socket, data, len, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+      struct pollfd pfd = { .fd = ring->socket, .events = POLLOUT, .revents = 0 };
+      if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+      continue;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int btcp2p_uring_sendv_all(struct btcp2p_uring_t* ring,
+                           struct iovec const * const iov,
+                           int iovcnt)
+{
+  struct msghdr msgs[BTCP2P_URING_MAX_LINKED_SENDS];
+
+  for (int base = 0; base < iovcnt; ) {
+    // Each send covers a group of iovecs, and the groups are linked so they
+    // are written in order by one io_uring_enter call.
+    int count = 0;
+    for (; count < BTCP2P_URING_MAX_LINKED_SENDS && base < iovcnt; count++) {
+      int group = iovcnt - base;
+      if (group > BTCP2P_URING_MAX_SEND_IOV) {
+        group = BTCP2P_URING_MAX_SEND_IOV;
+      }
+
+      memset(&msgs[count], 0, sizeof(struct msghdr));
+      msgs[count].msg_iov = (struct iovec*)&iov[base];
+      msgs[count].msg_iovlen = group;
+      base += group;
+
+      struct io_uring_sqe* sqe = btcp2p_uring_get_sqe(ring);
+      if (!sqe) {
+        return -1;
+      }
+
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = ring->socket;
+      sqe->addr = (uint64_t)(uintptr_t)&msgs[count];
+      sqe->len = 1;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = BTCP2P_URING_TAG_SEND | ((uint64_t)count << BTCP2P_URING_TAG_BITS);
+      btcp2p_uring_push_sqe(ring);
+    }
+
+    // The last send ends the chain.
+    ring->sqes[(*ring->sq_tail - 1) & ring->sq_mask].flags = 0;
+
+    ring->sends_pending = count;
+    while (ring->sends_pending > 0) {
+      if (btcp2p_uring_enter(ring, ring->sends_pending, IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR)
+      {
+        return -1;
+      }
+      btcp2p_uring_reap(ring);
+    }
+
+    // A short send cancels the rest of its chain; finish those with plain
+    // system calls so ordering is preserved.
+    for (int i = 0; i < count; i++) {
+      int result = ring->send_results[i];
+      size_t sent = 0;
+
+      if (result >= 0) {
+        sent = result;
+      } else if (result != -ECANCELED) {
+        errno = -result;
+        return -1;
+      }
+
+      for (size_t k = 0; k < msgs[i].msg_iovlen; k++) {
+        struct iovec const * const part = &msgs[i].msg_iov[k];
+        if (sent >= part->iov_len) {
+          sent -= part->iov_len;
+          continue;
+        }
+
+        if (btcp2p_uring_send_remainder(ring,
+                                        (uint8_t*)part->iov_base + sent,
+                                        part->iov_len - sent) < 0)
+        {
+          return -1;
+        }
+        sent = 0;
+      }
+    }
+  }
+
+  // Receive completions reaped while waiting for the sends were consumed from
+  // the completion queue, so an edge-triggered poller of the ring would never
+  // hear about them. Post a no-op completion to wake it again.
+  if (ring->chunk_count > 0 || ring->eof || ring->recv_error) {
+    struct io_uring_sqe* sqe = btcp2p_uring_get_sqe(ring);
+    if (sqe) {
+      sqe->opcode = IORING_OP_NOP;
+      sqe->user_data = BTCP2P_URING_TAG_NOTIFY;
+      btcp2p_uring_push_sqe(ring);
+      btcp2p_uring_enter(ring, 0, 0);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,53 @@
+// io_uring I/O backend for connections (Linux only).
+//
+// Each connection owns a small ring with a multishot receive armed on its
+// socket. Received data lands in a ring of provided buffers and is consumed
+// from shared memory without a system call per read. Sends are submitted as
+// linked vectored operations and completed with a single io_uring_enter call.
+#ifndef LIBBTCP2P_IO_URING_H
+#define LIBBTCP2P_IO_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Number of provided receive buffers per connection (power of two).
+#define BTCP2P_URING_BUFFER_COUNT 64
+
+// Size in bytes of each provided receive buffer.
+#define BTCP2P_URING_BUFFER_SIZE 4096
+
+struct btcp2p_uring_t;
+
+// btcp2p_uring_open creates a ring for the given socket and arms a multishot
+// receive on it. Returns NULL if the kernel lacks the required support.
+struct btcp2p_uring_t* btcp2p_uring_open(int socket);
+
+// btcp2p_uring_close tears down the ring. It does not close the socket.
+void btcp2p_uring_close(struct btcp2p_uring_t* ring);
+
+// btcp2p_uring_fd returns the ring's file descriptor, which becomes readable
+// when completions are posted.
+int btcp2p_uring_fd(struct btcp2p_uring_t* ring);
+
+// btcp2p_uring_has_pending returns true if received data or an end-of-stream
+// is waiting to be consumed.
+bool btcp2p_uring_has_pending(struct btcp2p_uring_t* ring);
+
+// btcp2p_uring_recv copies up to len received bytes into dst without
+// blocking. If dst is NULL the bytes are discarded instead. Returns the number
+// of bytes consumed, 0 on end-of-stream, or -1 on error with errno set
+// (EAGAIN if nothing has been received yet).
+ssize_t btcp2p_uring_recv(struct btcp2p_uring_t* ring,
+                          void* dst,
+                          size_t len);
+
+// btcp2p_uring_sendv_all sends every byte described by the given iovecs as a
+// chain of linked vectored sends. Returns 0 on success or -1 on error with errno set.
+int btcp2p_uring_sendv_all(struct btcp2p_uring_t* ring,
+                           struct iovec const * const iov,
+                           int iovcnt);
+
+#endif // LIBBTCP2P_IO_URING_H
@@ -4,13 +4,17 @@
 
 #include "libbtcp2p/log.h"
 
-static char* btcp2p_log_timestamp(time_t t) {
-  struct tm* utc_time;
-  static char date[100];
- 
-  utc_time = gmtime(&t);
-  strftime(date, 100, "%Y-%M-%dT%H:%M:%S%z", utc_time);
- 
+// Size of a buffer that holds a formatted log timestamp.
+#define BTCP2P_LOG_TIMESTAMP_SIZE 32
+
+// btcp2p_log_timestamp formats t as an ISO 8601 UTC timestamp into date,
+// which is returned.
+static char const * btcp2p_log_timestamp(time_t t, char date[BTCP2P_LOG_TIMESTAMP_SIZE]) {
+  struct tm utc_time;
+
+  gmtime_r(&t, &utc_time);
+  strftime(date, BTCP2P_LOG_TIMESTAMP_SIZE, "%Y-%m-%dT%H:%M:%S%z", &utc_time);
+
   return date;
 }
 
@@ -33,12 +37,16 @@ void btcp2p_log(enum btcp2p_log_level_t log_level,
 {
   time_t now;
   time(&now);
+  char date[BTCP2P_LOG_TIMESTAMP_SIZE];
 
   va_list args;
   va_start(args, format);
 
-  printf("btcp2p[%s]: %s: ", btcp2p_log_timestamp(now), btcp2p_log_level_str(log_level));
+  // Hold the stream so lines logged from other threads are not interleaved.
+  flockfile(stdout);
+  printf("btcp2p[%s]: %s: ", btcp2p_log_timestamp(now, date), btcp2p_log_level_str(log_level));
   vprintf(format, args);
+  funlockfile(stdout);
 
   va_end(args);
 }
@@ -49,10 +57,13 @@ void btcp2p_log_dump(enum btcp2p_log_level_t log_level,
 {
   time_t now;
   time(&now);
+  char date[BTCP2P_LOG_TIMESTAMP_SIZE];
 
-  printf("btcp2p[%s]: %s: hex dump\n", btcp2p_log_timestamp(now), btcp2p_log_level_str(log_level));
+  flockfile(stdout);
+  printf("btcp2p[%s]: %s: hex dump\n", btcp2p_log_timestamp(now, date), btcp2p_log_level_str(log_level));
   for (size_t i = 0; i < value_size; i++) {
     printf("%02X ", value[i]);
   }
   printf("\n");
+  funlockfile(stdout);
 }
@@ -12,7 +12,8 @@ enum btcp2p_log_level_t {
   BTCP2P_LOG_ERROR
 };
 
-// btcp2p_log logs a message of the given level to stdout.
+// btcp2p_log logs a message of the given level to stdout. It may be called
+// from any thread; each message is written without interleaving.
 void btcp2p_log(enum btcp2p_log_level_t log_level,
                 char const * const restrict format,
                 ...);
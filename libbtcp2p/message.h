@@ -0,0 +1,34 @@
+// Bitcoin P2P message and message header types.
+#ifndef LIBBTCP2P_MESSAGE_H
+#define LIBBTCP2P_MESSAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libbtcp2p/checked_buffer.h"
+#include "libbtcp2p/command.h"
+#include "libbtcp2p/sha256.h"
+
+// Size of a serialized block header, whose double-SHA256 is the block hash.
+#define BTCP2P_BLOCK_HEADER_SIZE 80
+
+// P2P message header
+struct btcp2p_message_header_t {
+  uint32_t magic; ///< Network magic number
+  char command[12]; ///< Command to execute as a string
+  uint32_t length; ///< Length of the payload
+  uint32_t checksum; ///< Checksum of message contents
+};
+
+// P2P message
+struct btcp2p_message_t {
+  struct btcp2p_message_header_t header;
+  enum btcp2p_command_id_t command_id; ///< Interned header.command
+  struct btcp2p_checked_buffer_t payload;
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE]; ///< Double-SHA256 of the payload
+  bool has_digest; ///< Was digest computed for this payload?
+  uint8_t block_hash[BTCP2P_SHA256_DIGEST_SIZE]; ///< Hash of a block message's header
+  bool has_block_hash; ///< Was block_hash computed for this payload?
+};
+
+#endif // LIBBTCP2P_MESSAGE_H
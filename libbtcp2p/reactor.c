@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "libbtcp2p/io.h"
+#include "libbtcp2p/log.h"
+#include "libbtcp2p/reactor.h"
+#include "libbtcp2p/timer.h"
+
+static void btcp2p_reactor_push_ready(struct btcp2p_reactor_t* reactor,
+                                      struct btcp2p_connection_t* connection)
+{
+  if (connection->is_ready) {
+    return;
+  }
+
+  connection->is_ready = true;
+  connection->next_ready = NULL;
+  if (reactor->ready_tail) {
+    reactor->ready_tail->next_ready = connection;
+  } else {
+    reactor->ready_head = connection;
+  }
+  reactor->ready_tail = connection;
+}
+
+// btcp2p_reactor_resume puts a connection that paused for lack of receive
+// budget back on the ready list to try again.
+static void btcp2p_reactor_resume(struct btcp2p_wheel_timer_t* timer, void* ctx)
+{
+  struct btcp2p_connection_t* connection = (struct btcp2p_connection_t*)
+    ((char*)timer - offsetof(struct btcp2p_connection_t, resume_timer));
+  btcp2p_reactor_push_ready(ctx, connection);
+}
+
+static struct btcp2p_connection_t* btcp2p_reactor_pop_ready(struct btcp2p_reactor_t* reactor)
+{
+  struct btcp2p_connection_t* connection = reactor->ready_head;
+  if (!connection) {
+    return NULL;
+  }
+
+  reactor->ready_head = connection->next_ready;
+  if (!reactor->ready_head) {
+    reactor->ready_tail = NULL;
+  }
+  connection->next_ready = NULL;
+  connection->is_ready = false;
+
+  return connection;
+}
+
+bool btcp2p_reactor_create(struct btcp2p_reactor_t* reactor) {
+  memset(reactor, 0, sizeof(struct btcp2p_reactor_t));
+
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor->epoll_fd < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "epoll_create1 failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Wake events carry a pointer to the descriptor itself to set them apart
+  // from connection events.
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = &reactor->wake_fd;
+  btcp2p_timer_wheel_create(&reactor->timers, btcp2p_timer_now_ns());
+
+  reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (reactor->wake_fd < 0 ||
+      epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) < 0)
+  {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to create reactor wake event: %s\n", strerror(errno));
+    if (reactor->wake_fd >= 0) {
+      close(reactor->wake_fd);
+    }
+    close(reactor->epoll_fd);
+    return false;
+  }
+
+  return true;
+}
+
+void btcp2p_reactor_destroy(struct btcp2p_reactor_t* reactor) {
+  close(reactor->wake_fd);
+  reactor->wake_fd = -1;
+  close(reactor->epoll_fd);
+  reactor->epoll_fd = -1;
+  reactor->num_connections = 0;
+
+  while (btcp2p_reactor_pop_ready(reactor) != NULL);
+}
+
+// btcp2p_reactor_watch_verify_pool registers the descriptor through which a
+// verify pool reports finished frames. Its events carry a NULL pointer to set
+// them apart from connection events.
+static bool btcp2p_reactor_watch_verify_pool(struct btcp2p_reactor_t* reactor,
+                                             struct btcp2p_verify_pool_t* pool)
+{
+  if (reactor->verify_pool == pool) {
+    return true;
+  }
+  if (reactor->verify_pool) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "reactor connections must share one verify pool.\n");
+    return false;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, btcp2p_verify_pool_fd(pool), &event) < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "epoll_ctl add failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  reactor->verify_pool = pool;
+  return true;
+}
+
+bool btcp2p_reactor_add(struct btcp2p_reactor_t* reactor,
+                        struct btcp2p_connection_t* connection)
+{
+  if (connection->verify_pool &&
+      !btcp2p_reactor_watch_verify_pool(reactor, connection->verify_pool))
+  {
+    return false;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = connection;
+
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, btcp2p_io_fd(connection), &event) < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "epoll_ctl add failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  // The io_uring backend reports received data through its own descriptor,
+  // so the socket is watched separately for room to flush queued messages.
+  if (btcp2p_io_fd(connection) != connection->socket) {
+    event.events = EPOLLOUT | EPOLLET;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, connection->socket, &event) < 0) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "epoll_ctl add failed: %s\n", strerror(errno));
+      epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, btcp2p_io_fd(connection), NULL);
+      return false;
+    }
+  }
+
+  connection->is_ready = false;
+  connection->next_ready = NULL;
+  reactor->num_connections++;
+  if (connection->verify_pool) {
+    btcp2p_verify_queue_watch(&connection->verify_queue, true);
+  }
+
+  // Data may have arrived before the connection was registered, and with
+  // edge-triggered notifications it would otherwise never be reported.
+  if (btcp2p_has_pending_data(connection)) {
+    btcp2p_reactor_push_ready(reactor, connection);
+  }
+
+  return true;
+}
+
+void btcp2p_reactor_remove(struct btcp2p_reactor_t* reactor,
+                           struct btcp2p_connection_t* connection)
+{
+  btcp2p_timer_wheel_cancel(&reactor->timers, &connection->resume_timer);
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, btcp2p_io_fd(connection), NULL) == 0) {
+    reactor->num_connections--;
+  }
+  if (btcp2p_io_fd(connection) != connection->socket) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->socket, NULL);
+  }
+  if (connection->verify_pool) {
+    btcp2p_verify_queue_watch(&connection->verify_queue, false);
+  }
+
+  if (!connection->is_ready) {
+    return;
+  }
+
+  // Unlink the connection from the ready list.
+  struct btcp2p_connection_t* previous = NULL;
+  for (struct btcp2p_connection_t* next = reactor->ready_head;
+       next != NULL;
+       previous = next, next = next->next_ready)
+  {
+    if (next != connection) continue;
+
+    if (previous) {
+      previous->next_ready = next->next_ready;
+    } else {
+      reactor->ready_head = next->next_ready;
+    }
+    if (reactor->ready_tail == connection) {
+      reactor->ready_tail = previous;
+    }
+    break;
+  }
+
+  connection->is_ready = false;
+  connection->next_ready = NULL;
+}
+
+bool btcp2p_reactor_pump(struct btcp2p_reactor_t* reactor, int timeout_ms) {
+  struct epoll_event events[BTCP2P_REACTOR_MAX_EVENTS];
+
+  if (reactor->ready_head) {
+    timeout_ms = 0;
+  } else if (reactor->timers.count > 0) {
+    // Sleep no longer than the next timer allows.
+    timeout_ms = btcp2p_timer_wheel_timeout_ms(&reactor->timers, btcp2p_timer_now_ns(), timeout_ms);
+  }
+
+  int count = epoll_wait(
+    reactor->epoll_fd,
+    events,
+    BTCP2P_REACTOR_MAX_EVENTS,
+    timeout_ms
+  );
+  if (count < 0) {
+    if (errno != EINTR) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "epoll_wait failed: %s\n", strerror(errno));
+      return false;
+    }
+    count = 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    struct btcp2p_connection_t* connection = events[i].data.ptr;
+
+    if ((void*)connection == &reactor->wake_fd) {
+      uint64_t wakes;
+      ssize_t drained = read(reactor->wake_fd, &wakes, sizeof(wakes));
+      (void)drained;
+      continue;
+    }
+
+    // The verify pool has finished frames for these connections.
+    if (!connection) {
+      for (struct btcp2p_verify_queue_t* queue = btcp2p_verify_pool_take_completed(reactor->verify_pool);
+           queue != NULL;
+           queue = queue->next_completed)
+      {
+        btcp2p_reactor_push_ready(reactor, queue->owner);
+      }
+      continue;
+    }
+
+    if (events[i].events & EPOLLOUT) {
+      connection->is_writable = true;
+
+      // Drain queued messages now that the send buffer has room. A failed
+      // flush is reported through the ready list like a failed receive.
+      if (btcp2p_queued_bytes(connection) > 0 && !btcp2p_flush(connection)) {
+        connection->closed = true;
+        btcp2p_reactor_push_ready(reactor, connection);
+      }
+    }
+
+    // Zero-copy completions are reported through the socket's error queue.
+    if ((events[i].events & EPOLLERR) && connection->zerocopy.enabled) {
+      btcp2p_zerocopy_reap(&connection->zerocopy, connection->socket);
+    }
+
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      btcp2p_reactor_push_ready(reactor, connection);
+    }
+  }
+
+  // Timers fire once socket events have been taken in.
+  if (reactor->timers.count > 0) {
+    btcp2p_timer_wheel_advance(&reactor->timers, btcp2p_timer_now_ns());
+  }
+
+  return true;
+}
+
+void btcp2p_reactor_wake(struct btcp2p_reactor_t* reactor) {
+  uint64_t one = 1;
+  ssize_t written = write(reactor->wake_fd, &one, sizeof(one));
+  (void)written;
+}
+
+struct btcp2p_connection_t* btcp2p_reactor_next(struct btcp2p_reactor_t* reactor) {
+  struct btcp2p_connection_t* connection;
+
+  while ((connection = btcp2p_reactor_pop_ready(reactor)) != NULL) {
+    connection->has_message = false;
+    if (connection->closed) {
+      return connection;
+    }
+
+    switch (btcp2p_try_recv_message(connection)) {
+    case BTCP2P_RECV_FAILED:
+      connection->closed = true;
+      return connection;
+    case BTCP2P_RECV_PARTIAL:
+      // The socket has been drained, so the next edge-triggered event will
+      // report the rest of the message. A paused connection left data on
+      // the socket that will not raise another event, so it is retried on
+      // a timer instead.
+      if (btcp2p_recv_paused(connection)) {
+        btcp2p_timer_wheel_schedule(&reactor->timers,
+                                    &connection->resume_timer,
+                                    btcp2p_timer_now_ns() + BTCP2P_RECV_RETRY_MS * BTCP2P_NS_PER_MS,
+                                    btcp2p_reactor_resume,
+                                    reactor);
+      }
+      continue;
+    default:
+      break;
+    }
+
+    // Edge-triggered events only fire on new data, so anything already queued
+    // in the receive ring or on the socket keeps the connection on the ready
+    // list.
+    if (btcp2p_has_pending_data(connection)) {
+      btcp2p_reactor_push_ready(reactor, connection);
+    }
+
+    btcp2p_dispatch(connection);
+    return connection;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,89 @@
+// Interfaces for servicing many P2P connections from a single thread.
+//
+// A reactor watches every registered connection through one edge-triggered
+// epoll instance. Connections with pending data are placed on a ready list
+// and handed back one message at a time, so the usual btcp2p_has_message and
+// btcp2p_unpack_message calls work unchanged on each returned connection.
+//
+// Connections opened with a verify pool are also put back on the ready list
+// when the pool finishes checking one of their frames. All such connections
+// in a reactor must share the same pool.
+//
+// Per-peer timers, such as ping intervals and stall deadlines, go on the
+// reactor's timer wheel. A pump sleeps no longer than the next timer allows
+// and fires the timers that have come due before it returns, so a loop
+// that only reacts to messages and timers can pump with a timeout of -1.
+//
+// Example:
+//   btcp2p_timer_wheel_schedule(&reactor.timers, &peer->ping_timer,
+//                               btcp2p_timer_now_ns() + 2 * BTCP2P_NS_PER_MINUTE, send_ping, peer);
+//   while (btcp2p_reactor_pump(&reactor, -1)) {
+//     struct btcp2p_connection_t* conn;
+//     while ((conn = btcp2p_reactor_next(&reactor)) != NULL) {
+//       if (conn->closed) { ... }
+//       if (btcp2p_has_message(conn, "ping")) { ... }
+//     }
+//   }
+#ifndef LIBBTCP2P_REACTOR_H
+#define LIBBTCP2P_REACTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "libbtcp2p/connection.h"
+#include "libbtcp2p/timer.h"
+
+// Maximum number of socket events collected by a single pump.
+#define BTCP2P_REACTOR_MAX_EVENTS 256
+
+struct btcp2p_reactor_t {
+  int epoll_fd;
+  int wake_fd; ///< eventfd that interrupts a waiting pump.
+  size_t num_connections; ///< Number of registered connections.
+  struct btcp2p_connection_t* ready_head; ///< Next connection to service.
+  struct btcp2p_connection_t* ready_tail; ///< Last connection to service.
+  struct btcp2p_verify_pool_t* verify_pool; ///< Pool watched for finished frames.
+  struct btcp2p_timer_wheel_t timers; ///< Timers fired by btcp2p_reactor_pump.
+};
+
+// btcp2p_reactor_create initializes a reactor with no registered connections.
+// Returns false if the underlying epoll instance could not be created.
+bool btcp2p_reactor_create(struct btcp2p_reactor_t* reactor);
+
+// btcp2p_reactor_destroy releases the resources held by the reactor. Any
+// registered connections are left open.
+void btcp2p_reactor_destroy(struct btcp2p_reactor_t* reactor);
+
+// btcp2p_reactor_add registers an open connection with the reactor.
+bool btcp2p_reactor_add(struct btcp2p_reactor_t* reactor,
+                        struct btcp2p_connection_t* connection);
+
+// btcp2p_reactor_remove unregisters a connection from the reactor. It must be
+// called before the connection is disconnected.
+void btcp2p_reactor_remove(struct btcp2p_reactor_t* reactor,
+                           struct btcp2p_connection_t* connection);
+
+// btcp2p_reactor_pump waits up to timeout_ms milliseconds, or indefinitely if
+// timeout_ms is negative, for socket activity on any registered connection.
+// The wait ends early at the next timer's deadline, and it does not block if
+// connections are still waiting on the ready list. Connections whose sockets
+// gain room for more data have their queued messages flushed, and timers
+// that have come due are fired. Returns false on an unrecoverable epoll
+// error.
+bool btcp2p_reactor_pump(struct btcp2p_reactor_t* reactor, int timeout_ms);
+
+// btcp2p_reactor_wake makes a pump that is waiting for events on another
+// thread return early. It is the one reactor call that is safe from any
+// thread.
+void btcp2p_reactor_wake(struct btcp2p_reactor_t* reactor);
+
+// btcp2p_reactor_next receives one message from the next ready connection and
+// returns that connection, or NULL once the ready list is empty. Receives
+// never block: connections holding only part of a message are skipped until
+// more data arrives. Connections that still have buffered data are moved to
+// the back of the ready list. Any handler registered with btcp2p_on for the
+// message is called before the connection is returned. If the returned connection has closed set it
+// should be removed and disconnected.
+struct btcp2p_connection_t* btcp2p_reactor_next(struct btcp2p_reactor_t* reactor);
+
+#endif // LIBBTCP2P_REACTOR_H
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libbtcp2p/ring_buffer.h"
+
+void btcp2p_ring_buffer_create(struct btcp2p_ring_buffer_t* rb, size_t capacity) {
+  size_t rounded = 64;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+
+  rb->buffer = malloc(rounded);
+  rb->capacity = rounded;
+  rb->head = 0;
+  rb->tail = 0;
+}
+
+void btcp2p_ring_buffer_destroy(struct btcp2p_ring_buffer_t* rb) {
+  free(rb->buffer);
+  rb->buffer = NULL;
+  rb->capacity = 0;
+  rb->head = 0;
+  rb->tail = 0;
+}
+
+size_t btcp2p_ring_buffer_readable(struct btcp2p_ring_buffer_t const * const rb) {
+  return rb->tail - rb->head;
+}
+
+size_t btcp2p_ring_buffer_writable(struct btcp2p_ring_buffer_t const * const rb) {
+  return rb->capacity - (rb->tail - rb->head);
+}
+
+int btcp2p_ring_buffer_write_iov(struct btcp2p_ring_buffer_t* rb,
+                                 struct iovec iov[2])
+{
+  size_t free_bytes = btcp2p_ring_buffer_writable(rb);
+  if (free_bytes == 0) {
+    return 0;
+  }
+
+  size_t offset = rb->tail & (rb->capacity - 1);
+  size_t first = rb->capacity - offset;
+  if (first > free_bytes) {
+    first = free_bytes;
+  }
+
+  iov[0].iov_base = rb->buffer + offset;
+  iov[0].iov_len = first;
+  if (first == free_bytes) {
+    return 1;
+  }
+
+  iov[1].iov_base = rb->buffer;
+  iov[1].iov_len = free_bytes - first;
+  return 2;
+}
+
+void btcp2p_ring_buffer_commit(struct btcp2p_ring_buffer_t* rb, size_t amount) {
+  rb->tail += amount;
+}
+
+size_t btcp2p_ring_buffer_read(struct btcp2p_ring_buffer_t* rb,
+                               uint8_t * const dst,
+                               size_t len)
+{
+  size_t readable = btcp2p_ring_buffer_readable(rb);
+  if (len > readable) {
+    len = readable;
+  }
+
+  size_t offset = rb->head & (rb->capacity - 1);
+  size_t first = rb->capacity - offset;
+  if (first > len) {
+    first = len;
+  }
+
+  memcpy(dst, rb->buffer + offset, first);
+  memcpy(dst + first, rb->buffer, len - first);
+  btcp2p_ring_buffer_consume(rb, len);
+
+  return len;
+}
+
+uint8_t* btcp2p_ring_buffer_peek(struct btcp2p_ring_buffer_t* rb, size_t len) {
+  if (len > btcp2p_ring_buffer_readable(rb)) {
+    return NULL;
+  }
+
+  size_t offset = rb->head & (rb->capacity - 1);
+  if (offset + len > rb->capacity) {
+    return NULL;
+  }
+
+  return rb->buffer + offset;
+}
+
+void btcp2p_ring_buffer_consume(struct btcp2p_ring_buffer_t* rb, size_t len) {
+  size_t readable = btcp2p_ring_buffer_readable(rb);
+  rb->head += len < readable ? len : readable;
+
+  // Restart an empty ring at the beginning of the buffer so the next receive
+  // is as contiguous as possible.
+  if (rb->head == rb->tail) {
+    rb->head = 0;
+    rb->tail = 0;
+  }
+}
@@ -0,0 +1,59 @@
+// Implements a fixed-capacity byte ring used to batch socket receives.
+//
+// Free space is exposed as at most two iovecs so that a single readv call can
+// fill the ring even when it wraps. Readable data can be copied out or, when
+// it does not wrap, referenced in place.
+#ifndef LIBBTCP2P_RING_BUFFER_H
+#define LIBBTCP2P_RING_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+struct btcp2p_ring_buffer_t {
+  uint8_t* buffer;
+  size_t capacity; ///< Total bytes allocated, always a power of two.
+  size_t head; ///< Total bytes ever consumed from the ring.
+  size_t tail; ///< Total bytes ever written into the ring.
+};
+
+// btcp2p_ring_buffer_create allocates an empty ring. The capacity is rounded
+// up to a power of two.
+void btcp2p_ring_buffer_create(struct btcp2p_ring_buffer_t* rb, size_t capacity);
+
+// btcp2p_ring_buffer_destroy frees resources allocated for the ring.
+void btcp2p_ring_buffer_destroy(struct btcp2p_ring_buffer_t* rb);
+
+// btcp2p_ring_buffer_readable returns the number of bytes waiting to be read.
+size_t btcp2p_ring_buffer_readable(struct btcp2p_ring_buffer_t const * const rb);
+
+// btcp2p_ring_buffer_writable returns the number of free bytes in the ring.
+size_t btcp2p_ring_buffer_writable(struct btcp2p_ring_buffer_t const * const rb);
+
+// btcp2p_ring_buffer_write_iov describes the free space in the ring with up to
+// two iovecs and returns how many were filled in. Data written there becomes
+// readable once btcp2p_ring_buffer_commit is called.
+int btcp2p_ring_buffer_write_iov(struct btcp2p_ring_buffer_t* rb,
+                                 struct iovec iov[2]);
+
+// btcp2p_ring_buffer_commit marks amount bytes of free space as written.
+void btcp2p_ring_buffer_commit(struct btcp2p_ring_buffer_t* rb, size_t amount);
+
+// btcp2p_ring_buffer_read copies up to len bytes out of the ring and consumes
+// them. Returns the number of bytes copied.
+size_t btcp2p_ring_buffer_read(struct btcp2p_ring_buffer_t* rb,
+                               uint8_t * const dst,
+                               size_t len);
+
+// btcp2p_ring_buffer_peek returns a pointer to the next len readable bytes if
+// they are all available and contiguous in memory, or NULL otherwise. The
+// bytes are not consumed.
+uint8_t* btcp2p_ring_buffer_peek(struct btcp2p_ring_buffer_t* rb, size_t len);
+
+// btcp2p_ring_buffer_consume discards up to len readable bytes. Pointers
+// returned by btcp2p_ring_buffer_peek remain valid until the space is
+// written again.
+void btcp2p_ring_buffer_consume(struct btcp2p_ring_buffer_t* rb, size_t len);
+
+#endif // LIBBTCP2P_RING_BUFFER_H
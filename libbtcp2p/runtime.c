@@ -0,0 +1,392 @@
+// Needed for pthread_setaffinity_np and the CPU_* macros.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbtcp2p/log.h"
+#include "libbtcp2p/runtime.h"
+
+// Shared state of a task broadcast to every shard.
+struct btcp2p_broadcast_t {
+  btcp2p_shard_task_t task;
+  void* arg;
+  btcp2p_shard_release_t release;
+  atomic_size_t remaining; ///< Shards that have not run the task yet.
+};
+
+// Marks the inbox of a stopped shard. Posting fails once an inbox holds it.
+static struct btcp2p_shard_task_entry_t btcp2p_shard_inbox_closed;
+#define BTCP2P_SHARD_INBOX_CLOSED (&btcp2p_shard_inbox_closed)
+
+static uint64_t btcp2p_runtime_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// btcp2p_broadcast_release drops one shard's reference to a broadcast,
+// releasing it once every shard is done with it.
+static void btcp2p_broadcast_release(struct btcp2p_broadcast_t* broadcast) {
+  if (atomic_fetch_sub_explicit(&broadcast->remaining, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  if (broadcast->release) {
+    broadcast->release(broadcast->arg);
+  }
+  free(broadcast);
+}
+
+static void btcp2p_broadcast_run(struct btcp2p_shard_t* shard, void* arg) {
+  struct btcp2p_broadcast_t* broadcast = arg;
+  broadcast->task(shard, broadcast->arg);
+  btcp2p_broadcast_release(broadcast);
+}
+
+// btcp2p_shard_run_inbox runs every task posted to the shard so far and
+// leaves the inbox holding empty, which is NULL or BTCP2P_SHARD_INBOX_CLOSED.
+// Posting pushes onto the front of the inbox, so the tasks taken are reversed
+// to run them in the order they were posted.
+static void btcp2p_shard_run_inbox(struct btcp2p_shard_t* shard,
+                                   struct btcp2p_shard_task_entry_t* empty)
+{
+  struct btcp2p_shard_task_entry_t* entry = atomic_exchange(&shard->inbox, empty);
+
+  struct btcp2p_shard_task_entry_t* ordered = NULL;
+  while (entry) {
+    struct btcp2p_shard_task_entry_t* next = entry->next;
+    entry->next = ordered;
+    ordered = entry;
+    entry = next;
+  }
+
+  while (ordered) {
+    struct btcp2p_shard_task_entry_t* next = ordered->next;
+    atomic_fetch_add_explicit(&shard->tasks, 1, memory_order_relaxed);
+    ordered->task(shard, ordered->arg);
+    free(ordered);
+    ordered = next;
+  }
+}
+
+// btcp2p_shard_adopt registers a newly assigned connection with the shard's
+// reactor. Runs on the shard's thread.
+static void btcp2p_shard_adopt(struct btcp2p_shard_t* shard, void* arg) {
+  struct btcp2p_connection_t* connection = arg;
+  struct btcp2p_runtime_config_t const * config = &shard->runtime->config;
+
+  if (shard->num_connections == shard->connections_capacity) {
+    size_t capacity = shard->connections_capacity ? 2 * shard->connections_capacity : 16;
+    struct btcp2p_connection_t** connections =
+      realloc(shard->connections, capacity * sizeof(*connections));
+    if (!connections) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "unable to grow shard %zu connections.\n", shard->index);
+      goto failed;
+    }
+    shard->connections = connections;
+    shard->connections_capacity = capacity;
+  }
+
+  if (!btcp2p_reactor_add(&shard->reactor, connection)) {
+    goto failed;
+  }
+
+  shard->connections[shard->num_connections++] = connection;
+  return;
+
+failed:
+  atomic_fetch_sub_explicit(&shard->assigned, 1, memory_order_relaxed);
+  connection->closed = true;
+  if (config->on_close) {
+    config->on_close(shard, connection, config->ctx);
+  }
+}
+
+// btcp2p_shard_release removes a connection from the shard and hands it back
+// through on_close.
+static void btcp2p_shard_release(struct btcp2p_shard_t* shard,
+                                 struct btcp2p_connection_t* connection)
+{
+  struct btcp2p_runtime_config_t const * config = &shard->runtime->config;
+
+  btcp2p_reactor_remove(&shard->reactor, connection);
+  for (size_t i = 0; i < shard->num_connections; i++) {
+    if (shard->connections[i] == connection) {
+      shard->connections[i] = shard->connections[--shard->num_connections];
+      break;
+    }
+  }
+  atomic_fetch_sub_explicit(&shard->assigned, 1, memory_order_relaxed);
+
+  if (config->on_close) {
+    config->on_close(shard, connection, config->ctx);
+  }
+}
+
+static void* btcp2p_shard_main(void* arg) {
+  struct btcp2p_shard_t* shard = arg;
+  struct btcp2p_runtime_t* runtime = shard->runtime;
+  struct btcp2p_runtime_config_t const * config = &runtime->config;
+
+  while (atomic_load_explicit(&runtime->running, memory_order_acquire)) {
+    uint64_t start = btcp2p_runtime_now_ns();
+    btcp2p_shard_run_inbox(shard, NULL);
+
+    uint64_t wait_start = btcp2p_runtime_now_ns();
+    if (!btcp2p_reactor_pump(&shard->reactor, config->poll_timeout_ms)) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "shard %zu stopped: reactor failed.\n", shard->index);
+      break;
+    }
+    uint64_t wait_end = btcp2p_runtime_now_ns();
+
+    struct btcp2p_connection_t* connection;
+    while ((connection = btcp2p_reactor_next(&shard->reactor)) != NULL) {
+      if (connection->closed) {
+        btcp2p_shard_release(shard, connection);
+        continue;
+      }
+
+      atomic_fetch_add_explicit(&shard->messages, 1, memory_order_relaxed);
+      if (config->on_message) {
+        config->on_message(shard, connection, config->ctx);
+      }
+    }
+
+    uint64_t end = btcp2p_runtime_now_ns();
+    atomic_fetch_add_explicit(&shard->busy_ns,
+                              (wait_start - start) + (end - wait_end),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->loops, 1, memory_order_relaxed);
+  }
+
+  return NULL;
+}
+
+// btcp2p_shard_pin restricts a shard's thread to a single CPU.
+static void btcp2p_shard_pin(struct btcp2p_shard_t* shard) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(shard->index % (size_t)cpus, &set);
+
+  int error = pthread_setaffinity_np(shard->thread, sizeof(set), &set);
+  if (error != 0) {
+    btcp2p_log(BTCP2P_LOG_INFO, "unable to pin shard %zu: %s\n", shard->index, strerror(error));
+  }
+}
+
+bool btcp2p_runtime_start(struct btcp2p_runtime_t* runtime,
+                          struct btcp2p_runtime_config_t const * const config)
+{
+  memset(runtime, 0, sizeof(struct btcp2p_runtime_t));
+  runtime->config = *config;
+
+  if (runtime->config.num_shards == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    runtime->config.num_shards = cpus > 0 ? (size_t)cpus : 1;
+  }
+  if (runtime->config.num_shards > BTCP2P_RUNTIME_MAX_SHARDS) {
+    runtime->config.num_shards = BTCP2P_RUNTIME_MAX_SHARDS;
+  }
+  if (runtime->config.poll_timeout_ms <= 0) {
+    runtime->config.poll_timeout_ms = BTCP2P_RUNTIME_POLL_TIMEOUT_MS;
+  }
+
+  atomic_store(&runtime->running, true);
+
+  for (size_t i = 0; i < runtime->config.num_shards; i++) {
+    struct btcp2p_shard_t* shard = &runtime->shards[i];
+    shard->runtime = runtime;
+    shard->index = i;
+
+    if (!btcp2p_reactor_create(&shard->reactor)) {
+      btcp2p_runtime_stop(runtime);
+      return false;
+    }
+
+    int error = pthread_create(&shard->thread, NULL, btcp2p_shard_main, shard);
+    if (error != 0) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "unable to start shard %zu: %s\n", i, strerror(error));
+      btcp2p_reactor_destroy(&shard->reactor);
+      btcp2p_runtime_stop(runtime);
+      return false;
+    }
+    runtime->num_shards++;
+
+    if (runtime->config.pin_threads) {
+      btcp2p_shard_pin(shard);
+    }
+  }
+
+  return true;
+}
+
+void btcp2p_runtime_stop(struct btcp2p_runtime_t* runtime) {
+  atomic_store(&runtime->running, false);
+
+  for (size_t i = 0; i < runtime->num_shards; i++) {
+    btcp2p_reactor_wake(&runtime->shards[i].reactor);
+  }
+  for (size_t i = 0; i < runtime->num_shards; i++) {
+    pthread_join(runtime->shards[i].thread, NULL);
+  }
+
+  // The shard threads are gone, so their remaining work is finished here.
+  // Closing the inbox makes later posts fail, and posts already under way
+  // are waited for, since they still wake the reactor.
+  for (size_t i = 0; i < runtime->num_shards; i++) {
+    struct btcp2p_shard_t* shard = &runtime->shards[i];
+
+    btcp2p_shard_run_inbox(shard, BTCP2P_SHARD_INBOX_CLOSED);
+    while (atomic_load(&shard->posting) > 0) {
+      sched_yield();
+    }
+    while (shard->num_connections > 0) {
+      btcp2p_shard_release(shard, shard->connections[shard->num_connections - 1]);
+    }
+
+    btcp2p_reactor_destroy(&shard->reactor);
+    free(shard->connections);
+    shard->connections = NULL;
+    shard->connections_capacity = 0;
+  }
+
+  runtime->num_shards = 0;
+}
+
+// btcp2p_runtime_pick_shard chooses the shard for a new connection.
+static size_t btcp2p_runtime_pick_shard(struct btcp2p_runtime_t* runtime) {
+  if (runtime->config.policy == BTCP2P_SHARD_LEAST_LOADED) {
+    size_t best = 0;
+    size_t best_load = SIZE_MAX;
+    for (size_t i = 0; i < runtime->num_shards; i++) {
+      size_t load = atomic_load_explicit(&runtime->shards[i].assigned, memory_order_relaxed);
+      if (load < best_load) {
+        best = i;
+        best_load = load;
+      }
+    }
+    return best;
+  }
+
+  return atomic_fetch_add_explicit(&runtime->next_shard, 1, memory_order_relaxed) % runtime->num_shards;
+}
+
+int btcp2p_runtime_add(struct btcp2p_runtime_t* runtime,
+                       struct btcp2p_connection_t* connection)
+{
+  if (runtime->num_shards == 0) {
+    return -1;
+  }
+
+  size_t index = btcp2p_runtime_pick_shard(runtime);
+  struct btcp2p_shard_t* shard = &runtime->shards[index];
+
+  atomic_fetch_add_explicit(&shard->assigned, 1, memory_order_relaxed);
+  if (!btcp2p_runtime_post(runtime, index, btcp2p_shard_adopt, connection)) {
+    atomic_fetch_sub_explicit(&shard->assigned, 1, memory_order_relaxed);
+    return -1;
+  }
+
+  return (int)index;
+}
+
+bool btcp2p_runtime_post(struct btcp2p_runtime_t* runtime,
+                         size_t shard,
+                         btcp2p_shard_task_t task,
+                         void* arg)
+{
+  if (shard >= runtime->num_shards) {
+    return false;
+  }
+
+  struct btcp2p_shard_task_entry_t* entry = malloc(sizeof(struct btcp2p_shard_task_entry_t));
+  if (!entry) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to allocate shard task.\n");
+    return false;
+  }
+  entry->task = task;
+  entry->arg = arg;
+
+  // Stop waits for posting to drop to zero before destroying the reactor
+  // woken below. It closes the inbox first, so a post it does not wait for
+  // finds the inbox closed.
+  struct btcp2p_shard_t* target = &runtime->shards[shard];
+  atomic_fetch_add(&target->posting, 1);
+  entry->next = atomic_load_explicit(&target->inbox, memory_order_relaxed);
+  do {
+    if (entry->next == BTCP2P_SHARD_INBOX_CLOSED) {
+      atomic_fetch_sub(&target->posting, 1);
+      free(entry);
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak(&target->inbox, &entry->next, entry));
+
+  btcp2p_reactor_wake(&target->reactor);
+  atomic_fetch_sub(&target->posting, 1);
+  return true;
+}
+
+bool btcp2p_runtime_broadcast(struct btcp2p_runtime_t* runtime,
+                              btcp2p_shard_task_t task,
+                              void* arg,
+                              btcp2p_shard_release_t release)
+{
+  if (runtime->num_shards == 0) {
+    return false;
+  }
+
+  struct btcp2p_broadcast_t* broadcast = malloc(sizeof(struct btcp2p_broadcast_t));
+  if (!broadcast) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to allocate broadcast.\n");
+    return false;
+  }
+  broadcast->task = task;
+  broadcast->arg = arg;
+  broadcast->release = release;
+  atomic_init(&broadcast->remaining, runtime->num_shards);
+
+  bool posted = true;
+  for (size_t i = 0; i < runtime->num_shards; i++) {
+    if (!btcp2p_runtime_post(runtime, i, btcp2p_broadcast_run, broadcast)) {
+      // Account for the shard that will never run it.
+      btcp2p_broadcast_release(broadcast);
+      posted = false;
+    }
+  }
+
+  return posted;
+}
+
+void btcp2p_runtime_stats(struct btcp2p_runtime_t* runtime,
+                          size_t shard,
+                          struct btcp2p_shard_stats_t* stats)
+{
+  memset(stats, 0, sizeof(struct btcp2p_shard_stats_t));
+  if (shard >= runtime->num_shards) {
+    return;
+  }
+
+  struct btcp2p_shard_t* s = &runtime->shards[shard];
+  stats->connections = atomic_load_explicit(&s->assigned, memory_order_relaxed);
+  stats->messages = atomic_load_explicit(&s->messages, memory_order_relaxed);
+  stats->tasks = atomic_load_explicit(&s->tasks, memory_order_relaxed);
+  stats->loops = atomic_load_explicit(&s->loops, memory_order_relaxed);
+  stats->busy_ns = atomic_load_explicit(&s->busy_ns, memory_order_relaxed);
+}
+
+struct btcp2p_connection_t* const * btcp2p_shard_connections(struct btcp2p_shard_t const * const shard,
+                                                             size_t* count)
+{
+  *count = shard->num_connections;
+  return shard->connections;
+}
@@ -0,0 +1,165 @@
+// Runs connections across several event-loop threads (Linux).
+//
+// A runtime starts one shard per thread, each with its own reactor.
+// Connections are assigned to a shard when added and stay there until they
+// close. All of a connection's state is therefore only touched by its shard's
+// thread and needs no locks, in line with docs/threading.md.
+//
+// Work for another shard, such as relaying an inv to peers everywhere, is
+// posted to that shard's inbox. Inboxes are lock-free queues that the
+// shard drains at the top of every loop iteration. Tasks therefore run on the
+// shard's own thread, where they may use its connections freely.
+//
+// Example:
+//   static void relay_inv(struct btcp2p_shard_t* shard, void* arg) {
+//     size_t count;
+//     struct btcp2p_connection_t* const * conns = btcp2p_shard_connections(shard, &count);
+//     for (size_t i = 0; i < count; i++) { btcp2p_queue_message(conns[i], "inv", ...); }
+//   }
+//
+//   struct btcp2p_runtime_config_t config = { .num_shards = 4, .on_close = closed };
+//   btcp2p_runtime_start(&runtime, &config);
+//   btcp2p_runtime_add(&runtime, &connection);
+//   btcp2p_runtime_broadcast(&runtime, relay_inv, inv, free);
+#ifndef LIBBTCP2P_RUNTIME_H
+#define LIBBTCP2P_RUNTIME_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbtcp2p/connection.h"
+#include "libbtcp2p/reactor.h"
+
+// Maximum number of shards in a runtime.
+#define BTCP2P_RUNTIME_MAX_SHARDS 64
+
+// Default time a shard waits for events. Posted tasks and stopping wake a
+// shard, and its reactor's timers bound the wait, so by default it waits
+// indefinitely.
+#define BTCP2P_RUNTIME_POLL_TIMEOUT_MS -1
+
+// Policies for choosing the shard of a new connection
+enum btcp2p_shard_policy_t {
+  BTCP2P_SHARD_ROUND_ROBIN, ///< Cycle through the shards in turn.
+  BTCP2P_SHARD_LEAST_LOADED ///< Pick the shard with the fewest connections.
+};
+
+struct btcp2p_shard_t;
+
+// Task run on a shard's thread with the argument it was posted with.
+typedef void (*btcp2p_shard_task_t)(struct btcp2p_shard_t* shard, void* arg);
+
+// Callback run on a shard's thread for one of its connections.
+typedef void (*btcp2p_shard_connection_cb_t)(struct btcp2p_shard_t* shard,
+                                             struct btcp2p_connection_t* connection,
+                                             void* ctx);
+
+// Releases the argument of a broadcast once every shard has run it.
+typedef void (*btcp2p_shard_release_t)(void* arg);
+
+// Runtime settings
+struct btcp2p_runtime_config_t {
+  size_t num_shards; ///< Number of shards, or 0 for one per online CPU.
+  bool pin_threads; ///< Pin shard i to CPU i modulo the number of CPUs?
+  enum btcp2p_shard_policy_t policy; ///< How new connections are placed.
+  int poll_timeout_ms; ///< Longest wait for events, or 0 for the default.
+  btcp2p_shard_connection_cb_t on_message; ///< Called after handlers for each message.
+  btcp2p_shard_connection_cb_t on_close; ///< Called once a connection leaves its shard.
+  void* ctx; ///< Passed to on_message and on_close.
+};
+
+// Snapshot of a shard's load
+struct btcp2p_shard_stats_t {
+  size_t connections; ///< Connections assigned to the shard.
+  uint64_t messages; ///< Messages received.
+  uint64_t tasks; ///< Inbox tasks run.
+  uint64_t loops; ///< Event loop iterations.
+  uint64_t busy_ns; ///< Time spent outside waiting for events.
+};
+
+// Entry in a shard's inbox.
+struct btcp2p_shard_task_entry_t {
+  btcp2p_shard_task_t task;
+  void* arg;
+  struct btcp2p_shard_task_entry_t* next;
+};
+
+struct btcp2p_runtime_t;
+
+struct btcp2p_shard_t {
+  struct btcp2p_runtime_t* runtime;
+  size_t index; ///< Position of the shard in the runtime.
+  pthread_t thread;
+  struct btcp2p_reactor_t reactor; ///< Services the shard's connections.
+  _Atomic(struct btcp2p_shard_task_entry_t*) inbox; ///< Posted tasks, newest first, or closed once stopped.
+  atomic_size_t posting; ///< Posts under way, which stop waits for.
+  struct btcp2p_connection_t** connections; ///< Connections owned by the shard.
+  size_t num_connections; ///< Number of entries in connections.
+  size_t connections_capacity; ///< Number of entries allocated in connections.
+  atomic_size_t assigned; ///< Connections assigned, including ones not yet adopted.
+  atomic_uint_fast64_t messages;
+  atomic_uint_fast64_t tasks;
+  atomic_uint_fast64_t loops;
+  atomic_uint_fast64_t busy_ns;
+};
+
+struct btcp2p_runtime_t {
+  struct btcp2p_runtime_config_t config;
+  struct btcp2p_shard_t shards[BTCP2P_RUNTIME_MAX_SHARDS];
+  size_t num_shards;
+  atomic_size_t next_shard; ///< Next shard for round-robin placement.
+  atomic_bool running;
+};
+
+// btcp2p_runtime_start starts the shards described by config. Returns false
+// if a shard could not be started, in which case none are left running.
+bool btcp2p_runtime_start(struct btcp2p_runtime_t* runtime,
+                          struct btcp2p_runtime_config_t const * const config);
+
+// btcp2p_runtime_stop stops and joins every shard. Connections still on a
+// shard are removed from it and passed to on_close. Tasks that were posted
+// but not run yet are run on the calling thread before that. Posting may
+// overlap stop: each post either has its task run or returns false.
+void btcp2p_runtime_stop(struct btcp2p_runtime_t* runtime);
+
+// btcp2p_runtime_add hands an open connection to a shard chosen by the
+// runtime's policy and returns the shard's index, or -1 on failure, in which
+// case the connection stays with the caller. Otherwise the connection must
+// from then on only be touched from tasks run on that shard, until on_close
+// has been called for it.
+int btcp2p_runtime_add(struct btcp2p_runtime_t* runtime,
+                       struct btcp2p_connection_t* connection);
+
+// btcp2p_runtime_post queues a task to run on the given shard's thread.
+// Tasks posted from one thread run in the order they were posted. Safe to
+// call from any thread. Returns false if the task could not be queued,
+// as happens once the runtime is stopping.
+bool btcp2p_runtime_post(struct btcp2p_runtime_t* runtime,
+                         size_t shard,
+                         btcp2p_shard_task_t task,
+                         void* arg);
+
+// btcp2p_runtime_broadcast queues a task to run on every shard. Once the
+// last shard has run it, release is called with arg on that shard's thread,
+// unless release is NULL. Safe to call from any thread.
+bool btcp2p_runtime_broadcast(struct btcp2p_runtime_t* runtime,
+                              btcp2p_shard_task_t task,
+                              void* arg,
+                              btcp2p_shard_release_t release);
+
+// btcp2p_runtime_stats fills in a snapshot of a shard's load. Safe to call
+// from any thread.
+void btcp2p_runtime_stats(struct btcp2p_runtime_t* runtime,
+                          size_t shard,
+                          struct btcp2p_shard_stats_t* stats);
+
+// btcp2p_shard_connections returns the connections owned by the shard and
+// stores their number in count. Only valid on the shard's own thread, until
+// the shard next services its connections.
+struct btcp2p_connection_t* const * btcp2p_shard_connections(struct btcp2p_shard_t const * const shard,
+                                                             size_t* count);
+
+#endif // LIBBTCP2P_RUNTIME_H
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "libbtcp2p/send_queue.h"
+
+// Initial number of message boundaries tracked by a queue.
+#define BTCP2P_SEND_QUEUE_INITIAL_FRAMES 64
+
+void btcp2p_send_queue_create(struct btcp2p_send_queue_t* queue, size_t max_bytes) {
+  memset(queue, 0, sizeof(struct btcp2p_send_queue_t));
+  btcp2p_checked_buffer_create(&queue->bytes);
+  queue->frame_capacity = BTCP2P_SEND_QUEUE_INITIAL_FRAMES;
+  queue->frame_ends = malloc(queue->frame_capacity * sizeof(uint64_t));
+  queue->max_bytes = max_bytes;
+}
+
+void btcp2p_send_queue_destroy(struct btcp2p_send_queue_t* queue) {
+  btcp2p_checked_buffer_destroy(&queue->bytes);
+  free(queue->frame_ends);
+  queue->frame_ends = NULL;
+  queue->frame_capacity = 0;
+  queue->frame_count = 0;
+}
+
+// btcp2p_send_queue_compact moves unsent bytes and message boundaries to the
+// front of their buffers.
+static void btcp2p_send_queue_compact(struct btcp2p_send_queue_t* queue) {
+  size_t end = btcp2p_checked_buffer_amount_written(&queue->bytes);
+
+  if (queue->sent > 0) {
+    memmove(queue->bytes.buffer, queue->bytes.buffer + queue->sent, end - queue->sent);
+    queue->bytes.rw_cursor = end - queue->sent;
+    queue->base += queue->sent;
+    queue->sent = 0;
+  }
+
+  if (queue->frame_head > 0) {
+    memmove(queue->frame_ends,
+            queue->frame_ends + queue->frame_head,
+            queue->frame_count * sizeof(uint64_t));
+    queue->frame_head = 0;
+  }
+}
+
+bool btcp2p_send_queue_push(struct btcp2p_send_queue_t* queue,
+                            struct btcp2p_message_t const * const message)
+{
+  size_t size = sizeof(message->header) + message->header.length;
+  if (btcp2p_send_queue_pending_bytes(queue) + size > queue->max_bytes) {
+    return false;
+  }
+
+  // Reclaim written space before growing the buffers.
+  if (queue->sent > 0 &&
+      btcp2p_checked_buffer_amount_written(&queue->bytes) + size > queue->bytes.capacity)
+  {
+    btcp2p_send_queue_compact(queue);
+  }
+  if (queue->frame_head + queue->frame_count == queue->frame_capacity) {
+    btcp2p_send_queue_compact(queue);
+    if (queue->frame_count == queue->frame_capacity) {
+      size_t capacity = queue->frame_capacity > 0
+        ? queue->frame_capacity * 2
+        : BTCP2P_SEND_QUEUE_INITIAL_FRAMES;
+      uint64_t* frame_ends = realloc(queue->frame_ends, capacity * sizeof(uint64_t));
+      if (!frame_ends) {
+        return false;
+      }
+      queue->frame_ends = frame_ends;
+      queue->frame_capacity = capacity;
+    }
+  }
+
+  // Grow geometrically so that many small pushes do not each reallocate.
+  size_t end = btcp2p_checked_buffer_amount_written(&queue->bytes);
+  size_t needed = end + size;
+  if (needed > queue->bytes.capacity) {
+    size_t capacity = queue->bytes.capacity * 2;
+    if (!btcp2p_checked_buffer_resize(&queue->bytes, capacity > needed ? capacity : needed)) {
+      return false;
+    }
+  }
+
+  if (!btcp2p_checked_buffer_write(&queue->bytes,
+                                   (uint8_t const*)&message->header,
+                                   sizeof(message->header)) ||
+      (message->header.length > 0 &&
+       !btcp2p_checked_buffer_write(&queue->bytes,
+                                    message->payload.buffer,
+                                    message->header.length)))
+  {
+    // Drop whatever part of the message was written.
+    queue->bytes.rw_cursor = end;
+    return false;
+  }
+
+  queue->frame_ends[queue->frame_head + queue->frame_count] =
+    queue->base + btcp2p_checked_buffer_amount_written(&queue->bytes);
+  queue->frame_count++;
+
+  return true;
+}
+
+uint8_t* btcp2p_send_queue_peek(struct btcp2p_send_queue_t* queue, size_t* len) {
+  *len = btcp2p_send_queue_pending_bytes(queue);
+  return queue->bytes.buffer + queue->sent;
+}
+
+void btcp2p_send_queue_advance(struct btcp2p_send_queue_t* queue, size_t amount) {
+  queue->sent += amount;
+
+  uint64_t position = queue->base + queue->sent;
+  while (queue->frame_count > 0 && queue->frame_ends[queue->frame_head] <= position) {
+    queue->frame_head++;
+    queue->frame_count--;
+  }
+
+  // Everything has been written, so start again from the front.
+  if (queue->sent == btcp2p_checked_buffer_amount_written(&queue->bytes)) {
+    queue->base += queue->sent;
+    queue->sent = 0;
+    queue->frame_head = 0;
+    btcp2p_checked_buffer_prepare_write(&queue->bytes);
+  }
+}
+
+size_t btcp2p_send_queue_depth(struct btcp2p_send_queue_t const * const queue) {
+  return queue->frame_count;
+}
+
+size_t btcp2p_send_queue_pending_bytes(struct btcp2p_send_queue_t const * const queue) {
+  return queue->bytes.rw_cursor - queue->sent;
+}
@@ -0,0 +1,61 @@
+// Implements a bounded queue of serialized outbound messages.
+//
+// Messages are appended back to back into one buffer so that many small
+// messages can be written to the socket with a single system call. The queue
+// tracks how many messages and bytes are still waiting to be written so that
+// callers can apply backpressure.
+#ifndef LIBBTCP2P_SEND_QUEUE_H
+#define LIBBTCP2P_SEND_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbtcp2p/checked_buffer.h"
+#include "libbtcp2p/message.h"
+
+// Default maximum number of bytes waiting in a send queue.
+#define BTCP2P_SEND_QUEUE_MAX_BYTES (8 * 1024 * 1024)
+
+// Largest piece of a send queue written by a single system call.
+#define BTCP2P_SEND_QUEUE_MAX_WRITE (256 * 1024)
+
+struct btcp2p_send_queue_t {
+  struct btcp2p_checked_buffer_t bytes; ///< Serialized messages to be sent.
+  size_t sent; ///< Bytes at the front of the buffer already written.
+  uint64_t base; ///< Stream offset of the first byte in the buffer.
+  uint64_t* frame_ends; ///< Stream offset just past each queued message.
+  size_t frame_head; ///< Index of the oldest queued message.
+  size_t frame_count; ///< Number of queued messages.
+  size_t frame_capacity; ///< Number of entries allocated in frame_ends.
+  size_t max_bytes; ///< Queued bytes beyond which pushes are refused.
+};
+
+// btcp2p_send_queue_create initializes an empty queue that holds at most
+// max_bytes of unsent data.
+void btcp2p_send_queue_create(struct btcp2p_send_queue_t* queue, size_t max_bytes);
+
+// btcp2p_send_queue_destroy frees resources allocated for the queue.
+void btcp2p_send_queue_destroy(struct btcp2p_send_queue_t* queue);
+
+// btcp2p_send_queue_push appends the header and payload of a packed message.
+// Returns false, leaving the queue unchanged, if the message does not fit or
+// memory for it could not be allocated.
+bool btcp2p_send_queue_push(struct btcp2p_send_queue_t* queue,
+                            struct btcp2p_message_t const * const message);
+
+// btcp2p_send_queue_peek returns a pointer to the unsent bytes at the front
+// of the queue and stores how many there are in len.
+uint8_t* btcp2p_send_queue_peek(struct btcp2p_send_queue_t* queue, size_t* len);
+
+// btcp2p_send_queue_advance marks amount bytes at the front of the queue as
+// written.
+void btcp2p_send_queue_advance(struct btcp2p_send_queue_t* queue, size_t amount);
+
+// btcp2p_send_queue_depth returns the number of messages not fully written.
+size_t btcp2p_send_queue_depth(struct btcp2p_send_queue_t const * const queue);
+
+// btcp2p_send_queue_pending_bytes returns the number of bytes not yet written.
+size_t btcp2p_send_queue_pending_bytes(struct btcp2p_send_queue_t const * const queue);
+
+#endif // LIBBTCP2P_SEND_QUEUE_H
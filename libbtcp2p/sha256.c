@@ -0,0 +1,372 @@
+// OpenSSL 3 deprecates the low-level block function used by the OpenSSL
+// backend, but it remains the only way to reach its assembly kernels.
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BTCP2P_SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "libbtcp2p/sha256.h"
+
+// Compresses count consecutive 64-byte blocks into the hash state.
+typedef void (*btcp2p_sha256_transform_t)(uint32_t state[8],
+                                          uint8_t const * blocks,
+                                          size_t count);
+
+static const uint32_t SHA256_INITIAL_STATE[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Padding that follows a 32-byte message to fill out its single block: the
+// terminating 0x80 byte, zeros, and the message length of 256 bits.
+static const uint8_t SHA256_32_PADDING[32] = {
+  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x00
+};
+
+static inline uint32_t btcp2p_sha256_load_be32(uint8_t const * const p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void btcp2p_sha256_store_be32(uint8_t* const p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline uint32_t btcp2p_sha256_rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void btcp2p_sha256_transform_portable(uint32_t state[8],
+                                             uint8_t const * blocks,
+                                             size_t count)
+{
+  uint32_t w[64];
+
+  for (; count > 0; count--, blocks += BTCP2P_SHA256_BLOCK_SIZE) {
+    for (int i = 0; i < 16; i++) {
+      w[i] = btcp2p_sha256_load_be32(blocks + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = btcp2p_sha256_rotr(w[i - 15], 7) ^ btcp2p_sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = btcp2p_sha256_rotr(w[i - 2], 17) ^ btcp2p_sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = btcp2p_sha256_rotr(e, 6) ^ btcp2p_sha256_rotr(e, 11) ^ btcp2p_sha256_rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+      uint32_t s0 = btcp2p_sha256_rotr(a, 2) ^ btcp2p_sha256_rotr(a, 13) ^ btcp2p_sha256_rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+static void btcp2p_sha256_transform_openssl(uint32_t state[8],
+                                            uint8_t const * blocks,
+                                            size_t count)
+{
+  SHA256_CTX ctx;
+  for (int i = 0; i < 8; i++) {
+    ctx.h[i] = state[i];
+  }
+
+  for (; count > 0; count--, blocks += BTCP2P_SHA256_BLOCK_SIZE) {
+    SHA256_Transform(&ctx, blocks);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    state[i] = ctx.h[i];
+  }
+}
+
+#ifdef BTCP2P_SHA256_X86
+
+// Each group of four rounds uses one vector of message words. The first four
+// vectors come from the block and the rest are derived with sha256msg1 and
+// sha256msg2 while earlier rounds run.
+__attribute__((target("sha,sse4.1")))
+static void btcp2p_sha256_transform_shani(uint32_t state[8],
+                                          uint8_t const * blocks,
+                                          size_t count)
+{
+  const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // Rearrange the state into the ABEF/CDGH order used by sha256rnds2.
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const*)&state[0]), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const*)&state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; count > 0; count--, blocks += BTCP2P_SHA256_BLOCK_SIZE) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i w[4];
+
+#pragma GCC unroll 4
+    for (int i = 0; i < 4; i++) {
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(blocks + 16 * i)), byteswap);
+    }
+
+    // Unrolled so the message vectors stay in registers.
+#pragma GCC unroll 16
+    for (int group = 0; group < 16; group++) {
+      __m128i msg = _mm_add_epi32(w[group & 3], _mm_loadu_si128((__m128i const*)&SHA256_K[4 * group]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+      if (group >= 3 && group < 15) {
+        __m128i next = _mm_add_epi32(w[(group + 1) & 3],
+                                     _mm_alignr_epi8(w[group & 3], w[(group - 1) & 3], 4));
+        w[(group + 1) & 3] = _mm_sha256msg2_epu32(next, w[group & 3]);
+      }
+
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+      if (group >= 1 && group < 13) {
+        w[(group - 1) & 3] = _mm_sha256msg1_epu32(w[(group - 1) & 3], w[group & 3]);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i*)&state[0], state0);
+  _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static bool btcp2p_sha256_cpu_has_shani(void) {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+    return false;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (ebx & (1u << 29)) != 0;
+}
+
+#endif
+
+static const btcp2p_sha256_transform_t SHA256_TRANSFORMS[BTCP2P_SHA256_BACKEND_COUNT] = {
+  [BTCP2P_SHA256_PORTABLE] = btcp2p_sha256_transform_portable,
+  [BTCP2P_SHA256_OPENSSL] = btcp2p_sha256_transform_openssl,
+#ifdef BTCP2P_SHA256_X86
+  [BTCP2P_SHA256_SHANI] = btcp2p_sha256_transform_shani,
+#endif
+};
+
+static char const * const SHA256_BACKEND_NAMES[BTCP2P_SHA256_BACKEND_COUNT] = {
+  [BTCP2P_SHA256_PORTABLE] = "portable",
+  [BTCP2P_SHA256_OPENSSL] = "openssl",
+  [BTCP2P_SHA256_SHANI] = "sha-ni",
+};
+
+// Backend in use, or -1 until the CPU has been inspected. Every thread
+// resolves it to the same value, so racing first calls are harmless.
+static _Atomic int SHA256_ACTIVE_BACKEND = -1;
+
+bool btcp2p_sha256_backend_supported(enum btcp2p_sha256_backend_t backend) {
+  switch (backend) {
+  case BTCP2P_SHA256_PORTABLE:
+  case BTCP2P_SHA256_OPENSSL:
+    return true;
+  case BTCP2P_SHA256_SHANI:
+#ifdef BTCP2P_SHA256_X86
+    return btcp2p_sha256_cpu_has_shani();
+#else
+    return false;
+#endif
+  default:
+    return false;
+  }
+}
+
+enum btcp2p_sha256_backend_t btcp2p_sha256_backend(void) {
+  int backend = atomic_load_explicit(&SHA256_ACTIVE_BACKEND, memory_order_relaxed);
+  if (backend >= 0) {
+    return (enum btcp2p_sha256_backend_t)backend;
+  }
+
+  backend = btcp2p_sha256_backend_supported(BTCP2P_SHA256_SHANI)
+    ? BTCP2P_SHA256_SHANI
+    : BTCP2P_SHA256_OPENSSL;
+  atomic_store_explicit(&SHA256_ACTIVE_BACKEND, backend, memory_order_relaxed);
+
+  return (enum btcp2p_sha256_backend_t)backend;
+}
+
+bool btcp2p_sha256_use_backend(enum btcp2p_sha256_backend_t backend) {
+  if (!btcp2p_sha256_backend_supported(backend)) {
+    return false;
+  }
+
+  atomic_store_explicit(&SHA256_ACTIVE_BACKEND, (int)backend, memory_order_relaxed);
+  return true;
+}
+
+char const * btcp2p_sha256_backend_name(enum btcp2p_sha256_backend_t backend) {
+  if ((unsigned)backend >= BTCP2P_SHA256_BACKEND_COUNT) {
+    return "unknown";
+  }
+
+  return SHA256_BACKEND_NAMES[backend];
+}
+
+static inline btcp2p_sha256_transform_t btcp2p_sha256_transform(void) {
+  return SHA256_TRANSFORMS[btcp2p_sha256_backend()];
+}
+
+void btcp2p_sha256_init(struct btcp2p_sha256_t* ctx) {
+  memcpy(ctx->state, SHA256_INITIAL_STATE, sizeof(ctx->state));
+  ctx->length = 0;
+}
+
+void btcp2p_sha256_update(struct btcp2p_sha256_t* ctx,
+                          uint8_t const * const data,
+                          size_t len)
+{
+  btcp2p_sha256_transform_t transform = btcp2p_sha256_transform();
+  size_t buffered = ctx->length % BTCP2P_SHA256_BLOCK_SIZE;
+  size_t offset = 0;
+
+  ctx->length += len;
+
+  // Complete a partially filled block first.
+  if (buffered > 0) {
+    size_t amount = BTCP2P_SHA256_BLOCK_SIZE - buffered;
+    if (amount > len) {
+      amount = len;
+    }
+    memcpy(ctx->buffer + buffered, data, amount);
+    offset = amount;
+    if (buffered + amount < BTCP2P_SHA256_BLOCK_SIZE) {
+      return;
+    }
+    transform(ctx->state, ctx->buffer, 1);
+  }
+
+  // Whole blocks are compressed straight from the input.
+  size_t blocks = (len - offset) / BTCP2P_SHA256_BLOCK_SIZE;
+  if (blocks > 0) {
+    transform(ctx->state, data + offset, blocks);
+    offset += blocks * BTCP2P_SHA256_BLOCK_SIZE;
+  }
+
+  memcpy(ctx->buffer, data + offset, len - offset);
+}
+
+void btcp2p_sha256_final(struct btcp2p_sha256_t* ctx,
+                         uint8_t out[BTCP2P_SHA256_DIGEST_SIZE])
+{
+  btcp2p_sha256_transform_t transform = btcp2p_sha256_transform();
+  size_t buffered = ctx->length % BTCP2P_SHA256_BLOCK_SIZE;
+  uint64_t bits = ctx->length * 8;
+
+  ctx->buffer[buffered++] = 0x80;
+  if (buffered > BTCP2P_SHA256_BLOCK_SIZE - 8) {
+    memset(ctx->buffer + buffered, 0, BTCP2P_SHA256_BLOCK_SIZE - buffered);
+    transform(ctx->state, ctx->buffer, 1);
+    buffered = 0;
+  }
+  memset(ctx->buffer + buffered, 0, BTCP2P_SHA256_BLOCK_SIZE - 8 - buffered);
+  btcp2p_sha256_store_be32(ctx->buffer + 56, (uint32_t)(bits >> 32));
+  btcp2p_sha256_store_be32(ctx->buffer + 60, (uint32_t)bits);
+  transform(ctx->state, ctx->buffer, 1);
+
+  for (int i = 0; i < 8; i++) {
+    btcp2p_sha256_store_be32(out + 4 * i, ctx->state[i]);
+  }
+}
+
+void btcp2p_sha256d_final(struct btcp2p_sha256_t* ctx,
+                          uint8_t out[BTCP2P_SHA256_DIGEST_SIZE])
+{
+  uint8_t first[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256_final(ctx, first);
+  btcp2p_sha256_32(first, out);
+}
+
+void btcp2p_sha256(uint8_t const * const data,
+                   size_t len,
+                   uint8_t out[BTCP2P_SHA256_DIGEST_SIZE])
+{
+  struct btcp2p_sha256_t ctx;
+  btcp2p_sha256_init(&ctx);
+  btcp2p_sha256_update(&ctx, data, len);
+  btcp2p_sha256_final(&ctx, out);
+}
+
+void btcp2p_sha256_32(uint8_t const in[BTCP2P_SHA256_DIGEST_SIZE],
+                      uint8_t out[BTCP2P_SHA256_DIGEST_SIZE])
+{
+  uint32_t state[8];
+  uint8_t block[BTCP2P_SHA256_BLOCK_SIZE];
+
+  memcpy(state, SHA256_INITIAL_STATE, sizeof(state));
+  memcpy(block, in, BTCP2P_SHA256_DIGEST_SIZE);
+  memcpy(block + BTCP2P_SHA256_DIGEST_SIZE, SHA256_32_PADDING, sizeof(SHA256_32_PADDING));
+
+  btcp2p_sha256_transform()(state, block, 1);
+
+  for (int i = 0; i < 8; i++) {
+    btcp2p_sha256_store_be32(out + 4 * i, state[i]);
+  }
+}
+
+void btcp2p_sha256d(uint8_t const * const data,
+                    size_t len,
+                    uint8_t out[BTCP2P_SHA256_DIGEST_SIZE])
+{
+  uint8_t first[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256(data, len, first);
+  btcp2p_sha256_32(first, out);
+}
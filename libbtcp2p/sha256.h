@@ -0,0 +1,97 @@
+// Implements SHA-256 and the double-SHA256 used for P2P message checksums.
+//
+// Hashing is split into a portable layer that handles buffering and padding
+// and a backend that compresses whole 64-byte blocks. The fastest backend the
+// CPU supports is chosen the first time anything is hashed:
+//
+//   BTCP2P_SHA256_SHANI    - x86 SHA extensions.
+//   BTCP2P_SHA256_OPENSSL  - OpenSSL's block function, which itself picks
+//                            AVX2, AVX or SSSE3 code for the running CPU.
+//   BTCP2P_SHA256_PORTABLE - plain C, available everywhere.
+//
+// The second pass of a double-SHA256 always hashes a 32-byte digest, which
+// fits in a single block with fixed padding. btcp2p_sha256d finishes with a
+// kernel specialised for that case.
+//
+// Example:
+//   struct btcp2p_sha256_t ctx;
+//   uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+//   btcp2p_sha256_init(&ctx);
+//   btcp2p_sha256_update(&ctx, header, 80);
+//   btcp2p_sha256_final(&ctx, digest);
+#ifndef LIBBTCP2P_SHA256_H
+#define LIBBTCP2P_SHA256_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of a SHA-256 digest in bytes.
+#define BTCP2P_SHA256_DIGEST_SIZE 32
+
+// Size of a SHA-256 block in bytes.
+#define BTCP2P_SHA256_BLOCK_SIZE 64
+
+// SHA-256 block compression backends
+enum btcp2p_sha256_backend_t {
+  BTCP2P_SHA256_PORTABLE, ///< Plain C.
+  BTCP2P_SHA256_OPENSSL, ///< OpenSSL's assembly block function.
+  BTCP2P_SHA256_SHANI, ///< x86 SHA extensions.
+  BTCP2P_SHA256_BACKEND_COUNT
+};
+
+// Streaming SHA-256 context
+struct btcp2p_sha256_t {
+  uint32_t state[8]; ///< Intermediate hash value.
+  uint8_t buffer[BTCP2P_SHA256_BLOCK_SIZE]; ///< Bytes of an incomplete block.
+  uint64_t length; ///< Total bytes hashed so far.
+};
+
+// btcp2p_sha256_init prepares a context to hash a new message.
+void btcp2p_sha256_init(struct btcp2p_sha256_t* ctx);
+
+// btcp2p_sha256_update hashes len more bytes of the message.
+void btcp2p_sha256_update(struct btcp2p_sha256_t* ctx,
+                          uint8_t const * const data,
+                          size_t len);
+
+// btcp2p_sha256_final pads the message and writes its digest into out.
+void btcp2p_sha256_final(struct btcp2p_sha256_t* ctx,
+                         uint8_t out[BTCP2P_SHA256_DIGEST_SIZE]);
+
+// btcp2p_sha256d_final pads the message and writes the SHA-256 of its digest
+// into out.
+void btcp2p_sha256d_final(struct btcp2p_sha256_t* ctx,
+                          uint8_t out[BTCP2P_SHA256_DIGEST_SIZE]);
+
+// btcp2p_sha256 writes the SHA-256 digest of data into out.
+void btcp2p_sha256(uint8_t const * const data,
+                   size_t len,
+                   uint8_t out[BTCP2P_SHA256_DIGEST_SIZE]);
+
+// btcp2p_sha256_32 writes the SHA-256 digest of a 32-byte input into out
+// using a single compression with precomputed padding.
+void btcp2p_sha256_32(uint8_t const in[BTCP2P_SHA256_DIGEST_SIZE],
+                      uint8_t out[BTCP2P_SHA256_DIGEST_SIZE]);
+
+// btcp2p_sha256d writes SHA-256(SHA-256(data)) into out.
+void btcp2p_sha256d(uint8_t const * const data,
+                    size_t len,
+                    uint8_t out[BTCP2P_SHA256_DIGEST_SIZE]);
+
+// btcp2p_sha256_backend returns the backend currently used for hashing.
+enum btcp2p_sha256_backend_t btcp2p_sha256_backend(void);
+
+// btcp2p_sha256_backend_supported returns true if the backend can run on
+// this CPU.
+bool btcp2p_sha256_backend_supported(enum btcp2p_sha256_backend_t backend);
+
+// btcp2p_sha256_use_backend switches hashing to the given backend. Returns
+// false, leaving the backend unchanged, if it is unsupported. Intended for
+// tests and benchmarks; it should not be called while other threads hash.
+bool btcp2p_sha256_use_backend(enum btcp2p_sha256_backend_t backend);
+
+// btcp2p_sha256_backend_name returns a short name for the backend.
+char const * btcp2p_sha256_backend_name(enum btcp2p_sha256_backend_t backend);
+
+#endif // LIBBTCP2P_SHA256_H
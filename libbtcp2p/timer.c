@@ -1,18 +1,248 @@
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
 #include "libbtcp2p/timer.h"
 
+// Mask of the tick bits below level Level.
+#define BTCP2P_TIMER_WHEEL_LOW_MASK(Level) ((1ULL << ((Level) * BTCP2P_TIMER_WHEEL_LEVEL_BITS)) - 1)
+
+// Slot of a tick at level Level.
+#define BTCP2P_TIMER_WHEEL_DIGIT(Tick, Level) \
+  (((Tick) >> ((Level) * BTCP2P_TIMER_WHEEL_LEVEL_BITS)) & (BTCP2P_TIMER_WHEEL_SLOTS - 1))
+
+uint64_t btcp2p_timer_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * BTCP2P_NS_PER_SECOND + (uint64_t)ts.tv_nsec;
+}
+
 void btcp2p_timer_init(struct btcp2p_timer_t* const timer, double timeout) {
-  timer->previous_time = time(NULL);
+  timer->previous_ns = btcp2p_timer_now_ns();
   timer->timeout = timeout;
 }
 
 void btcp2p_timer_reset(struct btcp2p_timer_t* const timer) {
-  timer->previous_time = time(NULL);
+  timer->previous_ns = btcp2p_timer_now_ns();
 }
 
 bool btcp2p_timer_expired(struct btcp2p_timer_t const * const timer) {
-  if (difftime(time(NULL), timer->previous_time) >= timer->timeout) {
+  uint64_t elapsed_ns = btcp2p_timer_now_ns() - timer->previous_ns;
+  if ((double)elapsed_ns >= timer->timeout * BTCP2P_NS_PER_SECOND) {
     return true;
   }
 
   return false;
 }
+
+void btcp2p_timer_wheel_create(struct btcp2p_timer_wheel_t* wheel, uint64_t now_ns) {
+  memset(wheel, 0, sizeof(struct btcp2p_timer_wheel_t));
+  wheel->tick = now_ns / BTCP2P_TIMER_WHEEL_TICK_NS;
+}
+
+// btcp2p_timer_wheel_deadline_tick returns the first tick at or after a
+// deadline.
+static uint64_t btcp2p_timer_wheel_deadline_tick(uint64_t deadline_ns) {
+  return deadline_ns / BTCP2P_TIMER_WHEEL_TICK_NS + (deadline_ns % BTCP2P_TIMER_WHEEL_TICK_NS != 0);
+}
+
+// btcp2p_timer_wheel_insert links a timer into the slot for its deadline,
+// relative to the wheel's current tick.
+static void btcp2p_timer_wheel_insert(struct btcp2p_timer_wheel_t* wheel,
+                                      struct btcp2p_wheel_timer_t* timer)
+{
+  uint64_t tick = btcp2p_timer_wheel_deadline_tick(timer->deadline_ns);
+  if (tick < wheel->tick) {
+    tick = wheel->tick;
+  }
+
+  // A timer belongs to the level of the highest digit in which its tick
+  // differs from the wheel's. Ticks beyond the top level wait at the end of
+  // it and are placed again when they get there.
+  uint64_t differ = tick ^ wheel->tick;
+  if (differ > BTCP2P_TIMER_WHEEL_LOW_MASK(BTCP2P_TIMER_WHEEL_LEVELS)) {
+    tick = wheel->tick | BTCP2P_TIMER_WHEEL_LOW_MASK(BTCP2P_TIMER_WHEEL_LEVELS);
+    differ = tick ^ wheel->tick;
+  }
+
+  size_t level = 0;
+  while (differ > BTCP2P_TIMER_WHEEL_LOW_MASK(level + 1)) {
+    level++;
+  }
+  size_t slot = BTCP2P_TIMER_WHEEL_DIGIT(tick, level);
+
+  struct btcp2p_wheel_timer_t** head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (timer->next) {
+    timer->next->prev_next = &timer->next;
+  }
+  timer->prev_next = head;
+  *head = timer;
+  wheel->occupied[level] |= 1ULL << slot;
+}
+
+// btcp2p_timer_wheel_unlink removes a scheduled timer from its slot.
+static void btcp2p_timer_wheel_unlink(struct btcp2p_timer_wheel_t* wheel,
+                                      struct btcp2p_wheel_timer_t* timer)
+{
+  struct btcp2p_wheel_timer_t** prev_next = timer->prev_next;
+  *prev_next = timer->next;
+  if (timer->next) {
+    timer->next->prev_next = prev_next;
+  }
+  timer->next = NULL;
+  timer->prev_next = NULL;
+
+  // The head of a slot is linked from the slot itself.
+  uintptr_t offset = (uintptr_t)prev_next - (uintptr_t)&wheel->slots[0][0];
+  if (offset < sizeof(wheel->slots) && *prev_next == NULL) {
+    size_t index = offset / sizeof(wheel->slots[0][0]);
+    wheel->occupied[index / BTCP2P_TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % BTCP2P_TIMER_WHEEL_SLOTS));
+  }
+}
+
+void btcp2p_timer_wheel_schedule(struct btcp2p_timer_wheel_t* wheel,
+                                 struct btcp2p_wheel_timer_t* timer,
+                                 uint64_t deadline_ns,
+                                 btcp2p_wheel_callback_t callback,
+                                 void* ctx)
+{
+  if (timer->prev_next) {
+    btcp2p_timer_wheel_unlink(wheel, timer);
+  } else {
+    wheel->count++;
+  }
+
+  timer->deadline_ns = deadline_ns;
+  timer->callback = callback;
+  timer->ctx = ctx;
+  btcp2p_timer_wheel_insert(wheel, timer);
+}
+
+void btcp2p_timer_wheel_cancel(struct btcp2p_timer_wheel_t* wheel,
+                               struct btcp2p_wheel_timer_t* timer)
+{
+  if (!timer->prev_next) {
+    return;
+  }
+
+  btcp2p_timer_wheel_unlink(wheel, timer);
+  wheel->count--;
+}
+
+bool btcp2p_timer_wheel_pending(struct btcp2p_wheel_timer_t const * const timer) {
+  return timer->prev_next != NULL;
+}
+
+// btcp2p_timer_wheel_next_tick returns the first tick from the wheel's
+// current one at which a slot needs processing. The wheel must not be
+// empty.
+static uint64_t btcp2p_timer_wheel_next_tick(struct btcp2p_timer_wheel_t const * const wheel) {
+  uint64_t next = UINT64_MAX;
+
+  for (size_t level = 0; level < BTCP2P_TIMER_WHEEL_LEVELS; level++) {
+    uint64_t pending = wheel->occupied[level] & (~0ULL << BTCP2P_TIMER_WHEEL_DIGIT(wheel->tick, level));
+    if (pending == 0) {
+      continue;
+    }
+
+    uint64_t slot = (uint64_t)__builtin_ctzll(pending);
+    uint64_t tick = (wheel->tick & ~BTCP2P_TIMER_WHEEL_LOW_MASK(level + 1)) |
+                    (slot << (level * BTCP2P_TIMER_WHEEL_LEVEL_BITS));
+    if (tick < wheel->tick) {
+      tick = wheel->tick;
+    }
+    if (tick < next) {
+      next = tick;
+    }
+  }
+
+  return next;
+}
+
+// btcp2p_timer_wheel_process handles the wheel's current tick: higher levels
+// whose slot has come round are moved down, then the timers due at the tick
+// fire.
+static size_t btcp2p_timer_wheel_process(struct btcp2p_timer_wheel_t* wheel) {
+  uint64_t tick = wheel->tick;
+
+  for (size_t level = BTCP2P_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    if ((tick & BTCP2P_TIMER_WHEEL_LOW_MASK(level)) != 0) {
+      continue;
+    }
+
+    size_t slot = BTCP2P_TIMER_WHEEL_DIGIT(tick, level);
+    struct btcp2p_wheel_timer_t* timer;
+    while ((timer = wheel->slots[level][slot]) != NULL) {
+      btcp2p_timer_wheel_unlink(wheel, timer);
+      btcp2p_timer_wheel_insert(wheel, timer);
+    }
+  }
+
+  // Timers scheduled by callbacks land on later ticks.
+  size_t slot = BTCP2P_TIMER_WHEEL_DIGIT(tick, 0);
+  size_t fired = 0;
+  wheel->tick = tick + 1;
+
+  struct btcp2p_wheel_timer_t* timer;
+  while ((timer = wheel->slots[0][slot]) != NULL) {
+    btcp2p_timer_wheel_unlink(wheel, timer);
+    if (btcp2p_timer_wheel_deadline_tick(timer->deadline_ns) > tick) {
+      // Waited at the end of the top level; not due yet.
+      btcp2p_timer_wheel_insert(wheel, timer);
+      continue;
+    }
+
+    wheel->count--;
+    fired++;
+    timer->callback(timer, timer->ctx);
+  }
+
+  return fired;
+}
+
+size_t btcp2p_timer_wheel_advance(struct btcp2p_timer_wheel_t* wheel, uint64_t now_ns) {
+  uint64_t now_tick = now_ns / BTCP2P_TIMER_WHEEL_TICK_NS;
+  size_t fired = 0;
+
+  while (wheel->tick <= now_tick) {
+    uint64_t next = wheel->count > 0 ? btcp2p_timer_wheel_next_tick(wheel) : UINT64_MAX;
+    if (next > now_tick) {
+      wheel->tick = now_tick + 1;
+      break;
+    }
+
+    // Nothing happens on the ticks in between.
+    wheel->tick = next;
+    fired += btcp2p_timer_wheel_process(wheel);
+  }
+
+  return fired;
+}
+
+uint64_t btcp2p_timer_wheel_next_deadline(struct btcp2p_timer_wheel_t const * const wheel) {
+  if (wheel->count == 0) {
+    return UINT64_MAX;
+  }
+
+  return btcp2p_timer_wheel_next_tick(wheel) * BTCP2P_TIMER_WHEEL_TICK_NS;
+}
+
+int btcp2p_timer_wheel_timeout_ms(struct btcp2p_timer_wheel_t const * const wheel,
+                                  uint64_t now_ns,
+                                  int max_ms)
+{
+  uint64_t deadline_ns = btcp2p_timer_wheel_next_deadline(wheel);
+  if (deadline_ns == UINT64_MAX) {
+    return max_ms;
+  }
+  if (deadline_ns <= now_ns) {
+    return 0;
+  }
+
+  uint64_t wait_ms = (deadline_ns - now_ns + BTCP2P_NS_PER_MS - 1) / BTCP2P_NS_PER_MS;
+  if (max_ms >= 0 && wait_ms > (uint64_t)max_ms) {
+    return max_ms;
+  }
+  return wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+}
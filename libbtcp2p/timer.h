@@ -1,15 +1,80 @@
-// Simple timer interfaces
+// Timer interfaces on the monotonic clock.
+//
+// btcp2p_timer_t is a single timer that the caller polls. For many timers,
+// such as a ping interval and stall deadline per peer, a timer wheel keeps
+// them sorted by deadline at O(1) cost per insert and cancel, fires the ones
+// that are due when advanced, and reports the next deadline so that an event
+// loop knows how long it may sleep.
+//
+// The wheel is hierarchical: BTCP2P_TIMER_WHEEL_LEVELS levels of
+// BTCP2P_TIMER_WHEEL_SLOTS slots, each slot of a level spanning a whole turn
+// of the level below. Timers sit in the level matching how far away they
+// are and move down a level as their slot comes round, so each timer is
+// touched at most once per level. Deadlines are rounded up to the next
+// BTCP2P_TIMER_WHEEL_TICK_NS, so timers never fire early and at most one
+// tick late.
+//
+// Example:
+//   btcp2p_timer_wheel_create(&wheel, btcp2p_timer_now_ns());
+//   btcp2p_timer_wheel_schedule(&wheel, &peer->ping, btcp2p_timer_now_ns() + 2 * BTCP2P_NS_PER_MINUTE,
+//                               send_ping, peer);
+//   for (;;) {
+//     ... wait until btcp2p_timer_wheel_next_deadline(&wheel) ...
+//     btcp2p_timer_wheel_advance(&wheel, btcp2p_timer_now_ns());
+//   }
 #ifndef LIBBTCP2P_TIMER_H
 #define LIBBTCP2P_TIMER_H
 
 #include <stdbool.h>
-#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BTCP2P_NS_PER_MS 1000000ULL
+#define BTCP2P_NS_PER_SECOND (1000 * BTCP2P_NS_PER_MS)
+#define BTCP2P_NS_PER_MINUTE (60 * BTCP2P_NS_PER_SECOND)
+
+// Resolution of the timer wheel.
+#define BTCP2P_TIMER_WHEEL_TICK_NS BTCP2P_NS_PER_MS
+
+// Shape of the timer wheel. Five levels of 64 one-millisecond slots cover
+// about 12 days; later deadlines wait in the top level until they are in
+// range.
+#define BTCP2P_TIMER_WHEEL_LEVEL_BITS 6
+#define BTCP2P_TIMER_WHEEL_SLOTS (1 << BTCP2P_TIMER_WHEEL_LEVEL_BITS)
+#define BTCP2P_TIMER_WHEEL_LEVELS 5
 
 struct btcp2p_timer_t {
-  time_t previous_time;
-  double timeout;
+  uint64_t previous_ns; ///< Monotonic time the timer was last reset.
+  double timeout; ///< Seconds until the timer expires.
+};
+
+struct btcp2p_wheel_timer_t;
+
+// Callback invoked by btcp2p_timer_wheel_advance when a timer fires. The
+// timer is no longer scheduled and may be scheduled again from the callback.
+typedef void (*btcp2p_wheel_callback_t)(struct btcp2p_wheel_timer_t* timer, void* ctx);
+
+// A timer on a wheel. Owned by the caller, who must cancel it before freeing
+// it. Zero-initialized timers are not scheduled.
+struct btcp2p_wheel_timer_t {
+  uint64_t deadline_ns; ///< Monotonic time the timer fires at.
+  btcp2p_wheel_callback_t callback;
+  void* ctx; ///< Passed to callback.
+  struct btcp2p_wheel_timer_t* next; ///< Next timer in the same slot.
+  struct btcp2p_wheel_timer_t** prev_next; ///< Link pointing at this timer, or NULL if not scheduled.
+};
+
+struct btcp2p_timer_wheel_t {
+  uint64_t tick; ///< Next tick to process.
+  size_t count; ///< Timers scheduled.
+  uint64_t occupied[BTCP2P_TIMER_WHEEL_LEVELS]; ///< Bit per non-empty slot.
+  struct btcp2p_wheel_timer_t* slots[BTCP2P_TIMER_WHEEL_LEVELS][BTCP2P_TIMER_WHEEL_SLOTS];
 };
 
+// btcp2p_timer_now_ns returns the current CLOCK_MONOTONIC time in
+// nanoseconds.
+uint64_t btcp2p_timer_now_ns(void);
+
 // btcp2p_timer_init initialized the given timer for the given timeout.
 void btcp2p_timer_init(struct btcp2p_timer_t* const timer, double timeout);
 
@@ -20,4 +85,44 @@ void btcp2p_timer_reset(struct btcp2p_timer_t* const timer);
 // reached.
 bool btcp2p_timer_expired(struct btcp2p_timer_t const * const timer);
 
+// btcp2p_timer_wheel_create initializes an empty wheel whose clock starts at
+// now_ns.
+void btcp2p_timer_wheel_create(struct btcp2p_timer_wheel_t* wheel, uint64_t now_ns);
+
+// btcp2p_timer_wheel_schedule arranges for callback to be called with timer
+// and ctx once the wheel has advanced to deadline_ns. A timer that is
+// already scheduled is moved. Deadlines that have passed fire within a
+// tick.
+void btcp2p_timer_wheel_schedule(struct btcp2p_timer_wheel_t* wheel,
+                                 struct btcp2p_wheel_timer_t* timer,
+                                 uint64_t deadline_ns,
+                                 btcp2p_wheel_callback_t callback,
+                                 void* ctx);
+
+// btcp2p_timer_wheel_cancel unschedules a timer. Cancelling a timer that is
+// not scheduled does nothing.
+void btcp2p_timer_wheel_cancel(struct btcp2p_timer_wheel_t* wheel,
+                               struct btcp2p_wheel_timer_t* timer);
+
+// btcp2p_timer_wheel_pending returns true if the timer is scheduled.
+bool btcp2p_timer_wheel_pending(struct btcp2p_wheel_timer_t const * const timer);
+
+// btcp2p_timer_wheel_advance moves the wheel's clock on to now_ns and fires
+// every timer that has become due, in deadline order to within a tick.
+// Returns the number of timers fired.
+size_t btcp2p_timer_wheel_advance(struct btcp2p_timer_wheel_t* wheel, uint64_t now_ns);
+
+// btcp2p_timer_wheel_next_deadline returns the monotonic time by which the
+// wheel should next be advanced, or UINT64_MAX if no timers are scheduled.
+// It is never later than the earliest deadline, but may be earlier when
+// distant timers need to move down a level.
+uint64_t btcp2p_timer_wheel_next_deadline(struct btcp2p_timer_wheel_t const * const wheel);
+
+// btcp2p_timer_wheel_timeout_ms converts the wait until the wheel's next
+// deadline into a poll timeout, rounded up, and capped at max_ms unless
+// max_ms is negative. Returns max_ms if no timers are scheduled.
+int btcp2p_timer_wheel_timeout_ms(struct btcp2p_timer_wheel_t const * const wheel,
+                                  uint64_t now_ns,
+                                  int max_ms);
+
 #endif // LIBBTCP2P_TIMER_H
@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "libbtcp2p/frame.h"
+#include "libbtcp2p/log.h"
+#include "libbtcp2p/verify_pool.h"
+
+// btcp2p_verify_job_checksum hashes the job's payload, recording its digest
+// in the message, and returns the checksum it should have.
+static uint32_t btcp2p_verify_job_checksum(struct btcp2p_verify_job_t* job)
+{
+  struct btcp2p_sha256_t ctx;
+  btcp2p_frame_hash_begin(&ctx, &job->message);
+  btcp2p_frame_hash_update(&ctx, &job->message, job->message.payload.buffer, 0, job->message.header.length);
+  return btcp2p_frame_hash_final(&ctx, &job->message);
+}
+
+// btcp2p_verify_job_finish records the result of checking a job. Once the
+// status is no longer pending the job may be reused by its queue.
+static void btcp2p_verify_job_finish(struct btcp2p_verify_job_t* job, uint32_t checksum)
+{
+  job->checksum = checksum;
+  atomic_store_explicit(
+    &job->status,
+    checksum == job->message.header.checksum ? BTCP2P_VERIFY_PASSED : BTCP2P_VERIFY_REJECTED,
+    memory_order_release
+  );
+}
+
+// btcp2p_verify_pool_report adds a watched queue to the completed list and
+// makes the notify pipe readable. The pool lock must be held.
+static void btcp2p_verify_pool_report(struct btcp2p_verify_pool_t* pool,
+                                      struct btcp2p_verify_queue_t* queue)
+{
+  if (!queue->watched || queue->is_completed) {
+    return;
+  }
+
+  queue->is_completed = true;
+  queue->next_completed = pool->completed_head;
+  pool->completed_head = queue;
+
+  if (!pool->notified) {
+    pool->notified = true;
+    ssize_t written = write(pool->notify_fds[1], "", 1);
+    (void)written;
+  }
+}
+
+static void* btcp2p_verify_pool_worker(void* arg) {
+  struct btcp2p_verify_pool_t* pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stopping && pool->work_head == NULL) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->work_head == NULL) {
+      break;
+    }
+
+    struct btcp2p_verify_job_t* job = pool->work_head;
+    pool->work_head = job->next;
+    if (pool->work_head == NULL) {
+      pool->work_tail = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    uint32_t checksum = btcp2p_verify_job_checksum(job);
+    pthread_mutex_lock(&pool->lock);
+
+    // The job is finished under the lock so that a queue being destroyed
+    // cannot be freed while the worker still refers to it.
+    btcp2p_verify_job_finish(job, checksum);
+    btcp2p_verify_pool_report(pool, job->queue);
+    pthread_cond_broadcast(&pool->job_done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+bool btcp2p_verify_pool_create(struct btcp2p_verify_pool_t* pool, size_t num_threads) {
+  memset(pool, 0, sizeof(struct btcp2p_verify_pool_t));
+  pool->min_payload = BTCP2P_VERIFY_MIN_PAYLOAD;
+
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if (num_threads > BTCP2P_VERIFY_POOL_MAX_THREADS) {
+    num_threads = BTCP2P_VERIFY_POOL_MAX_THREADS;
+  }
+
+  if (pipe(pool->notify_fds) < 0) {
+    btcp2p_log(BTCP2P_LOG_ERROR, "unable to create verify pool pipe: %s\n", strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(pool->notify_fds[i], F_SETFL, fcntl(pool->notify_fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(pool->notify_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->job_done, NULL);
+
+  for (; pool->num_threads < num_threads; pool->num_threads++) {
+    int error = pthread_create(&pool->threads[pool->num_threads],
+                               NULL,
+                               btcp2p_verify_pool_worker,
+                               pool);
+    if (error != 0) {
+      btcp2p_log(BTCP2P_LOG_ERROR, "unable to start verify worker: %s\n", strerror(error));
+      btcp2p_verify_pool_destroy(pool);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void btcp2p_verify_pool_destroy(struct btcp2p_verify_pool_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pool->num_threads = 0;
+
+  pthread_cond_destroy(&pool->job_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+  close(pool->notify_fds[0]);
+  close(pool->notify_fds[1]);
+}
+
+int btcp2p_verify_pool_fd(struct btcp2p_verify_pool_t const * const pool) {
+  return pool->notify_fds[0];
+}
+
+struct btcp2p_verify_queue_t* btcp2p_verify_pool_take_completed(struct btcp2p_verify_pool_t* pool)
+{
+  pthread_mutex_lock(&pool->lock);
+
+  struct btcp2p_verify_queue_t* completed = pool->completed_head;
+  pool->completed_head = NULL;
+  for (struct btcp2p_verify_queue_t* next = completed; next != NULL; next = next->next_completed) {
+    next->is_completed = false;
+  }
+
+  if (pool->notified) {
+    char drain[16];
+    while (read(pool->notify_fds[0], drain, sizeof(drain)) > 0);
+    pool->notified = false;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return completed;
+}
+
+void btcp2p_verify_queue_create(struct btcp2p_verify_queue_t* queue,
+                                struct btcp2p_verify_pool_t* pool,
+                                void* owner)
+{
+  memset(queue, 0, sizeof(struct btcp2p_verify_queue_t));
+  queue->pool = pool;
+  queue->owner = owner;
+
+  for (size_t i = 0; i < BTCP2P_VERIFY_QUEUE_DEPTH; i++) {
+    btcp2p_checked_buffer_create(&queue->jobs[i].message.payload);
+    atomic_init(&queue->jobs[i].status, BTCP2P_VERIFY_PENDING);
+    queue->jobs[i].queue = queue;
+  }
+}
+
+// btcp2p_verify_queue_busy returns true if a worker may still be checking one
+// of the queue's frames.
+static bool btcp2p_verify_queue_busy(struct btcp2p_verify_queue_t const * const queue) {
+  for (size_t i = 0; i < queue->count; i++) {
+    struct btcp2p_verify_job_t const * job =
+      &queue->jobs[(queue->head + i) % BTCP2P_VERIFY_QUEUE_DEPTH];
+    if (atomic_load_explicit(&job->status, memory_order_acquire) == BTCP2P_VERIFY_PENDING) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void btcp2p_verify_queue_destroy(struct btcp2p_verify_queue_t* queue) {
+  struct btcp2p_verify_pool_t* pool = queue->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  while (btcp2p_verify_queue_busy(queue)) {
+    pthread_cond_wait(&pool->job_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  btcp2p_verify_queue_watch(queue, false);
+
+  for (size_t i = 0; i < BTCP2P_VERIFY_QUEUE_DEPTH; i++) {
+    btcp2p_checked_buffer_destroy(&queue->jobs[i].message.payload);
+  }
+  queue->count = 0;
+}
+
+void btcp2p_verify_queue_watch(struct btcp2p_verify_queue_t* queue, bool watched) {
+  struct btcp2p_verify_pool_t* pool = queue->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  queue->watched = watched;
+
+  // An unwatched queue must not be reported, so unlink it from the list.
+  if (!watched && queue->is_completed) {
+    struct btcp2p_verify_queue_t** link = &pool->completed_head;
+    while (*link != queue) {
+      link = &(*link)->next_completed;
+    }
+    *link = queue->next_completed;
+    queue->is_completed = false;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+size_t btcp2p_verify_queue_depth(struct btcp2p_verify_queue_t const * const queue) {
+  return queue->count;
+}
+
+bool btcp2p_verify_queue_full(struct btcp2p_verify_queue_t const * const queue) {
+  return queue->count == BTCP2P_VERIFY_QUEUE_DEPTH;
+}
+
+struct btcp2p_message_t* btcp2p_verify_queue_reserve(struct btcp2p_verify_queue_t* queue) {
+  return &queue->jobs[(queue->head + queue->count) % BTCP2P_VERIFY_QUEUE_DEPTH].message;
+}
+
+void btcp2p_verify_queue_submit(struct btcp2p_verify_queue_t* queue) {
+  struct btcp2p_verify_pool_t* pool = queue->pool;
+  struct btcp2p_verify_job_t* job =
+    &queue->jobs[(queue->head + queue->count) % BTCP2P_VERIFY_QUEUE_DEPTH];
+
+  atomic_store_explicit(&job->status, BTCP2P_VERIFY_PENDING, memory_order_relaxed);
+  job->next = NULL;
+  queue->count++;
+
+  if (job->message.header.length < pool->min_payload) {
+    btcp2p_verify_job_finish(job, btcp2p_verify_job_checksum(job));
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->work_tail) {
+    pool->work_tail->next = job;
+  } else {
+    pool->work_head = job;
+  }
+  pool->work_tail = job;
+  pthread_cond_signal(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+enum btcp2p_verify_status_t btcp2p_verify_queue_peek(struct btcp2p_verify_queue_t* queue,
+                                                     struct btcp2p_verify_job_t** job)
+{
+  if (queue->count == 0) {
+    *job = NULL;
+    return BTCP2P_VERIFY_PENDING;
+  }
+
+  *job = &queue->jobs[queue->head];
+  return atomic_load_explicit(&(*job)->status, memory_order_acquire);
+}
+
+void btcp2p_verify_queue_pop(struct btcp2p_verify_queue_t* queue) {
+  queue->head = (queue->head + 1) % BTCP2P_VERIFY_QUEUE_DEPTH;
+  queue->count--;
+}
+
+bool btcp2p_verify_queue_wait(struct btcp2p_verify_queue_t* queue, int timeout_ms) {
+  struct btcp2p_verify_pool_t* pool = queue->pool;
+  struct btcp2p_verify_job_t* job;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  if (timeout_ms > 0) {
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (queue->count > 0 &&
+         btcp2p_verify_queue_peek(queue, &job) == BTCP2P_VERIFY_PENDING)
+  {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&pool->job_done, &pool->lock);
+    } else if (pthread_cond_timedwait(&pool->job_done, &pool->lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return btcp2p_verify_queue_peek(queue, &job) != BTCP2P_VERIFY_PENDING;
+}
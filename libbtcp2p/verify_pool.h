@@ -0,0 +1,153 @@
+// Checks message checksums on a pool of worker threads.
+//
+// A connection given a verify pool no longer hashes payloads on the thread
+// that receives them. Each complete frame is instead appended to the
+// connection's verify queue and handed to the pool. Workers may finish frames
+// in any order, but a queue only returns its oldest frame, and only once that
+// frame has been checked, so protocol logic sees messages from each peer in
+// the order they arrived.
+//
+// Payloads smaller than the pool's min_payload are checked on the receiving
+// thread when they are queued, since waking a worker for them costs more than
+// hashing them.
+//
+// Event loops learn about finished frames through btcp2p_verify_pool_fd,
+// which becomes readable whenever a worker finishes a frame for a watched
+// queue. btcp2p_verify_pool_take_completed then lists the queues to revisit.
+//
+// Example:
+//   struct btcp2p_message_t* frame = btcp2p_verify_queue_reserve(&queue);
+//   frame->header = header;
+//   btcp2p_checked_buffer_prepare_read(&frame->payload, payload, length);
+//   btcp2p_verify_queue_submit(&queue);
+//   ...
+//   struct btcp2p_verify_job_t* job;
+//   if (btcp2p_verify_queue_peek(&queue, &job) == BTCP2P_VERIFY_PASSED) {
+//     ... use job->message ...
+//     btcp2p_verify_queue_pop(&queue);
+//   }
+#ifndef LIBBTCP2P_VERIFY_POOL_H
+#define LIBBTCP2P_VERIFY_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbtcp2p/message.h"
+
+// Maximum number of worker threads in a pool.
+#define BTCP2P_VERIFY_POOL_MAX_THREADS 64
+
+// Maximum number of frames a queue holds before its oldest is returned.
+#define BTCP2P_VERIFY_QUEUE_DEPTH 16
+
+// Default size below which payloads are checked on the receiving thread.
+#define BTCP2P_VERIFY_MIN_PAYLOAD (4 * 1024)
+
+// Verification status of a queued frame
+enum btcp2p_verify_status_t {
+  BTCP2P_VERIFY_PENDING, ///< Not checked yet, or no frame is queued.
+  BTCP2P_VERIFY_PASSED, ///< The payload matches the header checksum.
+  BTCP2P_VERIFY_REJECTED ///< The payload does not match the header checksum.
+};
+
+struct btcp2p_verify_queue_t;
+
+// Frame owned by a verify queue.
+struct btcp2p_verify_job_t {
+  struct btcp2p_message_t message; ///< Frame being checked; owns its payload.
+  atomic_int status; ///< A btcp2p_verify_status_t.
+  uint32_t checksum; ///< Checksum computed for the payload once checked.
+  struct btcp2p_verify_queue_t* queue; ///< Queue the job belongs to.
+  struct btcp2p_verify_job_t* next; ///< Next job waiting for a worker.
+};
+
+struct btcp2p_verify_pool_t {
+  pthread_t threads[BTCP2P_VERIFY_POOL_MAX_THREADS];
+  size_t num_threads;
+  size_t min_payload; ///< Smaller payloads are checked on the receiving thread.
+  pthread_mutex_t lock; ///< Guards everything below.
+  pthread_cond_t work_ready; ///< Signalled when jobs are submitted.
+  pthread_cond_t job_done; ///< Broadcast when a job has been checked.
+  struct btcp2p_verify_job_t* work_head; ///< Next job for a worker.
+  struct btcp2p_verify_job_t* work_tail; ///< Last job for a worker.
+  struct btcp2p_verify_queue_t* completed_head; ///< Watched queues with finished jobs.
+  bool notified; ///< Is the notify pipe readable?
+  bool stopping; ///< Are the workers being shut down?
+  int notify_fds[2]; ///< Pipe that signals finished jobs to event loops.
+};
+
+// Per-peer queue of frames in arrival order.
+struct btcp2p_verify_queue_t {
+  struct btcp2p_verify_pool_t* pool;
+  void* owner; ///< Caller's pointer, typically the connection.
+  struct btcp2p_verify_job_t jobs[BTCP2P_VERIFY_QUEUE_DEPTH]; ///< Ring of frames.
+  size_t head; ///< Index of the oldest frame.
+  size_t count; ///< Number of queued frames.
+  bool watched; ///< Report finished jobs through the pool's descriptor?
+  bool is_completed; ///< Is the queue on the pool's completed list?
+  struct btcp2p_verify_queue_t* next_completed; ///< Next queue on the completed list.
+};
+
+// btcp2p_verify_pool_create starts a pool with num_threads workers, which is
+// clamped to between 1 and BTCP2P_VERIFY_POOL_MAX_THREADS. Returns false if
+// the threads or notify pipe could not be created.
+bool btcp2p_verify_pool_create(struct btcp2p_verify_pool_t* pool, size_t num_threads);
+
+// btcp2p_verify_pool_destroy stops the workers and releases the pool. Every
+// queue using the pool must have been destroyed first.
+void btcp2p_verify_pool_destroy(struct btcp2p_verify_pool_t* pool);
+
+// btcp2p_verify_pool_fd returns a descriptor that polls readable while
+// btcp2p_verify_pool_take_completed has queues to report.
+int btcp2p_verify_pool_fd(struct btcp2p_verify_pool_t const * const pool);
+
+// btcp2p_verify_pool_take_completed returns the watched queues that have had
+// jobs finish since the last call, linked through next_completed, and clears
+// the pool's descriptor.
+struct btcp2p_verify_queue_t* btcp2p_verify_pool_take_completed(struct btcp2p_verify_pool_t* pool);
+
+// btcp2p_verify_queue_create initializes an empty queue whose frames are
+// checked by the given pool.
+void btcp2p_verify_queue_create(struct btcp2p_verify_queue_t* queue,
+                                struct btcp2p_verify_pool_t* pool,
+                                void* owner);
+
+// btcp2p_verify_queue_destroy waits for the queue's frames to be checked and
+// frees its payload buffers.
+void btcp2p_verify_queue_destroy(struct btcp2p_verify_queue_t* queue);
+
+// btcp2p_verify_queue_watch sets whether finished jobs are reported through
+// btcp2p_verify_pool_take_completed.
+void btcp2p_verify_queue_watch(struct btcp2p_verify_queue_t* queue, bool watched);
+
+// btcp2p_verify_queue_depth returns the number of queued frames.
+size_t btcp2p_verify_queue_depth(struct btcp2p_verify_queue_t const * const queue);
+
+// btcp2p_verify_queue_full returns true if no more frames can be queued.
+bool btcp2p_verify_queue_full(struct btcp2p_verify_queue_t const * const queue);
+
+// btcp2p_verify_queue_reserve returns the message to fill in for the next
+// frame. Its payload buffer belongs to the queue and may be written to or
+// exchanged for another created buffer. The queue must not be full.
+struct btcp2p_message_t* btcp2p_verify_queue_reserve(struct btcp2p_verify_queue_t* queue);
+
+// btcp2p_verify_queue_submit appends the reserved frame to the queue and
+// starts checking it.
+void btcp2p_verify_queue_submit(struct btcp2p_verify_queue_t* queue);
+
+// btcp2p_verify_queue_peek points job at the oldest frame and returns its
+// status. Returns BTCP2P_VERIFY_PENDING if the queue is empty.
+enum btcp2p_verify_status_t btcp2p_verify_queue_peek(struct btcp2p_verify_queue_t* queue,
+                                                     struct btcp2p_verify_job_t** job);
+
+// btcp2p_verify_queue_pop removes the oldest frame once it has been checked.
+void btcp2p_verify_queue_pop(struct btcp2p_verify_queue_t* queue);
+
+// btcp2p_verify_queue_wait waits up to timeout_ms milliseconds, or forever if
+// negative, for the oldest frame to be checked. Returns true if it has been.
+bool btcp2p_verify_queue_wait(struct btcp2p_verify_queue_t* queue, int timeout_ms);
+
+#endif // LIBBTCP2P_VERIFY_POOL_H
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "libbtcp2p/zerocopy.h"
+
+bool btcp2p_zerocopy_enable(struct btcp2p_zerocopy_t* zc, int socket) {
+  memset(zc, 0, sizeof(struct btcp2p_zerocopy_t));
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  int enable = 1;
+  if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0) {
+    return false;
+  }
+
+  zc->enabled = true;
+  return true;
+#else
+  (void)socket;
+  errno = ENOTSUP;
+  return false;
+#endif
+}
+
+void btcp2p_zerocopy_destroy(struct btcp2p_zerocopy_t* zc) {
+  for (size_t i = 0; i < zc->in_flight_count; i++) {
+    btcp2p_checked_buffer_destroy(&zc->in_flight[i].buffer);
+  }
+  for (size_t i = 0; i < zc->free_count; i++) {
+    btcp2p_checked_buffer_destroy(&zc->free[i]);
+  }
+
+  zc->in_flight_count = 0;
+  zc->free_count = 0;
+  zc->enabled = false;
+}
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+
+// btcp2p_zerocopy_complete applies a notification that sends first through
+// last have completed. Returns the number of buffers released.
+static size_t btcp2p_zerocopy_complete(struct btcp2p_zerocopy_t* zc,
+                                       uint32_t first,
+                                       uint32_t last,
+                                       bool copied)
+{
+  size_t released = 0;
+  uint32_t span = last - first;
+
+  zc->completed += (uint64_t)span + 1;
+  if (copied) {
+    zc->copied += (uint64_t)span + 1;
+  }
+
+  for (size_t i = 0; i < zc->in_flight_count; ) {
+    struct btcp2p_zerocopy_send_t* entry = &zc->in_flight[i];
+
+    // Send ids wrap around, so compare offsets from the start of the range.
+    for (uint32_t k = 0; k < entry->sends; k++) {
+      if ((uint32_t)(entry->first_id + k - first) <= span) {
+        entry->pending--;
+      }
+    }
+
+    if (entry->pending > 0) {
+      i++;
+      continue;
+    }
+
+    // The kernel is done with the buffer, so it can be reused.
+    if (zc->free_count < BTCP2P_ZEROCOPY_MAX_FREE) {
+      zc->free[zc->free_count++] = entry->buffer;
+    } else {
+      btcp2p_checked_buffer_destroy(&entry->buffer);
+    }
+    memmove(entry, entry + 1, (zc->in_flight_count - i - 1) * sizeof(*entry));
+    zc->in_flight_count--;
+    released++;
+  }
+
+  return released;
+}
+
+size_t btcp2p_zerocopy_reap(struct btcp2p_zerocopy_t* zc, int socket) {
+  size_t released = 0;
+
+  for (;;) {
+    uint8_t control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level != IPPROTO_IP && cmsg->cmsg_level != IPPROTO_IPV6) {
+        continue;
+      }
+
+      struct sock_extended_err const * err = (void const*)CMSG_DATA(cmsg);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      released += btcp2p_zerocopy_complete(
+        zc,
+        err->ee_info,
+        err->ee_data,
+        (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0
+      );
+    }
+  }
+
+  return released;
+}
+
+// btcp2p_zerocopy_send_all blocks until len bytes from data have been sent
+// with the given flags, counting each zero-copy send in sends.
+static int btcp2p_zerocopy_send_all(struct btcp2p_zerocopy_t* zc,
+                                    int socket,
+                                    uint8_t const * data,
+                                    size_t len,
+                                    int flags,
+                                    uint32_t* sends)
+{
+  while (len > 0) {
+    ssize_t n = send(socket, data, len, flags);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // The socket ran out of memory to track notifications, so copy
+        // whatever remains.
+        flags &= ~MSG_ZEROCOPY;
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+      }
+
+      struct pollfd pfd = { .fd = socket, .events = POLLOUT, .revents = 0 };
+      if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        return -1;
+      }
+      continue;
+    }
+
+    if (flags & MSG_ZEROCOPY) {
+      zc->next_id++;
+      (*sends)++;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int btcp2p_zerocopy_send(struct btcp2p_zerocopy_t* zc,
+                         int socket,
+                         struct btcp2p_message_t* message)
+{
+  btcp2p_zerocopy_reap(zc, socket);
+
+  // Every tracking slot is taken, so wait for the kernel to finish with one.
+  // Pending notifications are reported as POLLERR.
+  while (zc->in_flight_count == BTCP2P_ZEROCOPY_MAX_IN_FLIGHT) {
+    struct pollfd pfd = { .fd = socket, .events = 0, .revents = 0 };
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      return -1;
+    }
+    btcp2p_zerocopy_reap(zc, socket);
+  }
+
+  // The header is copied because it is rewritten as soon as the next message
+  // is packed.
+  uint32_t sends = 0;
+  if (btcp2p_zerocopy_send_all(zc, socket, (uint8_t const*)&message->header,
+                               sizeof(message->header), MSG_MORE, &sends) < 0)
+  {
+    return -1;
+  }
+
+  uint32_t first_id = zc->next_id;
+  int result = btcp2p_zerocopy_send_all(zc, socket, message->payload.buffer,
+                                        message->header.length, MSG_ZEROCOPY, &sends);
+
+  // Even a failed send may have handed part of the payload to the kernel.
+  if (sends > 0) {
+    struct btcp2p_zerocopy_send_t* entry = &zc->in_flight[zc->in_flight_count++];
+    entry->buffer = message->payload;
+    entry->first_id = first_id;
+    entry->sends = sends;
+    entry->pending = sends;
+
+    if (zc->free_count > 0) {
+      message->payload = zc->free[--zc->free_count];
+    } else {
+      btcp2p_checked_buffer_create(&message->payload);
+    }
+  }
+
+  return result;
+}
+
+#else
+
+size_t btcp2p_zerocopy_reap(struct btcp2p_zerocopy_t* zc, int socket) {
+  (void)zc;
+  (void)socket;
+  return 0;
+}
+
+int btcp2p_zerocopy_send(struct btcp2p_zerocopy_t* zc,
+                         int socket,
+                         struct btcp2p_message_t* message)
+{
+  (void)zc;
+  (void)socket;
+  (void)message;
+  errno = ENOTSUP;
+  return -1;
+}
+
+#endif
@@ -0,0 +1,74 @@
+// Implements zero-copy transmission of large message payloads.
+//
+// Payloads sent with MSG_ZEROCOPY are read by the kernel straight from the
+// sender's memory, so the buffer must not be modified or freed until the
+// kernel reports through the socket error queue that it is done with it. A
+// zero-copy sender takes ownership of each payload buffer it sends, hands
+// back a replacement from a pool of completed buffers, and reclaims the sent
+// buffer once its completion notification arrives.
+//
+// Zero-copy sends need SO_ZEROCOPY, which is currently only available on
+// Linux. Elsewhere btcp2p_zerocopy_enable fails and messages keep using the
+// copying send path.
+#ifndef LIBBTCP2P_ZEROCOPY_H
+#define LIBBTCP2P_ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libbtcp2p/checked_buffer.h"
+#include "libbtcp2p/message.h"
+
+// Payloads smaller than this are copied. Pinning pages and handling the
+// completion costs more than copying small payloads.
+#define BTCP2P_ZEROCOPY_THRESHOLD (32 * 1024)
+
+// Maximum number of payload buffers waiting on completions.
+#define BTCP2P_ZEROCOPY_MAX_IN_FLIGHT 16
+
+// Maximum number of completed buffers kept for reuse.
+#define BTCP2P_ZEROCOPY_MAX_FREE 4
+
+// A payload buffer the kernel may still be reading from.
+struct btcp2p_zerocopy_send_t {
+  struct btcp2p_checked_buffer_t buffer;
+  uint32_t first_id; ///< Id of the first zero-copy send from the buffer.
+  uint32_t sends; ///< Number of zero-copy sends made from the buffer.
+  uint32_t pending; ///< Number of those sends not yet completed.
+};
+
+struct btcp2p_zerocopy_t {
+  bool enabled; ///< Was SO_ZEROCOPY enabled on the socket?
+  uint32_t next_id; ///< Id the kernel assigns to the next zero-copy send.
+  struct btcp2p_zerocopy_send_t in_flight[BTCP2P_ZEROCOPY_MAX_IN_FLIGHT];
+  size_t in_flight_count;
+  struct btcp2p_checked_buffer_t free[BTCP2P_ZEROCOPY_MAX_FREE];
+  size_t free_count;
+  uint64_t completed; ///< Zero-copy sends the kernel has completed.
+  uint64_t copied; ///< Completed sends the kernel fell back to copying.
+};
+
+// btcp2p_zerocopy_enable turns on SO_ZEROCOPY for the socket and prepares
+// the sender's state. Returns false if zero-copy sends are unsupported.
+bool btcp2p_zerocopy_enable(struct btcp2p_zerocopy_t* zc, int socket);
+
+// btcp2p_zerocopy_destroy frees every buffer held by the sender. The socket
+// must already be closed or no longer in use.
+void btcp2p_zerocopy_destroy(struct btcp2p_zerocopy_t* zc);
+
+// btcp2p_zerocopy_reap processes completion notifications waiting on the
+// socket's error queue without blocking, moving buffers the kernel is done
+// with back to the pool. Returns the number of buffers released.
+size_t btcp2p_zerocopy_reap(struct btcp2p_zerocopy_t* zc, int socket);
+
+// btcp2p_zerocopy_send blocks until the message has been sent. The header is
+// copied and the payload is sent with MSG_ZEROCOPY. The sender keeps the
+// payload buffer until its sends complete and replaces message->payload with
+// an empty buffer ready for packing. Returns 0 on success or -1 on error with
+// errno set.
+int btcp2p_zerocopy_send(struct btcp2p_zerocopy_t* zc,
+                         int socket,
+                         struct btcp2p_message_t* message);
+
+#endif // LIBBTCP2P_ZEROCOPY_H
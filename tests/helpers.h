@@ -0,0 +1,136 @@
+// Fixtures shared by the tests that script a peer over a socket.
+#ifndef LIBBTCP2P_TESTS_HELPERS_H
+#define LIBBTCP2P_TESTS_HELPERS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/connection.h>
+
+static const struct btcp2p_chain_t CHAIN = {
+  .name = "regtest", .version = BTCP2P_PROTOCOL_VERSION, .magic = BTCP2P_MAGIC_REGTEST, .port = 18444
+};
+
+// send_command_at writes one frame from the peer. Payloads are empty except
+// for a version claiming the given protocol version, a ping and a sendcmpct.
+static inline void send_command_at(int peer, char const * const command, int32_t version) {
+  struct btcp2p_connection_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.chain = &CHAIN;
+  btcp2p_checked_buffer_create(&conn.outgoing.payload);
+
+  if (strcmp(command, "version") == 0) {
+    btcp2p_pack_message(&conn, &conn.outgoing, command, "i", version);
+  } else if (strcmp(command, "ping") == 0) {
+    btcp2p_pack_message(&conn, &conn.outgoing, command, "L", (uint64_t)42);
+  } else if (strcmp(command, "sendcmpct") == 0) {
+    btcp2p_pack_message(&conn, &conn.outgoing, command, "bl", 1, 2);
+  } else {
+    btcp2p_pack_message(&conn, &conn.outgoing, command, "");
+  }
+  TEST_CHECK(send(peer, &conn.outgoing.header, sizeof(conn.outgoing.header), 0) ==
+             (ssize_t)sizeof(conn.outgoing.header));
+  if (conn.outgoing.header.length > 0) {
+    TEST_CHECK(send(peer, conn.outgoing.payload.buffer, conn.outgoing.header.length, 0) ==
+               (ssize_t)conn.outgoing.header.length);
+  }
+
+  btcp2p_checked_buffer_destroy(&conn.outgoing.payload);
+}
+
+// send_command writes one frame from a peer speaking our protocol version.
+static inline void send_command(int peer, char const * const command) {
+  send_command_at(peer, command, BTCP2P_PROTOCOL_VERSION);
+}
+
+// send_commands writes one frame per command, in order.
+static inline void send_commands(int peer, char const * const * commands, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    send_command(peer, commands[i]);
+  }
+}
+
+// open_handshaken completes the connection's handshake over a socket pair
+// and stores the other end, from which a peer is scripted, in peer. Fields
+// of the connection set beforehand, such as verify_pool, are kept. What the
+// connection sent during the handshake is discarded.
+static inline bool open_handshaken(struct btcp2p_connection_t* connection, int* peer) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  *peer = fds[1];
+  if (!btcp2p_begin_handshake(connection, &CHAIN, fds[0])) {
+    close(fds[1]);
+    return false;
+  }
+
+  send_command(*peer, "version");
+  send_command(*peer, "verack");
+  enum btcp2p_handshake_status_t status = BTCP2P_HANDSHAKE_PARTIAL;
+  for (int i = 0; i < 50 && status == BTCP2P_HANDSHAKE_PARTIAL; i++) {
+    status = btcp2p_continue_handshake(connection);
+    if (status == BTCP2P_HANDSHAKE_PARTIAL) {
+      struct pollfd pfd = { .fd = btcp2p_io_fd(connection), .events = POLLIN, .revents = 0 };
+      poll(&pfd, 1, 20);
+    }
+  }
+
+  uint8_t discarded[4096];
+  while (recv(*peer, discarded, sizeof(discarded), MSG_DONTWAIT) > 0);
+  return status == BTCP2P_HANDSHAKE_COMPLETE;
+}
+
+// open_loopback connects a non-blocking TCP client to a blocking server
+// socket over the loopback interface.
+static inline bool open_loopback(int* client, int* server) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr*)&addr, &addr_len) < 0)
+  {
+    return false;
+  }
+
+  *client = socket(AF_INET, SOCK_STREAM, 0);
+  fcntl(*client, F_SETFL, fcntl(*client, F_GETFL) | O_NONBLOCK);
+  if (connect(*client, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    return false;
+  }
+  *server = accept(listener, NULL, NULL);
+  close(listener);
+
+  struct pollfd pfd = { .fd = *client, .events = POLLOUT, .revents = 0 };
+  return *server >= 0 && poll(&pfd, 1, 1000) == 1;
+}
+
+// recv_all reads exactly len bytes from a blocking socket.
+static inline bool recv_all(int socket, uint8_t* dst, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(socket, dst, len, 0);
+    if (n <= 0) return false;
+    dst += n;
+    len -= n;
+  }
+  return true;
+}
+
+#endif
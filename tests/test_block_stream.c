@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/block_stream.h>
+#include <libbtcp2p/vartypes.h>
+
+#define MAX_TXS 4096
+#define MAX_BLOCK (1024 * 1024)
+
+// A serialized block and where each of its transactions lies in it.
+struct block_t {
+  uint8_t* bytes;
+  size_t length;
+  size_t tx_count;
+  size_t tx_offsets[MAX_TXS];
+  size_t tx_lengths[MAX_TXS];
+};
+
+// What a stream emitted.
+struct decoded_t {
+  struct block_t const * block;
+  bool has_header;
+  size_t tx_count;
+  size_t mismatched;
+};
+
+static void append(struct block_t* block, void const * data, size_t length) {
+  memcpy(block->bytes + block->length, data, length);
+  block->length += length;
+}
+
+static void append_filler(struct block_t* block, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    block->bytes[block->length] = (uint8_t)(block->length * 7);
+    block->length++;
+  }
+}
+
+static void append_varint(struct block_t* block, uint64_t value) {
+  struct btcp2p_varint_t vi;
+  btcp2p_varint_encode(&vi, value);
+  append(block, vi.data, vi.length);
+}
+
+static void append_script(struct block_t* block, size_t length) {
+  append_varint(block, length);
+  append_filler(block, length);
+}
+
+static void begin_block(struct block_t* block, uint64_t tx_count) {
+  block->bytes = malloc(MAX_BLOCK);
+  block->length = 0;
+  block->tx_count = 0;
+  append_filler(block, BTCP2P_BLOCK_HEADER_SIZE);
+  append_varint(block, tx_count);
+}
+
+// append_tx adds a transaction with the given inputs and outputs, each with
+// a script of script_size bytes. Transactions with witness_items give each
+// input that many witness items of 72 bytes.
+static void append_tx(struct block_t* block, size_t inputs, size_t outputs,
+                      size_t script_size, size_t witness_items)
+{
+  size_t start = block->length;
+  uint32_t version = 2;
+  append(block, &version, sizeof(version));
+  if (witness_items > 0) {
+    uint8_t marker[2] = { 0x00, 0x01 };
+    append(block, marker, sizeof(marker));
+  }
+
+  append_varint(block, inputs);
+  for (size_t i = 0; i < inputs; i++) {
+    append_filler(block, 36);
+    append_script(block, script_size);
+    append_filler(block, 4);
+  }
+  append_varint(block, outputs);
+  for (size_t i = 0; i < outputs; i++) {
+    append_filler(block, 8);
+    append_script(block, script_size);
+  }
+  for (size_t i = 0; witness_items > 0 && i < inputs; i++) {
+    append_varint(block, witness_items);
+    for (size_t item = 0; item < witness_items; item++) {
+      append_script(block, 72);
+    }
+  }
+  append_filler(block, 4);
+
+  block->tx_offsets[block->tx_count] = start;
+  block->tx_lengths[block->tx_count] = block->length - start;
+  block->tx_count++;
+}
+
+// build_mixed_block serializes a block with legacy and segwit transactions
+// and scripts that need every size of varint.
+static void build_mixed_block(struct block_t* block) {
+  begin_block(block, 5);
+  append_tx(block, 1, 1, 10, 0);
+  append_tx(block, 2, 2, 22, 2);
+  append_tx(block, 1, 3, 300, 0);
+  append_tx(block, 1, 1, 70000, 0);
+  append_tx(block, 3, 1, 0, 1);
+}
+
+static void on_header(uint8_t const header[BTCP2P_BLOCK_HEADER_SIZE], void* ctx) {
+  struct decoded_t* decoded = ctx;
+  decoded->has_header = memcmp(header, decoded->block->bytes, BTCP2P_BLOCK_HEADER_SIZE) == 0;
+}
+
+static void on_tx(uint8_t const * tx, size_t length, uint64_t index, void* ctx) {
+  struct decoded_t* decoded = ctx;
+  struct block_t const * block = decoded->block;
+
+  if (index != decoded->tx_count ||
+      index >= block->tx_count ||
+      length != block->tx_lengths[index] ||
+      memcmp(tx, block->bytes + block->tx_offsets[index], length) != 0)
+  {
+    decoded->mismatched++;
+  }
+  decoded->tx_count++;
+}
+
+// feed_in_pieces feeds the block to the stream piece bytes at a time.
+static bool feed_in_pieces(struct btcp2p_block_stream_t* stream,
+                           struct block_t const * block,
+                           size_t piece)
+{
+  for (size_t offset = 0; offset < block->length; offset += piece) {
+    size_t amount = piece < block->length - offset ? piece : block->length - offset;
+    if (!btcp2p_block_stream_feed(stream, block->bytes + offset, amount)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void test_whole_block() {
+  struct block_t block;
+  build_mixed_block(&block);
+
+  struct decoded_t decoded = { .block = &block };
+  struct btcp2p_block_stream_t stream;
+  btcp2p_block_stream_create(&stream, on_header, on_tx, &decoded);
+
+  TEST_CHECK(btcp2p_block_stream_feed(&stream, block.bytes, block.length));
+  TEST_CHECK(btcp2p_block_stream_done(&stream));
+  TEST_CHECK(decoded.has_header);
+  TEST_CHECK_(decoded.tx_count == 5, "%zu transactions", decoded.tx_count);
+  TEST_CHECK(decoded.mismatched == 0);
+
+  // Nothing was gathered into the window.
+  TEST_CHECK(stream.window.capacity == BTCP2P_CHECKED_BUFFER_INITIAL_CAPACITY);
+
+  btcp2p_block_stream_destroy(&stream);
+  free(block.bytes);
+}
+
+void test_any_split() {
+  struct block_t block;
+  build_mixed_block(&block);
+
+  struct decoded_t decoded = { .block = &block };
+  struct btcp2p_block_stream_t stream;
+  btcp2p_block_stream_create(&stream, on_header, on_tx, &decoded);
+
+  size_t pieces[] = { 1, 2, 3, 5, 9, 64, 81, 1000, 4096, 65536 };
+  for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+    memset(&decoded, 0, sizeof(decoded));
+    decoded.block = &block;
+    btcp2p_block_stream_reset(&stream);
+
+    TEST_CHECK_(feed_in_pieces(&stream, &block, pieces[i]), "pieces of %zu", pieces[i]);
+    TEST_CHECK(btcp2p_block_stream_done(&stream));
+    TEST_CHECK(decoded.has_header);
+    TEST_CHECK_(decoded.tx_count == 5, "%zu transactions in pieces of %zu", decoded.tx_count, pieces[i]);
+    TEST_CHECK(decoded.mismatched == 0);
+  }
+
+  btcp2p_block_stream_destroy(&stream);
+  free(block.bytes);
+}
+
+void test_window_stays_small() {
+  struct block_t block;
+  begin_block(&block, 3000);
+  for (size_t i = 0; i < 3000; i++) {
+    append_tx(&block, 1 + i % 2, 2, 25, i % 3 == 0 ? 2 : 0);
+  }
+
+  struct decoded_t decoded = { .block = &block };
+  struct btcp2p_block_stream_t stream;
+  btcp2p_block_stream_create(&stream, on_header, on_tx, &decoded);
+
+  // Pieces rarely end on a transaction boundary, but only the transaction
+  // split by each is kept.
+  TEST_CHECK(feed_in_pieces(&stream, &block, 1460));
+  TEST_CHECK(btcp2p_block_stream_done(&stream));
+  TEST_CHECK(decoded.tx_count == 3000);
+  TEST_CHECK(decoded.mismatched == 0);
+  TEST_CHECK_(stream.window.capacity == BTCP2P_CHECKED_BUFFER_INITIAL_CAPACITY,
+              "window of %zu bytes for a block of %zu", stream.window.capacity, block.length);
+
+  btcp2p_block_stream_destroy(&stream);
+  free(block.bytes);
+}
+
+void test_malformed_blocks() {
+  struct block_t block;
+  build_mixed_block(&block);
+
+  struct decoded_t decoded = { .block = &block };
+  struct btcp2p_block_stream_t stream;
+  btcp2p_block_stream_create(&stream, on_header, on_tx, &decoded);
+
+  // A truncated block is not done.
+  TEST_CHECK(btcp2p_block_stream_feed(&stream, block.bytes, block.length - 1));
+  TEST_CHECK(!btcp2p_block_stream_done(&stream));
+
+  // Bytes after the last transaction.
+  uint8_t extra[2] = { block.bytes[block.length - 1], 0 };
+  TEST_CHECK(!btcp2p_block_stream_feed(&stream, extra, sizeof(extra)));
+  TEST_CHECK(stream.state == BTCP2P_BLOCK_STREAM_FAILED);
+  TEST_CHECK(!btcp2p_block_stream_feed(&stream, block.bytes, block.length));
+
+  // The segwit marker must be followed by the flag.
+  size_t flag = block.tx_offsets[1] + 5;
+  TEST_CHECK(block.bytes[flag] == 0x01);
+  block.bytes[flag] = 0x02;
+  btcp2p_block_stream_reset(&stream);
+  TEST_CHECK(!btcp2p_block_stream_feed(&stream, block.bytes, block.length));
+  block.bytes[flag] = 0x01;
+
+  // Every block has a coinbase.
+  uint8_t empty[BTCP2P_BLOCK_HEADER_SIZE + 1] = { 0 };
+  btcp2p_block_stream_reset(&stream);
+  TEST_CHECK(!btcp2p_block_stream_feed(&stream, empty, sizeof(empty)));
+
+  // A script longer than any payload.
+  struct block_t huge;
+  begin_block(&huge, 1);
+  uint32_t version = 1;
+  append(&huge, &version, sizeof(version));
+  append_varint(&huge, 1);
+  append_filler(&huge, 36);
+  append_varint(&huge, 0xFFFFFFFFFFULL);
+  btcp2p_block_stream_reset(&stream);
+  TEST_CHECK(!btcp2p_block_stream_feed(&stream, huge.bytes, huge.length));
+
+  btcp2p_block_stream_destroy(&stream);
+  free(huge.bytes);
+  free(block.bytes);
+}
+
+TEST_LIST = {
+  { "test_whole_block", test_whole_block },
+  { "test_any_split", test_any_split },
+  { "test_window_stays_small", test_window_stays_small },
+  { "test_malformed_blocks", test_malformed_blocks },
+  { 0 },
+};
@@ -64,6 +64,29 @@ void test_checked_writes() {
   btcp2p_checked_buffer_destroy(&cb);
 }
 
+void test_failed_resize() {
+  struct btcp2p_checked_buffer_t cb;
+  btcp2p_checked_buffer_create(&cb);
+  btcp2p_checked_buffer_prepare_read(&cb, (uint8_t*)"hello", 5);
+  uint8_t* buffer = cb.buffer;
+  size_t capacity = cb.capacity;
+
+  // Sizes that cannot be aligned or allocated leave the buffer untouched.
+  TEST_CHECK(!btcp2p_checked_buffer_resize(&cb, SIZE_MAX - 1));
+  TEST_CHECK(!btcp2p_checked_buffer_resize(&cb, SIZE_MAX / 2));
+  TEST_CHECK(btcp2p_checked_buffer_prepare_copy(&cb, SIZE_MAX / 2) == NULL);
+  TEST_CHECK(cb.buffer == buffer);
+  TEST_CHECK(cb.capacity == capacity);
+  TEST_CHECK(cb.len == 5);
+  TEST_CHECK(strncmp((char*)cb.buffer, "hello", 5) == 0);
+
+  // Capacities round up to the alignment.
+  TEST_CHECK(btcp2p_checked_buffer_resize(&cb, 100));
+  TEST_CHECK(cb.capacity == 128);
+
+  btcp2p_checked_buffer_destroy(&cb);
+}
+
 void fuzz_checked_buffer() {
   // TODO: implement this
   // Randomly read and write various amounts of data in an attempt to crash
@@ -75,6 +98,7 @@ TEST_LIST = {
   { "test_dynamic_resize", test_checked_read_resize },
   { "test_checked_reads", test_checked_reads },
   { "test_checked_writes", test_checked_writes },
+  { "test_failed_resize", test_failed_resize },
   { "fuzz_checked_buffer", fuzz_checked_buffer },
   { 0 },
 };
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/command.h>
+
+// lookup pads a command string to 12 bytes and interns it.
+static enum btcp2p_command_id_t lookup(char const * const command) {
+  char padded[12] = { 0 };
+  strncpy(padded, command, sizeof(padded));
+  return btcp2p_command_lookup(padded);
+}
+
+void test_known_commands() {
+  TEST_CHECK(lookup("version") == BTCP2P_CMD_VERSION);
+  TEST_CHECK(lookup("inv") == BTCP2P_CMD_INV);
+  TEST_CHECK(lookup("block") == BTCP2P_CMD_BLOCK);
+  TEST_CHECK(lookup("sendaddrv2") == BTCP2P_CMD_SENDADDRV2);
+  TEST_CHECK(lookup("getcfcheckpt") == BTCP2P_CMD_GETCFCHECKPT);
+}
+
+void test_every_command_round_trips() {
+  for (int id = 1; id < BTCP2P_CMD_COUNT; id++) {
+    char const * name = btcp2p_command_name(id);
+    TEST_CHECK_(strlen(name) > 0, "command %d has a name", id);
+    TEST_CHECK_(lookup(name) == (enum btcp2p_command_id_t)id, "%s round trips", name);
+  }
+}
+
+void test_unknown_commands() {
+  TEST_CHECK(lookup("") == BTCP2P_CMD_UNKNOWN);
+  TEST_CHECK(lookup("pingg") == BTCP2P_CMD_UNKNOWN);
+  TEST_CHECK(lookup("pin") == BTCP2P_CMD_UNKNOWN);
+  TEST_CHECK(lookup("PING") == BTCP2P_CMD_UNKNOWN);
+  TEST_CHECK(lookup("getcfcheckp") == BTCP2P_CMD_UNKNOWN);
+  TEST_CHECK(btcp2p_command_name(BTCP2P_CMD_UNKNOWN)[0] == '\0');
+  TEST_CHECK(btcp2p_command_name(BTCP2P_CMD_COUNT)[0] == '\0');
+
+  // Bytes after the terminating NUL are part of the command field.
+  char garbage[12] = { 'p', 'i', 'n', 'g', 0, 0, 0, 0, 0, 0, 0, 'x' };
+  TEST_CHECK(btcp2p_command_lookup(garbage) == BTCP2P_CMD_UNKNOWN);
+}
+
+void fuzz_unknown_commands() {
+  srand(1234);
+  for (int i = 0; i < 100000; i++) {
+    char command[12] = { 0 };
+    int len = 1 + rand() % 12;
+    for (int j = 0; j < len; j++) {
+      command[j] = 'a' + rand() % 26;
+    }
+
+    // Any hit must be the command's own id.
+    enum btcp2p_command_id_t id = btcp2p_command_lookup(command);
+    if (id != BTCP2P_CMD_UNKNOWN) {
+      TEST_CHECK(strncmp(btcp2p_command_name(id), command, 12) == 0);
+    }
+  }
+}
+
+TEST_LIST = {
+  { "test_known_commands", test_known_commands },
+  { "test_every_command_round_trips", test_every_command_round_trips },
+  { "test_unknown_commands", test_unknown_commands },
+  { "fuzz_unknown_commands", fuzz_unknown_commands },
+  { 0 },
+};
@@ -0,0 +1,352 @@
+// Needed for syscall.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/connector.h>
+
+#define NUM_PEERS 16
+
+// Sends still to fail with EINPROGRESS, as the first send on a Fast Open
+// socket does when its SYN went out without our data.
+static atomic_int DEFERRED_SENDS;
+
+// sendmsg stands in for the C library's so that tests can defer sends.
+ssize_t sendmsg(int socket, struct msghdr const * msg, int flags) {
+  int deferred = atomic_load(&DEFERRED_SENDS);
+  while (deferred > 0) {
+    if (atomic_compare_exchange_weak(&DEFERRED_SENDS, &deferred, deferred - 1)) {
+      errno = EINPROGRESS;
+      return -1;
+    }
+  }
+  return syscall(SYS_sendmsg, socket, msg, flags);
+}
+
+struct server_t {
+  struct btcp2p_listener_t listener;
+  char port[6];
+  pthread_t thread;
+  size_t accepted;
+  atomic_bool stopping;
+  struct btcp2p_connection_t connections[NUM_PEERS];
+};
+
+// serve accepts up to NUM_PEERS inbound connections and drives their
+// handshakes.
+static void* serve(void* arg) {
+  struct server_t* server = arg;
+  size_t handshaken = 0;
+
+  for (int i = 0; i < 200 && handshaken < NUM_PEERS && !atomic_load(&server->stopping); i++) {
+    struct pollfd pfds[NUM_PEERS + 1];
+    pfds[0] = (struct pollfd){ .fd = server->listener.socket, .events = POLLIN, .revents = 0 };
+    for (size_t k = 0; k < server->accepted; k++) {
+      pfds[k + 1] = (struct pollfd){ .fd = btcp2p_io_fd(&server->connections[k]), .events = POLLIN, .revents = 0 };
+    }
+    poll(pfds, server->accepted + 1, 50);
+
+    while (server->accepted < NUM_PEERS &&
+           btcp2p_accept(&server->listener, &server->connections[server->accepted]) == BTCP2P_ACCEPT_COMPLETE)
+    {
+      server->accepted++;
+    }
+
+    handshaken = 0;
+    for (size_t k = 0; k < server->accepted; k++) {
+      if (server->connections[k].handshake == BTCP2P_HANDSHAKE_DONE ||
+          btcp2p_continue_handshake(&server->connections[k]) == BTCP2P_HANDSHAKE_COMPLETE)
+      {
+        handshaken++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static bool start_server(struct server_t* server, bool use_fastopen) {
+  memset(server, 0, sizeof(struct server_t));
+  server->listener.use_fastopen = use_fastopen;
+  if (!btcp2p_listen(&server->listener, "regtest", "127.0.0.1", "0")) {
+    return false;
+  }
+  snprintf(server->port, sizeof(server->port), "%u", btcp2p_listener_port(&server->listener));
+  return pthread_create(&server->thread, NULL, serve, server) == 0;
+}
+
+static void stop_server(struct server_t* server) {
+  atomic_store(&server->stopping, true);
+  pthread_join(server->thread, NULL);
+  for (size_t i = 0; i < server->accepted; i++) {
+    btcp2p_disconnect(&server->connections[i]);
+  }
+  btcp2p_listener_close(&server->listener);
+}
+
+// finish pumps the connector until every attempt has been returned.
+static void finish(struct btcp2p_connector_t* connector) {
+  for (int i = 0; i < 100 && btcp2p_connector_pending(connector) > 0; i++) {
+    TEST_CHECK(btcp2p_connector_pump(connector, 50));
+    while (btcp2p_connector_next(connector) != NULL);
+  }
+}
+
+void test_connects_many_in_parallel(void) {
+  struct server_t server;
+  if (!TEST_CHECK(start_server(&server, false))) {
+    return;
+  }
+
+  struct btcp2p_connector_t connector;
+  struct btcp2p_connect_attempt_t attempts[NUM_PEERS];
+  struct btcp2p_connection_t connections[NUM_PEERS];
+  memset(connections, 0, sizeof(connections));
+  btcp2p_connector_create(&connector);
+
+  for (size_t i = 0; i < NUM_PEERS; i++) {
+    TEST_CHECK(btcp2p_connector_start(&connector, &attempts[i], &connections[i],
+                                      "regtest", "127.0.0.1", server.port, 5000));
+  }
+  TEST_CHECK(btcp2p_connector_pending(&connector) == NUM_PEERS);
+
+  // Every address after the first comes from the cache.
+  TEST_CHECK(connector.dns.misses == 1);
+  TEST_CHECK(connector.dns.hits == NUM_PEERS - 1);
+
+  size_t ready = 0;
+  for (int i = 0; i < 100 && btcp2p_connector_pending(&connector) > 0; i++) {
+    TEST_CHECK(btcp2p_connector_pump(&connector, 50));
+
+    struct btcp2p_connect_attempt_t* attempt;
+    while ((attempt = btcp2p_connector_next(&connector)) != NULL) {
+      TEST_CHECK_(attempt->state == BTCP2P_CONNECT_READY, "attempt failed: %s", strerror(attempt->error));
+      if (attempt->state == BTCP2P_CONNECT_READY) {
+        TEST_CHECK(attempt->connection->handshake == BTCP2P_HANDSHAKE_DONE);
+        TEST_CHECK(attempt->finished_ms >= attempt->connected_ms);
+        TEST_CHECK(attempt->connected_ms >= attempt->started_ms);
+        ready++;
+      }
+    }
+  }
+  TEST_CHECK_(ready == NUM_PEERS, "%zu of %d ready", ready, NUM_PEERS);
+
+  stop_server(&server);
+  TEST_CHECK(server.accepted == NUM_PEERS);
+  for (size_t i = 0; i < NUM_PEERS; i++) {
+    if (attempts[i].state == BTCP2P_CONNECT_READY) {
+      btcp2p_disconnect(&connections[i]);
+    }
+  }
+  btcp2p_connector_destroy(&connector);
+}
+
+void test_refused_address_fails(void) {
+  struct btcp2p_listener_t listener;
+  memset(&listener, 0, sizeof(listener));
+  if (!TEST_CHECK(btcp2p_listen(&listener, "regtest", "127.0.0.1", "0"))) {
+    return;
+  }
+  char port[6];
+  snprintf(port, sizeof(port), "%u", btcp2p_listener_port(&listener));
+  btcp2p_listener_close(&listener);
+
+  struct btcp2p_connector_t connector;
+  struct btcp2p_connect_attempt_t attempt;
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  btcp2p_connector_create(&connector);
+
+  TEST_CHECK(btcp2p_connector_start(&connector, &attempt, &connection, "regtest", "127.0.0.1", port, 1000));
+  finish(&connector);
+  TEST_CHECK(attempt.state == BTCP2P_CONNECT_FAILED);
+  TEST_CHECK_(attempt.error == ECONNREFUSED, "error was %s", strerror(attempt.error));
+
+  btcp2p_connector_destroy(&connector);
+}
+
+void test_falls_back_to_next_address(void) {
+  struct server_t server;
+  if (!TEST_CHECK(start_server(&server, false))) {
+    return;
+  }
+
+  struct btcp2p_connector_t connector;
+  btcp2p_connector_create(&connector);
+
+  // Put a refused address ahead of the listener's in the cached entry.
+  struct btcp2p_dns_entry_t* entry =
+    (struct btcp2p_dns_entry_t*)btcp2p_dns_cache_resolve(&connector.dns, "127.0.0.1", server.port);
+  if (!TEST_CHECK(entry != NULL && entry->num_addresses == 1)) {
+    return;
+  }
+  entry->addresses[1] = entry->addresses[0];
+  entry->address_lengths[1] = entry->address_lengths[0];
+  ((struct sockaddr_in*)&entry->addresses[0])->sin_port = htons(1);
+  entry->num_addresses = 2;
+
+  struct btcp2p_connect_attempt_t attempt;
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  TEST_CHECK(btcp2p_connector_start(&connector, &attempt, &connection,
+                                    "regtest", "127.0.0.1", server.port, 5000));
+  finish(&connector);
+  TEST_CHECK_(attempt.state == BTCP2P_CONNECT_READY, "attempt failed: %s", strerror(attempt.error));
+  TEST_CHECK(attempt.next_address == 2);
+
+  if (attempt.state == BTCP2P_CONNECT_READY) {
+    btcp2p_disconnect(&connection);
+  }
+  btcp2p_connector_destroy(&connector);
+
+  stop_server(&server);
+  TEST_CHECK(server.accepted == 1);
+}
+
+void test_deadline_expires(void) {
+  // A socket that listens but never answers the handshake.
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+
+  int silent = socket(AF_INET, SOCK_STREAM, 0);
+  if (!TEST_CHECK(silent >= 0 &&
+                  bind(silent, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+                  listen(silent, 1) == 0 &&
+                  getsockname(silent, (struct sockaddr*)&addr, &addr_len) == 0))
+  {
+    return;
+  }
+  char port[6];
+  snprintf(port, sizeof(port), "%u", ntohs(addr.sin_port));
+
+  struct btcp2p_connector_t connector;
+  struct btcp2p_connect_attempt_t attempt;
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  btcp2p_connector_create(&connector);
+
+  TEST_CHECK(btcp2p_connector_start(&connector, &attempt, &connection, "regtest", "127.0.0.1", port, 200));
+  finish(&connector);
+  TEST_CHECK(attempt.state == BTCP2P_CONNECT_FAILED);
+  TEST_CHECK_(attempt.error == ETIMEDOUT, "error was %s", strerror(attempt.error));
+  TEST_CHECK(attempt.connected_ms != 0);
+  TEST_CHECK(attempt.finished_ms - attempt.started_ms >= 200);
+
+  btcp2p_connector_destroy(&connector);
+  close(silent);
+}
+
+// fastopen_enabled returns true if the kernel allows Fast Open on both the
+// client and the server side.
+static bool fastopen_enabled(void) {
+  FILE* f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+  int mode = 0;
+  if (f) {
+    if (fscanf(f, "%d", &mode) != 1) {
+      mode = 0;
+    }
+    fclose(f);
+  }
+  return (mode & 3) == 3;
+}
+
+void test_fastopen_reconnect(void) {
+  struct server_t server;
+  if (!TEST_CHECK(start_server(&server, true))) {
+    return;
+  }
+
+  struct btcp2p_connector_t connector;
+  btcp2p_connector_create(&connector);
+
+  // The first round fetches a cookie from the listener, which the second
+  // round can then use. Without kernel support both rounds fall back.
+  struct btcp2p_connect_attempt_t attempts[2];
+  struct btcp2p_connection_t connections[2];
+  memset(connections, 0, sizeof(connections));
+  for (size_t round = 0; round < 2; round++) {
+    connections[round].use_fastopen = true;
+    TEST_CHECK(btcp2p_connector_start(&connector, &attempts[round], &connections[round],
+                                      "regtest", "127.0.0.1", server.port, 5000));
+    finish(&connector);
+    TEST_CHECK_(attempts[round].state == BTCP2P_CONNECT_READY,
+                "round %zu failed: %s", round, strerror(attempts[round].error));
+  }
+  TEST_CHECK(!connections[0].used_fastopen);
+  if (fastopen_enabled()) {
+    TEST_CHECK(connections[1].used_fastopen);
+  }
+
+  TEST_CHECK(connector.stats.ready == 2);
+  TEST_CHECK(connector.stats.failed == 0);
+  TEST_CHECK(connector.stats.fastopen == (connections[1].used_fastopen ? 1 : 0));
+  TEST_CHECK(connector.stats.fastopen_handshake_ms <= connector.stats.handshake_ms);
+
+  for (size_t round = 0; round < 2; round++) {
+    if (attempts[round].state == BTCP2P_CONNECT_READY) {
+      TEST_CHECK(connections[round].addr_from.port == htons(btcp2p_listener_port(&server.listener)));
+      btcp2p_disconnect(&connections[round]);
+    }
+  }
+  btcp2p_connector_destroy(&connector);
+
+  stop_server(&server);
+  TEST_CHECK(server.accepted == 2);
+}
+
+void test_send_waits_for_deferred_connect(void) {
+  struct server_t server;
+  if (!TEST_CHECK(start_server(&server, true))) {
+    return;
+  }
+
+  struct btcp2p_connector_t connector;
+  struct btcp2p_connect_attempt_t attempt;
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  connection.use_fastopen = true;
+  btcp2p_connector_create(&connector);
+
+  // Our version is refused until the socket polls writable again.
+  atomic_store(&DEFERRED_SENDS, 1);
+  TEST_CHECK(btcp2p_connector_start(&connector, &attempt, &connection,
+                                    "regtest", "127.0.0.1", server.port, 5000));
+  finish(&connector);
+  TEST_CHECK(atomic_load(&DEFERRED_SENDS) == 0);
+  TEST_CHECK_(attempt.state == BTCP2P_CONNECT_READY, "attempt failed: %s", strerror(attempt.error));
+
+  if (attempt.state == BTCP2P_CONNECT_READY) {
+    btcp2p_disconnect(&connection);
+  }
+  btcp2p_connector_destroy(&connector);
+
+  stop_server(&server);
+  TEST_CHECK(server.accepted == 1);
+}
+
+TEST_LIST = {
+  { "test_connects_many_in_parallel", test_connects_many_in_parallel },
+  { "test_refused_address_fails", test_refused_address_fails },
+  { "test_falls_back_to_next_address", test_falls_back_to_next_address },
+  { "test_deadline_expires", test_deadline_expires },
+  { "test_fastopen_reconnect", test_fastopen_reconnect },
+  { "test_send_waits_for_deferred_connect", test_send_waits_for_deferred_connect },
+  { 0 },
+};
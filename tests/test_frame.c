@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/frame.h>
+#include <libbtcp2p/sha256.h>
+#include <libbtcp2p/vartypes.h>
+
+// wrap_payload writes a header for the length payload bytes already placed
+// after it in dst, returning the total frame size.
+static size_t wrap_payload(uint8_t* dst, char const * const command, uint32_t length) {
+  struct btcp2p_message_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = 0x0709110B;
+  strncpy(header.command, command, sizeof(header.command));
+  header.length = length;
+
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256d(dst + sizeof(header), length, digest);
+  memcpy(&header.checksum, digest, sizeof(header.checksum));
+  memcpy(dst, &header, sizeof(header));
+
+  return sizeof(header) + length;
+}
+
+// build_frame writes a header for a payload of the given length followed by
+// the payload bytes into dst, returning the total frame size.
+static size_t build_frame(uint8_t* dst, char const * const command, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    dst[sizeof(struct btcp2p_message_header_t) + i] = (uint8_t)i;
+  }
+  return wrap_payload(dst, command, length);
+}
+
+void test_whole_frame() {
+  uint8_t data[128];
+  size_t size = build_frame(data, "ping", 8);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(strncmp(message.header.command, "ping", 12) == 0);
+  TEST_CHECK(message.command_id == BTCP2P_CMD_PING);
+  TEST_CHECK(message.header.length == 8);
+  TEST_CHECK(message.payload.len == 8);
+  TEST_CHECK(memcmp(message.payload.buffer, data + sizeof(message.header), 8) == 0);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_empty_payload() {
+  uint8_t data[64];
+  size_t size = build_frame(data, "verack", 0);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(message.header.length == 0);
+  TEST_CHECK(reader.checksum == message.header.checksum);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_byte_at_a_time() {
+  uint8_t data[2048];
+  size_t size = build_frame(data, "block", 2000);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  for (size_t i = 0; i < size; i++) {
+    TEST_CHECK(reader.state != BTCP2P_FRAME_COMPLETE);
+    TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data + i, 1) == 1);
+  }
+
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(message.header.length == 2000);
+  TEST_CHECK(memcmp(message.payload.buffer, data + sizeof(message.header), 2000) == 0);
+  TEST_CHECK(reader.checksum == message.header.checksum);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_block_digests() {
+  uint8_t data[512];
+  size_t size = build_frame(data, "block", 300);
+  uint8_t const * payload = data + sizeof(struct btcp2p_message_header_t);
+
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+  uint8_t block_hash[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256d(payload, 300, digest);
+  btcp2p_sha256d(payload, BTCP2P_BLOCK_HEADER_SIZE, block_hash);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  // The block hash is taken from the running hash wherever the chunk
+  // boundaries fall around the end of the header.
+  for (size_t chunk = 1; chunk < 100; chunk += 7) {
+    btcp2p_frame_reader_reset(&reader);
+    for (size_t offset = 0; offset < size; ) {
+      size_t amount = chunk < size - offset ? chunk : size - offset;
+      offset += btcp2p_frame_reader_feed(&reader, &message, data + offset, amount);
+    }
+
+    TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+    TEST_CHECK(message.has_digest);
+    TEST_CHECK(memcmp(message.digest, digest, sizeof(digest)) == 0);
+    TEST_CHECK(message.has_block_hash);
+    TEST_CHECK(memcmp(message.block_hash, block_hash, sizeof(block_hash)) == 0);
+  }
+
+  // Other messages only get a digest.
+  size = build_frame(data, "tx", 300);
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(message.has_digest);
+  TEST_CHECK(memcmp(message.digest, digest, sizeof(digest)) == 0);
+  TEST_CHECK(!message.has_block_hash);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_corrupt_payload_checksum() {
+  uint8_t data[128];
+  size_t size = build_frame(data, "ping", 8);
+  data[size - 1] ^= 0x01;
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(reader.checksum != message.header.checksum);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_stops_at_frame_boundary() {
+  uint8_t data[256];
+  size_t first = build_frame(data, "inv", 37);
+  size_t second = build_frame(data + first, "pong", 8);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, first + second) == first);
+  TEST_CHECK(strncmp(message.header.command, "inv", 12) == 0);
+
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data + first, second) == second);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(strncmp(message.header.command, "pong", 12) == 0);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void fuzz_frame_splits() {
+  uint8_t data[4096];
+  size_t size = build_frame(data, "tx", 3000);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  srand(1234);
+  for (int round = 0; round < 100; round++) {
+    btcp2p_frame_reader_reset(&reader);
+
+    size_t offset = 0;
+    while (offset < size) {
+      size_t chunk = 1 + rand() % 97;
+      if (chunk > size - offset) {
+        chunk = size - offset;
+      }
+      offset += btcp2p_frame_reader_feed(&reader, &message, data + offset, chunk);
+    }
+
+    TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+    TEST_CHECK(memcmp(message.payload.buffer, data + sizeof(message.header), 3000) == 0);
+    TEST_CHECK(reader.checksum == message.header.checksum);
+  }
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_ring_zero_copy() {
+  uint8_t data[256];
+  size_t first = build_frame(data, "inv", 37);
+  size_t second = build_frame(data + first, "pong", 8);
+
+  struct btcp2p_ring_buffer_t ring;
+  btcp2p_ring_buffer_create(&ring, 1024);
+  struct iovec iov[2];
+  TEST_CHECK(btcp2p_ring_buffer_write_iov(&ring, iov) == 1);
+  memcpy(iov[0].iov_base, data, first + second);
+  btcp2p_ring_buffer_commit(&ring, first + second);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+  size_t held;
+
+  // Both frames come out of a single fill, with payloads referenced in place.
+  TEST_CHECK(btcp2p_frame_reader_consume(&reader, &message, &ring, &held) == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(strncmp(message.header.command, "inv", 12) == 0);
+  TEST_CHECK(held == 37);
+  TEST_CHECK(message.payload.buffer >= ring.buffer &&
+             message.payload.buffer < ring.buffer + ring.capacity);
+  TEST_CHECK(memcmp(message.payload.buffer, data + sizeof(message.header), 37) == 0);
+  TEST_CHECK(reader.checksum == message.header.checksum);
+  btcp2p_ring_buffer_consume(&ring, held);
+
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_consume(&reader, &message, &ring, &held) == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(strncmp(message.header.command, "pong", 12) == 0);
+  TEST_CHECK(held == 8);
+  btcp2p_ring_buffer_consume(&ring, held);
+  TEST_CHECK(btcp2p_ring_buffer_readable(&ring) == 0);
+
+  btcp2p_frame_reader_destroy(&reader);
+  btcp2p_ring_buffer_destroy(&ring);
+}
+
+void test_ring_wrapped_payload() {
+  uint8_t data[256];
+  size_t size = build_frame(data, "tx", 80);
+
+  struct btcp2p_ring_buffer_t ring;
+  btcp2p_ring_buffer_create(&ring, 128);
+
+  // Advance the ring's cursors so that the frame wraps around its end.
+  struct iovec iov[2];
+  btcp2p_ring_buffer_write_iov(&ring, iov);
+  btcp2p_ring_buffer_commit(&ring, 100);
+  btcp2p_ring_buffer_consume(&ring, 90);
+
+  TEST_CHECK(btcp2p_ring_buffer_write_iov(&ring, iov) == 2);
+  memcpy(iov[0].iov_base, data, iov[0].iov_len);
+  memcpy(iov[1].iov_base, data + iov[0].iov_len, size - iov[0].iov_len);
+  btcp2p_ring_buffer_commit(&ring, size);
+  btcp2p_ring_buffer_consume(&ring, 10);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+  size_t held;
+
+  // A wrapped payload cannot be referenced in place and is copied instead.
+  TEST_CHECK(btcp2p_frame_reader_consume(&reader, &message, &ring, &held) == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(held == 0);
+  TEST_CHECK(message.payload.buffer == reader.storage.buffer);
+  TEST_CHECK(memcmp(message.payload.buffer, data + sizeof(message.header), 80) == 0);
+  TEST_CHECK(reader.checksum == message.header.checksum);
+  TEST_CHECK(btcp2p_ring_buffer_readable(&ring) == 0);
+
+  btcp2p_frame_reader_destroy(&reader);
+  btcp2p_ring_buffer_destroy(&ring);
+}
+
+void test_discard_unwanted() {
+  uint8_t data[512];
+  size_t size = build_frame(data, "tx", 100);
+  size += build_frame(data + size, "verack", 0);
+  size += build_frame(data + size, "inv", 37);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+  reader.discard_mask = BTCP2P_COMMAND_BIT(BTCP2P_CMD_TX) | BTCP2P_COMMAND_BIT(BTCP2P_CMD_VERACK);
+
+  // Skipped frames never surface, so the first message out is the inv.
+  size_t storage_capacity = reader.storage.capacity;
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(message.command_id == BTCP2P_CMD_INV);
+  TEST_CHECK(memcmp(message.payload.buffer, data + size - 37, 37) == 0);
+  TEST_CHECK(reader.storage.capacity == storage_capacity);
+
+  TEST_CHECK(reader.dropped_bytes[BTCP2P_CMD_TX] == 124);
+  TEST_CHECK(reader.dropped_bytes[BTCP2P_CMD_VERACK] == 24);
+  TEST_CHECK(reader.dropped_bytes[BTCP2P_CMD_INV] == 0);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_ring_discard() {
+  uint8_t data[512];
+  size_t first = build_frame(data, "addr", 300);
+  size_t second = build_frame(data + first, "pong", 8);
+
+  struct btcp2p_ring_buffer_t ring;
+  btcp2p_ring_buffer_create(&ring, 256);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+  reader.discard_mask = BTCP2P_COMMAND_BIT(BTCP2P_CMD_ADDR);
+  size_t held;
+
+  // The discarded payload is larger than the ring and drains across fills.
+  size_t offset = 0;
+  enum btcp2p_frame_state_t state = BTCP2P_FRAME_HEADER_PARTIAL;
+  while (state != BTCP2P_FRAME_COMPLETE && offset < first + second) {
+    struct iovec iov[2];
+    btcp2p_ring_buffer_write_iov(&ring, iov);
+    size_t amount = iov[0].iov_len < 100 ? iov[0].iov_len : 100;
+    if (amount > first + second - offset) {
+      amount = first + second - offset;
+    }
+    memcpy(iov[0].iov_base, data + offset, amount);
+    btcp2p_ring_buffer_commit(&ring, amount);
+    offset += amount;
+
+    state = btcp2p_frame_reader_consume(&reader, &message, &ring, &held);
+  }
+
+  TEST_CHECK(state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(message.command_id == BTCP2P_CMD_PONG);
+  TEST_CHECK(reader.dropped_bytes[BTCP2P_CMD_ADDR] == first);
+
+  btcp2p_frame_reader_destroy(&reader);
+  btcp2p_ring_buffer_destroy(&ring);
+}
+
+void test_oversized_payload() {
+  uint8_t data[128];
+  size_t size = build_frame(data, "ping", 9);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  // The header alone is enough to refuse the frame.
+  size_t storage_capacity = reader.storage.capacity;
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == sizeof(message.header));
+  TEST_CHECK(reader.state == BTCP2P_FRAME_OVERSIZED);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == 0);
+
+  // Nothing is allocated for a header claiming a huge block.
+  struct btcp2p_message_header_t header;
+  memcpy(&header, data, sizeof(header));
+  strncpy(header.command, "block", sizeof(header.command));
+  header.length = UINT32_MAX;
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, (uint8_t*)&header, sizeof(header)) == sizeof(header));
+  TEST_CHECK(reader.state == BTCP2P_FRAME_OVERSIZED);
+  TEST_CHECK(reader.storage.capacity == storage_capacity);
+  TEST_CHECK(reader.budget_held == 0);
+
+  // Payloads at the limit are accepted.
+  size = build_frame(data, "ping", 8);
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_budget_pauses_reader() {
+  uint8_t data[4096];
+  size_t first = build_frame(data, "tx", 2000);
+  size_t second = build_frame(data + first, "tx", 1500);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+
+  // A lone payload always fits the reader's own budget, even when larger.
+  btcp2p_frame_reader_set_budget(&reader, NULL, 1000);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, first) == first);
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(reader.budget_held == 2000);
+
+  // The next payload waits, past its header, until the first is released.
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data + first, second) == sizeof(message.header));
+  TEST_CHECK(reader.state == BTCP2P_FRAME_PAUSED);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data + first + sizeof(message.header), 10) == 0);
+  TEST_CHECK(btcp2p_frame_reader_resume(&reader, &message) == BTCP2P_FRAME_PAUSED);
+
+  btcp2p_frame_reader_release(&reader, 2000);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data + first + sizeof(message.header),
+                                      second - sizeof(message.header)) == second - sizeof(message.header));
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(reader.checksum == message.header.checksum);
+  TEST_CHECK(reader.budget_held == 1500);
+
+  btcp2p_frame_reader_destroy(&reader);
+}
+
+void test_shared_budget() {
+  uint8_t data[4096];
+  size_t size = build_frame(data, "tx", 2000);
+
+  struct btcp2p_budget_t budget;
+  struct btcp2p_message_t messages[2];
+  struct btcp2p_frame_reader_t readers[2];
+  btcp2p_budget_create(&budget, 3000);
+  for (size_t i = 0; i < 2; i++) {
+    btcp2p_frame_reader_create(&readers[i]);
+    btcp2p_frame_reader_set_budget(&readers[i], &budget, SIZE_MAX);
+  }
+
+  TEST_CHECK(btcp2p_frame_reader_feed(&readers[0], &messages[0], data, size) == size);
+  TEST_CHECK(readers[0].state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(btcp2p_budget_used(&budget) == 2000);
+
+  // The shared budget holds back the other reader, even for its first
+  // payload.
+  TEST_CHECK(btcp2p_frame_reader_feed(&readers[1], &messages[1], data, size) == sizeof(messages[1].header));
+  TEST_CHECK(readers[1].state == BTCP2P_FRAME_PAUSED);
+  TEST_CHECK(atomic_load(&budget.refused) > 0);
+
+  // Destroying a reader returns what it still held.
+  btcp2p_frame_reader_destroy(&readers[0]);
+  TEST_CHECK(btcp2p_budget_used(&budget) == 0);
+  TEST_CHECK(btcp2p_frame_reader_resume(&readers[1], &messages[1]) == BTCP2P_FRAME_PAYLOAD_PARTIAL);
+  size_t header_size = sizeof(messages[1].header);
+  TEST_CHECK(btcp2p_frame_reader_feed(&readers[1], &messages[1], data + header_size, size - header_size) ==
+             size - header_size);
+  TEST_CHECK(readers[1].state == BTCP2P_FRAME_COMPLETE);
+
+  btcp2p_frame_reader_destroy(&readers[1]);
+  TEST_CHECK(btcp2p_budget_used(&budget) == 0);
+}
+
+struct streamed_t {
+  bool has_header;
+  uint64_t tx_count;
+  size_t tx_bytes;
+};
+
+static void count_header(uint8_t const header[BTCP2P_BLOCK_HEADER_SIZE], void* ctx) {
+  (void)header;
+  ((struct streamed_t*)ctx)->has_header = true;
+}
+
+static void count_tx(uint8_t const * tx, size_t length, uint64_t index, void* ctx) {
+  (void)tx;
+  struct streamed_t* streamed = ctx;
+  TEST_CHECK(index == streamed->tx_count);
+  streamed->tx_count++;
+  streamed->tx_bytes += length;
+}
+
+// append_bytes copies length bytes of src, or a pattern if src is NULL, to
+// *dst and advances it.
+static void append_bytes(uint8_t** dst, void const * src, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    (*dst)[i] = src ? ((uint8_t const *)src)[i] : (uint8_t)i;
+  }
+  *dst += length;
+}
+
+static void append_varint(uint8_t** dst, uint64_t value) {
+  struct btcp2p_varint_t vi;
+  btcp2p_varint_encode(&vi, value);
+  append_bytes(dst, vi.data, vi.length);
+}
+
+void test_streamed_block() {
+  uint8_t* data = malloc(300 * 1024);
+  uint8_t* end = data + sizeof(struct btcp2p_message_header_t);
+  append_bytes(&end, NULL, BTCP2P_BLOCK_HEADER_SIZE);
+  append_varint(&end, 1200);
+  for (size_t i = 0; i < 1200; i++) {
+    append_bytes(&end, NULL, 4);
+    append_varint(&end, 1);
+    append_bytes(&end, NULL, 36);
+    append_varint(&end, 107);
+    append_bytes(&end, NULL, 107 + 4);
+    append_varint(&end, 1);
+    append_bytes(&end, NULL, 8);
+    append_varint(&end, 25);
+    append_bytes(&end, NULL, 25 + 4);
+  }
+  uint32_t length = (uint32_t)(end - data - sizeof(struct btcp2p_message_header_t));
+  size_t size = wrap_payload(data, "block", length);
+  TEST_CHECK(length > 2 * BTCP2P_FRAME_STREAM_CHUNK);
+
+  uint8_t block_hash[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256d(data + sizeof(struct btcp2p_message_header_t), BTCP2P_BLOCK_HEADER_SIZE, block_hash);
+
+  struct streamed_t streamed = { 0 };
+  struct btcp2p_block_stream_t stream;
+  btcp2p_block_stream_create(&stream, count_header, count_tx, &streamed);
+
+  struct btcp2p_message_t message;
+  struct btcp2p_frame_reader_t reader;
+  btcp2p_frame_reader_create(&reader);
+  reader.block_stream = &stream;
+
+  // The block passes through one chunk of storage and only that is charged.
+  for (size_t offset = 0; offset < size; ) {
+    size_t amount = 1460 < size - offset ? 1460 : size - offset;
+    offset += btcp2p_frame_reader_feed(&reader, &message, data + offset, amount);
+    if (reader.state == BTCP2P_FRAME_PAYLOAD_PARTIAL) {
+      TEST_CHECK(reader.budget_held == BTCP2P_FRAME_STREAM_CHUNK);
+    }
+  }
+
+  TEST_CHECK(reader.state == BTCP2P_FRAME_COMPLETE);
+  TEST_CHECK(reader.checksum == message.header.checksum);
+  TEST_CHECK(message.header.length == length);
+  TEST_CHECK(message.payload.len == 0);
+  TEST_CHECK(message.has_block_hash);
+  TEST_CHECK(memcmp(message.block_hash, block_hash, sizeof(block_hash)) == 0);
+  TEST_CHECK_(reader.storage.capacity <= BTCP2P_FRAME_STREAM_CHUNK, "storage of %zu bytes", reader.storage.capacity);
+
+  TEST_CHECK(btcp2p_block_stream_done(&stream));
+  TEST_CHECK(streamed.has_header);
+  TEST_CHECK(streamed.tx_count == 1200);
+  TEST_CHECK(streamed.tx_bytes == length - BTCP2P_BLOCK_HEADER_SIZE - 3);
+
+  // Other commands are kept whole.
+  size = build_frame(data, "tx", 3000);
+  btcp2p_frame_reader_reset(&reader);
+  TEST_CHECK(btcp2p_frame_reader_feed(&reader, &message, data, size) == size);
+  TEST_CHECK(message.payload.len == 3000);
+
+  btcp2p_frame_reader_destroy(&reader);
+  btcp2p_block_stream_destroy(&stream);
+  free(data);
+}
+
+TEST_LIST = {
+  { "test_whole_frame", test_whole_frame },
+  { "test_empty_payload", test_empty_payload },
+  { "test_byte_at_a_time", test_byte_at_a_time },
+  { "test_block_digests", test_block_digests },
+  { "test_corrupt_payload_checksum", test_corrupt_payload_checksum },
+  { "test_stops_at_frame_boundary", test_stops_at_frame_boundary },
+  { "fuzz_frame_splits", fuzz_frame_splits },
+  { "test_ring_zero_copy", test_ring_zero_copy },
+  { "test_ring_wrapped_payload", test_ring_wrapped_payload },
+  { "test_discard_unwanted", test_discard_unwanted },
+  { "test_ring_discard", test_ring_discard },
+  { "test_oversized_payload", test_oversized_payload },
+  { "test_budget_pauses_reader", test_budget_pauses_reader },
+  { "test_shared_budget", test_shared_budget },
+  { "test_streamed_block", test_streamed_block },
+  { 0 },
+};
@@ -0,0 +1,312 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/connection.h>
+
+// A connection handshaking over one end of a socket pair, with a peer
+// scripted from the other end.
+struct pair_t {
+  struct btcp2p_connection_t connection;
+  int peer;
+};
+
+static bool open_pair(struct pair_t* pair, struct btcp2p_features_t const * const features) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  memset(&pair->connection, 0, sizeof(pair->connection));
+  if (features) {
+    pair->connection.features = *features;
+  }
+  pair->peer = fds[1];
+  if (!btcp2p_begin_handshake(&pair->connection, &CHAIN, fds[0])) {
+    close(fds[1]);
+    return false;
+  }
+  return true;
+}
+
+static void close_pair(struct pair_t* pair) {
+  btcp2p_disconnect(&pair->connection);
+  close(pair->peer);
+}
+
+// received_commands reads what the connection has sent to the peer and
+// returns the commands in order, separated by spaces. If relay is not NULL
+// it is set to the relay flag of a version among them.
+static void received_commands(int peer, char* out, size_t out_size, uint8_t* relay) {
+  uint8_t received[4096];
+  ssize_t length = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+
+  out[0] = '\0';
+  size_t offset = 0;
+  while (length > 0 && offset + sizeof(struct btcp2p_message_header_t) <= (size_t)length) {
+    struct btcp2p_message_header_t header;
+    memcpy(&header, received + offset, sizeof(header));
+    if (out[0] != '\0') {
+      strncat(out, " ", out_size - strlen(out) - 1);
+    }
+    strncat(out, header.command, out_size - strlen(out) - 1);
+    if (relay && strcmp(header.command, "version") == 0) {
+      *relay = received[offset + sizeof(header) + header.length - 1];
+    }
+    offset += sizeof(header) + header.length;
+  }
+}
+
+// handshake advances the connection until it completes or fails.
+static enum btcp2p_handshake_status_t handshake(struct btcp2p_connection_t* connection) {
+  enum btcp2p_handshake_status_t status = BTCP2P_HANDSHAKE_PARTIAL;
+  for (int i = 0; i < 50 && status == BTCP2P_HANDSHAKE_PARTIAL; i++) {
+    status = btcp2p_continue_handshake(connection);
+    if (status == BTCP2P_HANDSHAKE_PARTIAL) {
+      struct pollfd pfd = { .fd = btcp2p_io_fd(connection), .events = POLLIN, .revents = 0 };
+      poll(&pfd, 1, 20);
+    }
+  }
+  return status;
+}
+
+static int sendcmpct_calls;
+static bool sendcmpct_after_handshake;
+static uint64_t sendcmpct_version;
+
+static void on_sendcmpct(struct btcp2p_connection_t* connection, void* ctx) {
+  (void)ctx;
+  sendcmpct_calls++;
+  sendcmpct_after_handshake = connection->handshake == BTCP2P_HANDSHAKE_DONE;
+
+  uint8_t high_bandwidth = 0;
+  sendcmpct_version = 0;
+  btcp2p_unpack_message(connection, "bl", &high_bandwidth, &sendcmpct_version);
+}
+
+void test_verack_sent_on_version(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  char sent[256];
+  received_commands(pair.peer, sent, sizeof(sent), NULL);
+  TEST_CHECK_(strcmp(sent, "version") == 0, "sent '%s'", sent);
+
+  // Our verack goes out before the peer's arrives.
+  char const * const version[] = { "version" };
+  send_commands(pair.peer, version, 1);
+  TEST_CHECK(btcp2p_continue_handshake(&pair.connection) == BTCP2P_HANDSHAKE_PARTIAL);
+  TEST_CHECK(pair.connection.handshake == BTCP2P_HANDSHAKE_AWAIT_VERACK);
+  received_commands(pair.peer, sent, sizeof(sent), NULL);
+  TEST_CHECK_(strcmp(sent, "verack") == 0, "sent '%s'", sent);
+
+  char const * const verack[] = { "verack" };
+  send_commands(pair.peer, verack, 1);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_COMPLETE);
+  TEST_CHECK(pair.connection.handshake == BTCP2P_HANDSHAKE_DONE);
+
+  close_pair(&pair);
+}
+
+void test_verack_before_version(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  char const * const commands[] = { "verack", "version" };
+  send_commands(pair.peer, commands, 2);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_COMPLETE);
+
+  char sent[256];
+  received_commands(pair.peer, sent, sizeof(sent), NULL);
+  TEST_CHECK_(strcmp(sent, "version verack") == 0, "sent '%s'", sent);
+
+  close_pair(&pair);
+}
+
+void test_features_buffered(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+  sendcmpct_calls = 0;
+  btcp2p_on(&pair.connection, BTCP2P_CMD_SENDCMPCT, on_sendcmpct, NULL);
+
+  char const * const commands[] = {
+    "version", "wtxidrelay", "sendaddrv2", "sendheaders", "sendcmpct", "verack", "ping"
+  };
+  send_commands(pair.peer, commands, 7);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_COMPLETE);
+
+  struct btcp2p_peer_features_t const * features = &pair.connection.peer_features;
+  TEST_CHECK(features->wtxidrelay);
+  TEST_CHECK(features->sendaddrv2);
+  TEST_CHECK(features->sendheaders);
+  TEST_CHECK(features->sendcmpct);
+  TEST_CHECK(features->cmpct_high_bandwidth);
+  TEST_CHECK(features->cmpct_version == 2);
+
+  // The handler only hears of the announcement once the handshake is done,
+  // with its payload intact.
+  TEST_CHECK(sendcmpct_calls == 1);
+  TEST_CHECK(sendcmpct_after_handshake);
+  TEST_CHECK(sendcmpct_version == 2);
+  TEST_CHECK(pair.connection.num_held_features == 0);
+
+  // Messages after the handshake are left for the caller.
+  TEST_CHECK(btcp2p_try_recv_message(&pair.connection) == BTCP2P_RECV_COMPLETE);
+  TEST_CHECK(btcp2p_has_command(&pair.connection, BTCP2P_CMD_PING));
+
+  close_pair(&pair);
+}
+
+void test_too_many_features_fail(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  char const * commands[BTCP2P_HELD_FEATURES_MAX + 2] = { "version" };
+  for (size_t i = 1; i < BTCP2P_HELD_FEATURES_MAX + 2; i++) {
+    commands[i] = "sendheaders";
+  }
+  send_commands(pair.peer, commands, BTCP2P_HELD_FEATURES_MAX + 2);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_FAILED);
+
+  close_pair(&pair);
+}
+
+void test_unexpected_message_fails(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  char const * const commands[] = { "ping", "version", "verack" };
+  send_commands(pair.peer, commands, 3);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_FAILED);
+
+  close_pair(&pair);
+}
+
+void test_duplicate_version_fails(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  char const * const commands[] = { "version", "version", "verack" };
+  send_commands(pair.peer, commands, 3);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_FAILED);
+
+  close_pair(&pair);
+}
+
+void test_negotiates_features(void) {
+  struct btcp2p_features_t features = {
+    .sendheaders = true,
+    .wtxidrelay = true,
+    .sendaddrv2 = true,
+    .sendcmpct = true,
+    .cmpct_high_bandwidth = true,
+    .feefilter = 1000,
+  };
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, &features))) {
+    return;
+  }
+
+  send_command_at(pair.peer, "version", BTCP2P_WTXID_RELAY_VERSION);
+  char const * const commands[] = { "wtxidrelay", "verack" };
+  send_commands(pair.peer, commands, 2);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_COMPLETE);
+
+  char sent[256];
+  uint8_t relay = 0;
+  received_commands(pair.peer, sent, sizeof(sent), &relay);
+  TEST_CHECK_(strcmp(sent, "version wtxidrelay sendaddrv2 verack sendheaders sendcmpct feefilter") == 0,
+              "sent '%s'", sent);
+  TEST_CHECK(relay == 1);
+
+  struct btcp2p_negotiated_t const * negotiated = &pair.connection.negotiated;
+  TEST_CHECK(negotiated->peer_version == BTCP2P_WTXID_RELAY_VERSION);
+  TEST_CHECK(negotiated->relay);
+  TEST_CHECK(negotiated->sendheaders);
+  TEST_CHECK(negotiated->wtxidrelay);
+  TEST_CHECK(negotiated->sendaddrv2);
+  TEST_CHECK(negotiated->feefilter == 1000);
+  TEST_CHECK(!negotiated->sendcmpct);
+
+  // The peer's compact block offer usually follows the handshake.
+  char const * const later[] = { "sendcmpct" };
+  send_commands(pair.peer, later, 1);
+  struct pollfd pfd = { .fd = btcp2p_io_fd(&pair.connection), .events = POLLIN, .revents = 0 };
+  poll(&pfd, 1, 1000);
+  TEST_CHECK(btcp2p_try_recv_message(&pair.connection) == BTCP2P_RECV_COMPLETE);
+  TEST_CHECK(negotiated->sendcmpct);
+  TEST_CHECK(negotiated->cmpct_high_bandwidth);
+  TEST_CHECK(btcp2p_received_bytes(&pair.connection, BTCP2P_CMD_SENDCMPCT) ==
+             sizeof(struct btcp2p_message_header_t) + 9);
+
+  // The payload can still be unpacked by the caller.
+  uint8_t high_bandwidth = 0;
+  uint64_t version = 0;
+  TEST_CHECK(btcp2p_unpack_message(&pair.connection, "bl", &high_bandwidth, &version));
+  TEST_CHECK(high_bandwidth == 1 && version == 2);
+
+  close_pair(&pair);
+}
+
+void test_block_only(void) {
+  struct btcp2p_features_t features = {
+    .wtxidrelay = true,
+    .feefilter = 1000,
+    .block_only = true,
+  };
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, &features))) {
+    return;
+  }
+
+  // An older peer gets neither wtxidrelay nor, on a block-only connection,
+  // a fee filter.
+  char const * const commands[] = { "version", "verack" };
+  send_commands(pair.peer, commands, 2);
+  TEST_CHECK(handshake(&pair.connection) == BTCP2P_HANDSHAKE_COMPLETE);
+
+  char sent[256];
+  uint8_t relay = 1;
+  received_commands(pair.peer, sent, sizeof(sent), &relay);
+  TEST_CHECK_(strcmp(sent, "version verack") == 0, "sent '%s'", sent);
+  TEST_CHECK(relay == 0);
+
+  TEST_CHECK(!pair.connection.negotiated.relay);
+  TEST_CHECK(!pair.connection.negotiated.wtxidrelay);
+  TEST_CHECK(pair.connection.negotiated.feefilter == 0);
+
+  close_pair(&pair);
+}
+
+TEST_LIST = {
+  { "test_verack_sent_on_version", test_verack_sent_on_version },
+  { "test_verack_before_version", test_verack_before_version },
+  { "test_features_buffered", test_features_buffered },
+  { "test_too_many_features_fail", test_too_many_features_fail },
+  { "test_unexpected_message_fails", test_unexpected_message_fails },
+  { "test_duplicate_version_fails", test_duplicate_version_fails },
+  { "test_negotiates_features", test_negotiates_features },
+  { "test_block_only", test_block_only },
+  { 0 },
+};
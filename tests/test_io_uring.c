@@ -0,0 +1,316 @@
+// Needed for syscall.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/connection.h>
+#include <libbtcp2p/io_uring.h>
+
+// Larger than every provided buffer together, so the buffer ring wraps.
+#define LARGE_SIZE (3 * BTCP2P_URING_BUFFER_COUNT * BTCP2P_URING_BUFFER_SIZE + 123)
+
+// uring_supported returns false, noting why, if the kernel has no io_uring
+// or the test should not expect the backend to open.
+static bool uring_supported(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, 1, &params);
+  if (fd < 0) {
+    TEST_MSG("io_uring_setup failed (%s), skipping", strerror(errno));
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// open_ring opens a ring on a loopback client, returning NULL if the test
+// should be skipped.
+static struct btcp2p_uring_t* open_ring(int* client, int* server) {
+  if (!uring_supported() || !TEST_CHECK(open_loopback(client, server))) {
+    return NULL;
+  }
+
+  struct btcp2p_uring_t* ring = btcp2p_uring_open(*client);
+  if (!ring) {
+    TEST_MSG("kernel lacks multishot receives or provided buffer rings, skipping");
+    close(*client);
+    close(*server);
+  }
+  return ring;
+}
+
+static void fill_pattern(uint8_t* dst, size_t len, size_t seed) {
+  for (size_t i = 0; i < len; i++) {
+    dst[i] = (uint8_t)((i + seed) * 31 + (i >> 12));
+  }
+}
+
+// uring_recv_all reads exactly len bytes through the ring, in reads of at
+// most piece bytes, waiting on the ring's descriptor whenever nothing has
+// arrived yet.
+static bool uring_recv_all(struct btcp2p_uring_t* ring, uint8_t* dst, size_t len, size_t piece) {
+  size_t received = 0;
+  for (int idle = 0; received < len && idle < 100; ) {
+    size_t want = len - received < piece ? len - received : piece;
+    ssize_t n = btcp2p_uring_recv(ring, dst + received, want);
+    if (n > 0) {
+      received += (size_t)n;
+      idle = 0;
+      continue;
+    }
+    if (n == 0 || errno != EAGAIN) {
+      return false;
+    }
+
+    struct pollfd pfd = { .fd = btcp2p_uring_fd(ring), .events = POLLIN, .revents = 0 };
+    if (poll(&pfd, 1, 50) == 0) {
+      idle++;
+    }
+  }
+  return received == len;
+}
+
+struct peer_io_t {
+  int socket;
+  uint8_t* data;
+  size_t len;
+  bool ok;
+};
+
+static void* send_from_peer(void* arg) {
+  struct peer_io_t* io = arg;
+  size_t sent = 0;
+  while (sent < io->len) {
+    ssize_t n = send(io->socket, io->data + sent, io->len - sent, 0);
+    if (n <= 0) break;
+    sent += (size_t)n;
+  }
+  io->ok = sent == io->len;
+  return NULL;
+}
+
+static void* recv_at_peer(void* arg) {
+  struct peer_io_t* io = arg;
+  size_t received = 0;
+  while (received < io->len) {
+    // Read slowly so the sender's socket buffer stays full.
+    size_t want = io->len - received < 8192 ? io->len - received : 8192;
+    ssize_t n = recv(io->socket, io->data + received, want, 0);
+    if (n <= 0) break;
+    received += (size_t)n;
+    if (received % (64 * 1024) < 8192) {
+      struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+      nanosleep(&pause, NULL);
+    }
+  }
+  io->ok = received == io->len;
+  return NULL;
+}
+
+void test_round_trip(void) {
+  int client, server;
+  struct btcp2p_uring_t* ring = open_ring(&client, &server);
+  if (!ring) {
+    return;
+  }
+
+  // A header and payload go out as one linked send.
+  uint8_t header[24], payload[100], received[124];
+  fill_pattern(header, sizeof(header), 1);
+  fill_pattern(payload, sizeof(payload), 2);
+  struct iovec iov[2] = {
+    { .iov_base = header, .iov_len = sizeof(header) },
+    { .iov_base = payload, .iov_len = sizeof(payload) },
+  };
+  TEST_CHECK(btcp2p_uring_sendv_all(ring, iov, 2) == 0);
+  TEST_CHECK(recv_all(server, received, sizeof(received)));
+  TEST_CHECK(memcmp(received, header, sizeof(header)) == 0);
+  TEST_CHECK(memcmp(received + sizeof(header), payload, sizeof(payload)) == 0);
+
+  // Nothing has been received yet.
+  TEST_CHECK(!btcp2p_uring_has_pending(ring));
+  TEST_CHECK(btcp2p_uring_recv(ring, received, sizeof(received)) == -1);
+  TEST_CHECK(errno == EAGAIN);
+
+  TEST_CHECK(send(server, payload, sizeof(payload), 0) == (ssize_t)sizeof(payload));
+  memset(received, 0, sizeof(received));
+  TEST_CHECK(uring_recv_all(ring, received, sizeof(payload), sizeof(received)));
+  TEST_CHECK(memcmp(received, payload, sizeof(payload)) == 0);
+
+  // End of stream is reported once everything has been consumed.
+  close(server);
+  struct pollfd pfd = { .fd = btcp2p_uring_fd(ring), .events = POLLIN, .revents = 0 };
+  poll(&pfd, 1, 1000);
+  TEST_CHECK(btcp2p_uring_has_pending(ring));
+  TEST_CHECK(btcp2p_uring_recv(ring, received, sizeof(received)) == 0);
+
+  btcp2p_uring_close(ring);
+  close(client);
+}
+
+void test_buffer_ring_wraps(void) {
+  int client, server;
+  struct btcp2p_uring_t* ring = open_ring(&client, &server);
+  if (!ring) {
+    return;
+  }
+
+  struct peer_io_t io = { .socket = server, .data = malloc(LARGE_SIZE), .len = LARGE_SIZE };
+  uint8_t* received = malloc(LARGE_SIZE);
+  fill_pattern(io.data, LARGE_SIZE, 3);
+
+  // Let the peer fill every provided buffer first, so the multishot receive
+  // runs out of buffers and has to be armed again.
+  pthread_t thread;
+  pthread_create(&thread, NULL, send_from_peer, &io);
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 50 * 1000000 };
+  nanosleep(&pause, NULL);
+
+  // Reads that straddle buffers, part buffers, and several at once.
+  TEST_CHECK(uring_recv_all(ring, received, 1000, 1000));
+  TEST_CHECK(uring_recv_all(ring, received + 1000, 3 * BTCP2P_URING_BUFFER_SIZE, BTCP2P_URING_BUFFER_SIZE + 17));
+  size_t offset = 1000 + 3 * BTCP2P_URING_BUFFER_SIZE;
+  TEST_CHECK(uring_recv_all(ring, received + offset, LARGE_SIZE - offset, 5 * BTCP2P_URING_BUFFER_SIZE));
+  pthread_join(thread, NULL);
+
+  TEST_CHECK(io.ok);
+  TEST_CHECK(memcmp(received, io.data, LARGE_SIZE) == 0);
+
+  free(received);
+  free(io.data);
+  btcp2p_uring_close(ring);
+  close(client);
+  close(server);
+}
+
+void test_short_send_falls_back(void) {
+  int client, server;
+  struct btcp2p_uring_t* ring = open_ring(&client, &server);
+  if (!ring) {
+    return;
+  }
+
+  // A small send buffer and a slow reader cut the linked sends short, and
+  // the rest is written with plain system calls.
+  int sndbuf = 4096;
+  setsockopt(client, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  uint8_t* data = malloc(LARGE_SIZE);
+  fill_pattern(data, LARGE_SIZE, 4);
+  struct iovec iov[3] = {
+    { .iov_base = data, .iov_len = 24 },
+    { .iov_base = data + 24, .iov_len = LARGE_SIZE / 2 },
+    { .iov_base = data + 24 + LARGE_SIZE / 2, .iov_len = LARGE_SIZE - 24 - LARGE_SIZE / 2 },
+  };
+
+  struct peer_io_t io = { .socket = server, .data = malloc(LARGE_SIZE), .len = LARGE_SIZE };
+  pthread_t thread;
+  pthread_create(&thread, NULL, recv_at_peer, &io);
+  TEST_CHECK(btcp2p_uring_sendv_all(ring, iov, 3) == 0);
+  pthread_join(thread, NULL);
+
+  TEST_CHECK(io.ok);
+  TEST_CHECK(memcmp(io.data, data, LARGE_SIZE) == 0);
+
+  free(io.data);
+  free(data);
+  btcp2p_uring_close(ring);
+  close(client);
+  close(server);
+}
+
+void test_send_rewakes_poller(void) {
+  int client, server;
+  struct btcp2p_uring_t* ring = open_ring(&client, &server);
+  if (!ring) {
+    return;
+  }
+
+  uint8_t byte = 0x42;
+  TEST_CHECK(send(server, &byte, 1, 0) == 1);
+  struct pollfd pfd = { .fd = btcp2p_uring_fd(ring), .events = POLLIN, .revents = 0 };
+  TEST_CHECK(poll(&pfd, 1, 1000) == 1);
+
+  // Sending reaps the receive completion, so the ring must post another to
+  // keep the poller from missing the data.
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  TEST_CHECK(btcp2p_uring_sendv_all(ring, &iov, 1) == 0);
+  pfd.revents = 0;
+  TEST_CHECK(poll(&pfd, 1, 0) == 1);
+
+  uint8_t received = 0;
+  TEST_CHECK(btcp2p_uring_recv(ring, &received, 1) == 1);
+  TEST_CHECK(received == 0x42);
+
+  btcp2p_uring_close(ring);
+  close(client);
+  close(server);
+}
+
+void test_connection_backend(void) {
+  int client, server;
+  if (!TEST_CHECK(open_loopback(&client, &server))) {
+    return;
+  }
+
+  // Without kernel support the connection falls back to plain sockets.
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  connection.io_backend = BTCP2P_IO_URING;
+  if (!TEST_CHECK(btcp2p_begin_handshake(&connection, &CHAIN, client))) {
+    close(server);
+    return;
+  }
+  TEST_CHECK((connection.uring != NULL) == (connection.io_backend == BTCP2P_IO_URING));
+
+  send_command(server, "version");
+  send_command(server, "verack");
+  send_command(server, "pong");
+  enum btcp2p_handshake_status_t status = BTCP2P_HANDSHAKE_PARTIAL;
+  for (int i = 0; i < 50 && status == BTCP2P_HANDSHAKE_PARTIAL; i++) {
+    status = btcp2p_continue_handshake(&connection);
+    if (status == BTCP2P_HANDSHAKE_PARTIAL) {
+      struct pollfd pfd = { .fd = btcp2p_io_fd(&connection), .events = POLLIN, .revents = 0 };
+      poll(&pfd, 1, 20);
+    }
+  }
+  TEST_CHECK(status == BTCP2P_HANDSHAKE_COMPLETE);
+
+  // Messages after the handshake arrive through the same backend.
+  for (int i = 0; i < 50 && !btcp2p_has_message(&connection, "pong"); i++) {
+    TEST_CHECK(btcp2p_message_pump_timeout(&connection, 20));
+  }
+  TEST_CHECK(btcp2p_has_message(&connection, "pong"));
+
+  // Our version and verack reach the peer.
+  uint8_t received[256];
+  TEST_CHECK(recv(server, received, sizeof(received), 0) >= (ssize_t)(2 * sizeof(struct btcp2p_message_header_t)));
+  TEST_CHECK(strcmp((char*)received + 4, "version") == 0);
+
+  btcp2p_disconnect(&connection);
+  close(server);
+}
+
+TEST_LIST = {
+  { "test_round_trip", test_round_trip },
+  { "test_buffer_ring_wraps", test_buffer_ring_wraps },
+  { "test_short_send_falls_back", test_short_send_falls_back },
+  { "test_send_rewakes_poller", test_send_rewakes_poller },
+  { "test_connection_backend", test_connection_backend },
+  { 0 },
+};
@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/connection.h>
+
+// dial connects a blocking client socket to the listener over loopback.
+static int dial(struct btcp2p_listener_t const * const listener) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(btcp2p_listener_port(listener));
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  if (client >= 0 && connect(client, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(client);
+    return -1;
+  }
+  return client;
+}
+
+// accept_one polls the listener until a peer has been accepted or rejected.
+static enum btcp2p_accept_status_t accept_one(struct btcp2p_listener_t* listener,
+                                              struct btcp2p_connection_t* connection)
+{
+  for (int i = 0; i < 50; i++) {
+    enum btcp2p_accept_status_t status = btcp2p_accept(listener, connection);
+    if (status != BTCP2P_ACCEPT_NONE) {
+      return status;
+    }
+
+    struct pollfd pfd = { .fd = listener->socket, .events = POLLIN, .revents = 0 };
+    poll(&pfd, 1, 100);
+  }
+
+  return BTCP2P_ACCEPT_NONE;
+}
+
+// handshake drives an accepted connection's handshake for up to about
+// timeout_ms.
+static enum btcp2p_handshake_status_t handshake(struct btcp2p_connection_t* connection,
+                                                int timeout_ms)
+{
+  enum btcp2p_handshake_status_t status = btcp2p_continue_handshake(connection);
+  for (int waited = 0; waited < timeout_ms && status == BTCP2P_HANDSHAKE_PARTIAL; waited += 10) {
+    struct pollfd pfd = { .fd = btcp2p_io_fd(connection), .events = POLLIN, .revents = 0 };
+    poll(&pfd, 1, 10);
+    status = btcp2p_continue_handshake(connection);
+  }
+
+  return status;
+}
+
+void test_accept_performs_handshake(void) {
+  struct btcp2p_listener_t listener;
+  memset(&listener, 0, sizeof(listener));
+  if (!TEST_CHECK(btcp2p_listen(&listener, "regtest", "127.0.0.1", "0"))) {
+    return;
+  }
+  TEST_CHECK(btcp2p_listener_port(&listener) != 0);
+
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  TEST_CHECK(btcp2p_accept(&listener, &connection) == BTCP2P_ACCEPT_NONE);
+
+  int client = dial(&listener);
+  if (!TEST_CHECK(client >= 0)) {
+    return;
+  }
+  char const * const commands[] = { "version", "wtxidrelay", "sendaddrv2", "verack" };
+  send_commands(client, commands, 4);
+
+  TEST_CHECK(accept_one(&listener, &connection) == BTCP2P_ACCEPT_COMPLETE);
+  TEST_CHECK(handshake(&connection, 5000) == BTCP2P_HANDSHAKE_COMPLETE);
+  TEST_CHECK(!connection.closed);
+  TEST_CHECK(connection.peer_features.wtxidrelay);
+  TEST_CHECK(connection.peer_features.sendaddrv2);
+  TEST_CHECK(!connection.peer_features.sendheaders);
+  TEST_CHECK(connection.chain->magic == BTCP2P_MAGIC_REGTEST);
+
+  // The peer's address is recorded as the address the connection is from.
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+  getsockname(client, (struct sockaddr*)&local, &local_len);
+  TEST_CHECK(connection.addr_from.port == local.sin_port);
+  TEST_CHECK(memcmp(&connection.addr_from.address[12], &local.sin_addr, 4) == 0);
+  btcp2p_disconnect(&connection);
+
+  // The client receives our version followed by a verack.
+  uint8_t received[1024];
+  size_t length = 0;
+  ssize_t n;
+  while (length < sizeof(received) &&
+         (n = recv(client, received + length, sizeof(received) - length, 0)) > 0)
+  {
+    length += (size_t)n;
+  }
+  close(client);
+
+  if (!TEST_CHECK(length >= 2 * sizeof(struct btcp2p_message_header_t))) {
+    return;
+  }
+  uint32_t version_length;
+  memcpy(&version_length, received + 16, sizeof(version_length));
+  TEST_CHECK(strcmp((char*)received + 4, "version") == 0);
+  TEST_CHECK(length == 2 * sizeof(struct btcp2p_message_header_t) + version_length);
+  TEST_CHECK(strcmp((char*)received + sizeof(struct btcp2p_message_header_t) + version_length + 4, "verack") == 0);
+
+  btcp2p_listener_close(&listener);
+}
+
+void test_accept_rejects_missing_version(void) {
+  struct btcp2p_listener_t listener;
+  memset(&listener, 0, sizeof(listener));
+  if (!TEST_CHECK(btcp2p_listen(&listener, "regtest", "127.0.0.1", "0"))) {
+    return;
+  }
+
+  int client = dial(&listener);
+  if (!TEST_CHECK(client >= 0)) {
+    return;
+  }
+  char const * const commands[] = { "verack" };
+  send_commands(client, commands, 1);
+
+  struct btcp2p_connection_t connection;
+  memset(&connection, 0, sizeof(connection));
+  TEST_CHECK(accept_one(&listener, &connection) == BTCP2P_ACCEPT_COMPLETE);
+  TEST_CHECK(handshake(&connection, 5000) == BTCP2P_HANDSHAKE_FAILED);
+  btcp2p_disconnect(&connection);
+
+  close(client);
+  btcp2p_listener_close(&listener);
+}
+
+void test_accept_does_not_wait_for_silent_peer(void) {
+  struct btcp2p_listener_t listener;
+  memset(&listener, 0, sizeof(listener));
+  if (!TEST_CHECK(btcp2p_listen(&listener, "regtest", "127.0.0.1", "0"))) {
+    return;
+  }
+
+  // A peer that never speaks connects ahead of one that does.
+  int silent = dial(&listener);
+  int client = dial(&listener);
+  if (!TEST_CHECK(silent >= 0 && client >= 0)) {
+    return;
+  }
+  char const * const commands[] = { "version", "verack" };
+  send_commands(client, commands, 2);
+
+  struct btcp2p_connection_t quiet, chatty;
+  memset(&quiet, 0, sizeof(quiet));
+  memset(&chatty, 0, sizeof(chatty));
+  uint64_t start_ns = btcp2p_timer_now_ns();
+  TEST_CHECK(accept_one(&listener, &quiet) == BTCP2P_ACCEPT_COMPLETE);
+  TEST_CHECK(accept_one(&listener, &chatty) == BTCP2P_ACCEPT_COMPLETE);
+  TEST_CHECK(handshake(&chatty, 5000) == BTCP2P_HANDSHAKE_COMPLETE);
+  TEST_CHECK(btcp2p_continue_handshake(&quiet) == BTCP2P_HANDSHAKE_PARTIAL);
+  uint64_t elapsed_ms = (btcp2p_timer_now_ns() - start_ns) / BTCP2P_NS_PER_MS;
+  TEST_CHECK_(elapsed_ms < 1000, "handshake took %llu ms", (unsigned long long)elapsed_ms);
+
+  // Nothing has been sent to the silent peer, which is dropped once its
+  // deadline passes.
+  TEST_CHECK(handshake(&quiet, 100) == BTCP2P_HANDSHAKE_PARTIAL);
+  btcp2p_disconnect(&quiet);
+  struct pollfd pfd = { .fd = silent, .events = POLLIN, .revents = 0 };
+  uint8_t received[64];
+  TEST_CHECK(poll(&pfd, 1, 1000) == 1);
+  TEST_CHECK(recv(silent, received, sizeof(received), MSG_DONTWAIT) == 0);
+
+  btcp2p_disconnect(&chatty);
+  close(silent);
+  close(client);
+  btcp2p_listener_close(&listener);
+}
+
+void test_reuse_port_shares_port(void) {
+  struct btcp2p_listener_t first;
+  memset(&first, 0, sizeof(first));
+  first.reuse_port = true;
+  if (!TEST_CHECK(btcp2p_listen(&first, "regtest", "127.0.0.1", "0"))) {
+    return;
+  }
+
+  char port[6];
+  snprintf(port, sizeof(port), "%u", btcp2p_listener_port(&first));
+
+  struct btcp2p_listener_t second;
+  memset(&second, 0, sizeof(second));
+  second.reuse_port = true;
+  TEST_CHECK(btcp2p_listen(&second, "regtest", "127.0.0.1", port));
+  TEST_CHECK(btcp2p_listener_port(&second) == btcp2p_listener_port(&first));
+
+  // Without SO_REUSEPORT the port is taken.
+  struct btcp2p_listener_t third;
+  memset(&third, 0, sizeof(third));
+  TEST_CHECK(!btcp2p_listen(&third, "regtest", "127.0.0.1", port));
+  TEST_CHECK(third.socket == -1);
+
+  btcp2p_listener_close(&second);
+  btcp2p_listener_close(&first);
+}
+
+TEST_LIST = {
+  { "test_accept_performs_handshake", test_accept_performs_handshake },
+  { "test_accept_rejects_missing_version", test_accept_rejects_missing_version },
+  { "test_accept_does_not_wait_for_silent_peer", test_accept_does_not_wait_for_silent_peer },
+  { "test_reuse_port_shares_port", test_reuse_port_shares_port },
+  { 0 },
+};
@@ -0,0 +1,653 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/connection.h>
+#include <libbtcp2p/pack.h>
+#include <libbtcp2p/vartypes.h>
+
+// A handshaken connection over one end of a socket pair, with a peer
+// scripted from the other end.
+struct pair_t {
+  struct btcp2p_connection_t connection;
+  int peer;
+};
+
+// received_command returns the command of the first frame the connection
+// has sent to the peer since the last call, or "" if there is none.
+static void received_command(int peer, char out[13]) {
+  uint8_t received[4096];
+  ssize_t length = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+
+  memset(out, 0, 13);
+  if (length >= (ssize_t)sizeof(struct btcp2p_message_header_t)) {
+    struct btcp2p_message_header_t header;
+    memcpy(&header, received, sizeof(header));
+    memcpy(out, header.command, 12);
+  }
+}
+
+// open_verified_pair opens a pair whose connection checks checksums in pool,
+// or itself if pool is NULL.
+static bool open_verified_pair(struct pair_t* pair, bool use_wake,
+                               struct btcp2p_timer_wheel_t* timers,
+                               struct btcp2p_verify_pool_t* pool)
+{
+  memset(&pair->connection, 0, sizeof(pair->connection));
+  pair->connection.use_wake = use_wake;
+  pair->connection.verify_pool = pool;
+  if (!open_handshaken(&pair->connection, &pair->peer)) {
+    return false;
+  }
+  pair->connection.timers = timers;
+  return true;
+}
+
+static bool open_pair(struct pair_t* pair, bool use_wake, struct btcp2p_timer_wheel_t* timers) {
+  return open_verified_pair(pair, use_wake, timers, NULL);
+}
+
+static void close_pair(struct pair_t* pair) {
+  btcp2p_disconnect(&pair->connection);
+  close(pair->peer);
+}
+
+static uint64_t elapsed_ms(uint64_t start_ns) {
+  return (btcp2p_timer_now_ns() - start_ns) / BTCP2P_NS_PER_MS;
+}
+
+void test_timeout_without_data(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+
+  uint64_t start_ns = btcp2p_timer_now_ns();
+  TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, 50));
+  TEST_CHECK(!pair.connection.has_message);
+  TEST_CHECK_(elapsed_ms(start_ns) >= 49, "returned after %llu ms", (unsigned long long)elapsed_ms(start_ns));
+
+  // A message waiting ends an indefinite wait.
+  send_command(pair.peer, "ping");
+  TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, -1));
+  TEST_CHECK(btcp2p_has_message(&pair.connection, "ping"));
+
+  close_pair(&pair);
+}
+
+static void* wake_later(void* arg) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 20 * 1000000 };
+  nanosleep(&pause, NULL);
+  TEST_CHECK(btcp2p_wake(arg));
+  return NULL;
+}
+
+void test_wake_from_thread(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, true, NULL))) {
+    return;
+  }
+  if (!TEST_CHECK(pair.connection.wake_fd >= 0)) {
+    close_pair(&pair);
+    return;
+  }
+
+  for (int round = 0; round < 3; round++) {
+    pthread_t thread;
+    uint64_t start_ns = btcp2p_timer_now_ns();
+    pthread_create(&thread, NULL, wake_later, &pair.connection);
+    TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, 5000));
+    uint64_t waited_ms = elapsed_ms(start_ns);
+    pthread_join(thread, NULL);
+
+    TEST_CHECK(!pair.connection.has_message);
+    TEST_CHECK_(waited_ms >= 19 && waited_ms < 1000, "round %d woke after %llu ms",
+                round, (unsigned long long)waited_ms);
+  }
+
+  close_pair(&pair);
+  TEST_CHECK(pair.connection.wake_fd == -1);
+}
+
+void test_wake_requires_opt_in(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+
+  TEST_CHECK(pair.connection.wake_fd == -1);
+  TEST_CHECK(!btcp2p_wake(&pair.connection));
+
+  close_pair(&pair);
+}
+
+struct scheduled_ping_t {
+  struct btcp2p_wheel_timer_t timer;
+  struct btcp2p_connection_t* connection;
+  uint64_t sent_ns;
+};
+
+static void send_ping(struct btcp2p_wheel_timer_t* timer, void* ctx) {
+  (void)timer;
+  struct scheduled_ping_t* ping = ctx;
+  ping->sent_ns = btcp2p_timer_now_ns();
+  TEST_CHECK(btcp2p_pack_and_send_message(ping->connection, "ping", "L", (uint64_t)42));
+}
+
+void test_timer_sends_on_time(void) {
+  struct btcp2p_timer_wheel_t timers;
+  struct pair_t pair;
+  btcp2p_timer_wheel_create(&timers, btcp2p_timer_now_ns());
+  if (!TEST_CHECK(open_pair(&pair, false, &timers))) {
+    return;
+  }
+
+  struct scheduled_ping_t ping = { .connection = &pair.connection };
+  uint64_t deadline_ns = btcp2p_timer_now_ns() + 30 * BTCP2P_NS_PER_MS;
+  btcp2p_timer_wheel_schedule(&timers, &ping.timer, deadline_ns, send_ping, &ping);
+
+  // The timer, not the timeout, ends the wait.
+  TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, -1));
+  TEST_CHECK(ping.sent_ns >= deadline_ns);
+  TEST_CHECK_(ping.sent_ns - deadline_ns < 20 * BTCP2P_NS_PER_MS, "sent %llu us late",
+              (unsigned long long)(ping.sent_ns - deadline_ns) / 1000);
+
+  char command[13];
+  received_command(pair.peer, command);
+  TEST_CHECK_(strcmp(command, "ping") == 0, "sent '%s'", command);
+
+  // Timers also fire when a message is already waiting.
+  send_command(pair.peer, "pong");
+  ping.sent_ns = 0;
+  btcp2p_timer_wheel_schedule(&timers, &ping.timer, btcp2p_timer_now_ns(), send_ping, &ping);
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 2 * 1000000 };
+  nanosleep(&pause, NULL);
+  TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, -1));
+  TEST_CHECK(btcp2p_has_message(&pair.connection, "pong"));
+  TEST_CHECK(ping.sent_ns != 0);
+
+  close_pair(&pair);
+}
+
+void test_oversized_payload_fails(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+
+  // A ping nonce is 8 bytes, so a 9 byte ping is refused from its header.
+  struct btcp2p_message_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = BTCP2P_MAGIC_REGTEST;
+  strncpy(header.command, "ping", sizeof(header.command));
+  header.length = 9;
+  uint8_t frame[sizeof(header) + 9] = { 0 };
+  memcpy(frame, &header, sizeof(header));
+  TEST_CHECK(send(pair.peer, frame, sizeof(frame), 0) == (ssize_t)sizeof(frame));
+
+  TEST_CHECK(!btcp2p_message_pump_timeout(&pair.connection, 100));
+  TEST_CHECK(!pair.connection.has_message);
+
+  close_pair(&pair);
+}
+
+static void* release_later(void* arg) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 30 * 1000000 };
+  nanosleep(&pause, NULL);
+  btcp2p_budget_release(arg, 100);
+  return NULL;
+}
+
+void test_paused_until_budget_released(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+
+  // Other connections have used up the shared budget.
+  struct btcp2p_budget_t budget;
+  btcp2p_budget_create(&budget, 100);
+  TEST_CHECK(btcp2p_budget_charge(&budget, 100));
+  btcp2p_frame_reader_set_budget(&pair.connection.reader, &budget, BTCP2P_RECV_BUDGET);
+
+  send_command(pair.peer, "ping");
+  TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, 50));
+  TEST_CHECK(!pair.connection.has_message);
+  TEST_CHECK(btcp2p_recv_paused(&pair.connection));
+
+  pthread_t thread;
+  uint64_t start_ns = btcp2p_timer_now_ns();
+  pthread_create(&thread, NULL, release_later, &budget);
+  for (int i = 0; i < 100 && !pair.connection.has_message; i++) {
+    TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, -1));
+  }
+  pthread_join(thread, NULL);
+
+  TEST_CHECK(btcp2p_has_message(&pair.connection, "ping"));
+  TEST_CHECK(elapsed_ms(start_ns) >= 29);
+  TEST_CHECK(!btcp2p_recv_paused(&pair.connection));
+  TEST_CHECK(btcp2p_budget_used(&budget) == 8);
+
+  // The payload is released once the next message is pumped.
+  TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, 0));
+  TEST_CHECK(btcp2p_budget_used(&budget) == 0);
+
+  close_pair(&pair);
+}
+
+struct block_sender_t {
+  int peer;
+  uint8_t* frame;
+  size_t size;
+};
+
+static void* send_block(void* arg) {
+  struct block_sender_t* sender = arg;
+  for (size_t sent = 0; sent < sender->size; ) {
+    ssize_t n = send(sender->peer, sender->frame + sent, sender->size - sent, 0);
+    if (n <= 0) {
+      break;
+    }
+    sent += (size_t)n;
+  }
+  return NULL;
+}
+
+static void count_tx(uint8_t const * tx, size_t length, uint64_t index, void* ctx) {
+  (void)tx;
+  (void)length;
+  *(uint64_t*)ctx = index + 1;
+}
+
+// build_block frames a block of tx_count coinbase-like transactions, with
+// extra bytes of garbage after them, returning the frame size.
+static size_t build_block(uint8_t* frame, size_t tx_count, size_t extra) {
+  uint8_t* end = frame + sizeof(struct btcp2p_message_header_t) + BTCP2P_BLOCK_HEADER_SIZE;
+  memset(frame, 0, sizeof(struct btcp2p_message_header_t) + BTCP2P_BLOCK_HEADER_SIZE);
+  struct btcp2p_varint_t vi;
+  btcp2p_varint_encode(&vi, tx_count);
+  memcpy(end, vi.data, vi.length);
+  end += vi.length;
+
+  // version, one input with a 100 byte script, one output with a 25 byte
+  // script, lock time.
+  for (size_t i = 0; i < tx_count; i++) {
+    memset(end, 0x11, 4);
+    end += 4;
+    *end++ = 1;
+    memset(end, 0x11, 36);
+    end += 36;
+    *end++ = 100;
+    memset(end, 0x22, 100 + 4);
+    end += 100 + 4;
+    *end++ = 1;
+    memset(end, 0x33, 8);
+    end += 8;
+    *end++ = 25;
+    memset(end, 0x44, 25 + 4);
+    end += 25 + 4;
+  }
+  memset(end, 0, extra);
+  end += extra;
+
+  struct btcp2p_message_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = BTCP2P_MAGIC_REGTEST;
+  strncpy(header.command, "block", sizeof(header.command));
+  header.length = (uint32_t)(end - frame - sizeof(header));
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256d(frame + sizeof(header), header.length, digest);
+  memcpy(&header.checksum, digest, sizeof(header.checksum));
+  memcpy(frame, &header, sizeof(header));
+
+  return sizeof(header) + header.length;
+}
+
+void test_streamed_block(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+
+  uint64_t tx_count = 0;
+  struct btcp2p_block_stream_t stream;
+  btcp2p_block_stream_create(&stream, NULL, count_tx, &tx_count);
+  pair.connection.reader.block_stream = &stream;
+
+  struct block_sender_t sender = { .peer = pair.peer, .frame = malloc(512 * 1024) };
+  sender.size = build_block(sender.frame, 2000, 0);
+  pthread_t thread;
+  pthread_create(&thread, NULL, send_block, &sender);
+  for (int i = 0; i < 100 && !btcp2p_has_message(&pair.connection, "block"); i++) {
+    TEST_CHECK(btcp2p_message_pump_timeout(&pair.connection, 100));
+    TEST_CHECK(pair.connection.recv_charged <= BTCP2P_FRAME_STREAM_CHUNK);
+  }
+  pthread_join(thread, NULL);
+
+  TEST_CHECK(btcp2p_has_message(&pair.connection, "block"));
+  TEST_CHECK(tx_count == 2000);
+
+  // A block with bytes after its transactions is refused, though its
+  // checksum matches.
+  sender.size = build_block(sender.frame, 3, 1);
+  send_block(&sender);
+  bool pumped = true;
+  for (int i = 0; i < 10 && pumped; i++) {
+    pumped = btcp2p_message_pump_timeout(&pair.connection, 100);
+    TEST_CHECK(!pair.connection.has_message);
+  }
+  TEST_CHECK(!pumped);
+
+  close_pair(&pair);
+  btcp2p_block_stream_destroy(&stream);
+  free(sender.frame);
+}
+
+// send_ping_burst writes count pings with consecutive nonces from first in a
+// single segment from the peer.
+static void send_ping_burst(int peer, uint64_t first, size_t count) {
+  struct btcp2p_connection_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.chain = &CHAIN;
+  btcp2p_checked_buffer_create(&conn.outgoing.payload);
+
+  uint8_t burst[64 * (sizeof(struct btcp2p_message_header_t) + 8)];
+  size_t length = 0;
+  for (size_t i = 0; i < count && length + sizeof(conn.outgoing.header) + 8 <= sizeof(burst); i++) {
+    btcp2p_pack_message(&conn, &conn.outgoing, "ping", "L", first + i);
+    memcpy(burst + length, &conn.outgoing.header, sizeof(conn.outgoing.header));
+    length += sizeof(conn.outgoing.header);
+    memcpy(burst + length, conn.outgoing.payload.buffer, 8);
+    length += 8;
+  }
+  TEST_CHECK(send(peer, burst, length, 0) == (ssize_t)length);
+
+  btcp2p_checked_buffer_destroy(&conn.outgoing.payload);
+}
+
+// receive_batches pumps batches into messages until count messages have
+// been received.
+static bool receive_batches(struct btcp2p_connection_t* connection,
+                            struct btcp2p_message_t* messages,
+                            size_t count)
+{
+  size_t total = 0;
+  for (int i = 0; i < 100 && total < count; i++) {
+    size_t received = 0;
+    if (!btcp2p_message_pump_batch(connection, messages + total, count - total, &received)) {
+      return false;
+    }
+    total += received;
+  }
+  return total == count;
+}
+
+// nonces_match checks that each message is a ping carrying the nonce first
+// plus its index.
+static bool nonces_match(struct btcp2p_message_t* messages, size_t count, uint64_t first) {
+  for (size_t i = 0; i < count; i++) {
+    uint64_t nonce = 0;
+    btcp2p_checked_buffer_read_reset(&messages[i].payload);
+    if (messages[i].command_id != BTCP2P_CMD_PING ||
+        messages[i].header.length != sizeof(nonce) ||
+        btcp2p_unpack(&messages[i].payload, "L", &nonce) != sizeof(nonce) ||
+        nonce != first + i)
+    {
+      TEST_MSG("message %zu carries nonce %llu", i, (unsigned long long)nonce);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void check_batches(struct btcp2p_verify_pool_t* pool) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_verified_pair(&pair, false, NULL, pool))) {
+    return;
+  }
+
+  enum { BURST = 40 };
+  static struct btcp2p_message_t first[BURST], second[BURST];
+  for (size_t i = 0; i < BURST; i++) {
+    btcp2p_checked_buffer_create(&first[i].payload);
+    btcp2p_checked_buffer_create(&second[i].payload);
+  }
+
+  // Payloads received in earlier batches survive later receives.
+  send_ping_burst(pair.peer, 0, BURST);
+  TEST_CHECK(receive_batches(&pair.connection, first, BURST));
+  TEST_CHECK(!pair.connection.has_message);
+  TEST_CHECK(nonces_match(first, BURST, 0));
+
+  send_ping_burst(pair.peer, 1000, BURST);
+  TEST_CHECK(receive_batches(&pair.connection, second, BURST));
+  TEST_CHECK(nonces_match(second, BURST, 1000));
+  TEST_CHECK(nonces_match(first, BURST, 0));
+
+  // A batch holds no more than asked for, and the rest waits for the next.
+  send_ping_burst(pair.peer, 2000, BURST);
+  TEST_CHECK(receive_batches(&pair.connection, first, BURST / 2));
+  TEST_CHECK(receive_batches(&pair.connection, first + BURST / 2, BURST / 2));
+  TEST_CHECK(nonces_match(first, BURST, 2000));
+  TEST_CHECK(nonces_match(second, BURST, 1000));
+
+  close_pair(&pair);
+  for (size_t i = 0; i < BURST; i++) {
+    btcp2p_checked_buffer_destroy(&first[i].payload);
+    btcp2p_checked_buffer_destroy(&second[i].payload);
+  }
+}
+
+void test_batch_keeps_payloads(void) {
+  check_batches(NULL);
+}
+
+void test_verified_batch_keeps_payloads(void) {
+  struct btcp2p_verify_pool_t pool;
+  if (!TEST_CHECK(btcp2p_verify_pool_create(&pool, 2))) {
+    return;
+  }
+  check_batches(&pool);
+  btcp2p_verify_pool_destroy(&pool);
+}
+
+void test_batch_stays_within_budget(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+
+  // Room for two ping nonces at once.
+  struct btcp2p_budget_t budget;
+  btcp2p_budget_create(&budget, 1000);
+  btcp2p_frame_reader_set_budget(&pair.connection.reader, &budget, 16);
+
+  struct btcp2p_message_t messages[10];
+  for (size_t i = 0; i < 10; i++) {
+    btcp2p_checked_buffer_create(&messages[i].payload);
+  }
+
+  // The payloads handed out stay charged, so each batch stops at two.
+  send_ping_burst(pair.peer, 0, 10);
+  for (uint64_t first = 0; first < 10; first += 2) {
+    size_t count = 0;
+    TEST_CHECK(btcp2p_message_pump_batch_timeout(&pair.connection, messages, 10, &count, 100));
+    TEST_CHECK_(count == 2, "batch of %zu", count);
+    TEST_CHECK(btcp2p_budget_used(&budget) == 16);
+    TEST_CHECK(nonces_match(messages, count, first));
+  }
+
+  // The last batch is released by the next pump.
+  size_t count = 1;
+  TEST_CHECK(btcp2p_message_pump_batch_timeout(&pair.connection, messages, 10, &count, 0));
+  TEST_CHECK(count == 0);
+  TEST_CHECK(btcp2p_budget_used(&budget) == 0);
+
+  close_pair(&pair);
+  for (size_t i = 0; i < 10; i++) {
+    btcp2p_checked_buffer_destroy(&messages[i].payload);
+  }
+}
+
+void test_batch_waits_for_timeout_or_wake(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, true, NULL))) {
+    return;
+  }
+
+  struct btcp2p_message_t messages[4];
+  for (size_t i = 0; i < 4; i++) {
+    btcp2p_checked_buffer_create(&messages[i].payload);
+  }
+
+  size_t count = 1;
+  uint64_t start_ns = btcp2p_timer_now_ns();
+  TEST_CHECK(btcp2p_message_pump_batch_timeout(&pair.connection, messages, 4, &count, 150));
+  TEST_CHECK(count == 0);
+  TEST_CHECK_(elapsed_ms(start_ns) >= 149, "returned after %llu ms", (unsigned long long)elapsed_ms(start_ns));
+
+  // An indefinite wait ends with a wake.
+  pthread_t thread;
+  start_ns = btcp2p_timer_now_ns();
+  pthread_create(&thread, NULL, wake_later, &pair.connection);
+  TEST_CHECK(btcp2p_message_pump_batch_timeout(&pair.connection, messages, 4, &count, -1));
+  uint64_t waited_ms = elapsed_ms(start_ns);
+  pthread_join(thread, NULL);
+  TEST_CHECK(count == 0);
+  TEST_CHECK_(waited_ms >= 19 && waited_ms < 1000, "woke after %llu ms", (unsigned long long)waited_ms);
+
+  // Or with a message.
+  send_command(pair.peer, "ping");
+  TEST_CHECK(btcp2p_message_pump_batch_timeout(&pair.connection, messages, 4, &count, -1));
+  TEST_CHECK(count == 1 && messages[0].command_id == BTCP2P_CMD_PING);
+
+  close_pair(&pair);
+  for (size_t i = 0; i < 4; i++) {
+    btcp2p_checked_buffer_destroy(&messages[i].payload);
+  }
+}
+
+struct slow_reader_t {
+  int peer;
+  uint8_t* received;
+  size_t expected;
+  size_t length;
+};
+
+// read_slowly reads from the peer in small pieces with pauses in between, so
+// the connection's socket buffer stays full.
+static void* read_slowly(void* arg) {
+  struct slow_reader_t* reader = arg;
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+  while (reader->length < reader->expected) {
+    size_t want = reader->expected - reader->length < 512 ? reader->expected - reader->length : 512;
+    ssize_t n = recv(reader->peer, reader->received + reader->length, want, 0);
+    if (n <= 0) {
+      break;
+    }
+    reader->length += (size_t)n;
+    nanosleep(&pause, NULL);
+  }
+  return NULL;
+}
+
+// next_frame checks that the frame at *offset carries the given command and
+// payload, and moves past it.
+static bool next_frame(struct slow_reader_t const * reader, size_t* offset,
+                       char const * const command, uint8_t const * payload, uint32_t length)
+{
+  struct btcp2p_message_header_t header;
+  if (*offset + sizeof(header) > reader->length) {
+    return false;
+  }
+  memcpy(&header, reader->received + *offset, sizeof(header));
+  *offset += sizeof(header);
+  if (strncmp(header.command, command, sizeof(header.command)) != 0 ||
+      header.length != length ||
+      *offset + length > reader->length ||
+      memcmp(reader->received + *offset, payload, length) != 0)
+  {
+    return false;
+  }
+  *offset += length;
+  return true;
+}
+
+void test_send_batch_resumes(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, false, NULL))) {
+    return;
+  }
+  int sndbuf = 4096;
+  setsockopt(btcp2p_io_fd(&pair.connection), SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  // Enough messages, with and without payloads, for several iovec chunks and
+  // many more bytes than the socket buffer holds.
+  enum { COUNT = 100 };
+  static struct btcp2p_message_t messages[COUNT];
+  uint8_t hash[32];
+  size_t expected = 0;
+  for (size_t i = 0; i < COUNT; i++) {
+    memset(hash, (int)i, sizeof(hash));
+    btcp2p_checked_buffer_create(&messages[i].payload);
+    if (i % 3 == 0) {
+      btcp2p_pack_message(&pair.connection, &messages[i], "verack", "");
+    } else if (i % 3 == 1) {
+      btcp2p_pack_message(&pair.connection, &messages[i], "ping", "L", (uint64_t)i);
+    } else {
+      btcp2p_pack_message(&pair.connection, &messages[i], "inv", "Lhhhhhhhh", (uint64_t)i,
+                          hash, hash, hash, hash, hash, hash, hash, hash);
+    }
+    expected += sizeof(messages[i].header) + messages[i].header.length;
+  }
+
+  // A queued message goes out ahead of the batch.
+  TEST_CHECK(btcp2p_queue_message(&pair.connection, "pong", "L", (uint64_t)7));
+  expected += sizeof(struct btcp2p_message_header_t) + 8;
+
+  struct slow_reader_t reader = { .peer = pair.peer, .received = malloc(expected), .expected = expected };
+  pthread_t thread;
+  pthread_create(&thread, NULL, read_slowly, &reader);
+  TEST_CHECK(btcp2p_send_messages(&pair.connection, messages, COUNT));
+  pthread_join(thread, NULL);
+
+  TEST_CHECK_(reader.length == expected, "received %zu of %zu bytes", reader.length, expected);
+  TEST_CHECK(btcp2p_queued_bytes(&pair.connection) == 0);
+  size_t offset = 0;
+  uint64_t nonce = 7;
+  TEST_CHECK(next_frame(&reader, &offset, "pong", (uint8_t const *)&nonce, sizeof(nonce)));
+  for (size_t i = 0; i < COUNT; i++) {
+    TEST_CHECK_(next_frame(&reader, &offset, messages[i].header.command, messages[i].payload.buffer,
+                           messages[i].header.length), "message %zu", i);
+    btcp2p_checked_buffer_destroy(&messages[i].payload);
+  }
+
+  close_pair(&pair);
+  free(reader.received);
+}
+
+TEST_LIST = {
+  { "test_timeout_without_data", test_timeout_without_data },
+  { "test_wake_from_thread", test_wake_from_thread },
+  { "test_wake_requires_opt_in", test_wake_requires_opt_in },
+  { "test_timer_sends_on_time", test_timer_sends_on_time },
+  { "test_oversized_payload_fails", test_oversized_payload_fails },
+  { "test_paused_until_budget_released", test_paused_until_budget_released },
+  { "test_streamed_block", test_streamed_block },
+  { "test_send_batch_resumes", test_send_batch_resumes },
+  { "test_batch_keeps_payloads", test_batch_keeps_payloads },
+  { "test_verified_batch_keeps_payloads", test_verified_batch_keeps_payloads },
+  { "test_batch_waits_for_timeout_or_wake", test_batch_waits_for_timeout_or_wake },
+  { "test_batch_stays_within_budget", test_batch_stays_within_budget },
+  { 0 },
+};
@@ -0,0 +1,262 @@
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/budget.h>
+#include <libbtcp2p/reactor.h>
+
+// A reactor servicing one handshaken connection over one end of a socket
+// pair, with a peer scripted from the other end.
+struct pair_t {
+  struct btcp2p_reactor_t reactor;
+  struct btcp2p_connection_t connection;
+  int peer;
+};
+
+// open_pair handshakes the connection, checking checksums in pool unless it
+// is NULL, without registering it with the reactor yet.
+static bool open_pair(struct pair_t* pair, struct btcp2p_verify_pool_t* pool) {
+  if (!btcp2p_reactor_create(&pair->reactor)) {
+    return false;
+  }
+
+  memset(&pair->connection, 0, sizeof(pair->connection));
+  pair->connection.verify_pool = pool;
+  if (!open_handshaken(&pair->connection, &pair->peer)) {
+    btcp2p_reactor_destroy(&pair->reactor);
+    return false;
+  }
+  return true;
+}
+
+// register_pair adds the connection to the reactor and takes in the events
+// reported on registration, such as the socket being writable.
+static bool register_pair(struct pair_t* pair) {
+  return btcp2p_reactor_add(&pair->reactor, &pair->connection) &&
+         btcp2p_reactor_pump(&pair->reactor, 0);
+}
+
+static bool open_registered_pair(struct pair_t* pair, struct btcp2p_verify_pool_t* pool) {
+  if (!open_pair(pair, pool)) {
+    return false;
+  }
+  if (!register_pair(pair)) {
+    btcp2p_disconnect(&pair->connection);
+    close(pair->peer);
+    btcp2p_reactor_destroy(&pair->reactor);
+    return false;
+  }
+  return true;
+}
+
+static void close_pair(struct pair_t* pair) {
+  btcp2p_reactor_remove(&pair->reactor, &pair->connection);
+  btcp2p_disconnect(&pair->connection);
+  if (pair->peer >= 0) {
+    close(pair->peer);
+  }
+  btcp2p_reactor_destroy(&pair->reactor);
+}
+
+// next_is_ping returns true if the reactor hands back the pair's connection
+// holding a ping.
+static bool next_is_ping(struct pair_t* pair) {
+  struct btcp2p_connection_t* connection = btcp2p_reactor_next(&pair->reactor);
+  return connection == &pair->connection &&
+         !connection->closed &&
+         btcp2p_has_message(connection, "ping");
+}
+
+void test_buffered_messages_stay_ready(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_registered_pair(&pair, NULL))) {
+    return;
+  }
+
+  // One edge-triggered event covers all three pings, so the connection has
+  // to stay on the ready list while its receive ring holds more.
+  char const * const commands[] = { "ping", "ping", "ping" };
+  send_commands(pair.peer, commands, 3);
+  TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+  for (int i = 0; i < 3; i++) {
+    TEST_CHECK_(next_is_ping(&pair), "ping %d", i);
+  }
+  TEST_CHECK(btcp2p_reactor_next(&pair.reactor) == NULL);
+
+  close_pair(&pair);
+}
+
+void test_data_received_before_registration(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  // Receiving the first ping reads the second into the receive ring too,
+  // leaving nothing on the socket to report once registered.
+  char const * const commands[] = { "ping", "ping" };
+  send_commands(pair.peer, commands, 2);
+  struct pollfd pfd = { .fd = btcp2p_io_fd(&pair.connection), .events = POLLIN, .revents = 0 };
+  poll(&pfd, 1, 1000);
+  TEST_CHECK(btcp2p_try_recv_message(&pair.connection) == BTCP2P_RECV_COMPLETE);
+
+  TEST_CHECK(register_pair(&pair));
+  TEST_CHECK(next_is_ping(&pair));
+  TEST_CHECK(btcp2p_reactor_next(&pair.reactor) == NULL);
+
+  close_pair(&pair);
+}
+
+void test_flushes_queue_when_writable(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_registered_pair(&pair, NULL))) {
+    return;
+  }
+
+  // Queue more than the socket buffer holds.
+  int sndbuf = 4096;
+  setsockopt(pair.connection.socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  enum { PINGS = 2000 };
+  for (uint64_t i = 0; i < PINGS; i++) {
+    TEST_CHECK(btcp2p_queue_message(&pair.connection, "ping", "L", i));
+  }
+  size_t expected = btcp2p_queued_bytes(&pair.connection);
+  TEST_CHECK(btcp2p_flush(&pair.connection));
+  TEST_CHECK(btcp2p_queued_bytes(&pair.connection) > 0);
+
+  // The rest goes out as the peer makes room.
+  uint8_t received[4096];
+  size_t total = 0;
+  for (int i = 0; i < 1000 && total < expected; i++) {
+    ssize_t n = recv(pair.peer, received, sizeof(received), MSG_DONTWAIT);
+    if (n > 0) {
+      total += (size_t)n;
+    }
+    TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 10));
+  }
+  TEST_CHECK_(total == expected, "received %zu of %zu bytes", total, expected);
+  TEST_CHECK(btcp2p_queued_bytes(&pair.connection) == 0);
+  TEST_CHECK(!pair.connection.closed);
+
+  close_pair(&pair);
+}
+
+void test_failed_flush_closes(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  struct pair_t pair;
+  if (!TEST_CHECK(open_registered_pair(&pair, NULL))) {
+    return;
+  }
+
+  TEST_CHECK(btcp2p_queue_message(&pair.connection, "ping", "L", (uint64_t)42));
+  close(pair.peer);
+  pair.peer = -1;
+
+  // The flush fails within the pump, before anything is received.
+  TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+  TEST_CHECK(pair.connection.closed);
+  struct btcp2p_connection_t* connection = btcp2p_reactor_next(&pair.reactor);
+  TEST_CHECK(connection == &pair.connection && connection->closed);
+
+  close_pair(&pair);
+}
+
+void test_hangup_closes(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_registered_pair(&pair, NULL))) {
+    return;
+  }
+
+  close(pair.peer);
+  pair.peer = -1;
+
+  TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+  TEST_CHECK(!pair.connection.closed);
+  struct btcp2p_connection_t* connection = btcp2p_reactor_next(&pair.reactor);
+  TEST_CHECK(connection == &pair.connection && connection->closed);
+
+  close_pair(&pair);
+}
+
+void test_paused_connection_resumes(void) {
+  struct pair_t pair;
+  if (!TEST_CHECK(open_pair(&pair, NULL))) {
+    return;
+  }
+
+  // Someone else holds the whole shared budget.
+  struct btcp2p_budget_t budget;
+  btcp2p_budget_create(&budget, 64);
+  btcp2p_frame_reader_set_budget(&pair.connection.reader, &budget, SIZE_MAX);
+  TEST_CHECK(btcp2p_budget_charge(&budget, 64));
+  TEST_CHECK(register_pair(&pair));
+
+  // The ping is read off the socket but not let through, so no further
+  // socket event will report it.
+  send_command(pair.peer, "ping");
+  TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+  TEST_CHECK(btcp2p_reactor_next(&pair.reactor) == NULL);
+  TEST_CHECK(btcp2p_recv_paused(&pair.connection));
+  TEST_CHECK(pair.reactor.timers.count == 1);
+
+  // The resume timer retries once the budget has room again. A pump may
+  // return just before the timer is due, so it takes a few.
+  btcp2p_budget_release(&budget, 64);
+  struct btcp2p_connection_t* connection = NULL;
+  for (int i = 0; i < 10 && connection == NULL; i++) {
+    TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+    connection = btcp2p_reactor_next(&pair.reactor);
+  }
+  TEST_CHECK(connection == &pair.connection && btcp2p_has_message(connection, "ping"));
+
+  close_pair(&pair);
+}
+
+void test_verified_frames_make_ready(void) {
+  struct btcp2p_verify_pool_t pool;
+  if (!TEST_CHECK(btcp2p_verify_pool_create(&pool, 1))) {
+    return;
+  }
+  struct pair_t pair;
+  if (!TEST_CHECK(open_registered_pair(&pair, &pool))) {
+    btcp2p_verify_pool_destroy(&pool);
+    return;
+  }
+
+  // Every frame goes to the pool, so the ping is usually still being
+  // checked when it is first received. Once the socket is drained only the
+  // pool can make the connection ready again.
+  pool.min_payload = 0;
+  send_command(pair.peer, "ping");
+  TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+  struct btcp2p_connection_t* connection = btcp2p_reactor_next(&pair.reactor);
+  if (connection == NULL) {
+    TEST_CHECK(pair.reactor.ready_head == NULL);
+    TEST_CHECK(btcp2p_reactor_pump(&pair.reactor, 1000));
+    connection = btcp2p_reactor_next(&pair.reactor);
+  }
+  TEST_CHECK(connection == &pair.connection && btcp2p_has_message(connection, "ping"));
+
+  close_pair(&pair);
+  btcp2p_verify_pool_destroy(&pool);
+}
+
+TEST_LIST = {
+  { "test_buffered_messages_stay_ready", test_buffered_messages_stay_ready },
+  { "test_data_received_before_registration", test_data_received_before_registration },
+  { "test_flushes_queue_when_writable", test_flushes_queue_when_writable },
+  { "test_failed_flush_closes", test_failed_flush_closes },
+  { "test_hangup_closes", test_hangup_closes },
+  { "test_paused_connection_resumes", test_paused_connection_resumes },
+  { "test_verified_frames_make_ready", test_verified_frames_make_ready },
+  { 0 },
+};
@@ -0,0 +1,431 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/runtime.h>
+
+#define NUM_TASKS 1000
+
+struct order_t {
+  size_t ran[NUM_TASKS];
+  size_t count;
+  size_t wrong_shard;
+  atomic_bool done;
+};
+
+struct order_task_t {
+  struct order_t* order;
+  size_t seq;
+};
+
+static struct order_task_t ORDER_TASKS[NUM_TASKS];
+
+// record_order notes which task ran. It only runs on shard 1, so the shared
+// state needs no lock.
+static void record_order(struct btcp2p_shard_t* shard, void* arg) {
+  struct order_task_t* task = arg;
+  struct order_t* order = task->order;
+
+  if (shard->index != 1) {
+    order->wrong_shard++;
+  }
+  order->ran[order->count++] = task->seq;
+  if (order->count == NUM_TASKS) {
+    atomic_store(&order->done, true);
+  }
+}
+
+// wait_for spins until flag is set, giving up after a few seconds.
+static bool wait_for(atomic_bool* flag) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+  for (int i = 0; i < 5000; i++) {
+    if (atomic_load(flag)) {
+      return true;
+    }
+    nanosleep(&pause, NULL);
+  }
+  return false;
+}
+
+void test_post_runs_in_order(void) {
+  struct btcp2p_runtime_config_t config = { .num_shards = 2 };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  struct order_t* order = calloc(1, sizeof(struct order_t));
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+  TEST_CHECK(runtime->num_shards == 2);
+
+  for (size_t i = 0; i < NUM_TASKS; i++) {
+    ORDER_TASKS[i].order = order;
+    ORDER_TASKS[i].seq = i;
+    TEST_CHECK(btcp2p_runtime_post(runtime, 1, record_order, &ORDER_TASKS[i]));
+  }
+  TEST_CHECK(!btcp2p_runtime_post(runtime, 2, record_order, &ORDER_TASKS[0]));
+
+  TEST_CHECK(wait_for(&order->done));
+  btcp2p_runtime_stop(runtime);
+
+  TEST_CHECK(order->count == NUM_TASKS);
+  TEST_CHECK(order->wrong_shard == 0);
+  for (size_t i = 0; i < order->count; i++) {
+    TEST_CHECK_(order->ran[i] == i, "task %zu ran at position %zu", order->ran[i], i);
+  }
+
+  free(order);
+  free(runtime);
+}
+
+struct broadcast_t {
+  atomic_size_t runs;
+  atomic_size_t releases;
+  atomic_bool released;
+};
+
+static void count_run(struct btcp2p_shard_t* shard, void* arg) {
+  (void)shard;
+  struct broadcast_t* broadcast = arg;
+  atomic_fetch_add(&broadcast->runs, 1);
+}
+
+static void count_release(void* arg) {
+  struct broadcast_t* broadcast = arg;
+  atomic_fetch_add(&broadcast->releases, 1);
+  atomic_store(&broadcast->released, true);
+}
+
+void test_broadcast_releases_once(void) {
+  struct btcp2p_runtime_config_t config = { .num_shards = 4 };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  struct broadcast_t broadcast;
+  atomic_init(&broadcast.runs, 0);
+  atomic_init(&broadcast.releases, 0);
+  atomic_init(&broadcast.released, false);
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+
+  TEST_CHECK(btcp2p_runtime_broadcast(runtime, count_run, &broadcast, count_release));
+  TEST_CHECK(wait_for(&broadcast.released));
+  TEST_CHECK(atomic_load(&broadcast.runs) == 4);
+  TEST_CHECK(atomic_load(&broadcast.releases) == 1);
+
+  // Every shard ran exactly one task.
+  for (size_t i = 0; i < runtime->num_shards; i++) {
+    struct btcp2p_shard_stats_t stats;
+    btcp2p_runtime_stats(runtime, i, &stats);
+    TEST_CHECK_(stats.tasks == 1, "shard %zu ran %llu tasks", i, (unsigned long long)stats.tasks);
+    TEST_CHECK(stats.connections == 0);
+  }
+
+  btcp2p_runtime_stop(runtime);
+  free(runtime);
+}
+
+static void count_stopped(struct btcp2p_shard_t* shard, void* arg) {
+  (void)shard;
+  atomic_fetch_add((atomic_size_t*)arg, 1);
+}
+
+void test_stop_runs_queued_tasks(void) {
+  struct btcp2p_runtime_config_t config = { .num_shards = 3 };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  atomic_size_t runs;
+  atomic_init(&runs, 0);
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+
+  for (size_t i = 0; i < 100; i++) {
+    TEST_CHECK(btcp2p_runtime_post(runtime, i % 3, count_stopped, &runs));
+  }
+  btcp2p_runtime_stop(runtime);
+
+  TEST_CHECK(atomic_load(&runs) == 100);
+  TEST_CHECK(!btcp2p_runtime_post(runtime, 0, count_stopped, &runs));
+
+  free(runtime);
+}
+
+struct poster_t {
+  struct btcp2p_runtime_t* runtime;
+  atomic_size_t* runs;
+  size_t posted;
+};
+
+// post_until_stopped posts to every shard in turn until posting fails.
+static void* post_until_stopped(void* arg) {
+  struct poster_t* poster = arg;
+  for (size_t i = 0; ; i++) {
+    if (!btcp2p_runtime_post(poster->runtime, i % 2, count_stopped, poster->runs)) {
+      return NULL;
+    }
+    poster->posted++;
+  }
+}
+
+void test_post_overlapping_stop(void) {
+  struct btcp2p_runtime_config_t config = { .num_shards = 2 };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  atomic_size_t runs;
+  atomic_init(&runs, 0);
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+
+  struct poster_t posters[4];
+  pthread_t threads[4];
+  for (size_t i = 0; i < 4; i++) {
+    posters[i] = (struct poster_t){ .runtime = runtime, .runs = &runs, .posted = 0 };
+    pthread_create(&threads[i], NULL, post_until_stopped, &posters[i]);
+  }
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 5000000 };
+  nanosleep(&pause, NULL);
+  btcp2p_runtime_stop(runtime);
+
+  // Every post that succeeded had its task run, by a shard or by stop.
+  size_t posted = 0;
+  for (size_t i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    posted += posters[i].posted;
+  }
+  TEST_CHECK(posted > 0);
+  TEST_CHECK_(atomic_load(&runs) == posted, "ran %zu of %zu tasks", atomic_load(&runs), posted);
+
+  free(runtime);
+}
+
+// A connection handed to a runtime, with a peer scripted from the other end.
+// The connection comes first so the callbacks can find the rest.
+struct shard_peer_t {
+  struct btcp2p_connection_t connection;
+  int peer;
+  atomic_int shard; ///< Shard the connection was added to.
+  atomic_size_t pings; ///< Pings passed to on_message.
+  atomic_size_t closes; ///< Calls to on_close.
+  atomic_size_t wrong_shard; ///< Callbacks run on another shard.
+};
+
+static void check_shard(struct btcp2p_shard_t* shard, struct shard_peer_t* peer) {
+  if ((int)shard->index != atomic_load(&peer->shard)) {
+    atomic_fetch_add(&peer->wrong_shard, 1);
+  }
+}
+
+static void count_ping(struct btcp2p_shard_t* shard, struct btcp2p_connection_t* connection, void* ctx) {
+  (void)ctx;
+  struct shard_peer_t* peer = (struct shard_peer_t*)connection;
+  check_shard(shard, peer);
+  if (btcp2p_has_message(connection, "ping")) {
+    atomic_fetch_add(&peer->pings, 1);
+  }
+}
+
+static void count_close(struct btcp2p_shard_t* shard, struct btcp2p_connection_t* connection, void* ctx) {
+  (void)ctx;
+  struct shard_peer_t* peer = (struct shard_peer_t*)connection;
+  check_shard(shard, peer);
+  atomic_fetch_add(&peer->closes, 1);
+}
+
+// wait_for_count spins until count reaches want, giving up after a few
+// seconds.
+static bool wait_for_count(atomic_size_t* count, size_t want) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+  for (int i = 0; i < 5000; i++) {
+    if (atomic_load(count) >= want) {
+      return true;
+    }
+    nanosleep(&pause, NULL);
+  }
+  return false;
+}
+
+// add_peer hands a peer's connection to the runtime and records its shard.
+static int add_peer(struct btcp2p_runtime_t* runtime, struct shard_peer_t* peer) {
+  int shard = btcp2p_runtime_add(runtime, &peer->connection);
+  atomic_store(&peer->shard, shard);
+  return shard;
+}
+
+// close_peers releases peers whose connections the runtime has handed back.
+static void close_peers(struct shard_peer_t* peers, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    btcp2p_disconnect(&peers[i].connection);
+    if (peers[i].peer >= 0) {
+      close(peers[i].peer);
+    }
+  }
+  free(peers);
+}
+
+#define NUM_PEERS 6
+#define NUM_PINGS 20
+
+void test_connections_stay_on_shard(void) {
+  struct btcp2p_runtime_config_t config = {
+    .num_shards = 3, .on_message = count_ping, .on_close = count_close
+  };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  struct shard_peer_t* peers = calloc(NUM_PEERS, sizeof(struct shard_peer_t));
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+
+  // Round-robin placement cycles through the shards.
+  for (size_t i = 0; i < NUM_PEERS; i++) {
+    if (!TEST_CHECK(open_handshaken(&peers[i].connection, &peers[i].peer))) {
+      return;
+    }
+    int shard = add_peer(runtime, &peers[i]);
+    TEST_CHECK_(shard == (int)(i % 3), "peer %zu added to shard %d", i, shard);
+  }
+
+  for (size_t i = 0; i < NUM_PEERS; i++) {
+    for (size_t j = 0; j < NUM_PINGS; j++) {
+      send_command(peers[i].peer, "ping");
+    }
+  }
+  for (size_t i = 0; i < NUM_PEERS; i++) {
+    TEST_CHECK_(wait_for_count(&peers[i].pings, NUM_PINGS),
+                "peer %zu got %zu pings", i, atomic_load(&peers[i].pings));
+  }
+  for (size_t i = 0; i < runtime->num_shards; i++) {
+    struct btcp2p_shard_stats_t stats;
+    btcp2p_runtime_stats(runtime, i, &stats);
+    TEST_CHECK(stats.connections == 2);
+    TEST_CHECK_(stats.messages == 2 * NUM_PINGS, "shard %zu received %llu messages",
+                i, (unsigned long long)stats.messages);
+  }
+
+  // A peer hanging up closes its connection on its own shard.
+  close(peers[0].peer);
+  peers[0].peer = -1;
+  TEST_CHECK(wait_for_count(&peers[0].closes, 1));
+  TEST_CHECK(peers[0].connection.closed);
+
+  // Stopping hands back the connections still on a shard.
+  btcp2p_runtime_stop(runtime);
+  for (size_t i = 0; i < NUM_PEERS; i++) {
+    TEST_CHECK_(atomic_load(&peers[i].closes) == 1, "peer %zu closed %zu times",
+                i, atomic_load(&peers[i].closes));
+    TEST_CHECK(atomic_load(&peers[i].pings) == NUM_PINGS);
+    TEST_CHECK(atomic_load(&peers[i].wrong_shard) == 0);
+  }
+
+  close_peers(peers, NUM_PEERS);
+  free(runtime);
+}
+
+void test_least_loaded_placement(void) {
+  struct btcp2p_runtime_config_t config = {
+    .num_shards = 2, .policy = BTCP2P_SHARD_LEAST_LOADED, .on_close = count_close
+  };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  struct shard_peer_t* peers = calloc(4, sizeof(struct shard_peer_t));
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+  for (size_t i = 0; i < 4; i++) {
+    if (!TEST_CHECK(open_handshaken(&peers[i].connection, &peers[i].peer))) {
+      return;
+    }
+  }
+
+  TEST_CHECK(add_peer(runtime, &peers[0]) == 0);
+  TEST_CHECK(add_peer(runtime, &peers[1]) == 1);
+
+  // Once the first shard's connection closes, it is the least loaded again,
+  // and it wins ties after that.
+  close(peers[0].peer);
+  peers[0].peer = -1;
+  TEST_CHECK(wait_for_count(&peers[0].closes, 1));
+  TEST_CHECK(add_peer(runtime, &peers[2]) == 0);
+  TEST_CHECK(add_peer(runtime, &peers[3]) == 0);
+
+  struct btcp2p_shard_stats_t stats;
+  btcp2p_runtime_stats(runtime, 0, &stats);
+  TEST_CHECK(stats.connections == 2);
+  btcp2p_runtime_stats(runtime, 1, &stats);
+  TEST_CHECK(stats.connections == 1);
+
+  btcp2p_runtime_stop(runtime);
+  for (size_t i = 0; i < 4; i++) {
+    TEST_CHECK_(atomic_load(&peers[i].closes) == 1, "peer %zu closed %zu times",
+                i, atomic_load(&peers[i].closes));
+    TEST_CHECK(atomic_load(&peers[i].wrong_shard) == 0);
+  }
+
+  close_peers(peers, 4);
+  free(runtime);
+}
+
+struct shard_timer_t {
+  struct btcp2p_wheel_timer_t timer;
+  uint64_t scheduled_ns;
+  _Atomic uint64_t fired_ns;
+};
+
+static void mark_fired(struct btcp2p_wheel_timer_t* timer, void* ctx) {
+  (void)timer;
+  struct shard_timer_t* shard_timer = ctx;
+  atomic_store(&shard_timer->fired_ns, btcp2p_timer_now_ns());
+}
+
+static void schedule_timer(struct btcp2p_shard_t* shard, void* arg) {
+  struct shard_timer_t* shard_timer = arg;
+  shard_timer->scheduled_ns = btcp2p_timer_now_ns();
+  btcp2p_timer_wheel_schedule(&shard->reactor.timers, &shard_timer->timer,
+                              shard_timer->scheduled_ns + 20 * BTCP2P_NS_PER_MS, mark_fired, shard_timer);
+}
+
+void test_timer_wakes_shard(void) {
+  struct btcp2p_runtime_config_t config = { .num_shards = 1 };
+  struct btcp2p_runtime_t* runtime = malloc(sizeof(struct btcp2p_runtime_t));
+  struct shard_timer_t shard_timer = { 0 };
+
+  if (!TEST_CHECK(btcp2p_runtime_start(runtime, &config))) {
+    return;
+  }
+  // The shard waits without a timeout, so only the timer can wake it.
+  TEST_CHECK(runtime->config.poll_timeout_ms < 0);
+  TEST_CHECK(btcp2p_runtime_post(runtime, 0, schedule_timer, &shard_timer));
+
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+  for (int i = 0; i < 5000 && atomic_load(&shard_timer.fired_ns) == 0; i++) {
+    nanosleep(&pause, NULL);
+  }
+  btcp2p_runtime_stop(runtime);
+
+  uint64_t fired_ns = atomic_load(&shard_timer.fired_ns);
+  if (TEST_CHECK(fired_ns != 0)) {
+    TEST_CHECK_(fired_ns - shard_timer.scheduled_ns >= 20 * BTCP2P_NS_PER_MS,
+                "fired after %" PRIu64 "ns", fired_ns - shard_timer.scheduled_ns);
+  }
+
+  free(runtime);
+}
+
+TEST_LIST = {
+  { "test_post_runs_in_order", test_post_runs_in_order },
+  { "test_broadcast_releases_once", test_broadcast_releases_once },
+  { "test_stop_runs_queued_tasks", test_stop_runs_queued_tasks },
+  { "test_post_overlapping_stop", test_post_overlapping_stop },
+  { "test_timer_wakes_shard", test_timer_wakes_shard },
+  { "test_connections_stay_on_shard", test_connections_stay_on_shard },
+  { "test_least_loaded_placement", test_least_loaded_placement },
+  { 0 },
+};
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/send_queue.h>
+
+// make_message fills in a message with a payload of the given length.
+static void make_message(struct btcp2p_message_t* message,
+                         char const * const command,
+                         uint32_t length)
+{
+  memset(&message->header, 0, sizeof(message->header));
+  message->header.magic = 0x0709110B;
+  strncpy(message->header.command, command, sizeof(message->header.command));
+  message->header.length = length;
+
+  btcp2p_checked_buffer_create(&message->payload);
+  btcp2p_checked_buffer_prepare_write(&message->payload);
+  for (uint32_t i = 0; i < length; i++) {
+    uint8_t byte = (uint8_t)i;
+    btcp2p_checked_buffer_write(&message->payload, &byte, 1);
+  }
+}
+
+void test_coalesces_messages() {
+  struct btcp2p_send_queue_t queue;
+  btcp2p_send_queue_create(&queue, 4096);
+
+  struct btcp2p_message_t ping, verack;
+  make_message(&ping, "ping", 8);
+  make_message(&verack, "verack", 0);
+
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &verack));
+  TEST_CHECK(btcp2p_send_queue_depth(&queue) == 2);
+  TEST_CHECK(btcp2p_send_queue_pending_bytes(&queue) == 24 + 8 + 24);
+
+  // Both messages are contiguous so they can be written together.
+  size_t len;
+  uint8_t* data = btcp2p_send_queue_peek(&queue, &len);
+  TEST_CHECK(len == 56);
+  TEST_CHECK(memcmp(data, &ping.header, 24) == 0);
+  TEST_CHECK(memcmp(data + 24, ping.payload.buffer, 8) == 0);
+  TEST_CHECK(memcmp(data + 32, &verack.header, 24) == 0);
+
+  btcp2p_checked_buffer_destroy(&ping.payload);
+  btcp2p_checked_buffer_destroy(&verack.payload);
+  btcp2p_send_queue_destroy(&queue);
+}
+
+void test_partial_writes() {
+  struct btcp2p_send_queue_t queue;
+  btcp2p_send_queue_create(&queue, 4096);
+
+  struct btcp2p_message_t ping;
+  make_message(&ping, "ping", 8);
+
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+
+  // A message stays queued until its last byte has been written.
+  btcp2p_send_queue_advance(&queue, 31);
+  TEST_CHECK(btcp2p_send_queue_depth(&queue) == 2);
+  TEST_CHECK(btcp2p_send_queue_pending_bytes(&queue) == 33);
+
+  btcp2p_send_queue_advance(&queue, 1);
+  TEST_CHECK(btcp2p_send_queue_depth(&queue) == 1);
+
+  size_t len;
+  uint8_t* data = btcp2p_send_queue_peek(&queue, &len);
+  TEST_CHECK(len == 32);
+  TEST_CHECK(memcmp(data, &ping.header, 24) == 0);
+
+  btcp2p_send_queue_advance(&queue, 32);
+  TEST_CHECK(btcp2p_send_queue_depth(&queue) == 0);
+  TEST_CHECK(btcp2p_send_queue_pending_bytes(&queue) == 0);
+
+  btcp2p_checked_buffer_destroy(&ping.payload);
+  btcp2p_send_queue_destroy(&queue);
+}
+
+void test_refuses_when_full() {
+  struct btcp2p_send_queue_t queue;
+  btcp2p_send_queue_create(&queue, 100);
+
+  struct btcp2p_message_t ping;
+  make_message(&ping, "ping", 8);
+
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(!btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(btcp2p_send_queue_depth(&queue) == 3);
+
+  // Writing frees room for more messages.
+  btcp2p_send_queue_advance(&queue, 32);
+  TEST_CHECK(btcp2p_send_queue_push(&queue, &ping));
+  TEST_CHECK(btcp2p_send_queue_pending_bytes(&queue) == 96);
+
+  btcp2p_checked_buffer_destroy(&ping.payload);
+  btcp2p_send_queue_destroy(&queue);
+}
+
+void fuzz_interleaved_writes() {
+  struct btcp2p_send_queue_t queue;
+  btcp2p_send_queue_create(&queue, 1024 * 1024);
+
+  struct btcp2p_message_t message;
+  make_message(&message, "inv", 100);
+
+  // Mirror the queue with a simple byte stream and compare after each write.
+  uint8_t* expected = malloc(64 * 1024 * 1024);
+  size_t produced = 0;
+  size_t consumed = 0;
+  size_t frames = 0;
+
+  srand(1234);
+  for (int round = 0; round < 10000; round++) {
+    int pushes = rand() % 4;
+    for (int i = 0; i < pushes; i++) {
+      if (!btcp2p_send_queue_push(&queue, &message)) break;
+      memcpy(expected + produced, &message.header, 24);
+      memcpy(expected + produced + 24, message.payload.buffer, 100);
+      produced += 124;
+      frames++;
+    }
+
+    size_t len;
+    uint8_t* data = btcp2p_send_queue_peek(&queue, &len);
+    TEST_CHECK(len == produced - consumed);
+    size_t amount = len > 0 ? (size_t)rand() % (len + 1) : 0;
+    TEST_CHECK(memcmp(data, expected + consumed, amount) == 0);
+    btcp2p_send_queue_advance(&queue, amount);
+    consumed += amount;
+
+    TEST_CHECK(btcp2p_send_queue_depth(&queue) == frames - consumed / 124);
+  }
+
+  free(expected);
+  btcp2p_checked_buffer_destroy(&message.payload);
+  btcp2p_send_queue_destroy(&queue);
+}
+
+TEST_LIST = {
+  { "test_coalesces_messages", test_coalesces_messages },
+  { "test_partial_writes", test_partial_writes },
+  { "test_refuses_when_full", test_refuses_when_full },
+  { "fuzz_interleaved_writes", fuzz_interleaved_writes },
+  { 0 },
+};
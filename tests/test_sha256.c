@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <openssl/sha.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/sha256.h>
+
+#define MAX_INPUT 4096
+
+// fill_random fills the buffer with pseudo-random bytes.
+static void fill_random(uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    data[i] = (uint8_t)rand();
+  }
+}
+
+void test_known_vectors() {
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+
+  // SHA-256("abc") from FIPS 180-2.
+  static const uint8_t abc[BTCP2P_SHA256_DIGEST_SIZE] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+  };
+  btcp2p_sha256((uint8_t const*)"abc", 3, digest);
+  TEST_CHECK(memcmp(digest, abc, sizeof(abc)) == 0);
+
+  // The checksum of an empty payload is 0x5df6e0e2.
+  btcp2p_sha256d(NULL, 0, digest);
+  TEST_CHECK(digest[0] == 0x5d && digest[1] == 0xf6 && digest[2] == 0xe0 && digest[3] == 0xe2);
+}
+
+void test_backends_match_openssl() {
+  uint8_t* data = malloc(MAX_INPUT);
+  uint8_t expected[SHA256_DIGEST_LENGTH];
+  uint8_t expected_double[SHA256_DIGEST_LENGTH];
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+  enum btcp2p_sha256_backend_t original = btcp2p_sha256_backend();
+
+  srand(1234);
+  for (int backend = 0; backend < BTCP2P_SHA256_BACKEND_COUNT; backend++) {
+    if (!btcp2p_sha256_use_backend(backend)) {
+      continue;
+    }
+    TEST_CASE(btcp2p_sha256_backend_name(backend));
+
+    for (int round = 0; round < 1000; round++) {
+      size_t len = round < 200 ? (size_t)round : (size_t)rand() % MAX_INPUT;
+      fill_random(data, len);
+      SHA256(data, len, expected);
+      SHA256(expected, SHA256_DIGEST_LENGTH, expected_double);
+
+      btcp2p_sha256(data, len, digest);
+      TEST_CHECK(memcmp(digest, expected, sizeof(expected)) == 0);
+
+      btcp2p_sha256d(data, len, digest);
+      TEST_CHECK(memcmp(digest, expected_double, sizeof(expected_double)) == 0);
+
+      // Feed the same bytes in random pieces.
+      struct btcp2p_sha256_t ctx;
+      btcp2p_sha256_init(&ctx);
+      for (size_t offset = 0; offset < len; ) {
+        size_t amount = (size_t)rand() % (len - offset + 1);
+        btcp2p_sha256_update(&ctx, data + offset, amount);
+        offset += amount;
+      }
+      btcp2p_sha256_final(&ctx, digest);
+      TEST_CHECK(memcmp(digest, expected, sizeof(expected)) == 0);
+    }
+  }
+
+  TEST_CHECK(btcp2p_sha256_use_backend(original));
+  free(data);
+}
+
+void test_unsupported_backend() {
+  enum btcp2p_sha256_backend_t original = btcp2p_sha256_backend();
+  TEST_CHECK(!btcp2p_sha256_use_backend(BTCP2P_SHA256_BACKEND_COUNT));
+  TEST_CHECK(btcp2p_sha256_backend() == original);
+  TEST_CHECK(btcp2p_sha256_backend_supported(BTCP2P_SHA256_PORTABLE));
+}
+
+TEST_LIST = {
+  { "test_known_vectors", test_known_vectors },
+  { "test_backends_match_openssl", test_backends_match_openssl },
+  { "test_unsupported_backend", test_unsupported_backend },
+  { 0 },
+};
@@ -0,0 +1,166 @@
+// Drives the library from many threads at once. Built with ThreadSanitizer
+// by `make check`, so any shared mutable state in the code it reaches is
+// reported as a race.
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/connection.h>
+#include <libbtcp2p/log.h>
+#include <libbtcp2p/verify_pool.h>
+
+#define NUM_THREADS 8
+#define ROUNDS 2000
+
+static const struct btcp2p_chain_t CHAIN = {
+  .name = "regtest", .version = BTCP2P_PROTOCOL_VERSION, .magic = BTCP2P_MAGIC_REGTEST, .port = 18444
+};
+
+struct worker_t {
+  pthread_t thread;
+  int id;
+  struct btcp2p_verify_pool_t* pool;
+  int failures;
+};
+
+// check_oldest pops the oldest verified frame and checks that it carries the
+// expected nonce.
+static void check_oldest(struct worker_t* worker,
+                         struct btcp2p_verify_queue_t* queue,
+                         uint64_t expected)
+{
+  struct btcp2p_verify_job_t* job;
+  uint64_t nonce = 0;
+
+  btcp2p_verify_queue_wait(queue, -1);
+  if (btcp2p_verify_queue_peek(queue, &job) != BTCP2P_VERIFY_PASSED) {
+    worker->failures++;
+  } else {
+    memcpy(&nonce, job->message.payload.buffer, sizeof(nonce));
+  }
+  if (nonce != expected) {
+    worker->failures++;
+  }
+  btcp2p_verify_queue_pop(queue);
+}
+
+// stress_worker packs messages on its own connection state, reads them back
+// through a frame reader in random pieces, and passes copies through the
+// shared verify pool.
+static void* stress_worker(void* arg) {
+  struct worker_t* worker = arg;
+  unsigned seed = worker->id;
+
+  struct btcp2p_connection_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.chain = &CHAIN;
+  btcp2p_checked_buffer_create(&conn.outgoing.payload);
+  btcp2p_frame_reader_create(&conn.reader);
+
+  struct btcp2p_send_queue_t send_queue;
+  btcp2p_send_queue_create(&send_queue, 1024 * 1024);
+
+  struct btcp2p_verify_queue_t verify_queue;
+  btcp2p_verify_queue_create(&verify_queue, worker->pool, NULL);
+  uint64_t nonces[BTCP2P_VERIFY_QUEUE_DEPTH];
+  size_t oldest = 0;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t nonce = ((uint64_t)rand_r(&seed) << 32) | (uint64_t)rand_r(&seed);
+    btcp2p_pack_message(&conn, &conn.outgoing, "ping", "l", nonce);
+    btcp2p_send_queue_push(&send_queue, &conn.outgoing);
+
+    // Read the queued bytes back as a frame.
+    size_t len;
+    uint8_t* data = btcp2p_send_queue_peek(&send_queue, &len);
+    btcp2p_frame_reader_reset(&conn.reader);
+    for (size_t offset = 0; offset < len; ) {
+      size_t amount = 1 + rand_r(&seed) % (len - offset);
+      offset += btcp2p_frame_reader_feed(&conn.reader, &conn.message, data + offset, amount);
+    }
+    btcp2p_send_queue_advance(&send_queue, len);
+
+    conn.has_message = conn.reader.state == BTCP2P_FRAME_COMPLETE;
+    uint64_t unpacked = 0;
+    if (!conn.has_message ||
+        !btcp2p_has_message(&conn, "ping") ||
+        conn.reader.checksum != conn.message.header.checksum ||
+        !btcp2p_unpack_message(&conn, "l", &unpacked) ||
+        unpacked != nonce)
+    {
+      worker->failures++;
+    }
+
+    // Hand a copy to the pool, keeping at most a full queue in flight.
+    if (btcp2p_verify_queue_full(&verify_queue)) {
+      check_oldest(worker, &verify_queue, nonces[oldest]);
+      oldest = (oldest + 1) % BTCP2P_VERIFY_QUEUE_DEPTH;
+    }
+    struct btcp2p_message_t* frame = btcp2p_verify_queue_reserve(&verify_queue);
+    frame->header = conn.message.header;
+    frame->command_id = conn.message.command_id;
+    btcp2p_checked_buffer_prepare_read(&frame->payload, conn.message.payload.buffer, conn.message.header.length);
+    btcp2p_verify_queue_submit(&verify_queue);
+    nonces[(oldest + btcp2p_verify_queue_depth(&verify_queue) - 1) % BTCP2P_VERIFY_QUEUE_DEPTH] = nonce;
+
+    if (round % 100 == 0) {
+      btcp2p_log(BTCP2P_LOG_DEBUG, "thread %d round %d\n", worker->id, round);
+    }
+  }
+
+  while (btcp2p_verify_queue_depth(&verify_queue) > 0) {
+    check_oldest(worker, &verify_queue, nonces[oldest]);
+    oldest = (oldest + 1) % BTCP2P_VERIFY_QUEUE_DEPTH;
+  }
+
+  btcp2p_verify_queue_destroy(&verify_queue);
+  btcp2p_send_queue_destroy(&send_queue);
+  btcp2p_frame_reader_destroy(&conn.reader);
+  btcp2p_checked_buffer_destroy(&conn.outgoing.payload);
+
+  return NULL;
+}
+
+void test_concurrent_connections() {
+  struct btcp2p_verify_pool_t pool;
+  if (!TEST_CHECK(btcp2p_verify_pool_create(&pool, 4))) return;
+  pool.min_payload = 0;
+
+  // Keep the log lines written by the workers out of the test output.
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+
+  struct worker_t workers[NUM_THREADS];
+  for (int i = 0; i < NUM_THREADS; i++) {
+    workers[i].id = i + 1;
+    workers[i].pool = &pool;
+    workers[i].failures = 0;
+    pthread_create(&workers[i].thread, NULL, stress_worker, &workers[i]);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  close(null_fd);
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    TEST_CHECK_(workers[i].failures == 0, "thread %d failures", workers[i].id);
+  }
+
+  btcp2p_verify_pool_destroy(&pool);
+}
+
+TEST_LIST = {
+  { "test_concurrent_connections", test_concurrent_connections },
+  { 0 },
+};
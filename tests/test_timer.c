@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/timer.h>
+
+#define NUM_TIMERS 100000
+
+// Far enough ahead to start in the wheel's top level.
+#define START_NS (1000 * BTCP2P_NS_PER_SECOND)
+
+struct fired_t {
+  uint64_t now_ns; ///< Time the wheel is being advanced to.
+  uint64_t last_deadline_ns;
+  size_t count;
+  size_t early;
+  size_t late;
+  size_t out_of_order;
+};
+
+struct test_timer_t {
+  struct btcp2p_wheel_timer_t timer;
+  struct btcp2p_timer_wheel_t* wheel;
+  struct fired_t* fired;
+  size_t reschedules; ///< Times to schedule the timer again when it fires.
+  uint64_t interval_ns;
+};
+
+static void record_fire(struct btcp2p_wheel_timer_t* timer, void* ctx) {
+  struct fired_t* fired = ctx;
+
+  if (timer->deadline_ns > fired->now_ns) {
+    fired->early++;
+  }
+  if (fired->now_ns - timer->deadline_ns >= 2 * BTCP2P_TIMER_WHEEL_TICK_NS) {
+    fired->late++;
+  }
+  // Deadlines within the same tick may fire in any order.
+  if (timer->deadline_ns / BTCP2P_TIMER_WHEEL_TICK_NS < fired->last_deadline_ns / BTCP2P_TIMER_WHEEL_TICK_NS) {
+    fired->out_of_order++;
+  }
+  fired->last_deadline_ns = timer->deadline_ns;
+  fired->count++;
+}
+
+// advance_by steps the wheel forward in increments of step_ns until it
+// reaches end_ns, the way an event loop would.
+static size_t advance_by(struct btcp2p_timer_wheel_t* wheel, struct fired_t* fired,
+                         uint64_t end_ns, uint64_t step_ns)
+{
+  size_t count = 0;
+  while (fired->now_ns < end_ns) {
+    fired->now_ns += step_ns;
+    if (fired->now_ns > end_ns) {
+      fired->now_ns = end_ns;
+    }
+    count += btcp2p_timer_wheel_advance(wheel, fired->now_ns);
+  }
+  return count;
+}
+
+void test_fires_in_order(void) {
+  struct btcp2p_timer_wheel_t wheel;
+  struct btcp2p_wheel_timer_t* timers = calloc(NUM_TIMERS, sizeof(struct btcp2p_wheel_timer_t));
+  struct fired_t fired = { .now_ns = START_NS };
+
+  btcp2p_timer_wheel_create(&wheel, START_NS);
+  srand(1);
+  for (size_t i = 0; i < NUM_TIMERS; i++) {
+    // Spread over about an hour with sub-tick precision.
+    uint64_t delay_ns = ((uint64_t)rand() * 1000 + (uint64_t)rand() % 1000) % (60 * BTCP2P_NS_PER_MINUTE);
+    btcp2p_timer_wheel_schedule(&wheel, &timers[i], START_NS + delay_ns, record_fire, &fired);
+  }
+  TEST_CHECK(wheel.count == NUM_TIMERS);
+
+  // Jump straight to each deadline, as a poll with the wheel's timeout would.
+  size_t total = 0;
+  while (wheel.count > 0) {
+    uint64_t next = btcp2p_timer_wheel_next_deadline(&wheel);
+    if (!TEST_CHECK(next > fired.now_ns && next != UINT64_MAX)) {
+      break;
+    }
+    fired.now_ns = next;
+    total += btcp2p_timer_wheel_advance(&wheel, next);
+  }
+
+  TEST_CHECK_(total == NUM_TIMERS, "%zu of %d fired", total, NUM_TIMERS);
+  TEST_CHECK(fired.count == NUM_TIMERS);
+  TEST_CHECK_(fired.early == 0, "%zu fired early", fired.early);
+  TEST_CHECK_(fired.late == 0, "%zu fired late", fired.late);
+  TEST_CHECK_(fired.out_of_order == 0, "%zu fired out of order", fired.out_of_order);
+  for (size_t i = 0; i < NUM_TIMERS; i++) {
+    TEST_CHECK(!btcp2p_timer_wheel_pending(&timers[i]));
+  }
+  TEST_CHECK(btcp2p_timer_wheel_next_deadline(&wheel) == UINT64_MAX);
+
+  free(timers);
+}
+
+void test_cancel(void) {
+  struct btcp2p_timer_wheel_t wheel;
+  struct btcp2p_wheel_timer_t timers[64];
+  struct fired_t fired = { .now_ns = START_NS };
+
+  memset(timers, 0, sizeof(timers));
+  btcp2p_timer_wheel_create(&wheel, START_NS);
+  TEST_CHECK(!btcp2p_timer_wheel_pending(&timers[0]));
+
+  // Timers spread across levels, sharing slots.
+  for (size_t i = 0; i < 64; i++) {
+    uint64_t delay_ns = (i % 4 == 0 ? BTCP2P_NS_PER_MS : BTCP2P_NS_PER_SECOND) << (i % 12);
+    btcp2p_timer_wheel_schedule(&wheel, &timers[i], START_NS + delay_ns, record_fire, &fired);
+  }
+  for (size_t i = 0; i < 64; i += 2) {
+    btcp2p_timer_wheel_cancel(&wheel, &timers[i]);
+    TEST_CHECK(!btcp2p_timer_wheel_pending(&timers[i]));
+  }
+  // Cancelling twice does nothing.
+  btcp2p_timer_wheel_cancel(&wheel, &timers[0]);
+  TEST_CHECK(wheel.count == 32);
+
+  size_t count = advance_by(&wheel, &fired, START_NS + 60 * BTCP2P_NS_PER_MINUTE, 7 * BTCP2P_NS_PER_MS);
+  TEST_CHECK_(count == 32, "%zu fired", count);
+  TEST_CHECK(fired.early == 0);
+  TEST_CHECK(wheel.count == 0);
+  for (size_t level = 0; level < BTCP2P_TIMER_WHEEL_LEVELS; level++) {
+    TEST_CHECK_(wheel.occupied[level] == 0, "level %zu still occupied", level);
+  }
+}
+
+static void reschedule(struct btcp2p_wheel_timer_t* timer, void* ctx) {
+  struct test_timer_t* test = ctx;
+
+  record_fire(timer, test->fired);
+  if (test->reschedules > 0) {
+    test->reschedules--;
+    btcp2p_timer_wheel_schedule(test->wheel, timer, timer->deadline_ns + test->interval_ns, reschedule, ctx);
+  }
+}
+
+void test_reschedule_from_callback(void) {
+  struct btcp2p_timer_wheel_t wheel;
+  struct fired_t fired = { .now_ns = START_NS };
+  struct test_timer_t test = {
+    .wheel = &wheel,
+    .fired = &fired,
+    .reschedules = 9,
+    .interval_ns = 30 * BTCP2P_NS_PER_SECOND,
+  };
+
+  btcp2p_timer_wheel_create(&wheel, START_NS);
+  btcp2p_timer_wheel_schedule(&wheel, &test.timer, START_NS + test.interval_ns, reschedule, &test);
+
+  // A ping every 30 seconds for five minutes, polled every 100ms.
+  size_t count = advance_by(&wheel, &fired, START_NS + 5 * BTCP2P_NS_PER_MINUTE, 100 * BTCP2P_NS_PER_MS);
+  TEST_CHECK_(count == 10, "%zu fired", count);
+  TEST_CHECK(fired.early == 0);
+  TEST_CHECK(!btcp2p_timer_wheel_pending(&test.timer));
+
+  // A deadline already passed fires on the next tick.
+  btcp2p_timer_wheel_schedule(&wheel, &test.timer, START_NS, record_fire, &fired);
+  TEST_CHECK(btcp2p_timer_wheel_advance(&wheel, fired.now_ns) == 0);
+  TEST_CHECK(btcp2p_timer_wheel_advance(&wheel, fired.now_ns + BTCP2P_TIMER_WHEEL_TICK_NS) == 1);
+}
+
+void test_far_deadline(void) {
+  struct btcp2p_timer_wheel_t wheel;
+  struct btcp2p_wheel_timer_t timer = { 0 };
+  struct fired_t fired = { .now_ns = START_NS };
+
+  // Beyond the ~12 days the levels cover.
+  uint64_t deadline_ns = START_NS + 40ULL * 24 * 60 * BTCP2P_NS_PER_MINUTE + 123456789;
+  btcp2p_timer_wheel_create(&wheel, START_NS);
+  btcp2p_timer_wheel_schedule(&wheel, &timer, deadline_ns, record_fire, &fired);
+
+  size_t steps = 0;
+  size_t count = 0;
+  while (wheel.count > 0 && steps++ < 100) {
+    uint64_t next = btcp2p_timer_wheel_next_deadline(&wheel);
+    TEST_CHECK(next <= deadline_ns + BTCP2P_TIMER_WHEEL_TICK_NS);
+    fired.now_ns = next;
+    count += btcp2p_timer_wheel_advance(&wheel, next);
+  }
+  TEST_CHECK(count == 1);
+  TEST_CHECK(fired.early == 0);
+  TEST_CHECK(fired.late == 0);
+}
+
+void test_timeout_ms(void) {
+  struct btcp2p_timer_wheel_t wheel;
+  struct btcp2p_wheel_timer_t timer = { 0 };
+  struct fired_t fired = { .now_ns = START_NS };
+
+  btcp2p_timer_wheel_create(&wheel, START_NS);
+  TEST_CHECK(btcp2p_timer_wheel_next_deadline(&wheel) == UINT64_MAX);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS, 100) == 100);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS, -1) == -1);
+
+  // Sub-tick deadlines round up.
+  btcp2p_timer_wheel_schedule(&wheel, &timer, START_NS + 2500 * 1000, record_fire, &fired);
+  TEST_CHECK(btcp2p_timer_wheel_next_deadline(&wheel) == START_NS + 3 * BTCP2P_NS_PER_MS);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS, -1) == 3);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS + 1, -1) == 3);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS, 1) == 1);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS + 5 * BTCP2P_NS_PER_MS, -1) == 0);
+
+  TEST_CHECK(btcp2p_timer_wheel_advance(&wheel, START_NS + 2 * BTCP2P_NS_PER_MS) == 0);
+  TEST_CHECK(btcp2p_timer_wheel_advance(&wheel, START_NS + 3 * BTCP2P_NS_PER_MS) == 1);
+  TEST_CHECK(btcp2p_timer_wheel_timeout_ms(&wheel, START_NS + 3 * BTCP2P_NS_PER_MS, 100) == 100);
+}
+
+void test_simple_timer(void) {
+  struct btcp2p_timer_t timer;
+
+  btcp2p_timer_init(&timer, 0.05);
+  TEST_CHECK(!btcp2p_timer_expired(&timer));
+
+  uint64_t start_ns = btcp2p_timer_now_ns();
+  while (!btcp2p_timer_expired(&timer));
+  TEST_CHECK(btcp2p_timer_now_ns() - start_ns >= 40 * BTCP2P_NS_PER_MS);
+
+  btcp2p_timer_reset(&timer);
+  TEST_CHECK(!btcp2p_timer_expired(&timer));
+}
+
+TEST_LIST = {
+  { "test_fires_in_order", test_fires_in_order },
+  { "test_cancel", test_cancel },
+  { "test_reschedule_from_callback", test_reschedule_from_callback },
+  { "test_far_deadline", test_far_deadline },
+  { "test_timeout_ms", test_timeout_ms },
+  { "test_simple_timer", test_simple_timer },
+  { 0 },
+};
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <poll.h>
+
+#include "acutest.h"
+
+#include <libbtcp2p/sha256.h>
+#include <libbtcp2p/verify_pool.h>
+
+// queue_frame appends a frame with a payload of the given length whose first
+// byte is tag. The checksum is made invalid if corrupt is set.
+static void queue_frame(struct btcp2p_verify_queue_t* queue,
+                        uint32_t length,
+                        uint8_t tag,
+                        bool corrupt)
+{
+  struct btcp2p_message_t* frame = btcp2p_verify_queue_reserve(queue);
+  memset(&frame->header, 0, sizeof(frame->header));
+  strncpy(frame->header.command, "block", sizeof(frame->header.command));
+  frame->command_id = BTCP2P_CMD_BLOCK;
+  frame->header.length = length;
+
+  uint8_t* payload = btcp2p_checked_buffer_prepare_copy(&frame->payload, length);
+  for (uint32_t i = 0; i < length; i++) {
+    payload[i] = (uint8_t)(i * 13);
+  }
+  payload[0] = tag;
+
+  uint8_t digest[BTCP2P_SHA256_DIGEST_SIZE];
+  btcp2p_sha256d(payload, length, digest);
+  memcpy(&frame->header.checksum, digest, sizeof(frame->header.checksum));
+  if (corrupt) {
+    frame->header.checksum ^= 1;
+  }
+
+  btcp2p_verify_queue_submit(queue);
+}
+
+void test_preserves_arrival_order() {
+  struct btcp2p_verify_pool_t pool;
+  if (!TEST_CHECK(btcp2p_verify_pool_create(&pool, 4))) return;
+
+  struct btcp2p_verify_queue_t queue;
+  btcp2p_verify_queue_create(&queue, &pool, NULL);
+
+  // Large frames go to the workers while small frames are checked inline, so
+  // later frames are often finished first.
+  srand(1234);
+  uint8_t next_tag = 0;
+  uint8_t expected_tag = 0;
+  for (int round = 0; round < 500; round++) {
+    while (!btcp2p_verify_queue_full(&queue) && rand() % 2) {
+      uint32_t length = rand() % 2 ? 1 + rand() % 100 : 64 * 1024 + rand() % 100000;
+      queue_frame(&queue, length, next_tag++, false);
+    }
+
+    struct btcp2p_verify_job_t* job;
+    while (btcp2p_verify_queue_depth(&queue) > 0 && rand() % 2) {
+      TEST_CHECK(btcp2p_verify_queue_wait(&queue, -1));
+      TEST_CHECK(btcp2p_verify_queue_peek(&queue, &job) == BTCP2P_VERIFY_PASSED);
+      TEST_CHECK(job->message.payload.buffer[0] == expected_tag++);
+      btcp2p_verify_queue_pop(&queue);
+    }
+  }
+
+  btcp2p_verify_queue_destroy(&queue);
+  btcp2p_verify_pool_destroy(&pool);
+}
+
+void test_rejects_bad_checksum() {
+  struct btcp2p_verify_pool_t pool;
+  if (!TEST_CHECK(btcp2p_verify_pool_create(&pool, 2))) return;
+
+  struct btcp2p_verify_queue_t queue;
+  btcp2p_verify_queue_create(&queue, &pool, NULL);
+
+  queue_frame(&queue, 100000, 1, true);
+  queue_frame(&queue, 10, 2, true);
+  queue_frame(&queue, 100000, 3, false);
+
+  struct btcp2p_verify_job_t* job;
+  for (int i = 0; i < 3; i++) {
+    TEST_CHECK(btcp2p_verify_queue_wait(&queue, -1));
+    enum btcp2p_verify_status_t status = btcp2p_verify_queue_peek(&queue, &job);
+    TEST_CHECK(status == (i < 2 ? BTCP2P_VERIFY_REJECTED : BTCP2P_VERIFY_PASSED));
+    TEST_CHECK(job->message.has_digest);
+    TEST_CHECK(job->message.has_block_hash == (job->message.header.length >= BTCP2P_BLOCK_HEADER_SIZE));
+    TEST_CHECK(job->checksum == (i < 2 ? job->message.header.checksum ^ 1 : job->message.header.checksum));
+    btcp2p_verify_queue_pop(&queue);
+  }
+  TEST_CHECK(btcp2p_verify_queue_peek(&queue, &job) == BTCP2P_VERIFY_PENDING);
+  TEST_CHECK(job == NULL);
+
+  btcp2p_verify_queue_destroy(&queue);
+  btcp2p_verify_pool_destroy(&pool);
+}
+
+void test_reports_watched_queues() {
+  struct btcp2p_verify_pool_t pool;
+  if (!TEST_CHECK(btcp2p_verify_pool_create(&pool, 2))) return;
+
+  int owners[2];
+  struct btcp2p_verify_queue_t watched, unwatched;
+  btcp2p_verify_queue_create(&watched, &pool, &owners[0]);
+  btcp2p_verify_queue_create(&unwatched, &pool, &owners[1]);
+  btcp2p_verify_queue_watch(&watched, true);
+
+  queue_frame(&watched, 100000, 1, false);
+  queue_frame(&unwatched, 100000, 2, false);
+
+  struct pollfd pfd = { .fd = btcp2p_verify_pool_fd(&pool), .events = POLLIN, .revents = 0 };
+  TEST_CHECK(poll(&pfd, 1, 5000) == 1);
+  TEST_CHECK(btcp2p_verify_queue_wait(&unwatched, -1));
+
+  struct btcp2p_verify_queue_t* completed = btcp2p_verify_pool_take_completed(&pool);
+  TEST_CHECK(completed == &watched);
+  TEST_CHECK(completed->owner == &owners[0]);
+  TEST_CHECK(completed->next_completed == NULL);
+
+  // Taking the completed queues clears the descriptor.
+  TEST_CHECK(poll(&pfd, 1, 0) == 0);
+  TEST_CHECK(btcp2p_verify_pool_take_completed(&pool) == NULL);
+
+  btcp2p_verify_queue_destroy(&watched);
+  btcp2p_verify_queue_destroy(&unwatched);
+  btcp2p_verify_pool_destroy(&pool);
+}
+
+TEST_LIST = {
+  { "test_preserves_arrival_order", test_preserves_arrival_order },
+  { "test_rejects_bad_checksum", test_rejects_bad_checksum },
+  { "test_reports_watched_queues", test_reports_watched_queues },
+  { 0 },
+};
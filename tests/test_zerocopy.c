@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acutest.h"
+#include "helpers.h"
+
+#include <libbtcp2p/zerocopy.h>
+
+#define PAYLOAD_SIZE (64 * 1024)
+
+// make_message fills in a message with a recognizable payload.
+static void make_message(struct btcp2p_message_t* message) {
+  memset(&message->header, 0, sizeof(message->header));
+  strncpy(message->header.command, "block", sizeof(message->header.command));
+  message->header.length = PAYLOAD_SIZE;
+
+  btcp2p_checked_buffer_create(&message->payload);
+  btcp2p_checked_buffer_resize(&message->payload, PAYLOAD_SIZE);
+  for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+    message->payload.buffer[i] = (uint8_t)(i * 7);
+  }
+}
+
+// wait_for_release reaps completions until a buffer is released.
+static bool wait_for_release(struct btcp2p_zerocopy_t* zc, int socket) {
+  for (int attempt = 0; attempt < 100; attempt++) {
+    if (btcp2p_zerocopy_reap(zc, socket) > 0) {
+      return true;
+    }
+    struct pollfd pfd = { .fd = socket, .events = 0, .revents = 0 };
+    poll(&pfd, 1, 10);
+  }
+  return false;
+}
+
+void test_buffer_held_until_completion() {
+  int client, server;
+  if (!TEST_CHECK(open_loopback(&client, &server))) return;
+
+  struct btcp2p_zerocopy_t zc;
+  if (!TEST_CHECK(btcp2p_zerocopy_enable(&zc, client))) return;
+
+  struct btcp2p_message_t message;
+  make_message(&message);
+  uint8_t* sent = message.payload.buffer;
+
+  TEST_CHECK(btcp2p_zerocopy_send(&zc, client, &message) == 0);
+
+  // The sender keeps the payload and hands back a different buffer.
+  TEST_CHECK(zc.in_flight_count == 1);
+  TEST_CHECK(zc.in_flight[0].buffer.buffer == sent);
+  TEST_CHECK(message.payload.buffer != sent);
+
+  uint8_t* received = malloc(sizeof(message.header) + PAYLOAD_SIZE);
+  TEST_CHECK(recv_all(server, received, sizeof(message.header) + PAYLOAD_SIZE));
+  TEST_CHECK(memcmp(received, &message.header, sizeof(message.header)) == 0);
+  TEST_CHECK(memcmp(received + sizeof(message.header), sent, PAYLOAD_SIZE) == 0);
+
+  TEST_CHECK(wait_for_release(&zc, client));
+  TEST_CHECK(zc.in_flight_count == 0);
+  TEST_CHECK(zc.free_count == 1);
+  TEST_CHECK(zc.completed == zc.next_id);
+
+  free(received);
+  btcp2p_checked_buffer_destroy(&message.payload);
+  btcp2p_zerocopy_destroy(&zc);
+  close(client);
+  close(server);
+}
+
+void test_completed_buffers_reused() {
+  int client, server;
+  if (!TEST_CHECK(open_loopback(&client, &server))) return;
+
+  struct btcp2p_zerocopy_t zc;
+  if (!TEST_CHECK(btcp2p_zerocopy_enable(&zc, client))) return;
+
+  struct btcp2p_message_t message;
+  make_message(&message);
+  uint8_t* first = message.payload.buffer;
+  uint8_t* received = malloc(sizeof(message.header) + PAYLOAD_SIZE);
+
+  TEST_CHECK(btcp2p_zerocopy_send(&zc, client, &message) == 0);
+  TEST_CHECK(recv_all(server, received, sizeof(message.header) + PAYLOAD_SIZE));
+  TEST_CHECK(wait_for_release(&zc, client));
+
+  // Repack the replacement buffer and send it. The completed buffer is handed
+  // back as the next replacement.
+  btcp2p_checked_buffer_destroy(&message.payload);
+  make_message(&message);
+  TEST_CHECK(btcp2p_zerocopy_send(&zc, client, &message) == 0);
+  TEST_CHECK(message.payload.buffer == first);
+  TEST_CHECK(zc.free_count == 0);
+
+  TEST_CHECK(recv_all(server, received, sizeof(message.header) + PAYLOAD_SIZE));
+  TEST_CHECK(wait_for_release(&zc, client));
+
+  free(received);
+  btcp2p_checked_buffer_destroy(&message.payload);
+  btcp2p_zerocopy_destroy(&zc);
+  close(client);
+  close(server);
+}
+
+TEST_LIST = {
+  { "test_buffer_held_until_completion", test_buffer_held_until_completion },
+  { "test_completed_buffers_reused", test_completed_buffers_reused },
+  { 0 },
+};